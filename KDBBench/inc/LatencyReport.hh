@@ -0,0 +1,108 @@
+#ifndef __LATENCY_REPORT_HH
+#define __LATENCY_REPORT_HH
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+struct LATENCY_SUMMARY
+{
+    std::string name;
+    size_t count;
+    size_t errors;
+    double ops_per_sec;
+    // Microseconds
+    double p50;
+    double p99;
+    double p999;
+    double max;
+};
+
+// Nearest rank of an already sorted set
+inline double Percentile(const std::vector<uint64_t>& sorted_ns, double percentile)
+{
+    if(sorted_ns.empty())
+    {
+        return 0;
+    }
+
+    size_t rank = static_cast<size_t>(percentile / 100.0 * sorted_ns.size() + 0.5);
+    rank = std::min(std::max(rank, static_cast<size_t>(1)), sorted_ns.size());
+    return sorted_ns[rank - 1] / 1000.0;
+}
+
+// Sorts samples_ns in place
+inline LATENCY_SUMMARY Summarize(const std::string& name, std::vector<uint64_t>& samples_ns,
+    size_t errors, double seconds)
+{
+    std::sort(samples_ns.begin(), samples_ns.end());
+
+    LATENCY_SUMMARY summary;
+    summary.name = name;
+    summary.count = samples_ns.size();
+    summary.errors = errors;
+    summary.ops_per_sec = 0 < seconds ? samples_ns.size() / seconds : 0;
+    summary.p50 = Percentile(samples_ns, 50);
+    summary.p99 = Percentile(samples_ns, 99);
+    summary.p999 = Percentile(samples_ns, 99.9);
+    summary.max = samples_ns.empty() ? 0 : samples_ns.back() / 1000.0;
+    return summary;
+}
+
+inline void PrintTable(std::ostream& out, const std::vector<LATENCY_SUMMARY>& summaries)
+{
+    out << std::left << std::setw(11) << "op" << std::right
+        << std::setw(11) << "count"
+        << std::setw(12) << "ops/s"
+        << std::setw(11) << "p50 us"
+        << std::setw(11) << "p99 us"
+        << std::setw(11) << "p99.9 us"
+        << std::setw(11) << "max us"
+        << std::setw(9) << "errors" << "\n";
+
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(1);
+    for(const LATENCY_SUMMARY& summary : summaries)
+    {
+        out << std::left << std::setw(11) << summary.name << std::right
+            << std::setw(11) << summary.count
+            << std::setw(12) << summary.ops_per_sec
+            << std::setw(11) << summary.p50
+            << std::setw(11) << summary.p99
+            << std::setw(11) << summary.p999
+            << std::setw(11) << summary.max
+            << std::setw(9) << summary.errors << "\n";
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+// One JSON object per summary, keyed by name
+inline void PrintJson(std::ostream& out, const std::vector<LATENCY_SUMMARY>& summaries)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(1) << "{";
+    for(size_t index = 0; index < summaries.size(); index++)
+    {
+        const LATENCY_SUMMARY& summary = summaries[index];
+        out << (0 == index ? "" : ",") << "\n    \"" << summary.name << "\": {"
+            << "\"count\": " << summary.count
+            << ", \"errors\": " << summary.errors
+            << ", \"ops_per_sec\": " << summary.ops_per_sec
+            << ", \"latency_us\": {"
+            << "\"p50\": " << summary.p50
+            << ", \"p99\": " << summary.p99
+            << ", \"p99.9\": " << summary.p999
+            << ", \"max\": " << summary.max << "}}";
+    }
+    out << "\n  }";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef __WORKLOAD_HH
+#define __WORKLOAD_HH
+
+#include <retcode.hh>
+
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <string>
+
+enum BENCH_OP
+{
+    BENCH_OP_READ,
+    BENCH_OP_WRITE,
+    BENCH_OP_SUBSCRIBE,
+    NUM_BENCH_OPS
+};
+
+static const char* const BENCH_OP_NAMES[NUM_BENCH_OPS] = {"read", "write", "subscribe"};
+
+/* How often each operation is picked, from "read:write:subscribe" weights
+ * such as "90:10:0". Weights need not add up to 100.
+ */
+class OpMix
+{
+
+public:
+
+    OpMix()
+        : m_Weights{100, 0, 0}, m_Total(100)
+    {
+    }
+
+    RETCODE Parse(const std::string& mix)
+    {
+        std::stringstream weights(mix);
+        std::string weight;
+        unsigned int total = 0;
+        unsigned int parsed[NUM_BENCH_OPS] = {0};
+        for(size_t op = 0; op < NUM_BENCH_OPS; op++)
+        {
+            if(!std::getline(weights, weight, ':'))
+            {
+                return RTN_BAD_ARG;
+            }
+
+            try
+            {
+                int value = std::stoi(weight);
+                if(0 > value)
+                {
+                    return RTN_BAD_ARG;
+                }
+                parsed[op] = static_cast<unsigned int>(value);
+            }
+            catch(const std::exception&)
+            {
+                return RTN_BAD_ARG;
+            }
+
+            total += parsed[op];
+        }
+
+        if(0 == total || std::getline(weights, weight, ':'))
+        {
+            return RTN_BAD_ARG;
+        }
+
+        for(size_t op = 0; op < NUM_BENCH_OPS; op++)
+        {
+            m_Weights[op] = parsed[op];
+        }
+        m_Total = total;
+        return RTN_OK;
+    }
+
+    bool Uses(BENCH_OP op) const
+    {
+        return 0 < m_Weights[op];
+    }
+
+    template<class Engine>
+    BENCH_OP Next(Engine& engine) const
+    {
+        unsigned int pick = std::uniform_int_distribution<unsigned int>(0, m_Total - 1)(engine);
+        for(size_t op = 0; op < NUM_BENCH_OPS; op++)
+        {
+            if(pick < m_Weights[op])
+            {
+                return static_cast<BENCH_OP>(op);
+            }
+            pick -= m_Weights[op];
+        }
+
+        return BENCH_OP_READ;
+    }
+
+    std::string ToString(void) const
+    {
+        std::stringstream mix;
+        mix << m_Weights[BENCH_OP_READ] << ":" << m_Weights[BENCH_OP_WRITE] << ":" << m_Weights[BENCH_OP_SUBSCRIBE];
+        return mix.str();
+    }
+
+private:
+
+    unsigned int m_Weights[NUM_BENCH_OPS];
+    unsigned int m_Total;
+};
+
+/* Picks records 0..n-1. Uniform, or zipfian where record 0 is the hottest
+ * and theta in (0, 1) sets how skewed -- 0.99 is the usual YCSB setting.
+ *
+ * Zipfian uses Gray et al., "Quickly Generating Billion-Record Synthetic
+ * Databases": zeta(n) is summed once up front and each pick is O(1).
+ */
+class RecordPicker
+{
+
+public:
+
+    RecordPicker(unsigned int num_records, bool zipfian, double theta)
+        : m_Records(num_records), m_Zipfian(zipfian), m_Theta(theta),
+          m_Alpha(0), m_Zetan(0), m_Eta(0), m_Uniform(0, num_records - 1), m_Unit(0.0, 1.0)
+    {
+        if(m_Zipfian)
+        {
+            double zeta2 = Zeta(2, m_Theta);
+            m_Zetan = Zeta(m_Records, m_Theta);
+            m_Alpha = 1.0 / (1.0 - m_Theta);
+            m_Eta = (1.0 - std::pow(2.0 / m_Records, 1.0 - m_Theta)) / (1.0 - zeta2 / m_Zetan);
+        }
+    }
+
+    template<class Engine>
+    unsigned int Next(Engine& engine)
+    {
+        if(!m_Zipfian || 2 > m_Records)
+        {
+            return m_Uniform(engine);
+        }
+
+        double u = m_Unit(engine);
+        double uz = u * m_Zetan;
+        if(1.0 > uz)
+        {
+            return 0;
+        }
+
+        if(1.0 + std::pow(0.5, m_Theta) > uz)
+        {
+            return 1;
+        }
+
+        unsigned int record = static_cast<unsigned int>(m_Records * std::pow(m_Eta * u - m_Eta + 1.0, m_Alpha));
+        return record < m_Records ? record : m_Records - 1;
+    }
+
+private:
+
+    static double Zeta(unsigned int n, double theta)
+    {
+        double sum = 0;
+        for(unsigned int i = 1; i <= n; i++)
+        {
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+    unsigned int m_Records;
+    bool m_Zipfian;
+    double m_Theta;
+    double m_Alpha;
+    double m_Zetan;
+    double m_Eta;
+    std::uniform_int_distribution<unsigned int> m_Uniform;
+    std::uniform_real_distribution<double> m_Unit;
+};
+
+#endif
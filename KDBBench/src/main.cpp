@@ -0,0 +1,573 @@
+#include <CLI.hh>
+#include <INETMessenger.hh>
+#include <MessageTypes.hh>
+#include <DaemonThread.hh>
+#include <ConfigValues.hh>
+#include <Constants.hh>
+#include <DBMap.hh>
+#include <retcode.hh>
+#include <Logger.hh>
+#include <OFRI.hh>
+
+#include <Workload.hh>
+#include <LatencyReport.hh>
+
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+
+/* kdb-bench -- drives load at a running UpdateDaemon and reports ops/s
+ * and latency percentiles.
+ *
+ * Each of -n connections has its own PollThread and its own driver
+ * thread. Closed loop keeps -q requests in flight on every connection.
+ * Open loop (-R) sends at a fixed total rate whether or not replies keep
+ * up, never more than -q ahead, and times each request from when it was
+ * due rather than when it went out -- so a stalled daemon shows up in the
+ * tail instead of quietly slowing the load down.
+ *
+ * A subscribe is a SUBSCRIBE to the whole record and the UNSUBSCRIBE after
+ * it. Only the SUBSCRIBE is timed, and a refusal is counted like any other
+ * reply -- with a skewed mix two can land on the same record at once.
+ *
+ * Requests due during the warmup are sent but not counted.
+ *
+ *     kdb-bench -o DCC_CHAR -n 4 -m 80:15:5 -d zipfian -t 30 -j results.json
+ */
+
+typedef std::chrono::steady_clock BenchClock;
+
+constexpr size_t BENCH_DEFAULT_CONNECTIONS = 4;
+constexpr size_t BENCH_DEFAULT_CLOSED_DEPTH = 16;
+constexpr size_t BENCH_DEFAULT_OPEN_DEPTH = 1024;
+constexpr size_t BENCH_MAX_DEPTH = REQUEST_MAX_IN_FLIGHT / 2; // A subscribe holds two ids
+constexpr int BENCH_DEFAULT_SECONDS = 10;
+constexpr int BENCH_DEFAULT_WARMUP_SECONDS = 1;
+constexpr double BENCH_DEFAULT_THETA = 0.99;
+constexpr std::chrono::seconds BENCH_DRAIN_TIMEOUT(5);
+
+struct BENCH_SETTINGS
+{
+    std::string address;
+    std::string port;
+    OBJECT_SCHEMA object;
+    FIELD write_field;
+    OpMix mix;
+    bool zipfian;
+    double theta;
+    size_t connections;
+    size_t depth;
+    double rate; // Ops/s over every connection -- 0 is closed loop
+    BenchClock::time_point start;
+    BenchClock::time_point measure_from;
+    BenchClock::time_point measure_until;
+};
+
+class BenchConnection : public DaemonThread<>
+{
+
+public:
+
+    BenchConnection(const BENCH_SETTINGS& settings, size_t index)
+        : m_Settings(settings), m_Index(index), m_Poll(), m_Polling(true), m_Server(),
+          m_Engine(index + 1), m_Records(settings.object.numberOfRecords, settings.zipfian, settings.theta),
+          m_Sequence(0), m_Mutex(), m_Room(), m_InFlight(0), m_Updates(0), m_Samples(), m_Errors{0}
+    {
+        m_Poll.m_OnReceive += [this](const INET_PACKAGE* package)
+        {
+            if(MESSAGE_TYPE::UPDATE == package->header.data_type && Measured(BenchClock::now()))
+            {
+                m_Updates.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+    }
+
+    ~BenchConnection()
+    {
+        Stop();
+        StopPoll();
+    }
+
+    RETCODE Connect(void)
+    {
+        return m_Poll.Connect(m_Settings.address, m_Settings.port, m_Server);
+    }
+
+    // Driver thread -- sends until measuring is over
+    void execute(void)
+    {
+        const bool open_loop = 0 < m_Settings.rate;
+        std::chrono::nanoseconds interval(0);
+        BenchClock::time_point due = m_Settings.start;
+        if(open_loop)
+        {
+            interval = std::chrono::nanoseconds(static_cast<long long>(1e9 * m_Settings.connections / m_Settings.rate));
+            due += interval * m_Index / m_Settings.connections; // Spread connections over one interval
+        }
+
+        std::this_thread::sleep_until(m_Settings.start);
+        while(!StopRequested())
+        {
+            if(open_loop)
+            {
+                std::this_thread::sleep_until(due);
+            }
+
+            if(BenchClock::now() >= m_Settings.measure_until)
+            {
+                break;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_Room.wait(lock, [this]()
+                {
+                    return m_InFlight < m_Settings.depth || StopRequested();
+                });
+                if(StopRequested())
+                {
+                    break;
+                }
+                m_InFlight++;
+            }
+
+            if(open_loop)
+            {
+                Issue(m_Settings.mix.Next(m_Engine), due);
+                due += interval;
+            }
+            else
+            {
+                Issue(m_Settings.mix.Next(m_Engine), BenchClock::now());
+            }
+        }
+    }
+
+    void Wake()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Room.notify_all();
+    }
+
+    // After Stop() -- false if replies were still missing at the timeout
+    bool Drain(void)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        return m_Room.wait_for(lock, BENCH_DRAIN_TIMEOUT, [this]()
+        {
+            return 0 == m_InFlight;
+        });
+    }
+
+    // Only once the poll thread has stopped
+    std::vector<uint64_t>& Samples(BENCH_OP op)
+    {
+        return m_Samples[op];
+    }
+
+    size_t Errors(BENCH_OP op) const
+    {
+        return m_Errors[op];
+    }
+
+    unsigned long long Updates(void) const
+    {
+        return m_Updates.load(std::memory_order_relaxed);
+    }
+
+    void StopPoll(void)
+    {
+        if(m_Polling)
+        {
+            m_Polling = false;
+            m_Poll.StopPoll();
+        }
+    }
+
+private:
+
+    void Issue(BENCH_OP op, BenchClock::time_point due)
+    {
+        OFRI_ID ofri = {static_cast<OBJECT_ID>(m_Settings.object.objectNumber), 0, m_Records.Next(m_Engine), 0};
+        switch(op)
+        {
+            case BENCH_OP_READ:
+            {
+                m_Poll.Request(m_Server, MESSAGE_TYPE::DB, &ofri, sizeof(OFRI_ID), INET_FLAG_OBJECT_ID,
+                    [this, due](PackageHandle reply)
+                    {
+                        Complete(BENCH_OP_READ, due, Succeeded(reply));
+                        Release();
+                    });
+                break;
+            }
+            case BENCH_OP_WRITE:
+            {
+                // A new value every time so the daemon has a change to publish
+                ofri.f = m_Settings.write_field;
+                std::string payload(reinterpret_cast<const char*>(&ofri), sizeof(OFRI_ID));
+                payload += std::to_string(++m_Sequence);
+                m_Poll.Request(m_Server, MESSAGE_TYPE::DB, payload.data(), payload.size(), INET_FLAG_OBJECT_ID,
+                    [this, due](PackageHandle reply)
+                    {
+                        Complete(BENCH_OP_WRITE, due, Succeeded(reply));
+                        Release();
+                    });
+                break;
+            }
+            case BENCH_OP_SUBSCRIBE:
+            {
+                ofri.f = SUBSCRIBE_ALL;
+                m_Poll.Request(m_Server, MESSAGE_TYPE::SUBSCRIBE, &ofri, sizeof(OFRI_ID), INET_FLAG_OBJECT_ID,
+                    [this, due, ofri](PackageHandle reply)
+                    {
+                        // Refused only when this connection already holds
+                        // the record -- still an answer, so still timed
+                        Complete(BENCH_OP_SUBSCRIBE, due, static_cast<bool>(reply));
+                        if(!Succeeded(reply))
+                        {
+                            Release();
+                            return;
+                        }
+
+                        m_Poll.Request(m_Server, MESSAGE_TYPE::UNSUBSCRIBE, &ofri, sizeof(OFRI_ID), INET_FLAG_OBJECT_ID,
+                            [this](PackageHandle)
+                            {
+                                Release();
+                            });
+                    });
+                break;
+            }
+            default:
+            {
+                Release();
+                break;
+            }
+        }
+    }
+
+    static bool Succeeded(const PackageHandle& reply)
+    {
+        return reply && 0 < reply->header.message_size;
+    }
+
+    bool Measured(BenchClock::time_point due) const
+    {
+        return m_Settings.measure_from <= due && due < m_Settings.measure_until;
+    }
+
+    // Poll thread
+    void Complete(BENCH_OP op, BenchClock::time_point due, bool succeeded)
+    {
+        if(!Measured(due))
+        {
+            return;
+        }
+
+        if(succeeded)
+        {
+            m_Samples[op].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                BenchClock::now() - due).count());
+        }
+        else
+        {
+            m_Errors[op]++;
+        }
+    }
+
+    void Release(void)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_InFlight--;
+        m_Room.notify_all();
+    }
+
+    BenchConnection(const BenchConnection&);
+    BenchConnection& operator=(const BenchConnection&);
+
+    const BENCH_SETTINGS& m_Settings;
+    size_t m_Index;
+    PollThread m_Poll;
+    bool m_Polling;
+    CONNECTION m_Server;
+    std::mt19937_64 m_Engine; // Driver thread only
+    RecordPicker m_Records; // Driver thread only
+    unsigned int m_Sequence; // Driver thread only
+    std::mutex m_Mutex;
+    std::condition_variable m_Room;
+    size_t m_InFlight; // Guarded by m_Mutex
+    std::atomic<unsigned long long> m_Updates;
+    std::vector<uint64_t> m_Samples[NUM_BENCH_OPS]; // Poll thread only
+    size_t m_Errors[NUM_BENCH_OPS]; // Poll thread only
+};
+
+// Index of the field called name, or the last integer field when name is
+// empty -- the one writes go to
+static RETCODE FindWriteField(const OBJECT_SCHEMA& object, const std::string& name, FIELD& out_field)
+{
+    for(size_t index = object.fields.size(); 0 < index; index--)
+    {
+        const FIELD_SCHEMA& field = object.fields[index - 1];
+        bool integer = 'I' == field.fieldType || 'U' == field.fieldType || 'N' == field.fieldType;
+        if(name.empty() ? integer : name == field.fieldName)
+        {
+            out_field = static_cast<FIELD>(index - 1);
+            return RTN_OK;
+        }
+    }
+
+    return RTN_NOT_FOUND;
+}
+
+static void PrintSettings(std::ostream& out, const BENCH_SETTINGS& settings, int warmup, int seconds)
+{
+    out << "kdb-bench: " << settings.object.objectName << " at " << settings.address << ":" << settings.port
+        << ", " << settings.connections << " connections, mix " << settings.mix.ToString() << " (read:write:subscribe), "
+        << (settings.zipfian ? "zipfian" : "uniform") << " records, ";
+    if(0 < settings.rate)
+    {
+        out << "open loop at " << settings.rate << " ops/s";
+    }
+    else
+    {
+        out << "closed loop with " << settings.depth << " in flight per connection";
+    }
+    out << ", " << warmup << " s warmup, " << seconds << " s measured\n";
+}
+
+static void PrintSettingsJson(std::ostream& out, const BENCH_SETTINGS& settings, int warmup, int seconds)
+{
+    out << "  \"object\": \"" << settings.object.objectName << "\",\n"
+        << "  \"connections\": " << settings.connections << ",\n"
+        << "  \"mix\": \"" << settings.mix.ToString() << "\",\n"
+        << "  \"distribution\": \"" << (settings.zipfian ? "zipfian" : "uniform") << "\",\n"
+        << "  \"theta\": " << settings.theta << ",\n"
+        << "  \"loop\": \"" << (0 < settings.rate ? "open" : "closed") << "\",\n"
+        << "  \"target_ops_per_sec\": " << settings.rate << ",\n"
+        << "  \"in_flight\": " << settings.depth << ",\n"
+        << "  \"warmup_s\": " << warmup << ",\n"
+        << "  \"duration_s\": " << seconds << ",\n";
+}
+
+int main(int argc, char* argv[])
+{
+    CLI::Parser parse("kdb-bench", "Load generator and latency benchmark for the UpdateDaemon");
+    CLI::CLI_StringArgument objectArg("-o", "Object to run against", true);
+    CLI::CLI_StringArgument addressArg("-c", "Daemon address -- KDB_INET_ADDRESS if not given", false);
+    CLI::CLI_StringArgument portArg("-p", "Daemon port -- KDB_INET_PORT if not given", false);
+    CLI::CLI_IntArgument connectionsArg("-n", "Client connections (default 4)", false);
+    CLI::CLI_StringArgument mixArg("-m", "read:write:subscribe weights (default 100:0:0)", false);
+    CLI::CLI_StringArgument fieldArg("-f", "Field written to -- the last integer field if not given", false);
+    CLI::CLI_StringArgument distributionArg("-d", "Record distribution: uniform or zipfian (default uniform)", false);
+    CLI::CLI_StringArgument thetaArg("-z", "Zipfian skew in (0, 1) (default 0.99)", false);
+    CLI::CLI_IntArgument rateArg("-R", "Open loop at this many ops/s over all connections -- closed loop if not given", false);
+    CLI::CLI_IntArgument depthArg("-q", "Requests in flight per connection (default 16 closed loop, at most 1024 open loop)", false);
+    CLI::CLI_IntArgument secondsArg("-t", "Seconds to measure (default 10)", false);
+    CLI::CLI_IntArgument warmupArg("-w", "Seconds of warmup before measuring (default 1)", false);
+    CLI::CLI_StringArgument jsonArg("-j", "Also write the results as JSON to this file, - for stdout", false);
+    CLI::CLI_FlagArgument helpArg("-h", "Shows usage", false);
+
+    parse
+        .AddArg(objectArg)
+        .AddArg(addressArg)
+        .AddArg(portArg)
+        .AddArg(connectionsArg)
+        .AddArg(mixArg)
+        .AddArg(fieldArg)
+        .AddArg(distributionArg)
+        .AddArg(thetaArg)
+        .AddArg(rateArg)
+        .AddArg(depthArg)
+        .AddArg(secondsArg)
+        .AddArg(warmupArg)
+        .AddArg(jsonArg)
+        .AddArg(helpArg);
+
+    RETCODE retcode = parse.ParseCommandLineArguments(argc, argv);
+
+    if(helpArg.IsInUse())
+    {
+        parse.Usage();
+        return 0;
+    }
+
+    if(RTN_OK != retcode)
+    {
+        parse.Usage();
+        return retcode;
+    }
+
+    BENCH_SETTINGS settings;
+    settings.address = addressArg.IsInUse() ? addressArg.GetValue() : ConfigValues::Instance().Get(KDB_INET_ADDRESS);
+    settings.port = portArg.IsInUse() ? portArg.GetValue() : ConfigValues::Instance().Get(KDB_INET_PORT);
+    settings.connections = connectionsArg.IsInUse() ? connectionsArg.GetValue() : BENCH_DEFAULT_CONNECTIONS;
+    settings.rate = rateArg.IsInUse() ? rateArg.GetValue() : 0;
+    settings.depth = depthArg.IsInUse() ? depthArg.GetValue() :
+        0 < settings.rate ? BENCH_DEFAULT_OPEN_DEPTH : BENCH_DEFAULT_CLOSED_DEPTH;
+    settings.zipfian = false;
+    settings.theta = BENCH_DEFAULT_THETA;
+    settings.write_field = 0;
+    int seconds = secondsArg.IsInUse() ? secondsArg.GetValue() : BENCH_DEFAULT_SECONDS;
+    int warmup = warmupArg.IsInUse() ? warmupArg.GetValue() : BENCH_DEFAULT_WARMUP_SECONDS;
+
+    if(0 == settings.connections || 0 == settings.depth || BENCH_MAX_DEPTH < settings.depth ||
+       0 > settings.rate || 0 >= seconds || 0 > warmup)
+    {
+        LOG_ERROR("-n, -q, -R, -t and -w must be positive and -q at most ", BENCH_MAX_DEPTH);
+        return RTN_BAD_ARG;
+    }
+
+    if(RTN_OK != TryGetObjectInfo(objectArg.GetValue(), settings.object) || 0 == settings.object.numberOfRecords)
+    {
+        LOG_ERROR("No object ", objectArg.GetValue(), " in the schema");
+        return RTN_NOT_FOUND;
+    }
+
+    if(mixArg.IsInUse() && RTN_OK != settings.mix.Parse(mixArg.GetValue()))
+    {
+        LOG_ERROR("Could not read mix ", mixArg.GetValue(), " -- expected read:write:subscribe such as 90:10:0");
+        return RTN_BAD_ARG;
+    }
+
+    if(settings.mix.Uses(BENCH_OP_WRITE) &&
+       RTN_OK != FindWriteField(settings.object, fieldArg.IsInUse() ? fieldArg.GetValue() : "", settings.write_field))
+    {
+        LOG_ERROR("No field to write in ", settings.object.objectName, " -- name one with -f");
+        return RTN_NOT_FOUND;
+    }
+
+    if(distributionArg.IsInUse())
+    {
+        if("zipfian" == distributionArg.GetValue())
+        {
+            settings.zipfian = true;
+        }
+        else if("uniform" != distributionArg.GetValue())
+        {
+            LOG_ERROR("Unknown distribution ", distributionArg.GetValue());
+            return RTN_BAD_ARG;
+        }
+    }
+
+    if(thetaArg.IsInUse())
+    {
+        try
+        {
+            settings.theta = std::stod(thetaArg.GetValue());
+        }
+        catch(const std::exception&)
+        {
+            settings.theta = 0;
+        }
+
+        if(!(0 < settings.theta && 1 > settings.theta))
+        {
+            LOG_ERROR("Zipfian theta must be between 0 and 1, not ", thetaArg.GetValue());
+            return RTN_BAD_ARG;
+        }
+    }
+
+    std::vector<std::unique_ptr<BenchConnection>> connections;
+    for(size_t index = 0; index < settings.connections; index++)
+    {
+        connections.emplace_back(new BenchConnection(settings, index));
+        if(RTN_OK != connections.back()->Connect())
+        {
+            LOG_ERROR("Could not connect to ", settings.address, ":", settings.port);
+            return RTN_CONNECTION_FAIL;
+        }
+    }
+
+    PrintSettings(std::cout, settings, warmup, seconds);
+
+    settings.start = BenchClock::now() + std::chrono::milliseconds(100);
+    settings.measure_from = settings.start + std::chrono::seconds(warmup);
+    settings.measure_until = settings.measure_from + std::chrono::seconds(seconds);
+
+    for(std::unique_ptr<BenchConnection>& connection : connections)
+    {
+        connection->Start();
+    }
+
+    std::this_thread::sleep_until(settings.measure_until);
+
+    bool drained = true;
+    for(std::unique_ptr<BenchConnection>& connection : connections)
+    {
+        connection->Stop();
+        drained &= connection->Drain();
+    }
+
+    if(!drained)
+    {
+        LOG_WARN("Some replies had not arrived ", BENCH_DRAIN_TIMEOUT.count(), " s after the run");
+    }
+
+    for(std::unique_ptr<BenchConnection>& connection : connections)
+    {
+        connection->StopPoll();
+    }
+
+    // Gather once the poll threads are gone
+    std::vector<LATENCY_SUMMARY> summaries;
+    std::vector<uint64_t> all;
+    size_t all_errors = 0;
+    unsigned long long updates = 0;
+    for(size_t op = 0; op < NUM_BENCH_OPS; op++)
+    {
+        if(!settings.mix.Uses(static_cast<BENCH_OP>(op)))
+        {
+            continue;
+        }
+
+        std::vector<uint64_t> samples;
+        size_t errors = 0;
+        for(std::unique_ptr<BenchConnection>& connection : connections)
+        {
+            std::vector<uint64_t>& connection_samples = connection->Samples(static_cast<BENCH_OP>(op));
+            samples.insert(samples.end(), connection_samples.begin(), connection_samples.end());
+            errors += connection->Errors(static_cast<BENCH_OP>(op));
+        }
+
+        all.insert(all.end(), samples.begin(), samples.end());
+        all_errors += errors;
+        summaries.push_back(Summarize(BENCH_OP_NAMES[op], samples, errors, seconds));
+    }
+    summaries.push_back(Summarize("all", all, all_errors, seconds));
+
+    for(std::unique_ptr<BenchConnection>& connection : connections)
+    {
+        updates += connection->Updates();
+    }
+
+    PrintTable(std::cout, summaries);
+    std::cout << "updates received: " << updates << "\n";
+
+    if(jsonArg.IsInUse())
+    {
+        std::ofstream json_file;
+        bool to_stdout = "-" == jsonArg.GetValue();
+        if(!to_stdout)
+        {
+            json_file.open(jsonArg.GetValue());
+            if(!json_file.is_open())
+            {
+                LOG_ERROR("Could not open ", jsonArg.GetValue());
+                return RTN_NOT_FOUND;
+            }
+        }
+
+        std::ostream& json = to_stdout ? std::cout : json_file;
+        json << "{\n";
+        PrintSettingsJson(json, settings, warmup, seconds);
+        json << "  \"updates\": " << updates << ",\n  \"ops\": ";
+        PrintJson(json, summaries);
+        json << "\n}\n";
+    }
+
+    return 0;
+}
@@ -1,16 +1,22 @@
 #include <CLI.hh>
 #include <INETMessenger.hh>
+#include <shmMessenger.hh>
 #include <retcode.hh>
 #include <Logger.hh>
 #include <TasQ.hh>
 #include <MessageTypes.hh>
 
 static bool running = true;
+static EventNotifier message_notifier;
+
+// How long a shared memory read waits before checking for stop
+static const int SHM_READ_TIMEOUT_MS = 100;
 
 static void quitSignal(int sig)
 {
     LOG_INFO("Signal ", sig, " caught!");
     running = false;
+    message_notifier.Notify();
 }
 
 static void StopListening(void)
@@ -75,8 +81,7 @@ class WriteThread: public DaemonThread<TasQ<INET_PACKAGE*>*>
                 OFRI ofri = {0};
                 if(ofri_input >> ofri.o >> ofri.r >> ofri.f >> ofri.i)
                 {
-                    message = reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_PACKAGE) + sizeof(OFRI)]);
-                    message->header.message_size = sizeof(OFRI);
+                    message = AllocatePackage(sizeof(OFRI));
                     message->header.data_type = MESSAGE_TYPE::DB;
                     memcpy(message->payload, &ofri, sizeof(OFRI));
                 }
@@ -88,8 +93,7 @@ class WriteThread: public DaemonThread<TasQ<INET_PACKAGE*>*>
             }
             else
             {
-                message = reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_PACKAGE) + user_input.length() + 1]);
-                message->header.message_size = user_input.length() + 1;
+                message = AllocatePackage(user_input.length() + 1);
                 message->header.data_type = MESSAGE_TYPE::TEXT;
                 strncpy(message->payload, user_input.c_str(), user_input.length() + 1);
             }
@@ -99,6 +103,31 @@ class WriteThread: public DaemonThread<TasQ<INET_PACKAGE*>*>
 
 };
 
+// Replies from the daemon over shared memory
+class ShmReadThread: public DaemonThread<ShmClient*>
+{
+    void execute(ShmClient* p_client)
+    {
+        INET_PACKAGE* reply = nullptr;
+
+        while(StopRequested() == false)
+        {
+            RETCODE retcode = p_client->Receive(reply, SHM_READ_TIMEOUT_MS);
+            if(RTN_OK == retcode)
+            {
+                PrintMessage(reply);
+                FreePackage(reply);
+            }
+            else if(RTN_NOT_FOUND != retcode)
+            {
+                LOG_WARN("Shared memory server went away");
+                break;
+            }
+        }
+    }
+
+};
+
 int main(int argc, char* argv[])
 {
     signal(SIGQUIT, quitSignal);
@@ -106,12 +135,16 @@ int main(int argc, char* argv[])
     CLI::Parser parse("Listener", "Listen for database updates");
     CLI::CLI_StringArgument connectionAddressArg("-c", "Connection address for Other", false);
     CLI::CLI_StringArgument connectionPortArg("-p", "Connection port for Other", false);
+    CLI::CLI_StringArgument localPathArg("-u", "Local socket path for Other on this host", false);
+    CLI::CLI_StringArgument shmNameArg("-s", "Shared memory name for Other on this host", false);
     CLI::CLI_StringArgument listeningPortArg("-l", "Listening port", true);
     CLI::CLI_FlagArgument helpArg("-h", "Shows usage", false);
 
     parse
         .AddArg(connectionAddressArg)
         .AddArg(connectionPortArg)
+        .AddArg(localPathArg)
+        .AddArg(shmNameArg)
         .AddArg(listeningPortArg)
         .AddArg(helpArg);
 
@@ -151,6 +184,35 @@ int main(int argc, char* argv[])
                  connection.GetTCPSocket());
 
         }
+        else if(localPathArg.IsInUse())
+        {
+            retcode = connection.ConnectLocal(localPathArg.GetValue());
+            if(RTN_OK != retcode)
+            {
+                LOG_WARN("Couldn't connect to ", localPathArg.GetValue());
+            }
+            else
+            {
+                LOG_INFO("Connected to ", localPathArg.GetValue());
+            }
+        }
+
+        // Shared memory peer alongside the sockets
+        ShmClient shared_memory;
+        ShmReadThread shm_reader;
+        if(RTN_OK == retcode && shmNameArg.IsInUse())
+        {
+            retcode = shared_memory.Open(shmNameArg.GetValue());
+            if(RTN_OK != retcode)
+            {
+                LOG_WARN("Couldn't open shared memory ", shmNameArg.GetValue());
+            }
+            else
+            {
+                LOG_INFO("Connected to ", shared_memory.Server().address, " through ", shmNameArg.GetValue());
+                shm_reader.Start(&shared_memory);
+            }
+        }
 
         connection.m_OnClientConnect += PrintClientConnect;
         connection.m_OnServerConnect += PrintServerConnect;
@@ -159,6 +221,7 @@ int main(int argc, char* argv[])
         connection.m_OnStop += StopListening;
 
         TasQ<INET_PACKAGE*> messages;
+        messages.SetNotifier(&message_notifier);
         WriteThread* writer_thread = new WriteThread();
         writer_thread->Start(&messages);
 
@@ -169,14 +232,22 @@ int main(int argc, char* argv[])
             RETCODE retcode = RTN_OK;
             while(running)
             {
-                while(messages.TryPop(message))
+                message_notifier.Wait();
+
+                while(messages.PopNoWait(message))
                 {
                     connection.SendAll(message);
+                    if(shared_memory.IsOpen())
+                    {
+                        shared_memory.Send(static_cast<MESSAGE_TYPE>(message->header.data_type),
+                            message->payload, message->header.message_size);
+                    }
+                    FreePackage(message);
                 }
-
-                usleep(100);
             }
 
+            shm_reader.Stop();
+            shared_memory.Close();
             connection.StopPoll();
 
             LOG_INFO("Done listening!\n");
@@ -0,0 +1,371 @@
+#ifndef __MICRO_BENCH_HH
+#define __MICRO_BENCH_HH
+
+#include <retcode.hh>
+#include <Logger.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+/* Harness for kdb-microbench.
+ *
+ * A benchmark body runs its operation n times per call. Run() first grows
+ * n until one call takes at least the minimum time, keeps calling it for
+ * the warmup, then times the given number of repetitions. Results are in
+ * nanoseconds per operation over those repetitions.
+ *
+ * The calling thread is pinned to one CPU so repetitions do not wander
+ * between cores. Benchmarks that start threads of their own pin each to
+ * PinHelper(index), which walks the other allowed CPUs.
+ */
+
+// Keeps the compiler from dropping work whose result is never used
+template<class Value>
+inline void KeepValue(const Value& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct MICRO_SETTINGS
+{
+    size_t repetitions;
+    std::chrono::milliseconds min_time; // Per repetition
+    std::chrono::milliseconds warmup;
+    std::string filter; // Only names containing this
+};
+
+struct MICRO_RESULT
+{
+    std::string name;
+    size_t iterations; // Per repetition
+    size_t repetitions;
+    // Nanoseconds per operation
+    double median;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+class MicroBench
+{
+
+public:
+
+    typedef std::chrono::steady_clock Clock;
+
+    explicit MicroBench(const MICRO_SETTINGS& settings)
+        : m_Settings(settings), m_Cpus(), m_MainCpu(-1), m_Results()
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(0 == sched_getaffinity(0, sizeof(allowed), &allowed))
+        {
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if(CPU_ISSET(cpu, &allowed))
+                {
+                    m_Cpus.push_back(cpu);
+                }
+            }
+        }
+    }
+
+    // Calling thread to cpu, or to the first allowed CPU when cpu is negative
+    RETCODE PinMain(int cpu)
+    {
+        if(m_Cpus.empty())
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        if(0 > cpu)
+        {
+            cpu = m_Cpus.front();
+        }
+        else if(m_Cpus.end() == std::find(m_Cpus.begin(), m_Cpus.end(), cpu))
+        {
+            LOG_ERROR("CPU ", cpu, " is not one this process may run on");
+            return RTN_BAD_ARG;
+        }
+
+        m_MainCpu = cpu;
+        return Pin(cpu);
+    }
+
+    // Helper thread index of a benchmark -- spread over the CPUs that are
+    // not the main one, or shares it when there are no others
+    RETCODE PinHelper(size_t index) const
+    {
+        std::vector<int> others;
+        for(int cpu : m_Cpus)
+        {
+            if(cpu != m_MainCpu)
+            {
+                others.push_back(cpu);
+            }
+        }
+
+        if(others.empty())
+        {
+            return 0 > m_MainCpu ? RTN_NOT_FOUND : Pin(m_MainCpu);
+        }
+
+        return Pin(others[index % others.size()]);
+    }
+
+    int MainCpu(void) const
+    {
+        return m_MainCpu;
+    }
+
+    size_t NumCpus(void) const
+    {
+        return m_Cpus.size();
+    }
+
+    bool Selected(const std::string& name) const
+    {
+        return m_Settings.filter.empty() || std::string::npos != name.find(m_Settings.filter);
+    }
+
+    // body(n) does the operation n times. max_iterations caps n for
+    // operations with side effects that grow with every call.
+    template<class Body>
+    void Run(const std::string& name, Body body, size_t max_iterations = 0)
+    {
+        if(!Selected(name))
+        {
+            return;
+        }
+
+        size_t iterations = Calibrate(body, max_iterations);
+
+        Clock::time_point warm_until = Clock::now() + m_Settings.warmup;
+        while(Clock::now() < warm_until)
+        {
+            body(iterations);
+        }
+
+        std::vector<double> per_op;
+        per_op.reserve(m_Settings.repetitions);
+        for(size_t repetition = 0; repetition < m_Settings.repetitions; repetition++)
+        {
+            per_op.push_back(Time(body, iterations) / iterations);
+        }
+
+        m_Results.push_back(Summarize(name, iterations, per_op));
+    }
+
+    const std::vector<MICRO_RESULT>& Results(void) const
+    {
+        return m_Results;
+    }
+
+    // Median ns/op by name from a file PrintJson() wrote
+    static RETCODE ReadBaseline(const std::string& path, std::map<std::string, double>& out_baseline)
+    {
+        std::ifstream baseline_file(path);
+        if(!baseline_file.is_open())
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        static const std::string NAME_KEY = "\"name\": \"";
+        static const std::string MEDIAN_KEY = "\"median\": ";
+        std::string line;
+        while(std::getline(baseline_file, line))
+        {
+            size_t name_at = line.find(NAME_KEY);
+            size_t median_at = line.find(MEDIAN_KEY);
+            if(std::string::npos == name_at || std::string::npos == median_at)
+            {
+                continue;
+            }
+
+            name_at += NAME_KEY.size();
+            size_t name_end = line.find('"', name_at);
+            if(std::string::npos == name_end)
+            {
+                continue;
+            }
+
+            out_baseline[line.substr(name_at, name_end - name_at)] =
+                std::strtod(line.c_str() + median_at + MEDIAN_KEY.size(), nullptr);
+        }
+
+        return RTN_OK;
+    }
+
+    // With a baseline the last column is the change in median
+    void PrintTable(std::ostream& out, const std::map<std::string, double>& baseline) const
+    {
+        size_t name_width = 4;
+        for(const MICRO_RESULT& result : m_Results)
+        {
+            name_width = std::max(name_width, result.name.size());
+        }
+
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::left << std::setw(name_width + 2) << "name" << std::right
+            << std::setw(12) << "iterations"
+            << std::setw(12) << "median ns"
+            << std::setw(12) << "mean ns"
+            << std::setw(10) << "stddev"
+            << std::setw(12) << "min ns"
+            << std::setw(12) << "max ns";
+        if(!baseline.empty())
+        {
+            out << std::setw(10) << "vs base";
+        }
+        out << "\n" << std::fixed << std::setprecision(2);
+
+        for(const MICRO_RESULT& result : m_Results)
+        {
+            out << std::left << std::setw(name_width + 2) << result.name << std::right
+                << std::setw(12) << result.iterations
+                << std::setw(12) << result.median
+                << std::setw(12) << result.mean
+                << std::setw(10) << result.stddev
+                << std::setw(12) << result.min
+                << std::setw(12) << result.max;
+
+            std::map<std::string, double>::const_iterator base = baseline.find(result.name);
+            if(baseline.end() != base && 0 < base->second)
+            {
+                out << std::setw(9) << std::showpos << 100.0 * (result.median - base->second) / base->second
+                    << std::noshowpos << "%";
+            }
+            out << "\n";
+        }
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // One result per line so ReadBaseline() can find them again
+    void PrintJson(std::ostream& out, const std::string& commit) const
+    {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(3)
+            << "{\n"
+            << "  \"commit\": \"" << commit << "\",\n"
+            << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+            << "  \"cpus\": " << m_Cpus.size() << ",\n"
+            << "  \"pinned_cpu\": " << m_MainCpu << ",\n"
+            << "  \"repetitions\": " << m_Settings.repetitions << ",\n"
+            << "  \"min_time_ms\": " << m_Settings.min_time.count() << ",\n"
+            << "  \"warmup_ms\": " << m_Settings.warmup.count() << ",\n"
+            << "  \"results\": [";
+
+        for(size_t index = 0; index < m_Results.size(); index++)
+        {
+            const MICRO_RESULT& result = m_Results[index];
+            out << (0 == index ? "" : ",") << "\n    {"
+                << "\"name\": \"" << result.name << "\""
+                << ", \"iterations\": " << result.iterations
+                << ", \"repetitions\": " << result.repetitions
+                << ", \"ns_per_op\": {"
+                << "\"median\": " << result.median
+                << ", \"mean\": " << result.mean
+                << ", \"stddev\": " << result.stddev
+                << ", \"min\": " << result.min
+                << ", \"max\": " << result.max << "}}";
+        }
+
+        out << "\n  ]\n}\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+
+    static RETCODE Pin(int cpu)
+    {
+        cpu_set_t only;
+        CPU_ZERO(&only);
+        CPU_SET(cpu, &only);
+        return 0 == pthread_setaffinity_np(pthread_self(), sizeof(only), &only) ? RTN_OK : RTN_FAIL;
+    }
+
+    template<class Body>
+    static double Time(Body& body, size_t iterations)
+    {
+        Clock::time_point start = Clock::now();
+        body(iterations);
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+    // Smallest n, roughly, whose call takes min_time
+    template<class Body>
+    size_t Calibrate(Body& body, size_t max_iterations) const
+    {
+        const double target_ns = std::chrono::duration<double, std::nano>(m_Settings.min_time).count();
+        size_t iterations = 1;
+        while(0 == max_iterations || iterations < max_iterations)
+        {
+            double elapsed = Time(body, iterations);
+            if(elapsed >= target_ns)
+            {
+                break;
+            }
+
+            // Aim a little past the target, growing at most tenfold a step
+            double scale = 0 < elapsed ? 1.2 * target_ns / elapsed : 10;
+            size_t next = static_cast<size_t>(iterations * std::min(std::max(scale, 2.0), 10.0));
+            iterations = 0 == max_iterations ? next : std::min(next, max_iterations);
+        }
+
+        return iterations;
+    }
+
+    static MICRO_RESULT Summarize(const std::string& name, size_t iterations, std::vector<double>& per_op)
+    {
+        std::sort(per_op.begin(), per_op.end());
+
+        MICRO_RESULT result;
+        result.name = name;
+        result.iterations = iterations;
+        result.repetitions = per_op.size();
+        result.min = per_op.front();
+        result.max = per_op.back();
+
+        size_t middle = per_op.size() / 2;
+        result.median = 0 == per_op.size() % 2 ? (per_op[middle - 1] + per_op[middle]) / 2 : per_op[middle];
+
+        double sum = 0;
+        for(double value : per_op)
+        {
+            sum += value;
+        }
+        result.mean = sum / per_op.size();
+
+        double squares = 0;
+        for(double value : per_op)
+        {
+            squares += (value - result.mean) * (value - result.mean);
+        }
+        result.stddev = 1 < per_op.size() ? std::sqrt(squares / (per_op.size() - 1)) : 0;
+        return result;
+    }
+
+    MICRO_SETTINGS m_Settings;
+    std::vector<int> m_Cpus; // Allowed at start
+    int m_MainCpu;
+    std::vector<MICRO_RESULT> m_Results;
+};
+
+#endif
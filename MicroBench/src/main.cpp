@@ -0,0 +1,824 @@
+#include <CLI.hh>
+#include <DatabaseAccess.hh>
+#include <Database.hh>
+#include <INETMessenger.hh>
+#include <LockFreeQ.hh>
+#include <TasQ.hh>
+#include <Hook.hh>
+#include <profiler.hh>
+#include <Constants.hh>
+#include <retcode.hh>
+#include <Logger.hh>
+#include <OFRI.hh>
+
+#ifdef __KDB_COROUTINES
+#include <Coroutine.hh>
+#endif
+
+#include <MicroBench.hh>
+
+#include <functional>
+#include <streambuf>
+#include <fstream>
+#include <future>
+#include <atomic>
+#include <thread>
+
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* kdb-microbench -- repeatable timings of the storage, queue, logging and
+ * package hot paths, and of one broadcast to many local clients.
+ *
+ *     kdb-microbench -j before.json
+ *     ... change something, rebuild ...
+ *     kdb-microbench -b before.json
+ *
+ * Storage benchmarks run on a scratch copy of -o's layout in a temporary
+ * install dir, never on the real databases. PROFILE_SCOPE with profiling
+ * on only runs with -P, as it leaves a chrome trace beside the binary.
+ * The broadcast listens on a socket in the scratch dir and needs two file
+ * descriptors per client -- it uses fewer clients when the limit is low.
+ */
+
+#ifndef __KDB_GIT_COMMIT
+#define __KDB_GIT_COMMIT "unknown"
+#endif
+
+constexpr int MICRO_DEFAULT_REPETITIONS = 10;
+constexpr int MICRO_DEFAULT_MIN_TIME_MS = 100;
+constexpr int MICRO_DEFAULT_WARMUP_MS = 200;
+constexpr size_t MICRO_PROFILE_MAX_ITERATIONS = 10000; // Every one is a trace event on disk
+constexpr size_t MICRO_BROADCAST_PEERS = 1000;
+constexpr size_t MICRO_BROADCAST_SIZE = 4096;
+constexpr size_t MICRO_SPARE_FDS = 64; // Kept back from the broadcast clients
+constexpr std::chrono::seconds MICRO_CONNECT_TIMEOUT(10);
+static const size_t MICRO_PRODUCER_COUNTS[] = {1, 2, 4, 8, 16};
+
+// Database::Get<T> finds its file by type name -- BENCH_RECORD.db
+struct BENCH_RECORD
+{
+    unsigned int values[16];
+};
+constexpr size_t BENCH_RECORD_COUNT = 1024;
+
+// Swallows whatever is logged to it
+class NullBuffer : public std::streambuf
+{
+
+protected:
+
+    int overflow(int character)
+    {
+        return character;
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize count)
+    {
+        return count;
+    }
+};
+
+/* A temporary KDB_INSTALL_DIR holding zeroed databases, removed on
+ * destruction. Must exist before anything reads KDB_INSTALL_DIR.
+ */
+class ScratchInstall
+{
+
+public:
+
+    ScratchInstall()
+        : m_Root(), m_Files()
+    {
+        char root[] = "/tmp/kdb-microbench-XXXXXX";
+        if(nullptr == mkdtemp(root))
+        {
+            return;
+        }
+
+        m_Root = std::string(root) + "/";
+        mkdir((m_Root + DB_DIR).c_str(), 0755);
+        mkdir(DBDir().c_str(), 0755);
+        setenv(KDB_INSTALL_DIR.c_str(), m_Root.c_str(), 1);
+    }
+
+    ~ScratchInstall()
+    {
+        for(const std::string& file : m_Files)
+        {
+            unlink(file.c_str());
+        }
+
+        if(!m_Root.empty())
+        {
+            rmdir(DBDir().c_str());
+            rmdir((m_Root + DB_DIR).c_str());
+            rmdir(m_Root.c_str());
+        }
+    }
+
+    bool IsValid(void) const
+    {
+        return !m_Root.empty();
+    }
+
+    std::string DBDir(void) const
+    {
+        return m_Root + DB_DB_DIR;
+    }
+
+    // Removed by whoever listens on it
+    std::string SocketPath(const std::string& name) const
+    {
+        return m_Root + name + ".sock";
+    }
+
+    RETCODE Create(const std::string& name, size_t size)
+    {
+        std::string path = DBDir() + name + DB_EXT;
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(0 > fd)
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        m_Files.push_back(path);
+        RETCODE retcode = 0 == ftruncate(fd, size) ? RTN_OK : RTN_MALLOC_FAIL;
+        close(fd);
+        return retcode;
+    }
+
+private:
+
+    std::string m_Root;
+    std::vector<std::string> m_Files;
+};
+
+// Last integer field -- the one WriteValue and ReadValue are timed on
+static bool FindIntegerField(const OBJECT_SCHEMA& object, FIELD& out_field)
+{
+    for(size_t index = object.fields.size(); 0 < index; index--)
+    {
+        char type = object.fields[index - 1].fieldType;
+        if('I' == type || 'U' == type || 'N' == type)
+        {
+            out_field = static_cast<FIELD>(index - 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static RETCODE StorageBenches(MicroBench& bench, ScratchInstall& install, const std::string& object_name)
+{
+    std::map<std::string, OBJECT_SCHEMA>::const_iterator entry = dbSizes.begin();
+    FIELD field = 0;
+    for(; dbSizes.end() != entry; ++entry)
+    {
+        bool wanted = object_name.empty() || object_name == entry->first;
+        if(wanted && 0 < entry->second.numberOfRecords && FindIntegerField(entry->second, field))
+        {
+            break;
+        }
+    }
+
+    if(dbSizes.end() == entry)
+    {
+        LOG_WARN("No object ", object_name.empty() ? "" : object_name + " ",
+                 "with an integer field -- skipping DatabaseAccess");
+    }
+    else
+    {
+        const OBJECT_SCHEMA& object = entry->second;
+        RETCODE retcode = install.Create(object.objectName, object.objectSize * object.numberOfRecords);
+        if(RTN_OK != retcode)
+        {
+            return retcode;
+        }
+
+        OBJECT name = {0};
+        strncpy(name, object.objectName.c_str(), sizeof(name) - 1);
+        DatabaseAccess access(name);
+        if(!access.IsValid())
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        const RECORD records = object.numberOfRecords;
+        const std::string prefix = "storage/DatabaseAccess::";
+        bench.Run(prefix + "Get(record)", [&](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                KeepValue(access.Get(static_cast<RECORD>(iteration % records)));
+            }
+        });
+
+        OFRI ofri = {0};
+        strncpy(ofri.o, name, sizeof(ofri.o));
+        ofri.f = field;
+        bench.Run(prefix + "Get(ofri)", [&](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                ofri.r = static_cast<RECORD>(iteration % records);
+                KeepValue(access.Get(ofri));
+            }
+        });
+
+        std::string value;
+        bench.Run(prefix + "ReadValue", [&](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                ofri.r = static_cast<RECORD>(iteration % records);
+                access.ReadValue(ofri, value);
+                KeepValue(value);
+            }
+        });
+
+        std::vector<std::string> values;
+        for(unsigned int number = 1; number <= 64; number++)
+        {
+            values.push_back(std::to_string(number));
+        }
+        bench.Run(prefix + "WriteValue", [&](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                ofri.r = static_cast<RECORD>(iteration % records);
+                KeepValue(access.WriteValue(ofri, values[iteration % values.size()]));
+            }
+        });
+    }
+
+    RETCODE retcode = install.Create(type_name<BENCH_RECORD>(), sizeof(BENCH_RECORD) * BENCH_RECORD_COUNT);
+    if(RTN_OK != retcode)
+    {
+        return retcode;
+    }
+
+    Database database(install.DBDir());
+    bench.Run("storage/Database::Get<T>", [&](size_t iterations)
+    {
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            KeepValue(database.Get<BENCH_RECORD>(static_cast<RECORD>(iteration % BENCH_RECORD_COUNT)));
+        }
+    });
+
+    return RTN_OK;
+}
+
+// Single thread, one element through and back out
+template<class Queue>
+static void RoundTrip(MicroBench& bench, const std::string& name, Queue& queue)
+{
+    bench.Run(name, [&](size_t iterations)
+    {
+        int element = 0;
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            element = static_cast<int>(iteration);
+            queue.Push(element);
+            queue.PopNoWait(element);
+            KeepValue(element);
+        }
+    });
+}
+
+// producers threads push, this thread pops every element -- ns per element
+template<class Queue>
+static void Contended(MicroBench& bench, const std::string& name, size_t producers)
+{
+    bench.Run(name, [&bench, producers](size_t iterations)
+    {
+        Queue queue;
+        std::vector<std::thread> threads;
+        for(size_t producer = 0; producer < producers; producer++)
+        {
+            size_t share = iterations / producers + (producer < iterations % producers ? 1 : 0);
+            threads.emplace_back([&bench, &queue, producer, share]()
+            {
+                bench.PinHelper(producer);
+                for(size_t pushed = 0; pushed < share; pushed++)
+                {
+                    int element = static_cast<int>(pushed);
+                    queue.Push(element);
+                }
+            });
+        }
+
+        int element = 0;
+        for(size_t popped = 0; popped < iterations;)
+        {
+            if(queue.PopNoWait(element))
+            {
+                popped++;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        for(std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    });
+}
+
+static void QueueBenches(MicroBench& bench)
+{
+    TasQ<int> tasq;
+    RoundTrip(bench, "queue/TasQ push+pop", tasq);
+    SpscQ<int> spsc;
+    RoundTrip(bench, "queue/SpscQ push+pop", spsc);
+    MpscQ<int> mpsc;
+    RoundTrip(bench, "queue/MpscQ push+pop", mpsc);
+
+    for(size_t producers : MICRO_PRODUCER_COUNTS)
+    {
+        std::string suffix = " " + std::to_string(producers) + (1 == producers ? " producer" : " producers");
+        Contended<TasQ<int>>(bench, "queue/TasQ" + suffix, producers);
+        Contended<MpscQ<int>>(bench, "queue/MpscQ" + suffix, producers);
+    }
+}
+
+static void HookBenches(MicroBench& bench)
+{
+    for(size_t delegates : {1, 4})
+    {
+        Hook<std::function<void(int)>> hook;
+        unsigned long long total = 0;
+        for(size_t delegate = 0; delegate < delegates; delegate++)
+        {
+            hook += [&total](int value)
+            {
+                total += value;
+            };
+        }
+
+        bench.Run("hook/Hook::Invoke " + std::to_string(delegates) + (1 == delegates ? " delegate" : " delegates"),
+            [&](size_t iterations)
+            {
+                for(size_t iteration = 0; iteration < iterations; iteration++)
+                {
+                    hook.Invoke(static_cast<int>(iteration));
+                }
+                KeepValue(total);
+            });
+    }
+}
+
+// Formatting and the final write, to a stream that throws it away
+static void LogBenches(MicroBench& bench)
+{
+    NullBuffer discard;
+    std::ostream sink(&discard);
+    bench.Run("log/Logger::Log", [&](size_t iterations)
+    {
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            Log::Logger::Instance().Log(sink, Log::LogLevel::INFO, "INFO", __FILE__, __LINE__,
+                "Request ", iteration, " from ", "127.0.0.1", ":", 5055);
+        }
+    });
+}
+
+static void ProfileBenches(MicroBench& bench, bool profiling)
+{
+    bench.Run("profile/PROFILE_SCOPE compiled out", [&](size_t iterations)
+    {
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            PROFILE_SCOPE("microbench");
+            KeepValue(iteration);
+        }
+    });
+
+    if(!profiling)
+    {
+        return;
+    }
+
+    // What PROFILE_SCOPE is with __ENABLE_PROFILING
+    ProfPool::Instance();
+    bench.Run("profile/PROFILE_SCOPE enabled", [&](size_t iterations)
+    {
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            Timer timer("microbench");
+            KeepValue(iteration);
+        }
+    }, MICRO_PROFILE_MAX_ITERATIONS);
+}
+
+static void PackageBenches(MicroBench& bench)
+{
+    for(size_t size : {64, 4096})
+    {
+        bench.Run("package/AllocatePackage+FreePackage " + std::to_string(size) + " B", [size](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                INET_PACKAGE* package = AllocatePackage(size);
+                KeepValue(package);
+                FreePackage(package);
+            }
+        });
+
+        bench.Run("package/malloc+free " + std::to_string(size) + " B", [size](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                void* block = malloc(sizeof(INET_PACKAGE) + size);
+                KeepValue(block);
+                free(block);
+            }
+        });
+    }
+
+    // One broadcast to every peer, shared the way SendAll does it and
+    // copied per peer the way it used to
+    std::vector<INET_PACKAGE*> peers(MICRO_BROADCAST_PEERS);
+    const std::string fan_out = std::to_string(MICRO_BROADCAST_SIZE / 1024) + " KB x " +
+        std::to_string(MICRO_BROADCAST_PEERS) + " peers";
+    bench.Run("package/broadcast shared " + fan_out, [&](size_t iterations)
+    {
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            INET_PACKAGE* package = AllocatePackage(MICRO_BROADCAST_SIZE);
+            for(INET_PACKAGE*& peer : peers)
+            {
+                peer = RetainPackage(package);
+            }
+            FreePackage(package);
+            for(INET_PACKAGE* peer : peers)
+            {
+                FreePackage(peer);
+            }
+        }
+    });
+
+    bench.Run("package/broadcast cloned " + fan_out, [&](size_t iterations)
+    {
+        for(size_t iteration = 0; iteration < iterations; iteration++)
+        {
+            INET_PACKAGE* package = AllocatePackage(MICRO_BROADCAST_SIZE);
+            for(INET_PACKAGE*& peer : peers)
+            {
+                peer = ClonePackage(package);
+            }
+            FreePackage(package);
+            for(INET_PACKAGE* peer : peers)
+            {
+                FreePackage(peer);
+            }
+        }
+    });
+}
+
+// Raise the soft limit as far as allowed and say how many clients fit
+static size_t BroadcastPeers(void)
+{
+    struct rlimit limit;
+    if(0 != getrlimit(RLIMIT_NOFILE, &limit))
+    {
+        return 0;
+    }
+
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if(RLIM_INFINITY == limit.rlim_cur)
+    {
+        return MICRO_BROADCAST_PEERS;
+    }
+
+    size_t fit = MICRO_SPARE_FDS < limit.rlim_cur ? (limit.rlim_cur - MICRO_SPARE_FDS) / 2 : 0;
+    return std::min(MICRO_BROADCAST_PEERS, fit);
+}
+
+// PollGroup::SendAll() to clients on its AF_UNIX socket, timed until the
+// last one has it. The clients share one PollThread.
+static void NetworkBenches(MicroBench& bench, const ScratchInstall& install)
+{
+    const size_t num_peers = BroadcastPeers();
+    if(0 == num_peers)
+    {
+        LOG_WARN("No file descriptors to spare -- skipping the broadcast");
+        return;
+    }
+    if(MICRO_BROADCAST_PEERS != num_peers)
+    {
+        LOG_WARN("Broadcasting to ", num_peers, " clients -- the file descriptor limit is too low for ",
+                 MICRO_BROADCAST_PEERS);
+    }
+
+    const std::string path = install.SocketPath("broadcast");
+    setenv(KDB_INET_UNIX_PATH.c_str(), path.c_str(), 1);
+    PollGroup server("", 1);
+    if(server.GetLocalPath().empty())
+    {
+        LOG_WARN("Could not listen on ", path, " -- skipping the broadcast");
+        return;
+    }
+
+    std::atomic<size_t> connected(0);
+    server.m_OnClientConnect += [&connected](const CONNECTION&)
+    {
+        connected.fetch_add(1, std::memory_order_release);
+    };
+
+    std::atomic<size_t> received(0);
+    PollThread clients;
+    clients.m_OnReceive += [&received](const INET_PACKAGE*)
+    {
+        received.fetch_add(1, std::memory_order_release);
+    };
+
+    for(size_t peer = 0; peer < num_peers; peer++)
+    {
+        if(RTN_OK != clients.ConnectLocal(path))
+        {
+            LOG_WARN("Client ", peer, " could not connect -- skipping the broadcast");
+            clients.StopPoll();
+            server.StopPoll();
+            return;
+        }
+    }
+
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + MICRO_CONNECT_TIMEOUT;
+    while(num_peers != connected.load(std::memory_order_acquire) &&
+          std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::yield();
+    }
+
+    if(num_peers == connected.load(std::memory_order_acquire))
+    {
+        const std::string fan_out = std::to_string(MICRO_BROADCAST_SIZE / 1024) + " KB x " +
+            std::to_string(num_peers) + " local clients";
+        bench.Run("net/PollGroup::SendAll " + fan_out, [&](size_t iterations)
+        {
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+            {
+                const size_t delivered = received.load(std::memory_order_acquire) + num_peers;
+                INET_PACKAGE* package = AllocatePackage(MICRO_BROADCAST_SIZE);
+                server.SendAll(package);
+                FreePackage(package);
+                while(received.load(std::memory_order_acquire) < delivered)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    else
+    {
+        LOG_WARN("Only ", connected.load(), " of ", num_peers, " clients were accepted -- skipping the broadcast");
+    }
+
+    clients.StopPoll();
+    server.StopPoll();
+}
+
+#ifdef __KDB_COROUTINES
+static Task<int> Echo(int value)
+{
+    co_return value;
+}
+
+static Task<> AwaitEchoes(size_t count, long long& out_sum)
+{
+    for(size_t index = 0; index < count; index++)
+    {
+        out_sum += co_await Echo(static_cast<int>(index));
+    }
+}
+
+// Starts on the loop's thread and carries on on the poll thread after
+// the first reply
+static Task<> AsyncRequestChain(CoLoop& loop, PollThread& client, CONNECTION server,
+    size_t count, size_t& out_replies)
+{
+    co_await loop.Schedule();
+    for(size_t index = 0; index < count; index++)
+    {
+        unsigned int payload = static_cast<unsigned int>(index);
+        PackageHandle reply = co_await AsyncRequest(client, server, MESSAGE_TYPE::TEXT, &payload, sizeof(payload));
+        out_replies += nullptr == reply ? 0 : 1;
+    }
+    loop.Stop();
+}
+
+// The same exchange written as callbacks, each sending the next request
+struct CALLBACK_CHAIN
+{
+    PollThread& client;
+    CONNECTION server;
+    size_t remaining;
+    size_t replies;
+    EventNotifier done;
+};
+
+static void NextRequest(CALLBACK_CHAIN& chain)
+{
+    if(0 == chain.remaining)
+    {
+        chain.done.Notify();
+        return;
+    }
+
+    unsigned int payload = static_cast<unsigned int>(--chain.remaining);
+    chain.client.Request(chain.server, MESSAGE_TYPE::TEXT, &payload, sizeof(payload), INET_FLAG_NONE,
+        [&chain](PackageHandle reply)
+        {
+            chain.replies += nullptr == reply ? 0 : 1;
+            NextRequest(chain);
+        });
+}
+
+// Awaiting a Task, then request after request to an echo server on a
+// local socket -- co_await AsyncRequest() on a CoLoop against the
+// PackageTracker callbacks it wraps
+static void CoroutineBenches(MicroBench& bench, const ScratchInstall& install)
+{
+    bench.Run("coro/Task co_await", [](size_t iterations)
+    {
+        long long sum = 0;
+        Spawn(AwaitEchoes(iterations, sum));
+        KeepValue(sum);
+    });
+
+    const std::string path = install.SocketPath("echo");
+    PollThread server("", false, path);
+    if(server.GetLocalPath().empty())
+    {
+        LOG_WARN("Could not listen on ", path, " -- skipping requests");
+        return;
+    }
+
+    // Answers every request empty -- the request id comes back in the header
+    server.m_OnReceive += [&server](const INET_PACKAGE* request)
+    {
+        INET_PACKAGE* reply = AllocatePackage(0);
+        if(nullptr != reply)
+        {
+            reply->header = request->header;
+            reply->header.message_size = 0;
+            server.Send(reply);
+        }
+    };
+
+    PollThread client;
+    CONNECTION echo;
+    if(RTN_OK != client.ConnectLocal(path, echo))
+    {
+        LOG_WARN("Could not connect to ", path, " -- skipping requests");
+        client.StopPoll();
+        server.StopPoll();
+        return;
+    }
+
+    bench.Run("coro/AsyncRequest on CoLoop", [&](size_t iterations)
+    {
+        EventNotifier notifier;
+        CoLoop loop(notifier);
+        size_t replies = 0;
+        Spawn(AsyncRequestChain(loop, client, echo, iterations, replies));
+        loop.Run();
+        KeepValue(replies);
+    });
+
+    bench.Run("coro/PackageTracker callbacks", [&](size_t iterations)
+    {
+        CALLBACK_CHAIN chain = {client, echo, iterations, 0, EventNotifier()};
+        NextRequest(chain);
+        chain.done.Wait();
+        KeepValue(chain.replies);
+    });
+
+    client.StopPoll();
+    server.StopPoll();
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    CLI::Parser parse("kdb-microbench", "Microbenchmarks for storage, queue, logging, package and broadcast hot paths");
+    CLI::CLI_IntArgument repetitionsArg("-r", "Timed repetitions of each benchmark (default 10)", false);
+    CLI::CLI_IntArgument minTimeArg("-t", "Milliseconds each repetition runs for at least (default 100)", false);
+    CLI::CLI_IntArgument warmupArg("-w", "Milliseconds of warmup before timing (default 200)", false);
+    CLI::CLI_IntArgument cpuArg("-c", "CPU to pin to -- the first one allowed if not given", false);
+    CLI::CLI_StringArgument filterArg("-f", "Only benchmarks whose name contains this", false);
+    CLI::CLI_StringArgument objectArg("-o", "Object whose layout storage benchmarks use", false);
+    CLI::CLI_FlagArgument profileArg("-P", "Also time PROFILE_SCOPE with profiling on -- writes a trace", false);
+    CLI::CLI_StringArgument jsonArg("-j", "Write the results as JSON to this file, - for stdout", false);
+    CLI::CLI_StringArgument baselineArg("-b", "JSON from an earlier run to compare medians against", false);
+    CLI::CLI_FlagArgument helpArg("-h", "Shows usage", false);
+
+    parse
+        .AddArg(repetitionsArg)
+        .AddArg(minTimeArg)
+        .AddArg(warmupArg)
+        .AddArg(cpuArg)
+        .AddArg(filterArg)
+        .AddArg(objectArg)
+        .AddArg(profileArg)
+        .AddArg(jsonArg)
+        .AddArg(baselineArg)
+        .AddArg(helpArg);
+
+    RETCODE retcode = parse.ParseCommandLineArguments(argc, argv);
+
+    if(helpArg.IsInUse())
+    {
+        parse.Usage();
+        return 0;
+    }
+
+    if(RTN_OK != retcode)
+    {
+        parse.Usage();
+        return retcode;
+    }
+
+    MICRO_SETTINGS settings;
+    settings.repetitions = repetitionsArg.IsInUse() ? repetitionsArg.GetValue() : MICRO_DEFAULT_REPETITIONS;
+    settings.min_time = std::chrono::milliseconds(minTimeArg.IsInUse() ? minTimeArg.GetValue() : MICRO_DEFAULT_MIN_TIME_MS);
+    settings.warmup = std::chrono::milliseconds(warmupArg.IsInUse() ? warmupArg.GetValue() : MICRO_DEFAULT_WARMUP_MS);
+    settings.filter = filterArg.IsInUse() ? filterArg.GetValue() : "";
+    if(0 == settings.repetitions || 0 >= settings.min_time.count() || 0 > settings.warmup.count())
+    {
+        LOG_ERROR("-r and -t must be positive and -w not negative");
+        return RTN_BAD_ARG;
+    }
+
+    std::map<std::string, double> baseline;
+    if(baselineArg.IsInUse() && RTN_OK != MicroBench::ReadBaseline(baselineArg.GetValue(), baseline))
+    {
+        LOG_ERROR("Could not read baseline ", baselineArg.GetValue());
+        return RTN_NOT_FOUND;
+    }
+
+    MicroBench bench(settings);
+    retcode = bench.PinMain(cpuArg.IsInUse() ? cpuArg.GetValue() : -1);
+    if(RTN_OK != retcode)
+    {
+        LOG_WARN("Could not pin to a CPU -- timings may wander");
+    }
+
+    ScratchInstall install;
+    if(!install.IsValid())
+    {
+        LOG_ERROR("Could not make a scratch install dir");
+        return RTN_NOT_FOUND;
+    }
+
+    retcode = StorageBenches(bench, install, objectArg.IsInUse() ? objectArg.GetValue() : "");
+    if(RTN_OK != retcode)
+    {
+        LOG_WARN("Storage benchmarks did not all run: ", retcode);
+    }
+    QueueBenches(bench);
+    HookBenches(bench);
+    LogBenches(bench);
+    ProfileBenches(bench, profileArg.IsInUse());
+    PackageBenches(bench);
+    NetworkBenches(bench, install);
+#ifdef __KDB_COROUTINES
+    CoroutineBenches(bench, install);
+#endif
+
+    std::cout << "kdb-microbench at " << __KDB_GIT_COMMIT << ": pinned to CPU " << bench.MainCpu()
+              << " of " << bench.NumCpus() << ", " << settings.repetitions << " repetitions of at least "
+              << settings.min_time.count() << " ms\n";
+    bench.PrintTable(std::cout, baseline);
+
+    if(jsonArg.IsInUse())
+    {
+        if("-" == jsonArg.GetValue())
+        {
+            bench.PrintJson(std::cout, __KDB_GIT_COMMIT);
+        }
+        else
+        {
+            std::ofstream json_file(jsonArg.GetValue());
+            if(!json_file.is_open())
+            {
+                LOG_ERROR("Could not open ", jsonArg.GetValue());
+                return RTN_NOT_FOUND;
+            }
+            bench.PrintJson(json_file, __KDB_GIT_COMMIT);
+        }
+    }
+
+    return 0;
+}
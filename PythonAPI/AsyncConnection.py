@@ -0,0 +1,300 @@
+import asyncio
+
+from PythonAPI import INETConsts
+
+# asyncio client for the UpdateDaemon.
+#
+# Requests do not wait for each other. Each gets a request_id and a future,
+# and replies are matched back by id in whatever order they arrive, so one
+# connection can keep thousands in flight. Requests made in the same turn
+# of the event loop go out together in one writelines() call -- a single
+# sendmsg on Python 3.12 and later.
+#
+#     connection = await AsyncConnection.open("10.0.0.5", 5000)
+#     records = await connection.read_many(3, range(1000))
+#     async for o, r, changed, values in await connection.subscribe(3, 7):
+#         ...
+#
+# An empty reply means the daemon could not serve the request.
+
+REQUEST_MAX_IN_FLIGHT = 16 * 1024 # IDs are 16 bits on the wire
+REQUEST_ID_LIMIT = 0xFFFF
+
+class Subscription:
+
+    # Updates wait here until read -- nothing is dropped for a slow reader
+    def __init__(self, connection, key:tuple):
+        self._connection = connection
+        self.key = key
+        self._updates = asyncio.Queue()
+        self.closed = False
+
+    def __aiter__(self):
+        return self
+
+    # (o, r, changed_fields, values) as INETConsts.unpack_update() gives them
+    async def __anext__(self) -> tuple:
+        update = await self._updates.get()
+        if update is None:
+            raise StopAsyncIteration
+        return update
+
+    def matches(self, o:int, r:int, changed:list) -> bool:
+        key_o, key_r, key_f = self.key
+        return key_o == o and key_r in (INETConsts.SUBSCRIBE_ALL, r) and \
+            (INETConsts.SUBSCRIBE_ALL == key_f or key_f in changed)
+
+    def _deliver(self, update):
+        self._updates.put_nowait(update)
+
+    async def close(self):
+        if not self.closed:
+            self.closed = True
+            self._deliver(None)
+            await self._connection._unsubscribe(self)
+
+class AsyncConnection(asyncio.Protocol):
+
+    def __init__(self, max_in_flight:int = REQUEST_MAX_IN_FLIGHT):
+        self._loop = asyncio.get_running_loop()
+        self._transport = None
+        self._handshake = self._loop.create_future()
+        self._closed = self._loop.create_future()
+        self._buffer = bytearray()
+        self._pending = {} # request_id: future
+        self._next_id = 1
+        self._room = asyncio.Semaphore(min(max_in_flight, REQUEST_ID_LIMIT - 1))
+        self._outgoing = []
+        self._flush_scheduled = False
+        self._writable = asyncio.Event()
+        self._writable.set()
+        self._subscriptions = []
+        self._keys = {} # (o, r, f): task resolving to whether the daemon took it
+
+    # TCP to address:port, or the daemon's AF_UNIX socket when path is given.
+    # address defaults to KDB_INET_ADDRESS.
+    @classmethod
+    async def open(cls, address:str = None, port:int = None, path:str = None,
+                   max_in_flight:int = REQUEST_MAX_IN_FLIGHT):
+        loop = asyncio.get_running_loop()
+        connection = cls(max_in_flight)
+        if path:
+            await loop.create_unix_connection(lambda: connection, path)
+        else:
+            await loop.create_connection(lambda: connection,
+                address if address else INETConsts.KDB_INET_ADDRESS, port)
+        await connection._handshake
+        return connection
+
+    async def close(self):
+        if self._transport is not None:
+            self._transport.close()
+        await asyncio.shield(self._closed)
+
+    # One record, or field f of it when the daemon is asked for a value
+    async def read(self, o:int, r:int, f:int = 0, i:int = 0) -> bytes:
+        return await self.request(INETConsts.MESSAGE_TYPE_DB,
+                                  INETConsts.DB_OFRI_ID_STRUCT.pack(o, f, r, i))
+
+    # Set field f, index i of record r from its text form. The reply is the
+    # whole record after the write.
+    async def write(self, o:int, r:int, f:int, value, i:int = 0) -> bytes:
+        if isinstance(value, str):
+            value = value.encode()
+        return await self.request(INETConsts.MESSAGE_TYPE_DB,
+                                  INETConsts.DB_OFRI_ID_STRUCT.pack(o, f, r, i) + value)
+
+    # A record decoded into its generated class -- read_record(DCC_CHAR, 7).
+    # None if it could not be read.
+    async def read_record(self, object_class, r:int):
+        payload = await self.read(object_class.OBJECT_NUMBER, r)
+        if len(payload) != object_class.SIZE:
+            return None
+        return object_class(object_class.STRUCT.unpack(payload))
+
+    # Many records of object o at once, replies in the order of records.
+    # Cheaper than gathering read() calls -- no task per request.
+    async def read_many(self, o:int, records, f:int = 0) -> list:
+        pack = INETConsts.DB_OFRI_ID_STRUCT.pack
+        replies = []
+        for r in records:
+            replies.append(await self._submit(INETConsts.MESSAGE_TYPE_DB, pack(o, f, r, 0)))
+        return await asyncio.gather(*replies)
+
+    # (r, value) pairs into field f of object o
+    async def write_many(self, o:int, f:int, values) -> list:
+        pack = INETConsts.DB_OFRI_ID_STRUCT.pack
+        replies = []
+        for r, value in values:
+            if isinstance(value, str):
+                value = value.encode()
+            replies.append(await self._submit(INETConsts.MESSAGE_TYPE_DB, pack(o, f, r, 0) + value))
+        return await asyncio.gather(*replies)
+
+    # The daemon's counters, gauges and histograms in the Prometheus text
+    # format
+    async def stats(self) -> str:
+        return (await self.request(INETConsts.MESSAGE_TYPE_STATS, b"")).decode()
+
+    async def request(self, message_type:int, payload:bytes,
+                      flags:int = INETConsts.INET_FLAG_OBJECT_ID) -> bytes:
+        return await (await self._submit(message_type, payload, flags))
+
+    # Queue a request once there is room for it and hand back the future
+    # for its reply
+    async def _submit(self, message_type:int, payload:bytes,
+                      flags:int = INETConsts.INET_FLAG_OBJECT_ID) -> asyncio.Future:
+        await self._room.acquire()
+        if self._closed.done():
+            self._room.release()
+            raise ConnectionError("Connection to the daemon is closed")
+
+        if not self._writable.is_set():
+            try:
+                await self._writable.wait()
+            except BaseException:
+                self._room.release()
+                raise
+        request_id = self._take_id()
+        reply = self._loop.create_future()
+        reply.add_done_callback(self._release_room)
+        self._pending[request_id] = reply
+        self._send(INETConsts.pack_compact(message_type, payload, flags, request_id))
+        return reply
+
+    def _release_room(self, reply:asyncio.Future):
+        self._room.release()
+
+    # Updates to object o, record r or field f of it -- either may be
+    # SUBSCRIBE_ALL. Raises ValueError if the daemon refuses.
+    async def subscribe(self, o:int, r:int = INETConsts.SUBSCRIBE_ALL,
+                        f:int = INETConsts.SUBSCRIBE_ALL) -> Subscription:
+        key = (o, r, f)
+
+        # The daemon holds one subscription per key for us however many
+        # Subscriptions share it
+        accepted = self._keys.get(key)
+        if accepted is None:
+            accepted = self._loop.create_task(self._subscribe_key(key))
+            self._keys[key] = accepted
+
+        if not await asyncio.shield(accepted):
+            if self._keys.get(key) is accepted:
+                del self._keys[key]
+            raise ValueError(f"Subscription to {o}.{f}.{r} refused")
+
+        subscription = Subscription(self, key)
+        self._subscriptions.append(subscription)
+        return subscription
+
+    async def _subscribe_key(self, key:tuple) -> bool:
+        o, r, f = key
+        reply = await self.request(INETConsts.MESSAGE_TYPE_SUBSCRIBE,
+                                   INETConsts.DB_OFRI_ID_STRUCT.pack(o, f, r, 0))
+        return 0 < len(reply)
+
+    async def _unsubscribe(self, subscription:Subscription):
+        if subscription in self._subscriptions:
+            self._subscriptions.remove(subscription)
+
+        key = subscription.key
+        if any(key == other.key for other in self._subscriptions) or key not in self._keys:
+            return
+
+        del self._keys[key]
+        if not self._closed.done():
+            o, r, f = key
+            await self.request(INETConsts.MESSAGE_TYPE_UNSUBSCRIBE,
+                               INETConsts.DB_OFRI_ID_STRUCT.pack(o, f, r, 0))
+
+    def _take_id(self) -> int:
+        while self._next_id in self._pending:
+            self._next_id = self._next_id % REQUEST_ID_LIMIT + 1
+        request_id = self._next_id
+        self._next_id = self._next_id % REQUEST_ID_LIMIT + 1
+        return request_id
+
+    # Everything queued this turn goes out in one write
+    def _send(self, frame:bytes):
+        self._outgoing.append(frame)
+        if not self._flush_scheduled:
+            self._flush_scheduled = True
+            self._loop.call_soon(self._flush)
+
+    def _flush(self):
+        self._flush_scheduled = False
+        frames, self._outgoing = self._outgoing, []
+        if frames and self._transport is not None and not self._transport.is_closing():
+            self._transport.writelines(frames)
+
+    # asyncio.Protocol
+
+    def connection_made(self, transport):
+        self._transport = transport
+        transport.write(INETConsts.pack_ack())
+
+    def data_received(self, data:bytes):
+        self._buffer += data
+        header_size = INETConsts.INET_COMPACT_HEADER_SIZE
+        if not self._handshake.done():
+            ack_size = header_size + INETConsts.ACKNOWLEDGE_SIZE
+            if len(self._buffer) < ack_size:
+                return
+            message_type = INETConsts.INET_COMPACT_HEADER_STRUCT.unpack_from(self._buffer)[1]
+            if INETConsts.MESSAGE_TYPE_ACK != message_type:
+                self._handshake.set_exception(ConnectionError("Daemon did not acknowledge"))
+                self._transport.close()
+                return
+            del self._buffer[:ack_size]
+            self._handshake.set_result(True)
+
+        # Walk every whole frame, then drop them from the buffer at once
+        unpack_header = INETConsts.INET_COMPACT_HEADER_STRUCT.unpack_from
+        buffer = self._buffer
+        offset = 0
+        while len(buffer) - offset >= header_size:
+            size, message_type, flags, request_id = unpack_header(buffer, offset)
+            end = offset + header_size + size
+            if len(buffer) < end:
+                break
+            payload = bytes(buffer[offset + header_size:end])
+            offset = end
+
+            if request_id:
+                reply = self._pending.pop(request_id, None)
+                if reply is not None and not reply.done():
+                    reply.set_result(payload)
+            elif INETConsts.MESSAGE_TYPE_UPDATE == message_type:
+                self._dispatch_update(payload)
+
+        del buffer[:offset]
+
+    def _dispatch_update(self, payload:bytes):
+        update = INETConsts.unpack_update(payload)
+        o, r, changed, values = update
+        for subscription in self._subscriptions:
+            if subscription.matches(o, r, changed):
+                subscription._deliver(update)
+
+    def pause_writing(self):
+        self._writable.clear()
+
+    def resume_writing(self):
+        self._writable.set()
+
+    def connection_lost(self, exc):
+        error = ConnectionError("Connection to the daemon was lost")
+        if not self._handshake.done():
+            self._handshake.set_exception(error)
+        for reply in self._pending.values():
+            if not reply.done():
+                reply.set_exception(error)
+        self._pending.clear()
+        for subscription in self._subscriptions:
+            subscription.closed = True
+            subscription._deliver(None)
+        self._subscriptions.clear()
+        self._keys.clear()
+        self._writable.set()
+        if not self._closed.done():
+            self._closed.set_result(True)
@@ -0,0 +1,85 @@
+import mmap
+import os
+
+# Reads records straight out of an object's .db file on this host -- no
+# daemon and no sockets. The file is mapped read-only and shared with the
+# daemon, so writes show up as soon as they land. Nothing is locked: a
+# record read while the daemon writes it can be part old, part new.
+#
+# record() and field() hand back memoryviews into the mapping, so nothing
+# is copied until they are read. unpack() and iter_unpack() decode with the
+# object's precompiled STRUCT -- iter_unpack() walks a range of records in
+# one call, which is the fast way to scan a whole object.
+#
+#     with DCC_CHAR.open_db() as reader:
+#         total_xp = sum(row[-1] for row in reader.iter_unpack())
+#
+# Every view handed out must be released before close().
+
+KDB_INSTALL_DIR_ENV = "KDB_INSTALL_DIR"
+DB_DB_DIR = "db/db/"
+DB_EXT = ".db"
+
+def db_path(object_class) -> str:
+    return os.path.join(os.getenv(KDB_INSTALL_DIR_ENV, ""), DB_DB_DIR, object_class.__name__ + DB_EXT)
+
+class DBReader:
+
+    def __init__(self, object_class, path:str = None):
+        if object_class.STRUCT.size != object_class.SIZE:
+            raise ValueError(f"{object_class.__name__} FORMAT is {object_class.STRUCT.size} bytes "
+                             f"but records are {object_class.SIZE}")
+
+        self.object_class = object_class
+        self.path = path if path else db_path(object_class)
+        with open(self.path, "rb") as db_file:
+            self._map = mmap.mmap(db_file.fileno(), 0, access = mmap.ACCESS_READ)
+        self._view = memoryview(self._map)
+        self.size = object_class.SIZE
+        self.records = len(self._map) // self.size
+
+    def __len__(self) -> int:
+        return self.records
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def close(self):
+        self._view.release()
+        self._map.close()
+
+    def _offset(self, record:int) -> int:
+        if not 0 <= record < self.records:
+            raise IndexError(f"Record {record} is not in {self.object_class.__name__} "
+                             f"-- it has {self.records}")
+        return record * self.size
+
+    # Raw bytes of one record
+    def record(self, record:int) -> memoryview:
+        start = self._offset(record)
+        return self._view[start:start + self.size]
+
+    # Raw bytes of one field -- name as in the schema
+    def field(self, record:int, name:str) -> memoryview:
+        offset, size = self.object_class.FIELDS[name]
+        start = self._offset(record) + offset
+        return self._view[start:start + size]
+
+    # Raw bytes of records [start, stop)
+    def records_view(self, start:int = 0, stop:int = None) -> memoryview:
+        stop = self.records if stop is None else min(stop, self.records)
+        start = min(max(start, 0), stop)
+        return self._view[start * self.size:stop * self.size]
+
+    def unpack(self, record:int) -> tuple:
+        return self.object_class.STRUCT.unpack_from(self._map, self._offset(record))
+
+    def get(self, record:int):
+        return self.object_class(self.unpack(record))
+
+    # One tuple per record in [start, stop)
+    def iter_unpack(self, start:int = 0, stop:int = None):
+        return self.object_class.STRUCT.iter_unpack(self.records_view(start, stop))
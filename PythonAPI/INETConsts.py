@@ -3,19 +3,80 @@ import os
 
 # SERVER CONSTS
 
-SERVER_VERION =  2
+SERVER_VERSION = 3 # Compact framing -- server answers the ACK
+LEGACY_SERVER_VERSION = 2 # Full INET_HEADER framing -- no ACK reply
+SERVER_VERION = LEGACY_SERVER_VERSION # Old name kept for existing scripts
+
+# MESSAGE_TYPE
+
+MESSAGE_TYPE_NONE = 0
+MESSAGE_TYPE_TEXT = 1
+MESSAGE_TYPE_ACK = 2
+MESSAGE_TYPE_DB = 3
+MESSAGE_TYPE_UPDATE = 4 # Change notification -- UPDATE_HEADER, changed-field bitmap, values
+MESSAGE_TYPE_SUBSCRIBE = 5 # OFRI or OFRI_ID -- record or field may be SUBSCRIBE_ALL
+MESSAGE_TYPE_UNSUBSCRIBE = 6 # Same payload as SUBSCRIBE. Empty drops every subscription.
+MESSAGE_TYPE_STATS = 7 # Empty request. Reply is the daemon's metrics as exposition text.
+
+SUBSCRIBE_ALL = 0xFFFFFFFF # Any record or any field
+
+# INET HEADER FLAGS (compact framing only)
+
+INET_FLAG_NONE = 0x00
+INET_FLAG_OBJECT_ID = 0x01 # Payload starts with OFRI_ID instead of OFRI
 
 # INET C STRUCTS
 
 CONNECTION_FORMAT = "@H46s" # port, address
 INET_HEADER_FORMAT = CONNECTION_FORMAT + "II" #  CONNECTION, message_size, message_type
+INET_COMPACT_HEADER_FORMAT = "@IBBH" # message_size, message_type, flags, request_id
+ACKNOWLEDGE_FORMAT = "@I" # server_version
 
 DB_OR_FORMAT = "24sI" # OBJECT, RECORD
+DB_OFRI_FORMAT = "@20sIII" # OBJECT, FIELD, RECORD, INDEX
+DB_OFRI_ID_FORMAT = "@IIII" # OBJECT_ID, FIELD, RECORD, INDEX
+UPDATE_HEADER_FORMAT = "@IIII" # OBJECT_ID, RECORD, num_fields, value_size
 
 CONNECTION_SIZE = struct.calcsize(CONNECTION_FORMAT)
 INET_HEADER_SIZE = struct.calcsize(INET_HEADER_FORMAT)
+INET_COMPACT_HEADER_SIZE = struct.calcsize(INET_COMPACT_HEADER_FORMAT)
+ACKNOWLEDGE_SIZE = struct.calcsize(ACKNOWLEDGE_FORMAT)
+UPDATE_HEADER_SIZE = struct.calcsize(UPDATE_HEADER_FORMAT)
+
+# Precompiled -- these are packed and unpacked once per message
+INET_COMPACT_HEADER_STRUCT = struct.Struct(INET_COMPACT_HEADER_FORMAT)
+DB_OFRI_ID_STRUCT = struct.Struct(DB_OFRI_ID_FORMAT)
+UPDATE_HEADER_STRUCT = struct.Struct(UPDATE_HEADER_FORMAT)
+
+def header_format(version:int) -> str:
+    return INET_COMPACT_HEADER_FORMAT if version >= SERVER_VERSION else INET_HEADER_FORMAT
+
+def header_size(version:int) -> int:
+    return struct.calcsize(header_format(version))
+
+# Handshake is always sent with the full INET_HEADER
+def pack_ack(version:int = SERVER_VERSION) -> bytes:
+    return struct.pack(INET_HEADER_FORMAT + "I", 0, b"", ACKNOWLEDGE_SIZE, MESSAGE_TYPE_ACK, version)
+
+def pack_compact(message_type:int, payload:bytes, flags:int = INET_FLAG_NONE, request_id:int = 0) -> bytes:
+    return INET_COMPACT_HEADER_STRUCT.pack(len(payload), message_type, flags, request_id) + payload
+
+# UPDATE payloads: header, one bit per field in 64 bit words, then the
+# contents of each changed field in field order
+def unpack_update(payload:bytes) -> tuple:
+    o, r, num_fields, value_size = UPDATE_HEADER_STRUCT.unpack_from(payload)
+    words = (num_fields + 63) // 64
+    bits = struct.unpack_from("@%dQ" % words, payload, UPDATE_HEADER_SIZE)
+    changed = [f for f in range(num_fields) if bits[f // 64] >> (f % 64) & 1]
+    start = UPDATE_HEADER_SIZE + words * 8
+    return o, r, changed, payload[start:start + value_size]
 
 # INET ENVIRONMENT VARIABLES
 
 KDB_INET_ADDRESS_ENV = "KDB_INET_ADDRESS"
-KDB_INET_ADDRESS = os.getenv(KDB_INET_ADDRESS_ENV)
\ No newline at end of file
+KDB_INET_ADDRESS = os.getenv(KDB_INET_ADDRESS_ENV)
+
+# AF_UNIX path UpdateDaemon listens on for clients on the same host --
+# same handshake and framing as TCP
+KDB_INET_UNIX_PATH_ENV = "KDB_INET_UNIX_PATH"
+KDB_INET_UNIX_PATH = os.getenv(KDB_INET_UNIX_PATH_ENV)
@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <bits/stdc++.h>
 #include <ConfigValues.hh>
+#include <TasQ.hh>
 
 /* Object info */
 RETCODE ParseObjectEntry(std::istringstream& line, OBJECT_SCHEMA& out_object)
@@ -235,6 +236,11 @@ static RETCODE GenerateFieldHeader(FIELD_SCHEMA& field, std::ofstream& headerFil
     class OBJECT:
         
         FORMAT = "C struct format"
+        STRUCT = struct.Struct(FORMAT)
+        OBJECT_NUMBER = object number
+        NUMBER_OF_RECORDS = records in OBJECT.db
+        SIZE = bytes per record
+        FIELDS = {"member": (offset, size), ...}
 
         def __init__(self, data:tuple):
             if len(data) != number of expected members:
@@ -245,6 +251,10 @@ static RETCODE GenerateFieldHeader(FIELD_SCHEMA& field, std::ofstream& headerFil
 
         def __str__(self):
             return f"member: {str(self.member)} member2:{str(self.member2)} etc..."
+
+        @classmethod
+        def open_db(cls, path:str = None) -> DBReader:
+            return DBReader(cls, path) # Read-only mmap of OBJECT.db
 */
 static RETCODE GenerateObjectPythonFile(std::ofstream& pythonFile, OBJECT_SCHEMA& object)
 {
@@ -253,9 +263,18 @@ static RETCODE GenerateObjectPythonFile(std::ofstream& pythonFile, OBJECT_SCHEMA
     std::stringstream classInitFunc;
     std::stringstream classVariables;
     std::stringstream strFunc;
+    std::stringstream layout;
+    std::stringstream openFunc;
 
     classDefine << "# THIS FILE WAS GENERATED. DO NOT MODIFY!\n\n";
+    classDefine << "import struct\n";
+    classDefine << "from PythonAPI.DBReader import DBReader\n\n";
     classDefine << "class " << std::uppercase << object.objectName << ":\n";
+    layout << "    STRUCT = struct.Struct(FORMAT)\n";
+    layout << "    OBJECT_NUMBER = " << object.objectNumber << "\n";
+    layout << "    NUMBER_OF_RECORDS = " << object.numberOfRecords << "\n";
+    layout << "    SIZE = " << object.objectSize << "\n";
+    layout << "    FIELDS = { # name: (offset, size) in a record\n";
     classInitFunc << "    def __init__(self, data:tuple):\n";
     classInitFunc << "        if len(data) != ";
     strFunc << "\n\n    def __str__(self) -> str:\n";
@@ -265,34 +284,11 @@ static RETCODE GenerateObjectPythonFile(std::ofstream& pythonFile, OBJECT_SCHEMA
     size_t dataIndex = 0;
     for(const FIELD_SCHEMA& field : object.fields)
     {
-        classVariables << "        self."
-                       << field.fieldName
-                       << " = data["
-                       << dataIndex;
-
-
         if(field.numElements > 1)
         {
             format << field.numElements; // Add number of elements
-            if(!field.isMultiIndex) // s (string) is compound so we consider it a single field even though it has a number of elements
-            {
-                dataIndex += field.numElements - 1; // dataIndex == starting so ending is - 1 that way we get data[start:end]
-                classVariables << ":" << dataIndex;
-            }
         }
 
-        if(field.isMultiIndex) // Print like a string
-        {
-            strFunc << field.fieldName << ": { str(self." << field.fieldName << ", encoding = 'UTF-8').rstrip('\00) }";
-        }
-        else
-        {
-
-            strFunc << field.fieldName << ": {self." << field.fieldName << "} ";
-        }
-
-        classVariables << "]\n";
-
         switch(field.fieldType)
         {
             case 'I': // Unsigned integer
@@ -338,17 +334,60 @@ static RETCODE GenerateObjectPythonFile(std::ofstream& pythonFile, OBJECT_SCHEMA
             }
         }
 
-        dataIndex++;
+        // Padding decodes to nothing
+        if('x' == field.fieldType)
+        {
+            continue;
+        }
+
+        // s (string) and p (byte array) are compound so they decode to a single
+        // item even though they have a number of elements
+        size_t numItems = field.numElements;
+        if(field.isMultiIndex || 'B' == field.fieldType)
+        {
+            numItems = 1;
+        }
+
+        classVariables << "        self."
+                       << field.fieldName
+                       << " = data["
+                       << dataIndex;
+        if(numItems > 1)
+        {
+            classVariables << ":" << dataIndex + numItems; // data[start:end]
+        }
+        classVariables << "]\n";
+
+        if(field.isMultiIndex) // Print like a string
+        {
+            strFunc << field.fieldName << ": { str(self." << field.fieldName << ", encoding = 'UTF-8').rstrip(chr(0)) } ";
+        }
+        else
+        {
+
+            strFunc << field.fieldName << ": {self." << field.fieldName << "} ";
+        }
+
+        layout << "        \"" << field.fieldName << "\": ("
+               << field.fieldOffset << ", " << field.fieldSize << "),\n";
+
+        dataIndex += numItems;
     }
 
-    format << "\"\n\n";
+    format << "\"\n";
+    layout << "    }\n\n";
     strFunc << "\"";
     classInitFunc << dataIndex << ":\n";
     classInitFunc << "            return None\n\n";
 
-    pythonFile << classDefine.str() << format.str()
+    // Same-host reads straight from the .db file -- see PythonAPI/DBReader.py
+    openFunc << "\n\n    @classmethod\n";
+    openFunc << "    def open_db(cls, path:str = None) -> DBReader:\n";
+    openFunc << "        return DBReader(cls, path)\n";
+
+    pythonFile << classDefine.str() << format.str() << layout.str()
                << classInitFunc.str() << classVariables.str()
-               << strFunc.str();
+               << strFunc.str() << openFunc.str();
     return RTN_OK;
 }
 
@@ -773,6 +812,21 @@ static RETCODE WriteDBMapFooter(std::ofstream& headerStream)
         <<"    return RTN_NOT_FOUND;\n"
         <<"}\n";
 
+    headerStream
+        << "\nstatic RETCODE TryGetObjectName(const OBJECT_ID objectNumber, std::string& objectName)\n"
+        << "{\n"
+        <<"    for(const std::pair<const std::string, OBJECT_SCHEMA>& entry : dbSizes)\n"
+        <<"    {\n"
+        <<"        if(objectNumber == entry.second.objectNumber)\n"
+        <<"        {\n"
+        <<"            objectName = entry.first;\n"
+        <<"            return RTN_OK;\n"
+        <<"        }\n"
+        <<"    }\n"
+        <<"\n"
+        <<"    return RTN_NOT_FOUND;\n"
+        <<"}\n";
+
     headerStream << "\n#endif";
 
     return RTN_OK;
@@ -876,6 +930,7 @@ static RETCODE GenerateObject(const OBJECT& objectName, const std::string& skmPa
 
             }
 
+            field_entry.fieldOffset = out_object_entry.objectSize;
             out_object_entry.objectSize += field_entry.fieldSize;
             out_object_entry.fields.push_back(field_entry);
 
@@ -953,15 +1008,15 @@ static RETCODE GeneratePythonFile(OBJECT_SCHEMA& object_entry, const std::string
  *
 */
 
-RETCODE GenerateObjectDBFiles(const OBJECT& objectName,
+// Everything that only touches this object's own files -- safe to run
+// for several objects at once
+static RETCODE GenerateObjectFiles(const OBJECT& objectName,
     const std::string& skmPath,
     const std::string& incPath,
     const std::string& pyPath,
-    std::ofstream& dbMapStream,
-    std::ofstream& dbMapPyStream,
-    bool strict)
+    bool strict,
+    OBJECT_SCHEMA& object_entry)
 {
-    OBJECT_SCHEMA object_entry;
     RETCODE retcode = GenerateObject(objectName, skmPath, object_entry, strict);
     if( RTN_OK != retcode )
     {
@@ -1004,7 +1059,15 @@ RETCODE GenerateObjectDBFiles(const OBJECT& objectName,
         LOG_WARN("Error generating ", object_entry.objectName, DB_EXT);
     }
 
-    retcode |= AddToAllDBHeader(object_entry);
+    return retcode;
+}
+
+// The files every object is listed in. One object at a time, in order.
+static RETCODE AddObjectToMaps(OBJECT_SCHEMA& object_entry,
+    std::ofstream& dbMapStream,
+    std::ofstream& dbMapPyStream)
+{
+    RETCODE retcode = AddToAllDBHeader(object_entry);
     if( RTN_OK != retcode )
     {
         LOG_WARN("Error adding ", object_entry.objectName, " to allHeader", HEADER_EXT);
@@ -1037,6 +1100,24 @@ RETCODE GenerateObjectDBFiles(const OBJECT& objectName,
     return retcode;
 }
 
+RETCODE GenerateObjectDBFiles(const OBJECT& objectName,
+    const std::string& skmPath,
+    const std::string& incPath,
+    const std::string& pyPath,
+    std::ofstream& dbMapStream,
+    std::ofstream& dbMapPyStream,
+    bool strict)
+{
+    OBJECT_SCHEMA object_entry;
+    RETCODE retcode = GenerateObjectFiles(objectName, skmPath, incPath, pyPath, strict, object_entry);
+    if( RTN_OK != retcode )
+    {
+        return retcode;
+    }
+
+    return AddObjectToMaps(object_entry, dbMapStream, dbMapPyStream);
+}
+
 RETCODE GetSchemaFileObjectName(const std::string& skmFileName, std::string& out_ObjectName)
 {
     if("." == skmFileName || ".." == skmFileName)
@@ -1129,12 +1210,37 @@ RETCODE GenerateAllDBFiles(const std::string& skmPath, const std::string& incPat
             return retcode;
         }
 
-        for(std::string& schema : schema_files)
+        // Each object's own files are generated on the pool, then added to
+        // the shared maps in directory order
+        std::vector<OBJECT_SCHEMA> object_entries(schema_files.size());
+        std::vector<std::future<RETCODE>> generated;
+        for(size_t schema = 0; schema < schema_files.size(); schema++)
         {
-            OBJECT objName = {0};
-            strncpy(objName, schema.c_str(), sizeof(objName));
-            retcode |= GenerateObjectDBFiles(objName, skmPath, incPath,
-                pyPath, dbMapStream, dbMapPyStream, strict);
+            generated.push_back(TasqPool::Instance().Submit(
+                [&schema_files, &object_entries, &skmPath, &incPath, &pyPath, strict, schema]()
+                {
+                    OBJECT objName = {0};
+                    strncpy(objName, schema_files[schema].c_str(), sizeof(objName) - 1);
+                    return GenerateObjectFiles(objName, skmPath, incPath,
+                        pyPath, strict, object_entries[schema]);
+                }));
+        }
+
+        // Wait for everything before returning -- the tasks refer to locals
+        for(std::future<RETCODE>& object_retcode : generated)
+        {
+            object_retcode.wait();
+        }
+
+        for(size_t schema = 0; schema < schema_files.size(); schema++)
+        {
+            const std::string& objName = schema_files[schema];
+            retcode |= generated[schema].get();
+            if(RTN_OK == retcode)
+            {
+                retcode |= AddObjectToMaps(object_entries[schema], dbMapStream, dbMapPyStream);
+            }
+
             if(RTN_OK != retcode)
             {
                 LOG_WARN("Error generating ", objName, DB_EXT);
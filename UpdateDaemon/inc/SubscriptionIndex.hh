@@ -0,0 +1,217 @@
+#ifndef __SUBSCRIPTION_INDEX_HH
+#define __SUBSCRIPTION_INDEX_HH
+
+/* Who wants to hear about which part of the DB.
+ *
+ * A subscription names an object, a record of it or a single field of a
+ * record. SUBSCRIBE_ALL in the record or field says "any". A change to
+ * field f of record r can only match these keys:
+ *
+ *     (o, ALL, ALL)   whole object
+ *     (o, ALL, f)     field f in every record
+ *     (o, r,   ALL)   whole record
+ *     (o, r,   f)     one field
+ *
+ * Match() probes those (SubscriptionKeys() in MessageTypes.hh, which
+ * KDBClient matches against too) for each changed field -- the cost does
+ * not grow with the number of subscriptions, only with the number of
+ * subscribers it returns.
+ *
+ * Shared by every monitor shard. Lookups take a shared lock and changes an
+ * exclusive one -- subscriptions change far less often than records do.
+ */
+
+#include <OFRI.hh>
+#include <RecordDelta.hh>
+#include <INETMessenger.hh>
+#include <MessageTypes.hh>
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <mutex>
+
+class SubscriptionIndex
+{
+
+public:
+
+    // Returns false if connection already had this subscription
+    bool Subscribe(const SUBSCRIPTION& subscription, const CONNECTION& connection)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        std::vector<CONNECTION>& subscribers = m_Subscribers[subscription];
+        if(subscribers.end() != std::find(subscribers.begin(), subscribers.end(), connection))
+        {
+            return false;
+        }
+
+        subscribers.push_back(connection);
+        m_ByConnection[connection].push_back(subscription);
+        m_PerObject[subscription.o]++;
+        m_NumSubscriptions++;
+        return true;
+    }
+
+    // Returns false if connection was not subscribed
+    bool Unsubscribe(const SUBSCRIPTION& subscription, const CONNECTION& connection)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        ConnectionMap::iterator owned = m_ByConnection.find(connection);
+        if(m_ByConnection.end() == owned)
+        {
+            return false;
+        }
+
+        std::vector<SUBSCRIPTION>::iterator entry =
+            std::find(owned->second.begin(), owned->second.end(), subscription);
+        if(owned->second.end() == entry)
+        {
+            return false;
+        }
+
+        *entry = owned->second.back();
+        owned->second.pop_back();
+        if(owned->second.empty())
+        {
+            m_ByConnection.erase(owned);
+        }
+
+        Remove(subscription, connection);
+        return true;
+    }
+
+    // Connection went away -- drop everything it asked for
+    size_t UnsubscribeAll(const CONNECTION& connection)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        ConnectionMap::iterator owned = m_ByConnection.find(connection);
+        if(m_ByConnection.end() == owned)
+        {
+            return 0;
+        }
+
+        size_t removed = owned->second.size();
+        for(const SUBSCRIPTION& subscription : owned->second)
+        {
+            Remove(subscription, connection);
+        }
+
+        m_ByConnection.erase(owned);
+        return removed;
+    }
+
+    // Anyone subscribed to anything in object o
+    bool Watches(OBJECT_ID o) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_Mutex);
+        return m_PerObject.end() != m_PerObject.find(o);
+    }
+
+    // Everyone that wants to hear about a change to record r, once each.
+    // changed_fields is a RecordDelta bitmap of num_fields bits.
+    void Match(OBJECT_ID o, RECORD r, const uint64_t* changed_fields, size_t num_fields,
+               std::vector<CONNECTION>& out_subscribers)
+    {
+        out_subscribers.clear();
+        std::shared_lock<std::shared_mutex> lock(m_Mutex);
+        if(m_PerObject.end() == m_PerObject.find(o))
+        {
+            return;
+        }
+
+        size_t lists_matched = Collect(o, r, SUBSCRIBE_ALL, out_subscribers);
+        for(size_t field = 0; field < num_fields; field++)
+        {
+            if(DeltaFieldChanged(changed_fields, field))
+            {
+                lists_matched += Collect(o, r, static_cast<FIELD>(field), out_subscribers);
+            }
+        }
+
+        // One list never repeats a connection. Only pay to de-duplicate when
+        // someone may be subscribed at more than one level.
+        if(1 < lists_matched)
+        {
+            std::unordered_set<CONNECTION> seen;
+            std::vector<CONNECTION>::iterator last = std::remove_if(
+                out_subscribers.begin(), out_subscribers.end(),
+                [&seen](const CONNECTION& connection)
+                {
+                    return !seen.insert(connection).second;
+                });
+            out_subscribers.erase(last, out_subscribers.end());
+        }
+    }
+
+    size_t Size(void) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_Mutex);
+        return m_NumSubscriptions;
+    }
+
+private:
+
+    typedef std::unordered_map<SUBSCRIPTION, std::vector<CONNECTION>> SubscriberMap;
+    typedef std::unordered_map<CONNECTION, std::vector<SUBSCRIPTION>> ConnectionMap;
+
+    // Number of SubscriptionKeys for field f that anyone holds
+    size_t Collect(OBJECT_ID o, RECORD r, FIELD f, std::vector<CONNECTION>& out_subscribers) const
+    {
+        SUBSCRIPTION keys[SUBSCRIPTION_LEVELS];
+        SubscriptionKeys(o, r, f, keys);
+
+        size_t lists_matched = 0;
+        for(const SUBSCRIPTION& key : keys)
+        {
+            SubscriberMap::const_iterator subscribers = m_Subscribers.find(key);
+            if(m_Subscribers.end() != subscribers)
+            {
+                out_subscribers.insert(out_subscribers.end(),
+                    subscribers->second.begin(), subscribers->second.end());
+                lists_matched++;
+            }
+        }
+
+        return lists_matched;
+    }
+
+    void Remove(const SUBSCRIPTION& subscription, const CONNECTION& connection)
+    {
+        SubscriberMap::iterator subscribers = m_Subscribers.find(subscription);
+        if(m_Subscribers.end() == subscribers)
+        {
+            return;
+        }
+
+        std::vector<CONNECTION>& list = subscribers->second;
+        std::vector<CONNECTION>::iterator entry = std::find(list.begin(), list.end(), connection);
+        if(list.end() != entry)
+        {
+            *entry = list.back();
+            list.pop_back();
+            m_NumSubscriptions--;
+
+            std::unordered_map<OBJECT_ID, size_t>::iterator per_object = m_PerObject.find(subscription.o);
+            if(0 == --per_object->second)
+            {
+                m_PerObject.erase(per_object);
+            }
+        }
+
+        if(list.empty())
+        {
+            m_Subscribers.erase(subscribers);
+        }
+    }
+
+    SubscriberMap m_Subscribers;
+    ConnectionMap m_ByConnection; // So a disconnect does not scan every key
+    std::unordered_map<OBJECT_ID, size_t> m_PerObject; // Subscriptions in each object
+    mutable std::shared_mutex m_Mutex;
+    size_t m_NumSubscriptions = 0;
+};
+
+#endif
@@ -5,119 +5,652 @@
 #include <DaemonThread.hh>
 #include <DatabaseAccess.hh>
 #include <INETMessenger.hh>
+#include <shmMessenger.hh>
+#include <SubscriptionIndex.hh>
 #include <Logger.hh>
-#include <TasQ.hh>
+#include <LockFreeQ.hh>
+#include <Coroutine.hh>
+#include <Metrics.hh>
 
 #include <map>
-#include <set>
+#include <memory>
+#include <atomic>
 #include <iostream>
 
 
-class MonitorThread: public DaemonThread<TasQ<INET_PACKAGE*>*, TasQ<INET_PACKAGE*>*>
+// Requests start with an OFRI naming the object, or an OFRI_ID numbering it
+// when the client sets INET_FLAG_OBJECT_ID. Any value to write follows.
+static RETCODE DecodeRequestOFRI(const INET_PACKAGE* package, OFRI& out_ofri, size_t& out_value_offset)
 {
+    if(package->header.flags & INET_FLAG_OBJECT_ID)
+    {
+        if(sizeof(OFRI_ID) > package->header.message_size)
+        {
+            return RTN_BAD_ARG;
+        }
 
-public:
-    void execute(TasQ<INET_PACKAGE*>* incoming_objects, TasQ<INET_PACKAGE*>* outgoing_objects)
+        OFRI_ID ofri_id;
+        memcpy(&ofri_id, package->payload, sizeof(OFRI_ID));
+
+        std::string object_name;
+        RETURN_RETCODE_IF_NOT_OK(TryGetObjectName(ofri_id.o, object_name));
+
+        memset(out_ofri.o, 0, sizeof(out_ofri.o));
+        strncpy(out_ofri.o, object_name.c_str(), sizeof(out_ofri.o) - 1);
+        out_ofri.f = ofri_id.f;
+        out_ofri.r = ofri_id.r;
+        out_ofri.i = ofri_id.i;
+        out_value_offset = sizeof(OFRI_ID);
+        return RTN_OK;
+    }
+
+    if(sizeof(OFRI) > package->header.message_size)
     {
-        //DatabaseAccess db_object = DatabaseAccess(objectName);
+        return RTN_BAD_ARG;
+    }
 
-        // Get pointer to first record N
-        //char* p_read_pointer = db_object.Get(min_record);
+    memcpy(&out_ofri, package->payload, sizeof(OFRI));
+    out_ofri.o[OBJECT_NAME_LEN - 1] = '\0';
+    out_value_offset = sizeof(OFRI);
+    return RTN_OK;
+}
 
-        INET_PACKAGE* incoming_request;
-        char* incoming_value = nullptr;
-        unsigned long long data_recv = 0;
-        unsigned long long data_sent = 0;
+// Between the reactors and the monitors
+typedef MpscQ<INET_PACKAGE*> PackageQueue;
+// Between the monitors and the main loop. Each entry names its peer so a
+// notification is one package shared by every subscriber.
+typedef MpscQ<INET_OUTBOUND> OutboundQueue;
+constexpr size_t MONITOR_QUEUE_CAPACITY = 16 * 1024;
+
+// Traffic through the monitors, summed over every shard
+struct MONITOR_METRICS
+{
+    Counter& received_bytes;
+    Counter& reply_bytes;
+    Counter& rejected;
+    Counter& notifications;
+};
+
+inline MONITOR_METRICS& MonitorMetrics(void)
+{
+    static MONITOR_METRICS metrics = {
+        MetricsRegistry::Instance().GetCounter("kdb_monitor_received_bytes_total", "Payload bytes of requests the monitors handled"),
+        MetricsRegistry::Instance().GetCounter("kdb_monitor_reply_bytes_total", "Payload bytes of record replies"),
+        MetricsRegistry::Instance().GetCounter("kdb_requests_rejected_total", "Requests answered empty because they could not be served"),
+        MetricsRegistry::Instance().GetCounter("kdb_monitor_notifications_total", "Change notifications queued for subscribers")};
+    return metrics;
+}
 
+// Metric name with a shard label
+inline std::string ShardMetric(const std::string& name, size_t shard)
+{
+    return name + "{shard=\"" + std::to_string(shard) + "\"}";
+}
+
+// A request that cannot be served is still answered, with no payload, so a
+// client waiting on its reply is not left hanging
+static void RejectRequest(const INET_PACKAGE* request, OutboundQueue* outgoing_objects)
+{
+    MonitorMetrics().rejected.Add();
+    INET_PACKAGE* reply = AllocatePackage(0);
+    if(nullptr == reply)
+    {
+        LOG_ERROR("Out of package memory rejecting request from ", request->header.connection.address);
+        return;
+    }
+
+    reply->header = request->header;
+    reply->header.message_size = 0;
+    INET_OUTBOUND outbound = {request->header.connection, reply};
+    outgoing_objects->Push(outbound);
+}
+
+class MonitorThread: public DaemonThread<PackageQueue*, OutboundQueue*>
+{
+
+public:
+    // Shards share one subscription index
+    MonitorThread(SubscriptionIndex& subscriptions, size_t shard = 0)
+        : m_Notifier(), m_MonitoredObjects(),
+          m_Processed(MetricsRegistry::Instance().GetCounter(
+              ShardMetric("kdb_monitor_processed_total", shard), "Requests taken off a monitor queue")),
+#ifdef __KDB_COROUTINES
+          m_Loop(m_Notifier),
+#endif
+          m_Shard(shard), m_Subscriptions(subscriptions),
+          m_Latency(MetricsRegistry::Instance().GetHistogram(
+              ShardMetric("kdb_monitor_request_duration_ns", shard), "Time a monitor spent on one request"))
+    {
+    }
+
+    void execute(PackageQueue* incoming_objects, OutboundQueue* outgoing_objects)
+    {
+#ifdef __KDB_COROUTINES
+        Spawn(Serve(incoming_objects, outgoing_objects));
+        m_Loop.Run();
+#else
+        INET_PACKAGE* incoming_request;
         while (StopRequested() == false)
         {
-            while(incoming_objects->TryPop(incoming_request))
-            {
-                data_recv += incoming_request->header.message_size;
-                LOG_DEBUG("Total bytes recevied: ", data_recv);
-                OFRI ofri = {0};
-                memcpy(&ofri, incoming_request->payload, sizeof(OFRI));
-                LOG_INFO("GOT OFRI: ", ofri.o, ".", ofri.f, ".", ofri.r, ".", ofri.i);
-
-                // Check if a value was included
-                if(incoming_request->header.message_size > sizeof(OFRI))
-                {
-                    incoming_value = new char[incoming_request->header.message_size - sizeof(OFRI) + 1];
-                    memcpy(incoming_value, incoming_request->payload + sizeof(OFRI), sizeof(incoming_value));
-                    incoming_value[sizeof(incoming_value)] = '\0'; // For printing
-                }
-
-                OBJECT_SCHEMA object_info;
-                if(RTN_OK != TryGetObjectInfo(std::string(ofri.o), object_info))
-                {
-                    LOG_WARN("Could not find object: ", ofri.o);
-                    continue;
-                }
-
-                // Try and get DB access otherwise fail
-                if(m_MonitoredObjects.find(ofri.o) == m_MonitoredObjects.end())
-                {
-                    LOG_DEBUG("Did not find object ", ofri.o, ". Adding to monitored objects");
-
-                    DatabaseAccess db_access = DatabaseAccess(ofri.o);
-                    if(db_access.IsValid())
-                    {
-                        m_MonitoredObjects.emplace(ofri.o, DatabaseAccess(ofri.o));
-                    }
-                    else
-                    {
-                        LOG_WARN("Could not open object: ", ofri.o);
-                        continue;
-                    }
-                }
-                DatabaseAccess& access = m_MonitoredObjects.at(ofri.o);
-                char* p_read_pointer = access.Get(ofri.r);
-                if(nullptr == p_read_pointer)
-                {
-                    LOG_WARN("Could not find record: ", ofri.r);
-                    continue;
-                }
-
-                if(nullptr != incoming_value)
-                {
-                    
-                    if(IS_RETCODE_OK(access.WriteValue(ofri, incoming_value)))
-                    {
-                        LOG_INFO("Updated ", ofri.o, ".", ofri.f, ".",
-                                  ofri.r, ".", ofri.i, " = ",
-                                  std::string(incoming_value));
-                    }
-                    else
-                    {
-                        LOG_INFO("Failed to update ", ofri.o, ".", ofri.f, ".",
-                                  ofri.r, ".", ofri.i, " with ",
-                                  std::string(incoming_value));
-                    }
-
-                    delete[] incoming_value;
-                    incoming_value = nullptr;
-                }
-
-                PrintDBObject(object_info, p_read_pointer, ofri.r);
-                
-                INET_PACKAGE* outgoing_package = reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_HEADER) + object_info.objectSize]);
-                memcpy(outgoing_package, &(incoming_request->header), sizeof(INET_HEADER));
-                memcpy(outgoing_package->payload, p_read_pointer, object_info.objectSize);
-                outgoing_package->header.message_size = object_info.objectSize;
-                outgoing_package->header.data_type = MESSAGE_TYPE::DB;
-                outgoing_objects->Push(outgoing_package);
-                data_sent += outgoing_package->header.message_size;
-                LOG_DEBUG("Total bytes sent: ", data_sent);
-                delete incoming_request;
-            }
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            m_Notifier.Wait();
+
+            while(incoming_objects->PopNoWait(incoming_request))
+            {
+                HandleRequest(incoming_request, outgoing_objects);
+            }
         }
+#endif
+    }
 
+#ifdef __KDB_COROUTINES
+    // The same loop as a coroutine on this thread's CoLoop
+    Task<> Serve(PackageQueue* incoming_objects, OutboundQueue* outgoing_objects)
+    {
+        INET_PACKAGE* incoming_request = nullptr;
+        while(co_await m_Loop.Pop(*incoming_objects, incoming_request))
+        {
+            HandleRequest(incoming_request, outgoing_objects);
+        }
     }
+#endif
+
+    // Read or write one record and reply. Frees the request.
+    void HandleRequest(INET_PACKAGE* incoming_request, OutboundQueue* outgoing_objects)
+    {
+        MetricsTimer timer(m_Latency);
+        m_Processed.Add();
+        MonitorMetrics().received_bytes.Add(incoming_request->header.message_size);
+
+        if(MESSAGE_TYPE::SUBSCRIBE == incoming_request->header.data_type ||
+           MESSAGE_TYPE::UNSUBSCRIBE == incoming_request->header.data_type)
+        {
+            HandleSubscription(incoming_request, outgoing_objects);
+            FreePackage(incoming_request);
+            return;
+        }
+
+        OFRI ofri = {0};
+        size_t value_offset = 0;
+        if(RTN_OK != DecodeRequestOFRI(incoming_request, ofri, value_offset))
+        {
+            LOG_WARN("Could not decode request from ", incoming_request->header.connection.address);
+            RejectRequest(incoming_request, outgoing_objects);
+            FreePackage(incoming_request);
+            return;
+        }
+        LOG_INFO("GOT OFRI: ", ofri.o, ".", ofri.f, ".", ofri.r, ".", ofri.i);
+
+        // Check if a value was included -- stop at any terminator
+        m_Value.clear();
+        if(incoming_request->header.message_size > value_offset)
+        {
+            size_t value_size = incoming_request->header.message_size - value_offset;
+            const char* p_value = incoming_request->payload + value_offset;
+            m_Value.assign(p_value, strnlen(p_value, value_size));
+        }
+
+        // Look up in place -- copying the schema allocates
+        std::map<std::string, OBJECT_SCHEMA>::const_iterator object_entry = dbSizes.find(ofri.o);
+        if(dbSizes.end() == object_entry)
+        {
+            LOG_WARN("Could not find object: ", ofri.o);
+            RejectRequest(incoming_request, outgoing_objects);
+            FreePackage(incoming_request);
+            return;
+        }
+        const OBJECT_SCHEMA& object_info = object_entry->second;
+
+        // Try and get DB access otherwise fail
+        if(m_MonitoredObjects.find(ofri.o) == m_MonitoredObjects.end())
+        {
+            LOG_DEBUG("Did not find object ", ofri.o, ". Adding to monitored objects");
+
+            DatabaseAccess db_access = DatabaseAccess(ofri.o);
+            if(db_access.IsValid())
+            {
+                m_MonitoredObjects.emplace(ofri.o, DatabaseAccess(ofri.o));
+            }
+            else
+            {
+                LOG_WARN("Could not open object: ", ofri.o);
+                RejectRequest(incoming_request, outgoing_objects);
+                FreePackage(incoming_request);
+                return;
+            }
+        }
+        DatabaseAccess& access = m_MonitoredObjects.at(ofri.o);
+        char* p_read_pointer = access.Get(ofri.r);
+        if(nullptr == p_read_pointer)
+        {
+            LOG_WARN("Could not find record: ", ofri.r);
+            RejectRequest(incoming_request, outgoing_objects);
+            FreePackage(incoming_request);
+            return;
+        }
+
+        bool changed = false;
+        if(!m_Value.empty())
+        {
+            // Capture the record before the first watched write so
+            // there is something to diff against
+            if(m_Subscriptions.Watches(static_cast<OBJECT_ID>(object_info.objectNumber)))
+            {
+                TakeSnapshot(object_info, ofri.r, p_read_pointer);
+            }
+
+            if(IS_RETCODE_OK(access.WriteValue(ofri, m_Value)))
+            {
+                LOG_INFO("Updated ", ofri.o, ".", ofri.f, ".",
+                          ofri.r, ".", ofri.i, " = ",
+                          m_Value);
+                changed = true;
+            }
+            else
+            {
+                LOG_INFO("Failed to update ", ofri.o, ".", ofri.f, ".",
+                          ofri.r, ".", ofri.i, " with ",
+                          m_Value);
+            }
+        }
+
+        PrintDBObject(object_info, p_read_pointer, ofri.r);
+        
+        INET_PACKAGE* outgoing_package = AllocatePackage(object_info.objectSize);
+        if(nullptr == outgoing_package)
+        {
+            LOG_ERROR("Out of package memory replying to ", incoming_request->header.connection.address);
+            FreePackage(incoming_request);
+            return;
+        }
+        outgoing_package->header = incoming_request->header;
+        memcpy(outgoing_package->payload, p_read_pointer, object_info.objectSize);
+        outgoing_package->header.message_size = object_info.objectSize;
+        outgoing_package->header.data_type = MESSAGE_TYPE::DB;
+        MonitorMetrics().reply_bytes.Add(outgoing_package->header.message_size);
+        INET_OUTBOUND outbound = {outgoing_package->header.connection, outgoing_package};
+        outgoing_objects->Push(outbound);
+
+        // Writer hears back before the watchers do
+        if(changed)
+        {
+            NotifyChange(object_info, ofri.r, p_read_pointer, outgoing_objects);
+        }
+        FreePackage(incoming_request);
+    }
+
+    void Wake()
+    {
+#ifdef __KDB_COROUTINES
+        m_Loop.Stop();
+#else
+        m_Notifier.Notify();
+#endif
+    }
+
+    // SUBSCRIBE or UNSUBSCRIBE to an object, record or field. SUBSCRIBE_ALL
+    // in the record or field widens it. An UNSUBSCRIBE with no payload drops
+    // everything the connection holds -- the daemon sends one on disconnect.
+    // Every shard gets that one so it lands after anything already queued
+    // for the connection, and only shard 0 answers it.
+    // The reply echoes the request's OFRI on success and is empty otherwise.
+    void HandleSubscription(const INET_PACKAGE* request, OutboundQueue* outgoing_objects)
+    {
+        const CONNECTION& connection = request->header.connection;
+        const bool subscribe = MESSAGE_TYPE::SUBSCRIBE == request->header.data_type;
+        bool accepted = false;
+
+        if(!subscribe && 0 == request->header.message_size)
+        {
+            size_t removed = m_Subscriptions.UnsubscribeAll(connection);
+            LOG_DEBUG("Dropped ", removed, " subscriptions of ", connection.address, ":", connection.port);
+            DropUnwatchedSnapshots();
+            if(0 != m_Shard)
+            {
+                return;
+            }
+            accepted = true;
+        }
+        else
+        {
+            SUBSCRIPTION subscription = {0};
+            if(RTN_OK == DecodeSubscription(request, subscription))
+            {
+                accepted = subscribe ?
+                    m_Subscriptions.Subscribe(subscription, connection) :
+                    m_Subscriptions.Unsubscribe(subscription, connection);
+                LOG_DEBUG(subscribe ? "Subscribe " : "Unsubscribe ", connection.address, ":",
+                          connection.port, " to ", subscription.o, ".", subscription.f, ".",
+                          subscription.r, accepted ? "" : " ignored", " -- ",
+                          m_Subscriptions.Size(), " total");
+                DropUnwatchedSnapshots();
+            }
+            else
+            {
+                LOG_WARN("Bad subscription from ", connection.address);
+            }
+        }
+
+        const size_t reply_size = accepted ? request->header.message_size : 0;
+        INET_PACKAGE* reply = AllocatePackage(reply_size);
+        if(nullptr == reply)
+        {
+            LOG_ERROR("Out of package memory replying to ", connection.address);
+            return;
+        }
+
+        reply->header = request->header;
+        reply->header.message_size = reply_size;
+        memcpy(reply->payload, request->payload, reply_size);
+        INET_OUTBOUND outbound = {connection, reply};
+        outgoing_objects->Push(outbound);
+    }
+
+    // Diff record against what its subscribers were last sent and push
+    // only the fields that changed. Everyone watching a record shares one
+    // snapshot of it and one encoded delta, so the diff and the copy are
+    // done once however many there are.
+    void NotifyChange(const OBJECT_SCHEMA& object_info, RECORD record,
+                      const char* p_record, OutboundQueue* outgoing_objects)
+    {
+        const OBJECT_ID object_id = static_cast<OBJECT_ID>(object_info.objectNumber);
+        std::unordered_map<OBJECT_ID, std::unordered_map<RECORD, std::vector<char>>>::iterator object_snapshots =
+            m_Snapshots.find(object_id);
+        if(m_Snapshots.end() == object_snapshots)
+        {
+            return;
+        }
+
+        std::unordered_map<RECORD, std::vector<char>>::iterator snapshot = object_snapshots->second.find(record);
+        if(object_snapshots->second.end() == snapshot)
+        {
+            return;
+        }
+
+        const DeltaLayout& layout = Layout(object_info);
+        m_ChangedFields.resize(layout.BitmapWords());
+        if(0 == layout.DiffRecord(snapshot->second.data(), p_record, m_ChangedFields.data()))
+        {
+            return;
+        }
+        memcpy(snapshot->second.data(), p_record, object_info.objectSize);
+
+        m_Subscriptions.Match(object_id, record, m_ChangedFields.data(),
+            object_info.fields.size(), m_Recipients);
+        if(m_Recipients.empty())
+        {
+            // Unsubscribed on another shard -- stop keeping a copy
+            if(!m_Subscriptions.Watches(object_id))
+            {
+                object_snapshots->second.erase(snapshot);
+            }
+            return;
+        }
+
+        const size_t delta_size = DeltaSize(object_info, m_ChangedFields.data());
+        INET_PACKAGE* notification = AllocatePackage(delta_size);
+        if(nullptr == notification)
+        {
+            LOG_ERROR("Out of package memory for change to ", object_info.objectName);
+            return;
+        }
 
+        // Who it goes to is in each queue entry, not the shared header
+        notification->header.data_type = MESSAGE_TYPE::UPDATE;
+        notification->header.flags = INET_FLAG_OBJECT_ID;
+        EncodeDelta(object_info, record, m_ChangedFields.data(), p_record, notification->payload);
+
+        m_Notifications.clear();
+        for(const CONNECTION& subscriber : m_Recipients)
+        {
+            m_Notifications.push_back({subscriber, RetainPackage(notification)});
+        }
+        FreePackage(notification);
+
+        // One claim on the queue for the whole fan-out
+        MonitorMetrics().notifications.Add(m_Notifications.size());
+        outgoing_objects->PushN(m_Notifications.data(), m_Notifications.size());
+    }
+
+    EventNotifier m_Notifier; // Set on the incoming queue -- wakes the monitor
     std::map<std::string, DatabaseAccess> m_MonitoredObjects;
-    std::map<OFRI, std::vector<CONNECTION>> m_Monitors;
+    Counter& m_Processed; // Requests taken off the queue
+#ifdef __KDB_COROUTINES
+    CoLoop m_Loop; // Runs Serve() on the monitor thread
+#endif
+
+private:
+
+    // Subscriptions are kept by object number so OFRI and OFRI_ID requests
+    // land on the same key
+    RETCODE DecodeSubscription(const INET_PACKAGE* request, SUBSCRIPTION& out_subscription)
+    {
+        OFRI ofri = {0};
+        size_t value_offset = 0;
+        RETURN_RETCODE_IF_NOT_OK(DecodeRequestOFRI(request, ofri, value_offset));
+
+        std::map<std::string, OBJECT_SCHEMA>::const_iterator object_entry = dbSizes.find(ofri.o);
+        if(dbSizes.end() == object_entry)
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        const OBJECT_SCHEMA& object_info = object_entry->second;
+        if((SUBSCRIBE_ALL != ofri.r && object_info.numberOfRecords <= ofri.r) ||
+           (SUBSCRIBE_ALL != ofri.f && object_info.fields.size() <= ofri.f))
+        {
+            return RTN_BAD_ARG;
+        }
+
+        out_subscription.o = static_cast<OBJECT_ID>(object_info.objectNumber);
+        out_subscription.r = ofri.r;
+        out_subscription.f = ofri.f;
+        return RTN_OK;
+    }
+
+    void TakeSnapshot(const OBJECT_SCHEMA& object_info, RECORD record, const char* p_record)
+    {
+        std::vector<char>& snapshot = m_Snapshots[static_cast<OBJECT_ID>(object_info.objectNumber)][record];
+        if(snapshot.empty())
+        {
+            snapshot.assign(p_record, p_record + object_info.objectSize);
+        }
+    }
+
+    void DropUnwatchedSnapshots(void)
+    {
+        std::unordered_map<OBJECT_ID, std::unordered_map<RECORD, std::vector<char>>>::iterator object_snapshots =
+            m_Snapshots.begin();
+        while(m_Snapshots.end() != object_snapshots)
+        {
+            if(m_Subscriptions.Watches(object_snapshots->first))
+            {
+                ++object_snapshots;
+            }
+            else
+            {
+                object_snapshots = m_Snapshots.erase(object_snapshots);
+            }
+        }
+    }
+
+    const DeltaLayout& Layout(const OBJECT_SCHEMA& object_info)
+    {
+        const OBJECT_ID object_id = static_cast<OBJECT_ID>(object_info.objectNumber);
+        std::unordered_map<OBJECT_ID, DeltaLayout>::iterator layout = m_Layouts.find(object_id);
+        if(m_Layouts.end() == layout)
+        {
+            layout = m_Layouts.emplace(object_id, DeltaLayout(object_info)).first;
+        }
+
+        return layout->second;
+    }
+
+    size_t m_Shard;
+    SubscriptionIndex& m_Subscriptions;
+    Histogram& m_Latency; // Of HandleRequest()
+    std::string m_Value; // Scratch for HandleRequest()
+    std::vector<CONNECTION> m_Recipients; // Scratch for NotifyChange()
+    std::vector<uint64_t> m_ChangedFields; // Scratch for NotifyChange()
+    std::vector<INET_OUTBOUND> m_Notifications; // Scratch for NotifyChange()
+    std::unordered_map<OBJECT_ID, DeltaLayout> m_Layouts;
+    // Each watched record as its subscribers last saw it
+    std::unordered_map<OBJECT_ID, std::unordered_map<RECORD, std::vector<char>>> m_Snapshots;
+};
+
+// Records are handed to shards this many at a time so neighbours share a
+// shard's mappings and snapshots
+constexpr RECORD MONITOR_PARTITION_RECORDS = 64;
+
+// N MonitorThreads, each with its own queue. Every request for a record
+// lands on the same shard so records are updated in the order their
+// requests arrived without any locking between shards.
+class MonitorPool
+{
+
+public:
+
+    // Zero shards reads the count from KDB_MONITOR_SHARDS
+    explicit MonitorPool(size_t num_shards = 0)
+        : m_Subscriptions(), m_Queues(), m_Shards()
+    {
+        if(0 == num_shards)
+        {
+            num_shards = LoadShardCount();
+        }
+
+        for(size_t shard = 0; shard < num_shards; shard++)
+        {
+            m_Queues.emplace_back(new PackageQueue(MONITOR_QUEUE_CAPACITY));
+            m_Shards.emplace_back(new MonitorThread(m_Subscriptions, shard));
+            m_Queues.back()->SetNotifier(&m_Shards.back()->m_Notifier);
+            MetricsRegistry::Instance().Sample(ShardMetric("kdb_monitor_queue_depth", shard),
+                "Requests waiting on a monitor queue",
+                [this, shard](){ return static_cast<double>(QueueDepth(shard)); });
+        }
+
+        MetricsRegistry::Instance().Sample("kdb_subscriptions", "Subscriptions held across all connections",
+            [this](){ return static_cast<double>(NumSubscriptions()); });
+    }
+
+    ~MonitorPool()
+    {
+        Stop();
+
+        for(size_t shard = 0; shard < m_Queues.size(); shard++)
+        {
+            MetricsRegistry::Instance().Unsample(ShardMetric("kdb_monitor_queue_depth", shard));
+        }
+        MetricsRegistry::Instance().Unsample("kdb_subscriptions");
+    }
+
+    void Start(OutboundQueue* outgoing_objects)
+    {
+        for(size_t shard = 0; shard < m_Shards.size(); shard++)
+        {
+            m_Shards[shard]->Start(m_Queues[shard].get(), outgoing_objects);
+        }
+    }
+
+    void Stop(void)
+    {
+        for(size_t shard = 0; shard < m_Shards.size(); shard++)
+        {
+            m_Shards[shard]->Stop();
+        }
+
+        // Whatever never got processed goes back to the pool
+        INET_PACKAGE* leftover = nullptr;
+        for(size_t shard = 0; shard < m_Queues.size(); shard++)
+        {
+            while(m_Queues[shard]->PopNoWait(leftover))
+            {
+                FreePackage(leftover);
+            }
+        }
+    }
+
+    // Whole-object requests have no record so they all go to shard 0
+    size_t ShardOf(OBJECT_ID object, RECORD record) const
+    {
+        if(1 == m_Shards.size() || SUBSCRIBE_ALL == record)
+        {
+            return 0;
+        }
+
+        uint64_t partition = (static_cast<uint64_t>(object) << 32) | (record / MONITOR_PARTITION_RECORDS);
+        partition *= 0x9E3779B97F4A7C15ULL;
+        return (partition >> 32) % m_Shards.size();
+    }
+
+    // Takes ownership of package
+    void Push(size_t shard, INET_PACKAGE* package)
+    {
+        m_Queues[shard]->Push(package);
+    }
+
+    // Every shard gets its own copy. Caller keeps package.
+    void PushAll(const INET_PACKAGE* package)
+    {
+        for(size_t shard = 0; shard < m_Queues.size(); shard++)
+        {
+            INET_PACKAGE* copy = ClonePackage(package);
+            if(nullptr == copy)
+            {
+                LOG_ERROR("Out of package memory for shard ", shard);
+                continue;
+            }
+
+            m_Queues[shard]->Push(copy);
+        }
+    }
+
+    size_t NumShards(void) const
+    {
+        return m_Shards.size();
+    }
+
+    size_t QueueDepth(size_t shard) const
+    {
+        return m_Queues[shard]->Size();
+    }
+
+    unsigned long long Processed(size_t shard) const
+    {
+        return m_Shards[shard]->m_Processed.Value();
+    }
+
+    size_t NumSubscriptions(void) const
+    {
+        return m_Subscriptions.Size();
+    }
+
+private:
+
+    static size_t LoadShardCount(void)
+    {
+        size_t num_shards = 1;
+        std::string shards = ConfigValues::Instance().Get(KDB_MONITOR_SHARDS);
+        if(!shards.empty())
+        {
+            try
+            {
+                num_shards = std::stoul(shards);
+            }
+            catch(std::exception const& except)
+            {
+                LOG_WARN("Could not convert ", KDB_MONITOR_SHARDS, " value ", shards, " -- using one shard");
+            }
+        }
+
+        return 0 == num_shards ? 1 : num_shards;
+    }
+
+    MonitorPool(const MonitorPool&);
+    MonitorPool& operator=(const MonitorPool&);
+
+    SubscriptionIndex m_Subscriptions; // Before the shards that refer to it
+    std::vector<std::unique_ptr<PackageQueue>> m_Queues;
+    std::vector<std::unique_ptr<MonitorThread>> m_Shards;
 };
 
 
@@ -1,14 +1,20 @@
 #include <CLI.hh>
 #include <DatabaseAccess.hh>
 #include <UpdateDeamon.hh>
+#include <Metrics.hh>
 #include <Logger.hh>
 #include <unistd.h>
 #include <string.h>
 
 static bool g_process_is_running = true;
+static volatile sig_atomic_t g_dump_stats = false;
 
-static TasQ<INET_PACKAGE*> g_outgoing_changes;
-static TasQ<INET_PACKAGE*> g_incoming_changes;
+static OutboundQueue g_outgoing_changes(MONITOR_QUEUE_CAPACITY);
+static MonitorPool* g_monitors = nullptr;
+static EventNotifier g_outgoing_notifier;
+
+// How often KDB_METRICS_FILE is rewritten when not configured
+static const std::chrono::seconds METRICS_DEFAULT_INTERVAL(10);
 
 static void quitSignal(int sig)
 {
@@ -17,6 +23,63 @@ static void quitSignal(int sig)
     strcpy(signal_text, strsignal(sig));
     LOG_INFO("Quitting on signal: ", signal_text);
     g_process_is_running = false;
+    g_outgoing_notifier.Notify();
+}
+
+// Main loop logs the shard queues -- nothing here but the flag is signal safe
+static void statsSignal(int sig)
+{
+    g_dump_stats = true;
+    g_outgoing_notifier.Notify();
+}
+
+static void DumpStats(void)
+{
+    for(size_t shard = 0; shard < g_monitors->NumShards(); shard++)
+    {
+        LOG_INFO("Monitor shard ", shard, ": ", g_monitors->QueueDepth(shard), " queued, ",
+                 g_monitors->Processed(shard), " processed");
+    }
+    LOG_INFO("Subscriptions: ", g_monitors->NumSubscriptions(),
+             " Outgoing queued: ", g_outgoing_changes.Size());
+    LOG_INFO("Metrics:\n", MetricsRegistry::Instance().Render());
+}
+
+// Requests by MESSAGE_TYPE -- anything past STATS is counted as unknown
+static Counter& RequestCounter(unsigned int data_type)
+{
+    static const char* const TYPE_NAMES[] = {"NONE", "TEXT", "ACK", "DB", "UPDATE", "SUBSCRIBE", "UNSUBSCRIBE", "STATS", "UNKNOWN"};
+    static const size_t NUM_TYPE_NAMES = sizeof(TYPE_NAMES) / sizeof(TYPE_NAMES[0]);
+    static const std::vector<Counter*> counters = []()
+    {
+        std::vector<Counter*> by_type;
+        for(size_t type = 0; type < NUM_TYPE_NAMES; type++)
+        {
+            by_type.push_back(&MetricsRegistry::Instance().GetCounter(
+                std::string("kdb_requests_total{type=\"") + TYPE_NAMES[type] + "\"}", "Requests from clients by message type"));
+        }
+        return by_type;
+    }();
+
+    return *counters[std::min(static_cast<size_t>(data_type), NUM_TYPE_NAMES - 1)];
+}
+
+// Answered straight from the reactor -- the monitors are not involved
+static void StatsRequest(const INET_PACKAGE* package)
+{
+    const std::string stats = MetricsRegistry::Instance().Render();
+    INET_PACKAGE* reply = AllocatePackage(stats.size());
+    if(nullptr == reply)
+    {
+        LOG_ERROR("Out of package memory for stats to ", package->header.connection.address);
+        return;
+    }
+
+    reply->header = package->header;
+    reply->header.message_size = stats.size();
+    memcpy(reply->payload, stats.data(), stats.size());
+    INET_OUTBOUND outbound = {package->header.connection, reply};
+    g_outgoing_changes.Push(outbound);
 }
 
 static void clientConnect(const CONNECTION& connection)
@@ -27,40 +90,119 @@ static void clientConnect(const CONNECTION& connection)
 static void clientDisconnect(const CONNECTION& connection)
 {
     LOG_INFO("Client ", connection.address, ":", connection.port, " disconnected" );
+
+    // Goes through the monitor queues so it lands after anything the client
+    // already asked for
+    INET_PACKAGE* unsubscribe = AllocatePackage(0);
+    if(nullptr == unsubscribe)
+    {
+        LOG_ERROR("Out of package memory dropping subscriptions of ", connection.address);
+        return;
+    }
+
+    unsubscribe->header.connection = connection;
+    unsubscribe->header.data_type = MESSAGE_TYPE::UNSUBSCRIBE;
+    g_monitors->PushAll(unsubscribe);
+    FreePackage(unsubscribe);
 }
 
 // Route changes from clients to one of N incoming change queues depending on
-// Which shard the change belongs to
+// which shard the change belongs to
 static void ClientRequest(const INET_PACKAGE* package)
 {
     LOG_DEBUG("Client ", package->header.connection.address, ":", package->header.connection.port, " request");
+    RequestCounter(package->header.data_type).Add();
+
+    if(MESSAGE_TYPE::STATS == package->header.data_type)
+    {
+        StatsRequest(package);
+        return;
+    }
+
+    // Drop every subscription -- any shard may hold some
+    if(MESSAGE_TYPE::UNSUBSCRIBE == package->header.data_type && 0 == package->header.message_size)
+    {
+        g_monitors->PushAll(package);
+        return;
+    }
+
+    OFRI ofri = {0};
+    size_t value_offset = 0;
+    if(RTN_OK != DecodeRequestOFRI(package, ofri, value_offset))
+    {
+        LOG_WARN("Malformed request from ", package->header.connection.address);
+        RejectRequest(package, &g_outgoing_changes);
+        return;
+    }
 
-    INET_PACKAGE* request = reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_HEADER) + package->header.message_size]);
-    request->header = package->header;
-    memcpy(request->payload, package->payload, request->header.message_size);
-    OFRI* ofri = reinterpret_cast<OFRI*>(request->payload);
+    // Look up in place -- copying the schema allocates
+    std::map<std::string, OBJECT_SCHEMA>::const_iterator object_info = dbSizes.find(ofri.o);
+    if(dbSizes.end() == object_info)
+    {
+        LOG_WARN("Could not open: ", ofri.o);
+        RejectRequest(package, &g_outgoing_changes);
+        return;
+    }
 
-    OBJECT_SCHEMA object_info;
-    if(RTN_OK != TryGetObjectInfo(std::string(ofri->o), object_info))
+    bool any_record = SUBSCRIBE_ALL == ofri.r &&
+        (MESSAGE_TYPE::SUBSCRIBE == package->header.data_type ||
+         MESSAGE_TYPE::UNSUBSCRIBE == package->header.data_type);
+    if(!any_record && object_info->second.numberOfRecords < ofri.r)
     {
-        LOG_WARN("Could not open: ", ofri->o);
+        LOG_WARN("Invalid record: ", ofri.r, " > max: ", object_info->second.numberOfRecords);
+        RejectRequest(package, &g_outgoing_changes);
         return;
     }
 
-    if(object_info.numberOfRecords < ofri->r)
+    INET_PACKAGE* request = ClonePackage(package);
+    if(nullptr == request)
     {
-        LOG_WARN("Invalid record: ", ofri->r, " > max: ", object_info.numberOfRecords);
+        LOG_ERROR("Out of package memory for request from ", package->header.connection.address);
         return;
     }
 
-    g_incoming_changes.Push(request);
+    g_monitors->Push(g_monitors->ShardOf(
+        static_cast<OBJECT_ID>(object_info->second.objectNumber), ofri.r), request);
+}
+
+
+static std::chrono::seconds LoadMetricsInterval(void)
+{
+    std::chrono::seconds interval = METRICS_DEFAULT_INTERVAL;
+    std::string seconds = ConfigValues::Instance().Get(KDB_METRICS_INTERVAL);
+    if(!seconds.empty())
+    {
+        try
+        {
+            interval = std::chrono::seconds(std::stoul(seconds));
+        }
+        catch(std::exception const& except)
+        {
+            LOG_WARN("Could not convert ", KDB_METRICS_INTERVAL, " value ", seconds, " -- using ",
+                     METRICS_DEFAULT_INTERVAL.count(), " seconds");
+        }
+    }
+
+    return 0 == interval.count() ? METRICS_DEFAULT_INTERVAL : interval;
 }
 
+// Replies and change notifications each name the one peer they are for
+static void RouteOutgoing(PollGroup& connection, ShmMessenger* shared_memory, const INET_OUTBOUND& outgoing)
+{
+    if(nullptr != shared_memory && IsShmConnection(outgoing.connection))
+    {
+        shared_memory->Send(outgoing.connection, outgoing.package);
+        return;
+    }
+
+    connection.Send(outgoing.connection, outgoing.package);
+}
 
 int main(int argc, char* argv[])
 {
     signal(SIGQUIT, quitSignal);
     signal(SIGINT, quitSignal);
+    signal(SIGUSR1, statsSignal);
     CLI::Parser parse("UpdateDaemon", "Manages reading and writing of DBs");
     CLI::CLI_StringArgument portArg("-p", "Connection port for DBUpdate");
     CLI::CLI_FlagArgument helpArg("-h", "Shows usage", false);
@@ -79,29 +221,94 @@ int main(int argc, char* argv[])
     std::string port = portArg.IsInUse() ?
         portArg.GetValue() : ConfigValues::Instance().Get(KDB_INET_PORT);
 
-    MonitorThread monitor;
-    monitor.Start(&g_incoming_changes, &g_outgoing_changes);
+    MonitorPool monitors;
+    g_monitors = &monitors;
+    g_outgoing_changes.SetNotifier(&g_outgoing_notifier);
+    monitors.Start(&g_outgoing_changes);
+    LOG_INFO("Monitoring with ", monitors.NumShards(), " shards");
 
-    PollThread connection(portArg.GetValue());
+    MetricsRegistry::Instance().Sample("kdb_outgoing_queue_depth", "Replies and notifications waiting to be routed",
+        [](){ return static_cast<double>(g_outgoing_changes.Size()); });
+    MetricsRegistry::Instance().Sample("kdb_package_pool_hit_ratio", "Package allocations served without a new slab",
+        [](){ return SlabPool::Instance().Stats().HitRate(); });
+    MetricsRegistry::Instance().Sample("kdb_package_pool_held_bytes", "Slab memory owned by the package pool",
+        [](){ return static_cast<double>(SlabPool::Instance().Stats().bytes_held); });
+    MetricsRegistry::Instance().Sample("kdb_package_pool_in_use_bytes", "Package memory handed out and not yet freed",
+        [](){ return static_cast<double>(SlabPool::Instance().Stats().bytes_in_use); });
+    MetricsRegistry::Instance().Sample("kdb_uptime_seconds", "Seconds since the daemon started",
+        [start = std::chrono::steady_clock::now()](){
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); });
+
+    // Scrapers that read files rather than sending STATS
+    MetricsDumper metrics_dumper;
+    std::string metrics_file = ConfigValues::Instance().Get(KDB_METRICS_FILE);
+    if(!metrics_file.empty())
+    {
+        metrics_dumper.Start(metrics_file, LoadMetricsInterval());
+        LOG_INFO("Writing metrics to ", metrics_file);
+    }
+
+    PollGroup connection(port);
 
     LOG_INFO("Connection on ", connection.GetTCPAddress(), ":", connection.GetTCPPort());
+    if(!connection.GetLocalPath().empty())
+    {
+        LOG_INFO("Local connections on ", connection.GetLocalPath());
+    }
 
     connection.m_OnReceive += ClientRequest;
     connection.m_OnClientConnect += clientConnect;
     connection.m_OnDisconnect += clientDisconnect;
 
+    // Clients on this host can skip sockets entirely
+    std::unique_ptr<ShmMessenger> shared_memory;
+    std::string shm_name = ConfigValues::Instance().Get(KDB_SHM_NAME);
+    if(!shm_name.empty())
+    {
+        shared_memory.reset(new ShmMessenger(shm_name));
+        if(shared_memory->GetName().empty())
+        {
+            shared_memory.reset();
+        }
+        else
+        {
+            LOG_INFO("Shared memory connections on ", shm_name);
+            shared_memory->m_OnReceive += ClientRequest;
+            shared_memory->m_OnClientConnect += clientConnect;
+            shared_memory->m_OnDisconnect += clientDisconnect;
+            shared_memory->StartPoll();
+        }
+    }
+
     std::chrono::time_point start = std::chrono::steady_clock::now();
 
-    INET_PACKAGE* outgoing_message = nullptr;
+    INET_OUTBOUND outgoing_message = {};
     while(g_process_is_running)
     {
-        while(g_outgoing_changes.TryPop(outgoing_message))
+        g_outgoing_notifier.Wait();
+
+        while(g_outgoing_changes.PopNoWait(outgoing_message))
+        {
+            RouteOutgoing(connection, shared_memory.get(), outgoing_message);
+        }
+
+        if(g_dump_stats)
         {
-            connection.SendAll(outgoing_message);
-            delete outgoing_message;
+            g_dump_stats = false;
+            DumpStats();
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 
-    monitor.Stop();
+    connection.StopPoll();
+    if(shared_memory)
+    {
+        shared_memory->StopPoll();
+    }
+    metrics_dumper.Stop();
+    monitors.Stop();
+
+    SLAB_POOL_STATS pool_stats = SlabPool::Instance().Stats();
+    LOG_INFO("Package pool hit rate: ", pool_stats.HitRate() * 100.0, "% of ",
+             pool_stats.allocations, " allocations, ", pool_stats.bytes_held,
+             " bytes held, ", pool_stats.oversized, " oversized");
 }
\ No newline at end of file
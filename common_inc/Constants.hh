@@ -21,5 +21,16 @@ static const std::string DB_DB_DIR = DB_DIR + "db/";
 static const std::string KDB_INSTALL_DIR = "KDB_INSTALL_DIR";
 static const std::string KDB_INET_ADDRESS = "KDB_INET_ADDRESS";
 static const std::string KDB_INET_PORT = "KDB_INET_PORT";
+static const std::string KDB_INET_SEND_BUFFER_SIZE = "KDB_INET_SEND_BUFFER_SIZE";
+static const std::string KDB_INET_OVERFLOW_POLICY = "KDB_INET_OVERFLOW_POLICY";
+static const std::string KDB_INET_REACTORS = "KDB_INET_REACTORS";
+static const std::string KDB_INET_BACKEND = "KDB_INET_BACKEND";
+static const std::string KDB_INET_UNIX_PATH = "KDB_INET_UNIX_PATH";
+static const std::string KDB_INET_HANDSHAKE_TIMEOUT = "KDB_INET_HANDSHAKE_TIMEOUT";
+static const std::string KDB_MONITOR_SHARDS = "KDB_MONITOR_SHARDS";
+static const std::string KDB_SHM_NAME = "KDB_SHM_NAME";
+static const std::string KDB_CLIENT_CONNECTIONS = "KDB_CLIENT_CONNECTIONS";
+static const std::string KDB_METRICS_FILE = "KDB_METRICS_FILE";
+static const std::string KDB_METRICS_INTERVAL = "KDB_METRICS_INTERVAL";
 
 #endif
\ No newline at end of file
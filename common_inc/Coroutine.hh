@@ -0,0 +1,446 @@
+#ifndef __COROUTINE_HH
+#define __COROUTINE_HH
+
+/* C++20 coroutines on top of the reactor and the work queues.
+ *
+ * Only built when CMake is run with -DKDB_COROUTINES=ON, which moves the
+ * tree to C++20 and defines __KDB_COROUTINES. Everything else builds the
+ * same either way.
+ *
+ * Task<T> is a lazy coroutine -- it runs when awaited and hands T back to
+ * whoever awaited it. Spawn() starts a Task<> nobody waits on.
+ *
+ * CoLoop drives coroutines on one thread, waking on an EventNotifier:
+ *
+ *     co_await loop.Pop(queue, element)   next element of a LockFreeQ
+ *     co_await loop.Schedule()            carry on on the loop's thread
+ *
+ * AsyncRequest() sends a request through a PollThread and resumes the
+ * coroutine with the reply on the poll thread itself, so a multi-step
+ * exchange reads top to bottom with no thread hop per step. Code after it
+ * runs on the poll thread -- anything slow should Schedule() elsewhere.
+ */
+
+#ifdef __KDB_COROUTINES
+
+#include <INETMessenger.hh>
+#include <EventNotifier.hh>
+#include <LockFreeQ.hh>
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <atomic>
+#include <vector>
+
+// What a Task<T> hands back, kept apart so Task<void> can share the rest
+template<class Result>
+class TaskResult
+{
+
+public:
+
+    void return_value(Result value)
+    {
+        m_Value.emplace(std::move(value));
+    }
+
+    Result Take(void)
+    {
+        if(m_Exception)
+        {
+            std::rethrow_exception(m_Exception);
+        }
+
+        return std::move(*m_Value);
+    }
+
+protected:
+
+    std::exception_ptr m_Exception;
+    std::optional<Result> m_Value;
+};
+
+template<>
+class TaskResult<void>
+{
+
+public:
+
+    void return_void(void)
+    {
+    }
+
+    void Take(void)
+    {
+        if(m_Exception)
+        {
+            std::rethrow_exception(m_Exception);
+        }
+    }
+
+protected:
+
+    std::exception_ptr m_Exception;
+};
+
+template<class Result = void>
+class Task
+{
+
+public:
+
+    struct promise_type : public TaskResult<Result>
+    {
+        Task get_return_object(void)
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        // Go straight back to whoever awaited us
+        struct FINAL_AWAITER
+        {
+            bool await_ready(void) noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> finished) noexcept
+            {
+                std::coroutine_handle<> continuation = finished.promise().m_Continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume(void) noexcept
+            {
+            }
+        };
+
+        FINAL_AWAITER final_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception(void)
+        {
+            this->m_Exception = std::current_exception();
+        }
+
+        std::coroutine_handle<> m_Continuation;
+    };
+
+    Task(Task&& other) noexcept
+        : m_Handle(other.m_Handle)
+    {
+        other.m_Handle = nullptr;
+    }
+
+    ~Task()
+    {
+        if(m_Handle)
+        {
+            m_Handle.destroy();
+        }
+    }
+
+    bool await_ready(void) const noexcept
+    {
+        return !m_Handle || m_Handle.done();
+    }
+
+    // Start the task -- it resumes awaiting when it finishes
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        m_Handle.promise().m_Continuation = awaiting;
+        return m_Handle;
+    }
+
+    Result await_resume(void)
+    {
+        return m_Handle.promise().Take();
+    }
+
+private:
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : m_Handle(handle)
+    {
+    }
+
+    Task(const Task&);
+    Task& operator=(const Task&);
+
+    std::coroutine_handle<promise_type> m_Handle;
+};
+
+// Owns itself and goes away when done
+struct DETACHED_TASK
+{
+    struct promise_type
+    {
+        DETACHED_TASK get_return_object(void)
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        void return_void(void)
+        {
+        }
+
+        void unhandled_exception(void)
+        {
+            LOG_ERROR("Exception escaped a spawned task");
+        }
+    };
+};
+
+// Run task now, up to its first suspension, without waiting for it
+inline DETACHED_TASK Spawn(Task<> task)
+{
+    co_await task;
+}
+
+/* Runs coroutines on the thread that calls Run().
+ *
+ * Other threads hand it coroutines with Post(). A coroutine waiting in
+ * Pop() is retried every time the loop wakes, so the queue it waits on
+ * must wake the loop -- set the same notifier on it.
+ */
+class CoLoop
+{
+
+public:
+
+    explicit CoLoop(EventNotifier& notifier)
+        : m_Notifier(notifier), m_Posted(), m_Waiting(), m_Stopping(false)
+    {
+        m_Posted.SetNotifier(&m_Notifier);
+    }
+
+    // Any thread
+    void Post(std::coroutine_handle<> handle)
+    {
+        m_Posted.Push(handle);
+    }
+
+    // Until Stop(). Waiters in Pop() are resumed once more so they can
+    // see the loop is stopping.
+    void Run(void)
+    {
+        while(!m_Stopping.load(std::memory_order_acquire))
+        {
+            m_Notifier.Wait();
+            Poll();
+        }
+
+        Poll();
+    }
+
+    // Any thread
+    void Stop(void)
+    {
+        m_Stopping.store(true, std::memory_order_release);
+        m_Notifier.Notify();
+    }
+
+    bool Stopping(void) const
+    {
+        return m_Stopping.load(std::memory_order_acquire);
+    }
+
+    // One pass over posted coroutines, then over waiters
+    void Poll(void)
+    {
+        std::coroutine_handle<> handle;
+        while(m_Posted.PopNoWait(handle))
+        {
+            handle.resume();
+        }
+
+        // Resumed coroutines may start waiting again
+        std::vector<WAITER> waiting;
+        waiting.swap(m_Waiting);
+        for(WAITER& waiter : waiting)
+        {
+            if(waiter.ready() || Stopping())
+            {
+                waiter.handle.resume();
+            }
+            else
+            {
+                m_Waiting.push_back(std::move(waiter));
+            }
+        }
+    }
+
+    // Awaiting it moves the coroutine onto the loop's thread
+    struct SCHEDULE_AWAITER
+    {
+        bool await_ready(void) noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            loop.Post(awaiting);
+        }
+
+        void await_resume(void) noexcept
+        {
+        }
+
+        CoLoop& loop;
+    };
+
+    SCHEDULE_AWAITER Schedule(void)
+    {
+        return SCHEDULE_AWAITER{*this};
+    }
+
+    // co_await Pop(queue, element) is true with element filled in, false
+    // once the loop is stopping. Only the loop's thread may pop queue.
+    template<class Queue, class Element>
+    class POP_AWAITER
+    {
+
+    public:
+
+        POP_AWAITER(CoLoop& loop, Queue& queue, Element& out_element)
+            : m_Loop(loop), m_Queue(queue), m_Element(out_element), m_Popped(false)
+        {
+        }
+
+        bool await_ready(void)
+        {
+            m_Popped = m_Queue.PopNoWait(m_Element);
+            return m_Popped || m_Loop.Stopping();
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            m_Loop.m_Waiting.push_back({[this]()
+            {
+                m_Popped = m_Queue.PopNoWait(m_Element);
+                return m_Popped;
+            }, awaiting});
+        }
+
+        bool await_resume(void)
+        {
+            return m_Popped;
+        }
+
+    private:
+
+        CoLoop& m_Loop;
+        Queue& m_Queue;
+        Element& m_Element;
+        bool m_Popped;
+    };
+
+    template<class Queue, class Element>
+    POP_AWAITER<Queue, Element> Pop(Queue& queue, Element& out_element)
+    {
+        return POP_AWAITER<Queue, Element>(*this, queue, out_element);
+    }
+
+private:
+
+    struct WAITER
+    {
+        std::function<bool()> ready;
+        std::coroutine_handle<> handle;
+    };
+
+    CoLoop(const CoLoop&);
+    CoLoop& operator=(const CoLoop&);
+
+    EventNotifier& m_Notifier;
+    MpscQ<std::coroutine_handle<>> m_Posted;
+    std::vector<WAITER> m_Waiting; // Loop thread only
+    std::atomic<bool> m_Stopping;
+};
+
+/* co_await AsyncRequest(...) gives the PackageHandle a future from
+ * PollThread::Request() would, empty if the request failed. The
+ * coroutine carries on on the poll thread, or right away on this one if
+ * the request could not be sent.
+ */
+class RequestAwaiter
+{
+
+public:
+
+    RequestAwaiter(PollThread& poll, const CONNECTION& connection, unsigned int data_type,
+        const void* payload, size_t size, unsigned short flags)
+        : m_Poll(poll), m_Connection(connection), m_DataType(data_type), m_Payload(payload),
+          m_Size(size), m_Flags(flags), m_Reply(), m_Awaiting(), m_Arrived(false)
+    {
+    }
+
+    bool await_ready(void) noexcept
+    {
+        return false;
+    }
+
+    // Whichever of the reply and this finishes second carries on
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+        m_Awaiting = awaiting;
+        m_Poll.Request(m_Connection, m_DataType, m_Payload, m_Size, m_Flags,
+            [this](PackageHandle reply)
+            {
+                m_Reply = std::move(reply);
+                if(m_Arrived.exchange(true))
+                {
+                    m_Awaiting.resume();
+                }
+            });
+
+        return !m_Arrived.exchange(true);
+    }
+
+    PackageHandle await_resume(void)
+    {
+        return std::move(m_Reply);
+    }
+
+private:
+
+    PollThread& m_Poll;
+    CONNECTION m_Connection;
+    unsigned int m_DataType;
+    const void* m_Payload; // Copied out before await_suspend returns
+    size_t m_Size;
+    unsigned short m_Flags;
+    PackageHandle m_Reply;
+    std::coroutine_handle<> m_Awaiting;
+    std::atomic<bool> m_Arrived;
+};
+
+inline RequestAwaiter AsyncRequest(PollThread& poll, const CONNECTION& connection, unsigned int data_type,
+    const void* payload, size_t size, unsigned short flags = INET_FLAG_NONE)
+{
+    return RequestAwaiter(poll, connection, data_type, payload, size, flags);
+}
+
+#endif
+
+#endif
@@ -67,6 +67,10 @@ public:
         return true;
     }
 
+    // Called once stop is requested -- threads that block waiting for work
+    // override this to wake themselves up so they can see it
+    virtual void Wake() { }
+
     // Request the thread to stop by setting value in promise object
     void Stop()
     {
@@ -74,6 +78,7 @@ public:
         {
             m_Running = false;
             m_exitSignal.set_value();
+            Wake();
             m_RunningThread->join();
             if(nullptr != m_RunningThread)
             {
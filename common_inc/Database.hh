@@ -28,7 +28,9 @@ class Database
         template <typename OBJ_TYPE>
         OBJ_TYPE* Get(const RECORD record)
         {
-            char* p_object_memory = GetObjectMem(type_name<OBJ_TYPE>().c_str());
+            OBJECT object_name = {0};
+            strncpy(object_name, type_name<OBJ_TYPE>().c_str(), sizeof(object_name) - 1);
+            char* p_object_memory = GetObjectMem(object_name);
             if(nullptr != p_object_memory)
             {
                 return reinterpret_cast<OBJ_TYPE*>(p_object_memory + sizeof(OBJ_TYPE) * record );
@@ -83,9 +85,6 @@ class Database
             return RTN_NOT_FOUND;
         }
 
-        template <typename ObjectType>
-        RETCODE Subscribe();
-
     int OpenDatabase(const OBJECT& objectName);
 
     private:
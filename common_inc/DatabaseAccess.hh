@@ -12,6 +12,33 @@
 #include <string>
 #include <sstream>
 #include <retcode.hh>
+#include <Metrics.hh>
+
+// Storage use summed over every open object. Failed writes are attempts
+// less writes.
+struct STORAGE_METRICS
+{
+    Counter& record_reads;
+    Counter& value_reads;
+    Counter& write_attempts;
+    Counter& writes;
+    Counter& maps;
+    Counter& map_failures;
+    Gauge& mapped_bytes;
+};
+
+inline STORAGE_METRICS& StorageMetrics(void)
+{
+    static STORAGE_METRICS metrics = {
+        MetricsRegistry::Instance().GetCounter("kdb_db_record_reads_total", "Records looked up in a mapped object"),
+        MetricsRegistry::Instance().GetCounter("kdb_db_value_reads_total", "Field values read as text"),
+        MetricsRegistry::Instance().GetCounter("kdb_db_write_attempts_total", "Field values asked to be written"),
+        MetricsRegistry::Instance().GetCounter("kdb_db_writes_total", "Field values written"),
+        MetricsRegistry::Instance().GetCounter("kdb_db_maps_total", "Object files mapped"),
+        MetricsRegistry::Instance().GetCounter("kdb_db_map_failures_total", "Object files that could not be opened or mapped"),
+        MetricsRegistry::Instance().GetGauge("kdb_db_mapped_bytes", "Bytes of object files mapped now")};
+    return metrics;
+}
 
 class DatabaseAccess
 {
@@ -64,6 +91,7 @@ class DatabaseAccess
                 size_t byte_index = m_Object.objectSize * record;
                 if( m_Size > byte_index )
                 {
+                    StorageMetrics().record_reads.Add();
                     return m_DBAddress + byte_index;
                 }
             }
@@ -90,6 +118,7 @@ class DatabaseAccess
         RETCODE WriteValue(const OFRI& ofri, const std::string& value)
         {
             RETCODE retcode = RTN_OK;
+            StorageMetrics().write_attempts.Add();
             void* p_value = Get(ofri);
             if(nullptr == p_value)
             {
@@ -191,11 +220,13 @@ class DatabaseAccess
                 }
             }
 
+            StorageMetrics().writes.Add();
             return RTN_OK;
         }
 
         RETCODE ReadValue(const OFRI& ofri, std::string& value)
         {
+            StorageMetrics().value_reads.Add();
             void* p_value = Get(ofri);
             if(nullptr == p_value)
             {
@@ -295,6 +326,7 @@ class DatabaseAccess
             if( 0 > fd )
             {
                 std::cout << "Failed to open: " << m_ObjectName << "\n";
+                StorageMetrics().map_failures.Add();
                 return RTN_NOT_FOUND;
             }
 
@@ -310,8 +342,14 @@ class DatabaseAccess
             if( nullptr == m_DBAddress )
             {
                 std::cout << "Failed to map: " <<  m_ObjectName << "\n";
+                StorageMetrics().map_failures.Add();
                 retcode |= RTN_FAIL;
             }
+            else
+            {
+                StorageMetrics().maps.Add();
+                StorageMetrics().mapped_bytes.Add(m_Size);
+            }
 
             m_IsOpen = true;
 
@@ -322,12 +360,20 @@ class DatabaseAccess
         {
             int error = 0;
 
+            if(nullptr == m_DBAddress)
+            {
+                m_IsOpen = false;
+                return RTN_OK;
+            }
+
             error = munmap(m_DBAddress, m_Size);
             if( 0 != error )
             {
                 return RTN_FAIL;
             }
 
+            StorageMetrics().mapped_bytes.Add(-static_cast<int64_t>(m_Size));
+
             m_IsOpen = false;
             return RTN_OK;
         }
@@ -0,0 +1,94 @@
+#ifndef __EVENT_NOTIFIER_HH
+#define __EVENT_NOTIFIER_HH
+
+/* Wakes a thread that is waiting for work.
+ *
+ * Wraps an eventfd so the same wakeup can be waited on directly with
+ * Wait() or added to an epoll set with GetFD(). Notify() only writes to
+ * the fd so it is safe to call from signal handlers.
+ */
+
+#include <Logger.hh>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdint>
+
+class EventNotifier
+{
+
+public:
+
+    EventNotifier()
+        : m_FD(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if(0 > m_FD)
+        {
+            LOG_ERROR("Could not create eventfd: ", strerror(errno));
+        }
+    }
+
+    ~EventNotifier()
+    {
+        if(0 <= m_FD)
+        {
+            close(m_FD);
+        }
+    }
+
+    // Async signal safe
+    void Notify(void)
+    {
+        uint64_t count = 1;
+        ssize_t written = write(m_FD, &count, sizeof(count));
+        (void)written; // Only fails when the counter is already huge -- still readable
+    }
+
+    // Block until notified or timeout_ms passes (-1 waits forever).
+    // Returns true when woken by Notify().
+    bool Wait(int timeout_ms = -1)
+    {
+        struct pollfd poll_fd;
+        poll_fd.fd = m_FD;
+        poll_fd.events = POLLIN;
+        poll_fd.revents = 0;
+
+        int ready = 0;
+        do
+        {
+            ready = poll(&poll_fd, 1, timeout_ms);
+        } while(0 > ready && EINTR == errno);
+
+        if(0 >= ready)
+        {
+            return false;
+        }
+
+        Drain();
+        return true;
+    }
+
+    // Reset after being woken through an epoll set
+    void Drain(void)
+    {
+        uint64_t count = 0;
+        ssize_t bytes_read = read(m_FD, &count, sizeof(count));
+        (void)bytes_read; // EAGAIN just means nothing was pending
+    }
+
+    int GetFD(void) const
+    {
+        return m_FD;
+    }
+
+private:
+
+    EventNotifier(const EventNotifier&);
+    EventNotifier& operator=(const EventNotifier&);
+
+    int m_FD;
+};
+
+#endif
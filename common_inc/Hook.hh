@@ -15,7 +15,7 @@ public:
     template <typename ... EventArgs>
     void Invoke(EventArgs&& ... args)
     {
-        for (DelegateType delegate : m_Delegates)
+        for (DelegateType& delegate : m_Delegates)
         {
             delegate(std::forward<EventArgs>(args)...);
         }
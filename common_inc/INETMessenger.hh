@@ -2,18 +2,31 @@
 #define INETMESSENGER__HH
 
 // Update version for production
-constexpr unsigned int _SERVER_VERSION = 2;
+constexpr unsigned int _SERVER_VERSION = 3;
+
+// First version framed with INET_COMPACT_HEADER instead of the full INET_HEADER
+constexpr unsigned int _COMPACT_SERVER_VERSION = 3;
+
+// Oldest client version still accepted -- always full INET_HEADER framing
+constexpr unsigned int _LEGACY_SERVER_VERSION = 2;
 
 #include <retcode.hh>
 #include <OFRI.hh>
 #include <DaemonThread.hh>
 #include <TasQ.hh>
+#include <LockFreeQ.hh>
 #include <Hook.hh>
 #include <profiler.hh>
 #include <Logger.hh>
 #include <ConfigValues.hh>
 #include <Constants.hh>
 #include <MessageTypes.hh>
+#include <SlabPool.hh>
+#include <EventNotifier.hh>
+#include <TimerNotifier.hh>
+#include <IOUring.hh>
+#include <RequestTracker.hh>
+#include <Metrics.hh>
 
 #include <vector>
 #include <string>
@@ -31,6 +44,17 @@ constexpr unsigned int _SERVER_VERSION = 2;
 #include <signal.h>
 #include <sys/mman.h>
 #include <sstream>
+#include <cstddef>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <atomic>
+#include <future>
 
 struct CONNECTION
 {
@@ -58,12 +82,35 @@ namespace std
     };
 }
 
+// Flags carried in the header of compact (v3) messages
+constexpr unsigned short INET_FLAG_NONE = 0x00;
+constexpr unsigned short INET_FLAG_OBJECT_ID = 0x01; // Payload addresses objects by number (OFRI_ID)
+
 struct INET_HEADER
 {
     CONNECTION connection; // Where this message comes from
     unsigned int message_size; // Size of payload only
     unsigned int data_type; // User can define here to differentiate messages
+
+    // Legacy (v2) framing ends here -- the rest only travels in compact headers
+    unsigned short request_id; // Echoed back on responses
+    unsigned short flags; // INET_FLAG_*
+};
+
+// Bytes of INET_HEADER sent on the wire by legacy (v2) connections
+constexpr size_t INET_LEGACY_HEADER_SIZE = offsetof(INET_HEADER, request_id);
+static_assert(56 == INET_LEGACY_HEADER_SIZE, "Legacy INET_HEADER framing changed size");
+
+// Wire header for compact (v3) connections. The connection is implied by
+// the socket it arrives on so it is not sent.
+struct INET_COMPACT_HEADER
+{
+    unsigned int message_size; // Size of payload only
+    unsigned char data_type; // MESSAGE_TYPE
+    unsigned char flags; // INET_FLAG_*
+    unsigned short request_id; // Echoed back on responses
 };
+static_assert(8 == sizeof(INET_COMPACT_HEADER), "Compact header must stay 8 bytes");
 
 struct INET_PACKAGE
 {
@@ -71,12 +118,115 @@ struct INET_PACKAGE
     char payload[0]; // The data of the message
 };
 
+// Packages come from the slab pool -- never new/delete them directly
+inline INET_PACKAGE* AllocatePackage(size_t payload_size)
+{
+    INET_PACKAGE* package = static_cast<INET_PACKAGE*>(
+        SlabPool::Instance().Allocate(sizeof(INET_PACKAGE) + payload_size));
+    if(nullptr != package)
+    {
+        memset(&package->header, 0, sizeof(INET_HEADER));
+        package->header.message_size = payload_size;
+    }
+
+    return package;
+}
+
+// Drops one reference -- the last one returns the package to the pool
+inline void FreePackage(INET_PACKAGE* package)
+{
+    SlabPool::Instance().Free(package);
+}
+
+// Share a package without copying it. Shared packages must not be written
+// to and every holder calls FreePackage() when done.
+inline INET_PACKAGE* RetainPackage(INET_PACKAGE* package)
+{
+    SlabPool::Instance().Retain(package);
+    return package;
+}
+
+// Package with header and payload copied from another
+inline INET_PACKAGE* ClonePackage(const INET_PACKAGE* package)
+{
+    INET_PACKAGE* clone = AllocatePackage(package->header.message_size);
+    if(nullptr != clone)
+    {
+        clone->header = package->header;
+        memcpy(clone->payload, package->payload, package->header.message_size);
+    }
+
+    return clone;
+}
+
+struct PackageDeleter
+{
+    void operator()(INET_PACKAGE* package) const
+    {
+        FreePackage(package);
+    }
+};
+
+// Owns a pooled package and returns it to the pool when it goes out of scope
+typedef std::unique_ptr<INET_PACKAGE, PackageDeleter> PackageHandle;
+typedef RequestTracker<PackageHandle> PackageTracker;
+
 struct ACKNOWLEDGE
 {
     // _SERVER_VERSION is used for this
     unsigned int server_version;
 };
 
+inline bool IsCompactVersion(unsigned int version)
+{
+    return _COMPACT_SERVER_VERSION <= version;
+}
+
+// Number of header bytes on the wire for a negotiated protocol version
+inline size_t InetHeaderSize(unsigned int version)
+{
+    return IsCompactVersion(version) ?
+        sizeof(INET_COMPACT_HEADER) : INET_LEGACY_HEADER_SIZE;
+}
+
+// Write the wire form of header into out_buffer and return its size
+inline size_t EncodeInetHeader(const INET_HEADER& header, unsigned int version, char* out_buffer)
+{
+    if(IsCompactVersion(version))
+    {
+        INET_COMPACT_HEADER compact;
+        compact.message_size = header.message_size;
+        compact.data_type = static_cast<unsigned char>(header.data_type);
+        compact.flags = static_cast<unsigned char>(header.flags);
+        compact.request_id = header.request_id;
+        memcpy(out_buffer, &compact, sizeof(compact));
+        return sizeof(compact);
+    }
+
+    memcpy(out_buffer, &header, INET_LEGACY_HEADER_SIZE);
+    return INET_LEGACY_HEADER_SIZE;
+}
+
+// Read a wire header of the negotiated version. Connection is left for the
+// caller to fill in from the socket the header arrived on.
+inline void DecodeInetHeader(const char* buffer, unsigned int version, INET_HEADER& out_header)
+{
+    if(IsCompactVersion(version))
+    {
+        INET_COMPACT_HEADER compact;
+        memcpy(&compact, buffer, sizeof(compact));
+        out_header.message_size = compact.message_size;
+        out_header.data_type = compact.data_type;
+        out_header.flags = compact.flags;
+        out_header.request_id = compact.request_id;
+        return;
+    }
+
+    memcpy(&out_header, buffer, INET_LEGACY_HEADER_SIZE);
+    out_header.request_id = 0;
+    out_header.flags = INET_FLAG_NONE;
+}
+
 // get sockaddr, IPv4 or IPv6:
 static void *get_in_addr(struct sockaddr *sa)
 {
@@ -87,6 +237,44 @@ static void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// get port in host order, IPv4 or IPv6:
+static unsigned short get_in_port(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return ntohs(((struct sockaddr_in*)sa)->sin_port);
+    }
+
+    return ntohs(((struct sockaddr_in6*)sa)->sin6_port);
+}
+
+// Peers on the AF_UNIX socket have no address or port. They are named
+// "unix:<pid>:<n>" with n counting every local connection this process has
+// made or accepted. A socket number would be handed straight to the next
+// connection, which would then get replies still queued for the old one.
+static const char INET_LOCAL_PREFIX[] = "unix:";
+
+inline bool IsLocalConnection(const CONNECTION& connection)
+{
+    return 0 == strncmp(connection.address, INET_LOCAL_PREFIX, sizeof(INET_LOCAL_PREFIX) - 1);
+}
+
+inline CONNECTION LocalConnection(int socket)
+{
+    static std::atomic<uint64_t> next_local(0);
+
+    CONNECTION connection = {0};
+    struct ucred credentials = {0};
+    socklen_t credentials_size = sizeof(credentials);
+    if(0 != getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size))
+    {
+        credentials.pid = 0;
+    }
+
+    snprintf(connection.address, sizeof(connection.address), "%s%d:%llu", INET_LOCAL_PREFIX, credentials.pid,
+        static_cast<unsigned long long>(next_local.fetch_add(1, std::memory_order_relaxed) + 1));
+    return connection;
+}
+
 inline static std::string PortIntToString(int port)
 {
     std::stringstream portstream;
@@ -108,84 +296,259 @@ static int PortStringToInt(const std::string port)
     return converted_port;
 }
 
-// Used to verify handshake from socket -- client must send handhake in 1 second
-static RETCODE ReceiveAck(int socket)
+// Handshakes always arrive in legacy framing -- INET_HEADER then ACKNOWLEDGE.
+// Compact clients are answered with an ACK in compact framing so they know
+// the version was accepted.
+constexpr size_t INET_HANDSHAKE_SIZE = INET_LEGACY_HEADER_SIZE + sizeof(ACKNOWLEDGE);
+
+// Check a client's handshake and pull out the version it asked for
+static RETCODE DecodeHandshake(const char* handshake, unsigned int& out_version)
+{
+    INET_HEADER header = {0};
+    DecodeInetHeader(handshake, _LEGACY_SERVER_VERSION, header);
+    ACKNOWLEDGE acknowledge = {0};
+    memcpy(&acknowledge, handshake + INET_LEGACY_HEADER_SIZE, sizeof(ACKNOWLEDGE));
+
+    if( header.data_type != MESSAGE_TYPE::ACK ||
+        _LEGACY_SERVER_VERSION > acknowledge.server_version ||
+        _SERVER_VERSION < acknowledge.server_version)
+    {
+        return RTN_CONNECTION_FAIL;
+    }
+
+    out_version = acknowledge.server_version;
+    return RTN_OK;
+}
+
+// Client must SendAck immediately after connecting
+static RETCODE SendAck(int socket, INET_PACKAGE& handshake)
 {
-    RETCODE retcode = RTN_OK;
+    // Legacy framing -- the in memory header is longer than the wire one
+    char frame[INET_LEGACY_HEADER_SIZE + sizeof(ACKNOWLEDGE)];
+    handshake.header.data_type = MESSAGE_TYPE::ACK;
+    EncodeInetHeader(handshake.header, _LEGACY_SERVER_VERSION, frame);
+    memcpy(frame + INET_LEGACY_HEADER_SIZE, handshake.payload, sizeof(ACKNOWLEDGE));
+    if(static_cast<ssize_t>(sizeof(frame)) != send(socket, frame, sizeof(frame), 0))
+    {
+        return RTN_CONNECTION_FAIL;
+    }
+
+    return RTN_OK;
+}
 
-    // Timeout at 1 second to wait for recv
+// Compact clients wait for the server to echo the accepted version
+static RETCODE ReceiveAckReply(int socket, unsigned int version)
+{
     struct timeval time_value;
-    time_value.tv_sec = 1; // Should make this a config variable
+    time_value.tv_sec = 1;
     time_value.tv_usec = 0;
     setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&time_value, sizeof(time_value));
 
-    INET_PACKAGE& handshake = *reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_PACKAGE) + sizeof(ACKNOWLEDGE)]);
-
-    int bytes_received =
-        recv(socket, static_cast<void*>(&handshake), sizeof(INET_PACKAGE) + sizeof(ACKNOWLEDGE), 0);
+    char reply[sizeof(INET_COMPACT_HEADER) + sizeof(ACKNOWLEDGE)] = {0};
+    int bytes_received = recv(socket, reply, sizeof(reply), MSG_WAITALL);
 
-    ACKNOWLEDGE& acknowledge =
-        *reinterpret_cast<ACKNOWLEDGE*>(handshake.payload);
-
-    // Reset
     time_value.tv_sec = 0;
     setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&time_value, sizeof(time_value));
 
-    if( sizeof(INET_PACKAGE) + sizeof(ACKNOWLEDGE) != bytes_received ||
-        handshake.header.data_type != MESSAGE_TYPE::ACK ||
-        _SERVER_VERSION != acknowledge.server_version)
+    if(static_cast<int>(sizeof(reply)) != bytes_received)
     {
-        #if __INET_BLACKLIST
-        // Sniff any bad handshake attempts
-        char* attempted_ack = reinterpret_cast<char*>(&handshake);
-        attempted_ack[sizeof(INET_PACKAGE) + sizeof(ACKNOWLEDGE) - 1] = '\0';
-        LOG_INFO("Acknowledge failed. Connection sent: ", attempted_ack);
-        
-        // Non-block set for smooth receives and sends
-        if(fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) < 0)
-        {
-            return RTN_FAIL;
-        }
+        return RTN_CONNECTION_FAIL;
+    }
 
-        char more_buffer[4096] = {0};
-        while(0 < recv(socket, more_buffer, sizeof(more_buffer) - 1, 0));
-        {
-            more_buffer[4096 - 1] = '\0';
-            LOG_INFO("More: ", more_buffer);
-            memset(more_buffer, 0, sizeof(more_buffer));
-        }
-        
-        if(0 > send(socket, "SUCK MY <b>ENTIRE</b> DICK", sizeof("SUCK MY <b>ENTIRE</b> DICK"), 0)) // Config file for custom blacklist message
-        {
-            LOG_WARN("Could not send aggressive response!");
-        }
-#endif
-        retcode = RTN_CONNECTION_FAIL;
+    // Only compact clients wait for this so the reply is always compact
+    INET_COMPACT_HEADER header;
+    memcpy(&header, reply, sizeof(INET_COMPACT_HEADER));
+    ACKNOWLEDGE acknowledge = {0};
+    memcpy(&acknowledge, reply + sizeof(INET_COMPACT_HEADER), sizeof(ACKNOWLEDGE));
+
+    if(MESSAGE_TYPE::ACK != header.data_type ||
+       version != acknowledge.server_version)
+    {
+        return RTN_CONNECTION_FAIL;
     }
 
-    delete &handshake;
+    return RTN_OK;
+}
+
+// Largest payload accepted from a peer before the connection is dropped
+constexpr unsigned int INET_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+// Starting size of each connection's read buffer -- grows to fit big frames
+constexpr size_t INET_READ_BUFFER_SIZE = 16 * 1024;
+
+// Bytes that may be queued for one peer when not configured
+constexpr size_t INET_DEFAULT_SEND_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// Most packages coalesced into a single writev()
+constexpr size_t INET_MAX_COALESCE = 64;
+
+// Packages producers can queue for the poll thread before they spill into
+// its locked overflow list, and how many it takes off per pop
+constexpr size_t INET_SEND_QUEUE_CAPACITY = 8 * 1024;
+constexpr size_t INET_SEND_BATCH = 64;
 
-    return retcode;
+// Time an accepted client has to send its handshake when not configured
+constexpr unsigned int INET_DEFAULT_HANDSHAKE_TIMEOUT_MS = 1000;
+
+// Most connections accepted per wakeup -- established peers get a turn
+// between batches during a connection storm
+constexpr size_t INET_MAX_ACCEPT_BATCH = 64;
+
+// How a PollThread waits for and does its socket I/O
+enum INET_BACKEND
+{
+    INET_BACKEND_EPOLL = 0, // Readiness with epoll, then recv/writev
+    INET_BACKEND_IO_URING // Completions from io_uring -- falls back to epoll
+};
+
+// io_uring ring sizing per PollThread
+constexpr unsigned int INET_URING_ENTRIES = 256;
+constexpr unsigned short INET_URING_BUFFER_GROUP = 0;
+constexpr unsigned int INET_URING_BUFFERS = 256; // Power of two
+constexpr size_t INET_URING_BUFFER_SIZE = 8 * 1024;
+
+// What to do when a peer's outbound queue is full
+enum INET_OVERFLOW_POLICY
+{
+    INET_OVERFLOW_DISCONNECT = 0, // Drop the slow peer
+    INET_OVERFLOW_DROP_OLDEST, // Discard unsent packages to make room
+    INET_OVERFLOW_BLOCK // Producer waits in Send() until there is room
+};
+
+// Socket traffic summed over every PollThread in the process
+struct INET_METRICS
+{
+    Counter& bytes_received;
+    Counter& frames_received;
+    Counter& bytes_sent;
+    Counter& frames_sent;
+    Counter& connects;
+    Counter& disconnects;
+    Counter& bad_frames;
+    Counter& overflow_disconnects;
+    Counter& overflow_drops;
+    Gauge& connections;
+};
+
+inline INET_METRICS& InetMetrics(void)
+{
+    static INET_METRICS metrics = {
+        MetricsRegistry::Instance().GetCounter("kdb_inet_received_bytes_total", "Bytes read from peers"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_received_frames_total", "Frames read from peers"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_sent_bytes_total", "Bytes written to peers, headers included"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_sent_frames_total", "Frames fully written to peers"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_connects_total", "Peers that finished their handshake"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_disconnects_total", "Connected peers that went away"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_bad_frames_total", "Connections dropped for a bad frame"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_overflow_disconnects_total", "Peers dropped for a full send buffer"),
+        MetricsRegistry::Instance().GetCounter("kdb_inet_overflow_drops_total", "Unsent packages discarded for a full send buffer"),
+        MetricsRegistry::Instance().GetGauge("kdb_inet_connections", "Peers connected now")};
+    return metrics;
 }
 
-// Client must SendAck immediately after connecting
-static RETCODE SendAck(int socket, INET_PACKAGE& handshake)
+// Queued send -- who it goes to and the (possibly shared) package to send.
+// The package's own header.connection is ignored.
+struct INET_OUTBOUND
 {
-    handshake.header.data_type = MESSAGE_TYPE::ACK;
-    if(-1 == send(socket, static_cast<void*>(&handshake), sizeof(INET_PACKAGE) + sizeof(ACKNOWLEDGE), 0))
+    CONNECTION connection;
+    INET_PACKAGE* package;
+};
+
+// Per socket state owned by the poll thread
+struct INET_SESSION
+{
+    CONNECTION connection;
+    unsigned int version; // Negotiated protocol
+    uint32_t events; // Poll events without EPOLLOUT
+
+    // Bytes received but not yet framed live in [read_start, read_end)
+    std::vector<char> read_buffer;
+    size_t read_start;
+    size_t read_end;
+
+    // Packages waiting for the socket -- front one may be partly written
+    std::deque<INET_PACKAGE*> send_queue;
+    size_t send_offset; // Bytes of the front frame already written
+    size_t send_bytes; // Frame bytes in send_queue not yet written
+    bool write_armed; // Waiting on EPOLLOUT for the socket to drain
+
+    uint64_t id; // Never reused -- tells io_uring completions for a reused fd apart
+    bool send_inflight; // io_uring writev submitted and not yet completed
+
+    // Accepted but no handshake yet -- not in the connection map, nothing
+    // is sent to it and nobody has been told it connected
+    bool handshaking;
+
+    INET_SESSION()
+        : connection(), version(_LEGACY_SERVER_VERSION), events(0), read_buffer(),
+          read_start(0), read_end(0), send_queue(), send_offset(0),
+          send_bytes(0), write_armed(false), id(0), send_inflight(false),
+          handshaking(false)
     {
-        return RTN_CONNECTION_FAIL;
     }
 
-    return RTN_OK;
-}
+    INET_SESSION(const CONNECTION& peer, unsigned int peer_version, uint32_t poll_events, uint64_t session_id)
+        : connection(peer), version(peer_version), events(poll_events),
+          read_buffer(INET_READ_BUFFER_SIZE), read_start(0), read_end(0),
+          send_queue(), send_offset(0), send_bytes(0), write_armed(false),
+          id(session_id), send_inflight(false), handshaking(false)
+    {
+    }
+
+    size_t FrameSize(const INET_PACKAGE* package) const
+    {
+        return InetHeaderSize(version) + package->header.message_size;
+    }
+};
+
+// An accepted socket that must finish its handshake by deadline
+struct INET_HANDSHAKE_DEADLINE
+{
+    std::chrono::steady_clock::time_point deadline;
+    int fd;
+    uint64_t session_id; // fd may have been closed and reused since
+};
+
+// A socket another thread connected, waiting for the poll thread to serve it
+struct INET_PENDING_SESSION
+{
+    int fd;
+    CONNECTION connection;
+    unsigned int version;
+    std::promise<RETCODE> added;
+};
+
+#if __INET_IO_URING
+// What a completion is for -- kept in the low bits of its user_data
+enum INET_URING_OP
+{
+    INET_URING_OP_SEND = 0, // user_data is the INET_URING_SEND itself
+    INET_URING_OP_ACCEPT,
+    INET_URING_OP_RECEIVE, // Session id in the upper bits
+    INET_URING_OP_NOTIFY,
+    INET_URING_OP_TIMER
+};
+constexpr uint64_t INET_URING_OP_BITS = 3;
+constexpr uint64_t INET_URING_OP_MASK = (1 << INET_URING_OP_BITS) - 1;
 
+// One writev on the ring. Packages are retained until it completes since the
+// session may be gone by then.
+struct alignas(1 << INET_URING_OP_BITS) INET_URING_SEND
+{
+    uint64_t session_id;
+    size_t num_packages;
+    INET_PACKAGE* packages[INET_MAX_COALESCE];
+    char headers[INET_MAX_COALESCE][sizeof(INET_HEADER)];
+    struct iovec iov[INET_MAX_COALESCE * 2];
+};
+#endif
 
-// Event callback definitions
-typedef void (*ConnectDelegate)(const CONNECTION&);
-typedef void (*DisconnectDelegate)(const CONNECTION&);
-typedef void (*MessageDelegate)(const INET_PACKAGE*);
-typedef void (*StopDelegate)(void);
+// Event callback definitions -- free functions or anything bound to an
+// object, so one process can hook several PollThreads apart
+typedef std::function<void(const CONNECTION&)> ConnectDelegate;
+typedef std::function<void(const CONNECTION&)> DisconnectDelegate;
+typedef std::function<void(const INET_PACKAGE*)> MessageDelegate;
+typedef std::function<void(void)> StopDelegate;
 
 // @TODO: Figure out how to pass queue reference rather than pointer
 class PollThread: public DaemonThread<int>
@@ -193,6 +556,8 @@ class PollThread: public DaemonThread<int>
 
 public:
 
+    // Every peer gets a reference to the same package -- nothing is copied,
+    // so it must not be changed afterwards. Caller still frees its own.
     RETCODE SendAll(INET_PACKAGE* package)
     {
         PROFILE_FUNCTION();
@@ -202,31 +567,45 @@ public:
             return RTN_CONNECTION_FAIL;
         }
 
-        for(std::unordered_map<CONNECTION,int>::iterator iter = m_ConnectionMap.begin(); iter != m_ConnectionMap.end(); ++iter)
+        // Snapshot the peers -- Enqueue() may block while the poll thread
+        // adds and removes connections
+        std::vector<CONNECTION> connections;
         {
-            INET_PACKAGE* message = reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_PACKAGE) + package->header.message_size]);
-            message->header.message_size = package->header.message_size;
-            message->header.connection = iter->first;
-            message->header.data_type = package->header.data_type;
-            memcpy(message->payload, package->payload, message->header.message_size);
-            m_SendQueue.Push(message);
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            connections.reserve(m_ConnectionMap.size());
+            for(std::unordered_map<CONNECTION,int>::iterator iter = m_ConnectionMap.begin(); iter != m_ConnectionMap.end(); ++iter)
+            {
+                connections.push_back(iter->first);
+            }
+        }
+
+        for(size_t connection_index = 0; connection_index < connections.size(); connection_index++)
+        {
+            Enqueue(connections[connection_index], RetainPackage(package));
         }
 
         return RTN_OK;
     }
 
-    // Use your own memory -- Recieve() will need to delete memory
+    // Takes ownership of a package from AllocatePackage()
     RETCODE Send(INET_PACKAGE* package)
+    {
+        return Send(package->header.connection, package);
+    }
+
+    // Takes one reference to a package that may be shared -- its own
+    // header.connection is ignored
+    RETCODE Send(const CONNECTION& connection, INET_PACKAGE* package)
     {
         PROFILE_FUNCTION();
 
         if(!m_Ready)
         {
+            FreePackage(package);
             return RTN_CONNECTION_FAIL;
         }
         
-        // Wait until send goes through
-        m_SendQueue.Push(package);
+        Enqueue(connection, package);
         return RTN_OK;
     }
 
@@ -241,16 +620,68 @@ public:
            return RTN_CONNECTION_FAIL; 
         }
         
-        INET_PACKAGE* package = new char[sizeof(DATA) + sizeof(INET_PACKAGE)];
-        package->header.message_size = sizeof(DATA);
+        INET_PACKAGE* package = AllocatePackage(sizeof(DATA));
+        if(nullptr == package)
+        {
+            return RTN_MALLOC_FAIL;
+        }
+
         package->header.connection = connection;
-        memcpy(&(package->payload[0]), *data, sizeof(DATA));
-        m_SendQueue.Push(package);
+        memcpy(&(package->payload[0]), &data, sizeof(DATA));
+        Enqueue(connection, package);
         return RTN_OK;
     }
 
+    // Send a request to a compact (v3) peer and get a future for its reply.
+    // The reply comes back through the future instead of m_OnReceive. An
+    // empty reply means the request could not be sent or the peer left.
+    std::future<PackageHandle> Request(const CONNECTION& connection, unsigned int data_type,
+        const void* payload, size_t size, unsigned short flags = INET_FLAG_NONE)
+    {
+        PROFILE_FUNCTION();
+        std::future<PackageHandle> reply;
+        std::shared_ptr<PackageTracker> tracker = GetTracker(connection);
+        unsigned short request_id = 0;
+        if(RTN_OK != tracker->Track(request_id, reply))
+        {
+            LOG_WARN("Too many requests in flight to ", connection.address, ":", connection.port);
+            std::promise<PackageHandle> failed;
+            failed.set_value(PackageHandle());
+            return failed.get_future();
+        }
+
+        SendRequest(*tracker, request_id, connection, data_type, payload, size, flags);
+        return reply;
+    }
+
+    // Same as above but on_reply is called with the reply on the poll
+    // thread -- nobody has to block on a future. A request that cannot be
+    // sent calls on_reply with an empty reply before returning.
+    void Request(const CONNECTION& connection, unsigned int data_type,
+        const void* payload, size_t size, unsigned short flags,
+        PackageTracker::Callback on_reply)
+    {
+        PROFILE_FUNCTION();
+        std::shared_ptr<PackageTracker> tracker = GetTracker(connection);
+        unsigned short request_id = 0;
+        if(RTN_OK != tracker->Track(request_id, on_reply))
+        {
+            LOG_WARN("Too many requests in flight to ", connection.address, ":", connection.port);
+            on_reply(PackageHandle());
+            return;
+        }
+
+        SendRequest(*tracker, request_id, connection, data_type, payload, size, flags);
+    }
+
+    // Applies to connections that make their first Request() afterwards
+    void SetRequestOrder(REQUEST_ORDER order)
+    {
+        m_RequestOrder = order;
+    }
+
     // Used by client to try and get data from queue 
-    // User must delete message aftger use
+    // User must FreePackage() message after use
     RETCODE Receive(INET_PACKAGE* message)
     {
         PROFILE_FUNCTION();
@@ -272,12 +703,23 @@ public:
         int num_poll_events = 0;
         int err = 0;
         int ret = 0;
-        int timeout = 10; /* in milliseconds */
+        int timeout = -1; /* Sends wake us through m_SendNotifier */
         int maxevents = 64;
         struct epoll_event events[64];
 
+        m_PollThreadID.store(std::this_thread::get_id(), std::memory_order_release);
+
+#if __INET_IO_URING
+        if(INET_BACKEND_IO_URING == m_Backend)
+        {
+            ExecuteRing();
+            return;
+        }
+#endif
+
         while(StopRequested() == false)
         {
+            AdoptPendingSessions();
             retcode = HandleSends();
 
             num_poll_events = epoll_wait(m_PollFD, events, maxevents, timeout);
@@ -307,12 +749,25 @@ public:
             {
                 int fd = events[i].data.fd;
 
-                if (m_TCPSocket == fd)
+                // Producers queued sends -- they go out at the top of the loop
+                if (m_SendNotifier.GetFD() == fd)
+                {
+                    m_SendNotifier.Drain();
+                    continue;
+                }
+
+                if (m_HandshakeTimer.GetFD() == fd)
+                {
+                    ExpireHandshakes();
+                    continue;
+                }
+
+                if (m_TCPSocket == fd || m_LocalSocket == fd)
                 {
                     /*
                     * A new client is connecting to us...
                     */
-                    if (RTN_OK != AcceptNewClient())
+                    if (RTN_OK != AcceptNewClient(fd))
                     {
                         LOG_WARN("Failed to accept client socket: ",fd);
                     }
@@ -322,14 +777,31 @@ public:
                 /*
                 * We have event(s) from client, let's call `recv()` to read it.
                 */
-                CONNECTION connection = m_FDMap[fd];
-                retcode = HandleEvent(connection, fd, events[i].events);
+                std::unordered_map<int, INET_SESSION>::iterator session = m_Sessions.find(fd);
+                if(session == m_Sessions.end())
+                {
+                    continue;
+                }
+
+                // Socket drained enough to take more of the queue
+                if(events[i].events & EPOLLOUT)
+                {
+                    if(RTN_OK != FlushSession(fd, session->second))
+                    {
+                        continue;
+                    }
+                }
+
+                if(0 == (events[i].events & ~EPOLLOUT))
+                {
+                    continue;
+                }
+
+                retcode = HandleEvent(session->second, fd, events[i].events);
                 if(RTN_CONNECTION_FAIL == retcode)
                 {
                     // Send signal that it's not available for sending??
                 }
-
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
 
 
@@ -338,20 +810,47 @@ public:
         LOG_DEBUG("Stopped polling thread");
     }
 
-    PollThread(const std::string& portNumber = "") :
-        m_Ready(false), m_PollFD(-1), m_TCPSocket(-1), m_Port(portNumber),
-        m_Address(), m_SendQueue(), m_ReceiveQueue()
+    // reuse_port lets several PollThreads listen on the same port -- see PollGroup
+    // local_path also listens on an AF_UNIX socket for clients on this host
+    PollThread(const std::string& portNumber = "", bool reuse_port = false,
+               const std::string& local_path = "") :
+        m_Ready(false), m_PollFD(-1), m_TCPSocket(-1), m_LocalSocket(-1), m_Port(portNumber),
+        m_ReusePort(reuse_port), m_Address(), m_LocalPath(local_path), m_SendQueue(INET_SEND_QUEUE_CAPACITY), m_ReceiveQueue(),
+        m_SendBufferSize(INET_DEFAULT_SEND_BUFFER_SIZE),
+        m_OverflowPolicy(INET_OVERFLOW_DISCONNECT), m_DroppedPackages(0),
+        m_PollThreadID(), m_Backend(INET_BACKEND_EPOLL), m_NextSessionID(0),
+        m_HandshakeTimeout(INET_DEFAULT_HANDSHAKE_TIMEOUT_MS), m_Adopting(false),
+        m_NumTrackers(0), m_RequestOrder(REQUEST_ORDER_ANY)
     {
         PROFILE_FUNCTION();
+        LoadSendLimits();
+        LoadHandshakeTimeout();
+        LoadBackend();
+        m_SendQueue.SetNotifier(&m_SendNotifier);
         RETCODE retcode = GetConnectionForSelf();
-        retcode |= InitPoll();
-        // We add our own listening socket to pool to check for new connections
-        retcode |= AddFDToPoll(m_TCPSocket, EPOLLIN | EPOLLPRI);
+        if(!m_LocalPath.empty())
+        {
+            retcode |= GetLocalConnectionForSelf();
+        }
+        if(INET_BACKEND_EPOLL == m_Backend)
+        {
+            retcode |= InitPoll();
+            // We add our own listening socket to pool to check for new connections
+            retcode |= AddFDToPoll(m_TCPSocket, EPOLLIN | EPOLLPRI);
+            if(0 <= m_LocalSocket)
+            {
+                retcode |= AddFDToPoll(m_LocalSocket, EPOLLIN | EPOLLPRI);
+            }
+            retcode |= AddFDToPoll(m_SendNotifier.GetFD(), EPOLLIN);
+            retcode |= AddFDToPoll(m_HandshakeTimer.GetFD(), EPOLLIN);
+        }
         if(RTN_OK == retcode)
         {
             // Ignore broken pipe signal to prevent send/read from causing errors
             signal(SIGPIPE, SIG_IGN);
 
+            m_Adopting = true;
+
             // Everything set up lets-a-go!
             Start(0);
 
@@ -410,6 +909,14 @@ public:
                 return RTN_CONNECTION_FAIL;
             }
 
+            // Kernel spreads incoming connections over every listener on the port
+            if (m_ReusePort && setsockopt(m_TCPSocket, SOL_SOCKET, SO_REUSEPORT, &yes,
+                    sizeof(int)) == -1)
+            {
+                LOG_ERROR("Failed to set SO_REUSEPORT on TCP socket");
+                return RTN_CONNECTION_FAIL;
+            }
+
             if (bind(m_TCPSocket, currentAddrInfo->ai_addr, currentAddrInfo->ai_addrlen) == -1)
             {
                 close(m_TCPSocket);
@@ -420,8 +927,10 @@ public:
             break;
         }
 
-        // Start listening for connections
-        if(-1 == listen(m_TCPSocket, 10))
+        // Start listening for connections. Accepts are drained in batches so
+        // the listener must not block once the queue is empty.
+        if(-1 == listen(m_TCPSocket, SOMAXCONN) ||
+           0 > fcntl(m_TCPSocket, F_SETFL, fcntl(m_TCPSocket, F_GETFL) | O_NONBLOCK))
         {
             LOG_ERROR("Failed to start listening on socket: ", m_TCPSocket);
             close(m_TCPSocket);
@@ -445,14 +954,70 @@ public:
         return RTN_OK;
     }
 
-    RETCODE Connect(const CONNECTION& connection)
+    // Same framing and handshake as TCP -- local clients just skip the
+    // network stack
+    RETCODE GetLocalConnectionForSelf(void)
+    {
+        PROFILE_FUNCTION();
+        struct sockaddr_un local_address;
+        memset(&local_address, 0, sizeof(local_address));
+        if(sizeof(local_address.sun_path) <= m_LocalPath.length())
+        {
+            LOG_ERROR("Local socket path is too long: ", m_LocalPath);
+            return RTN_BAD_ARG;
+        }
+
+        local_address.sun_family = AF_UNIX;
+        strncpy(local_address.sun_path, m_LocalPath.c_str(), sizeof(local_address.sun_path) - 1);
+
+        if((m_LocalSocket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        {
+            LOG_ERROR("Could not create local socket for listening");
+            return RTN_CONNECTION_FAIL;
+        }
+
+        // Left behind by a daemon that did not shut down cleanly
+        unlink(m_LocalPath.c_str());
+
+        if(bind(m_LocalSocket, (struct sockaddr *)&local_address, sizeof(local_address)) == -1)
+        {
+            LOG_ERROR("Could not bind local socket: ", m_LocalPath, " ", strerror(errno));
+            close(m_LocalSocket);
+            m_LocalSocket = -1;
+            return RTN_CONNECTION_FAIL;
+        }
+
+        if(-1 == listen(m_LocalSocket, SOMAXCONN) ||
+           0 > fcntl(m_LocalSocket, F_SETFL, fcntl(m_LocalSocket, F_GETFL) | O_NONBLOCK))
+        {
+            LOG_ERROR("Failed to start listening on local socket: ", m_LocalPath);
+            close(m_LocalSocket);
+            m_LocalSocket = -1;
+            unlink(m_LocalPath.c_str());
+            return RTN_CONNECTION_FAIL;
+        }
+
+        return RTN_OK;
+    }
+
+    RETCODE Connect(const CONNECTION& connection, unsigned int version = _SERVER_VERSION)
     {
         std::string port = PortIntToString(connection.port);
-        return Connect(std::string(connection.address), port);
+        return Connect(std::string(connection.address), port, version);
     }
 
     // Can send to this connection using Send() with CONNECTION
-    RETCODE Connect(const std::string& address, const std::string& port)
+    // Pass _LEGACY_SERVER_VERSION to talk to servers without compact framing
+    RETCODE Connect(const std::string& address, const std::string& port,
+                    unsigned int version = _SERVER_VERSION)
+    {
+        CONNECTION connection;
+        return Connect(address, port, connection, version);
+    }
+
+    // Same as above and names the peer the way Send() and Request() want it
+    RETCODE Connect(const std::string& address, const std::string& port,
+                    CONNECTION& out_connection, unsigned int version = _SERVER_VERSION)
     {
         PROFILE_FUNCTION();
         struct addrinfo hints = {0};
@@ -507,50 +1072,191 @@ public:
 
         char accepted_address[INET6_ADDRSTRLEN];
 
-        inet_ntop(returnedAddrInfo->ai_addr->sa_family,
-                    get_in_addr((struct sockaddr *)&returnedAddrInfo),
+        // Name the peer by the address that actually connected
+        inet_ntop(currentAddrInfo->ai_addr->sa_family,
+                    get_in_addr(currentAddrInfo->ai_addr),
                     accepted_address,
                     sizeof(accepted_address));
 
         freeaddrinfo(returnedAddrInfo);
 
-        // We must send handshake with server version
-        ACKNOWLEDGE ack = {_SERVER_VERSION};
         CONNECTION conn = {0, '\0'};
-        INET_PACKAGE& handshake = *reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_PACKAGE) + sizeof(ACKNOWLEDGE)]);
-        memcpy(handshake.header.connection.address,
-            m_Address.c_str(),
-            sizeof(handshake.header.connection.address));
-        handshake.header.connection.port = m_PollFD;
-        handshake.header.message_size = sizeof(ACKNOWLEDGE);
-        memcpy(handshake.payload, &ack, sizeof(ACKNOWLEDGE)); 
+        memcpy(conn.address, accepted_address, sizeof(conn.address));
+        conn.port = PortStringToInt(port);
 
-        // Send our server version to server to match
-        RETCODE retcode = SendAck(connectedSocket, handshake);
-        if(RTN_OK == retcode)
+        RETCODE retcode = StartSession(connectedSocket, conn, version);
+        if(RTN_OK != retcode)
+        {
+            LOG_WARN(
+                "Failed to add: ",
+                address,
+                " on port: ",
+                port);
+        }
+
+        out_connection = conn;
+        return retcode;
+    }
+
+    // Connect to a server on this host through its AF_UNIX socket
+    RETCODE ConnectLocal(const std::string& path, unsigned int version = _SERVER_VERSION)
+    {
+        CONNECTION server;
+        return ConnectLocal(path, server, version);
+    }
+
+    // out_connection names the server for Send() and Request()
+    RETCODE ConnectLocal(const std::string& path, CONNECTION& out_connection,
+                         unsigned int version = _SERVER_VERSION)
+    {
+        PROFILE_FUNCTION();
+        struct sockaddr_un server_address;
+        memset(&server_address, 0, sizeof(server_address));
+        if(path.empty() || sizeof(server_address.sun_path) <= path.length())
+        {
+            LOG_ERROR("Bad local socket path: ", path);
+            return RTN_BAD_ARG;
+        }
+
+        server_address.sun_family = AF_UNIX;
+        strncpy(server_address.sun_path, path.c_str(), sizeof(server_address.sun_path) - 1);
+
+        int connectedSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(-1 == connectedSocket)
+        {
+            LOG_ERROR("Error creating local client socket");
+            return RTN_CONNECTION_FAIL;
+        }
+
+        if(-1 == connect(connectedSocket, (struct sockaddr *)&server_address, sizeof(server_address)))
+        {
+            close(connectedSocket);
+            LOG_ERROR("Client failed to connect to ", path);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        CONNECTION conn = LocalConnection(connectedSocket);
+        RETCODE retcode = StartSession(connectedSocket, conn, version);
+        if(RTN_OK != retcode)
+        {
+            LOG_WARN("Failed to add local server: ", path);
+        }
+
+        out_connection = conn;
+        return retcode;
+    }
+
+    // Handshake with a server we just connected to and start serving it.
+    // The socket is closed on failure.
+    RETCODE StartSession(int connectedSocket, const CONNECTION& conn, unsigned int version)
+    {
+        PROFILE_FUNCTION();
+
+        // We must send handshake with server version
+        ACKNOWLEDGE ack = {version};
+        PackageHandle handshake_package(AllocatePackage(sizeof(ACKNOWLEDGE)));
+        if(nullptr == handshake_package)
+        {
+            close(connectedSocket);
+            return RTN_MALLOC_FAIL;
+        }
+        INET_PACKAGE& handshake = *handshake_package;
+        memcpy(handshake.header.connection.address,
+            m_Address.c_str(),
+            sizeof(handshake.header.connection.address));
+        handshake.header.connection.port = m_PollFD;
+        handshake.header.message_size = sizeof(ACKNOWLEDGE);
+        memcpy(handshake.payload, &ack, sizeof(ACKNOWLEDGE)); 
+
+        // Send our server version to server to match
+        RETCODE retcode = SendAck(connectedSocket, handshake);
+        if(RTN_OK == retcode && IsCompactVersion(version))
+        {
+            retcode = ReceiveAckReply(connectedSocket, version);
+        }
+
+        if(RTN_OK != retcode)
+        {
+            close(connectedSocket);
+        }
+
+        if(RTN_OK == retcode)
         {
             // Non-block set for smooth receives and sends
             if(fcntl(connectedSocket, F_SETFL, fcntl(connectedSocket, F_GETFL) | O_NONBLOCK) < 0)
             {
+                close(connectedSocket);
                 return RTN_FAIL;
             }
 
-            memcpy(conn.address, accepted_address, sizeof(conn.address));
-            conn.port = PortStringToInt(port);
-            retcode |= AddConnection(connectedSocket, conn, EPOLLIN | EPOLLPRI);
+            retcode |= AdoptSession(connectedSocket, conn, version);
         }
 
-        if(RTN_OK != retcode)
+        return retcode;
+    }
+
+    // Sessions belong to the poll thread so a socket connected anywhere
+    // else is handed over and we wait until it is being served
+    RETCODE AdoptSession(int connectedSocket, const CONNECTION& conn, unsigned int version)
+    {
+        if(std::this_thread::get_id() == m_PollThreadID.load(std::memory_order_acquire))
         {
-            LOG_WARN(
-                "Failed to add: ",
-                address,
-                " on port: ",
-                port);
+            return AddConnection(connectedSocket, conn, EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLET, version);
         }
 
-        delete &handshake;
-        return retcode;
+        INET_PENDING_SESSION pending = {connectedSocket, conn, version, std::promise<RETCODE>()};
+        std::future<RETCODE> added = pending.added.get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_PendingMutex);
+            if(!m_Adopting)
+            {
+                close(connectedSocket);
+                return RTN_CONNECTION_FAIL;
+            }
+            m_PendingSessions.push_back(&pending);
+        }
+        m_SendNotifier.Notify();
+
+        return added.get();
+    }
+
+    // Poll thread only
+    void AdoptPendingSessions()
+    {
+        std::deque<INET_PENDING_SESSION*> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_PendingMutex);
+            if(m_PendingSessions.empty())
+            {
+                return;
+            }
+            pending.swap(m_PendingSessions);
+        }
+
+        for(size_t session = 0; session < pending.size(); session++)
+        {
+            INET_PENDING_SESSION& adopt = *pending[session];
+            adopt.added.set_value(
+                AddConnection(adopt.fd, adopt.connection,
+                    EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLET, adopt.version));
+        }
+    }
+
+    // Refuse new hand overs and fail the ones the poll thread never got to
+    void FailPendingSessions()
+    {
+        std::deque<INET_PENDING_SESSION*> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_PendingMutex);
+            m_Adopting = false;
+            pending.swap(m_PendingSessions);
+        }
+
+        for(size_t session = 0; session < pending.size(); session++)
+        {
+            close(pending[session]->fd);
+            pending[session]->added.set_value(RTN_CONNECTION_FAIL);
+        }
     }
 
     RETCODE StopListeningForAccepts()
@@ -561,196 +1267,1083 @@ public:
             m_Ready = false;
             Stop();
             close(m_TCPSocket);
+            CloseLocalSocket();
             return RTN_OK;
         }
 
         return RTN_OK;
     }
 
-    RETCODE HandleEvent(const CONNECTION& connection, int fd, uint32_t revents)
+    // Edge triggered -- drain the socket, then frame everything buffered.
+    // Partial frames stay in the session's buffer until the next event.
+    RETCODE HandleEvent(INET_SESSION& session, int fd, uint32_t revents)
     {
         PROFILE_FUNCTION();
         RETCODE retcode = RTN_OK;
         int err;
         ssize_t recv_ret;
-        INET_HEADER inet_header = {};
-        const uint32_t err_mask = EPOLLERR | EPOLLHUP;
+        bool peer_closed = false;
+        const uint32_t err_mask = EPOLLERR;
 
         // Need to get connection that matches fd to call disconnect delegate
         if (revents & err_mask)
         {
-            retcode = RemoveConnection(fd, connection);
+            RemoveConnection(fd, session.connection);
             return RTN_CONNECTION_FAIL;
         }
 
-        recv_ret = recv(fd, &(inet_header), sizeof(INET_HEADER), 0);
-        if (recv_ret == 0)
+        while(true)
         {
-            RemoveConnection(fd, connection);
-            return RTN_CONNECTION_FAIL;
-        }
+            // Make room at the end of the buffer for this read
+            if(session.read_end == session.read_buffer.size())
+            {
+                CompactReadBuffer(session);
+            }
+
+            recv_ret = recv(fd, session.read_buffer.data() + session.read_end,
+                session.read_buffer.size() - session.read_end, 0);
+
+            if (recv_ret > 0)
+            {
+                session.read_end += recv_ret;
+                InetMetrics().bytes_received.Add(recv_ret);
+
+                // Frame as we go so the buffer only grows for large messages
+                retcode = ParseFrames(fd, session);
+                if(RTN_OK != retcode)
+                {
+                    LOG_WARN("Bad frame from connection: ", session.connection.address, ":", session.connection.port);
+                    InetMetrics().bad_frames.Add();
+                    RemoveConnection(fd, session.connection);
+                    return RTN_CONNECTION_FAIL;
+                }
+
+                continue;
+            }
+
+            if (recv_ret == 0)
+            {
+                peer_closed = true;
+                break;
+            }
 
-        if (recv_ret < 0)
-        {
             /* EAGAIN denotes no data to read -- kindly ignore */
             err = errno;
-            if (err == EAGAIN)
+            if (err == EAGAIN || err == EWOULDBLOCK)
             {
-                return RTN_OK;
+                break;
+            }
+
+            if (err == EINTR)
+            {
+                continue;
             }
 
             /* Error */
-            LOG_WARN("Error receving data from connection: ", m_FDMap[fd].address, ":", " errorno: ", strerror(errno));
-            RemoveConnection(fd, connection);
+            LOG_WARN("Error receving data from connection: ", session.connection.address, ":", " errorno: ", strerror(err));
+            RemoveConnection(fd, session.connection);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        if(peer_closed || (revents & EPOLLHUP))
+        {
+            RemoveConnection(fd, session.connection);
             return RTN_CONNECTION_FAIL;
         }
 
-        /* Dynamically create memory for whole package size */
-        /* Maybe needs size limiting to avoid giant packages */
-        INET_PACKAGE* package = reinterpret_cast<INET_PACKAGE*>(new char[sizeof(INET_PACKAGE) + inet_header.message_size]);
-        memcpy(&(package->header.connection), &m_FDMap[fd], sizeof(CONNECTION));
-        package->header.message_size = inet_header.message_size;
-        package->header.data_type = inet_header.data_type;
-        int remaining_message = package->header.message_size;
+        return RTN_OK;
+    }
 
-        while(0 < (recv_ret = recv(fd, package->payload + inet_header.message_size - remaining_message, remaining_message, 0)))
+    // Deliver every complete frame in the session's buffer. An accepted
+    // socket's first frame is its handshake.
+    RETCODE ParseFrames(int fd, INET_SESSION& session)
+    {
+        PROFILE_FUNCTION();
+        if(session.handshaking)
         {
-            remaining_message -= recv_ret;
+            RETURN_RETCODE_IF_NOT_OK(ParseHandshake(fd, session));
+            if(session.handshaking)
+            {
+                return RTN_OK;
+            }
         }
 
-        if (remaining_message != 0)
+        const size_t header_size = InetHeaderSize(session.version);
+        INET_HEADER inet_header = {};
+
+        while(session.read_end - session.read_start >= header_size)
         {
-            err = errno;
-            if (err != EAGAIN)
+            const char* frame = session.read_buffer.data() + session.read_start;
+            DecodeInetHeader(frame, session.version, inet_header);
+
+            if(INET_MAX_MESSAGE_SIZE < inet_header.message_size)
             {
-                /* Error */
-                LOG_WARN("Error receving data from connection: ", package->header.connection.address, " errono: ", strerror(errno));
-                RemoveConnection(fd, connection);
-                return RTN_CONNECTION_FAIL;
+                LOG_WARN("Message of ", inet_header.message_size, " bytes is over the limit of ", INET_MAX_MESSAGE_SIZE);
+                return RTN_BAD_ARG;
+            }
+
+            const size_t frame_size = header_size + inet_header.message_size;
+            if(session.read_end - session.read_start < frame_size)
+            {
+                // Incomplete -- make sure the whole frame will fit once it arrives
+                if(session.read_buffer.size() < frame_size)
+                {
+                    CompactReadBuffer(session);
+                    session.read_buffer.resize(frame_size);
+                }
+
+                return RTN_OK;
+            }
+
+            PackageHandle package(AllocatePackage(inet_header.message_size));
+            if(nullptr == package)
+            {
+                LOG_ERROR("Could not allocate ", inet_header.message_size, " byte package");
+                return RTN_MALLOC_FAIL;
+            }
+
+            package->header = inet_header;
+            package->header.connection = session.connection;
+            memcpy(package->payload, frame + header_size, inet_header.message_size);
+            session.read_start += frame_size;
+            InetMetrics().frames_received.Add();
+
+            // Replies someone made a Request() for go to their future
+            if(0 != inet_header.request_id && CompleteRequest(package))
+            {
+                continue;
             }
 
+            m_OnReceive.Invoke(package.get());
+        }
+
+        // Everything consumed so start again at the front
+        if(session.read_start == session.read_end)
+        {
+            session.read_start = 0;
+            session.read_end = 0;
         }
 
-        m_OnReceive.Invoke(package);
-        delete[] package;
         return RTN_OK;
     }
 
-    RETCODE HandleSends(void)
+    // Finish an accepted socket's handshake once all of it has arrived.
+    // Leaves session.handshaking set while still waiting.
+    RETCODE ParseHandshake(int fd, INET_SESSION& session)
     {
         PROFILE_FUNCTION();
-        int message_length = 0;
-        int socket;
-        INET_PACKAGE* packet;
+        if(session.read_end - session.read_start < INET_HANDSHAKE_SIZE)
+        {
+            return RTN_OK;
+        }
 
-        while(m_SendQueue.TryPop(packet))
+        const char* handshake = session.read_buffer.data() + session.read_start;
+        unsigned int version = _LEGACY_SERVER_VERSION;
+        if(RTN_OK != DecodeHandshake(handshake, version))
         {
-            std::unordered_map<CONNECTION,int>::iterator connection = m_ConnectionMap.find(packet->header.connection);
-            if(connection != m_ConnectionMap.end())
+#if __INET_BLACKLIST
+            // Sniff any bad handshake attempts
+            std::string attempted_ack(handshake, session.read_end - session.read_start);
+            LOG_INFO("Acknowledge failed. Connection sent: ", attempted_ack.c_str());
+
+            if(0 > send(fd, "SUCK MY <b>ENTIRE</b> DICK", sizeof("SUCK MY <b>ENTIRE</b> DICK"), 0)) // Config file for custom blacklist message
             {
-                message_length = packet->header.message_size + sizeof(INET_PACKAGE);
-                while(message_length > 0)
-                {
-                    message_length -= send(connection->second, packet, message_length, 0);
-                }
+                LOG_WARN("Could not send aggressive response!");
             }
-            else
+#endif
+            LOG_WARN("Failed to accept client: ", session.connection.address);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        session.read_start += INET_HANDSHAKE_SIZE;
+        session.version = version;
+
+        if(m_ConnectionMap.find(session.connection) != m_ConnectionMap.end())
+        {
+            LOG_WARN("Bad connection: ", session.connection.address);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        // Legacy clients do not expect a reply. Queued before anyone hears
+        // about the connection so it is the first thing the client reads.
+        if(IsCompactVersion(version))
+        {
+            INET_PACKAGE* reply = AllocatePackage(sizeof(ACKNOWLEDGE));
+            if(nullptr == reply)
             {
-                LOG_WARN("Could not find: ", packet->header.connection.address, "sending failed!");
+                return RTN_MALLOC_FAIL;
             }
 
-            delete packet;
+            ACKNOWLEDGE acknowledge = {version};
+            reply->header.connection = session.connection;
+            reply->header.data_type = MESSAGE_TYPE::ACK;
+            memcpy(reply->payload, &acknowledge, sizeof(ACKNOWLEDGE));
+            Enqueue(session.connection, reply);
         }
 
+        session.handshaking = false;
+        RegisterConnection(fd, session.connection);
         return RTN_OK;
     }
 
-    RETCODE AcceptNewClient()
+    // Close every accepted socket whose handshake is overdue. Deadlines are
+    // all the same distance out so they expire in the order they were made.
+    void ExpireHandshakes(void)
     {
         PROFILE_FUNCTION();
-        RETCODE retcode = RTN_OK;
-        struct sockaddr incoming_accepted_address;
-        socklen_t incoming_address_size = sizeof(incoming_accepted_address);
-        int accept_socket = -1;
-        char accepted_address[INET6_ADDRSTRLEN];
-        int err = 0;
+        m_HandshakeTimer.Drain();
 
-        CONNECTION connection = {0};
-        ACKNOWLEDGE acknowledge = {0};
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while(!m_HandshakeDeadlines.empty() && m_HandshakeDeadlines.front().deadline <= now)
+        {
+            const INET_HANDSHAKE_DEADLINE expired = m_HandshakeDeadlines.front();
+            m_HandshakeDeadlines.pop_front();
+
+            std::unordered_map<int, INET_SESSION>::iterator session = m_Sessions.find(expired.fd);
+            if(session != m_Sessions.end() && session->second.id == expired.session_id &&
+               session->second.handshaking)
+            {
+                LOG_WARN("Handshake timed out for ", session->second.connection.address, ":",
+                    session->second.connection.port);
+                RemoveConnection(expired.fd, session->second.connection);
+            }
+        }
 
-        accept_socket = accept(m_TCPSocket,
-                            (struct sockaddr *)&incoming_accepted_address,
-                            &incoming_address_size);
+        if(!m_HandshakeDeadlines.empty())
+        {
+            m_HandshakeTimer.ArmAt(m_HandshakeDeadlines.front().deadline);
+        }
+    }
 
-        if(0 < accept_socket)
+    // Move unparsed bytes to the front of the buffer, growing it if already there
+    void CompactReadBuffer(INET_SESSION& session)
+    {
+        if(0 == session.read_start)
         {
-            inet_ntop(incoming_accepted_address.sa_family,
-            get_in_addr((struct sockaddr *)&incoming_accepted_address),
-                accepted_address, sizeof(accepted_address));
+            session.read_buffer.resize(session.read_buffer.size() * 2);
+            return;
+        }
 
-            // Wait for client to send ack
-            retcode = ReceiveAck(accept_socket);
+        memmove(session.read_buffer.data(),
+            session.read_buffer.data() + session.read_start,
+            session.read_end - session.read_start);
+        session.read_end -= session.read_start;
+        session.read_start = 0;
+    }
+
+    // Hand a package to the poll thread, waiting first if the peer is
+    // full and the policy is to block
+    void Enqueue(const CONNECTION& connection, INET_PACKAGE* package)
+    {
+        if(INET_OVERFLOW_BLOCK == m_OverflowPolicy)
+        {
+            const size_t frame_size = sizeof(INET_HEADER) + package->header.message_size;
+            std::unique_lock<std::mutex> lock(m_OutboundMutex);
+
+            // The poll thread drains the queues so it must never wait on them
+            if(std::this_thread::get_id() != m_PollThreadID.load(std::memory_order_acquire))
+            {
+                m_OutboundCondition.wait(lock, [this, &connection, frame_size]()
+                {
+                    std::unordered_map<CONNECTION, size_t>::iterator outbound =
+                        m_OutboundBytes.find(connection);
+                    return !m_Ready || outbound == m_OutboundBytes.end() ||
+                        0 == outbound->second ||
+                        outbound->second + frame_size <= m_SendBufferSize;
+                });
+            }
+
+            std::unordered_map<CONNECTION, size_t>::iterator outbound =
+                m_OutboundBytes.find(connection);
+            if(outbound != m_OutboundBytes.end())
+            {
+                outbound->second += frame_size;
+            }
+        }
+
+        INET_OUTBOUND outbound = {connection, package};
+        m_SendQueue.Push(outbound);
+    }
+
+    // Give back room reserved in Enqueue() once a package leaves the queue
+    void ReleaseOutbound(const CONNECTION& connection, const INET_PACKAGE* package)
+    {
+        if(INET_OVERFLOW_BLOCK != m_OverflowPolicy)
+        {
+            return;
+        }
 
-            if(RTN_OK == retcode)
+        const size_t frame_size = sizeof(INET_HEADER) + package->header.message_size;
+        {
+            std::lock_guard<std::mutex> lock(m_OutboundMutex);
+            std::unordered_map<CONNECTION, size_t>::iterator outbound =
+                m_OutboundBytes.find(connection);
+            if(outbound != m_OutboundBytes.end())
             {
-                memcpy(connection.address, accepted_address, sizeof(connection.address));
-                connection.port = PortStringToInt(m_Port);
+                outbound->second -= std::min(outbound->second, frame_size);
+            }
+        }
+
+        m_OutboundCondition.notify_all();
+    }
+
+    // Move everything queued by producers onto the peers' queues, then write
+    // out each peer that got something in as few writev() calls as it takes
+    RETCODE HandleSends(void)
+    {
+        PROFILE_FUNCTION();
+        INET_OUTBOUND outbound[INET_SEND_BATCH];
+        std::vector<int> pending_sockets;
 
-                // Non-block set for smooth receives and sends
-                if(fcntl(accept_socket, F_SETFL, fcntl(accept_socket, F_GETFL) | O_NONBLOCK) < 0)
+        size_t num_outbound = 0;
+        while(0 != (num_outbound = m_SendQueue.PopN(outbound, INET_SEND_BATCH)))
+        {
+            for(size_t package = 0; package < num_outbound; package++)
+            {
+                std::unordered_map<CONNECTION,int>::iterator connection = m_ConnectionMap.find(outbound[package].connection);
+                if(connection == m_ConnectionMap.end())
                 {
-                    return RTN_FAIL;
+                    LOG_DEBUG("Could not find: ", outbound[package].connection.address, " sending failed!");
+                    ReleaseOutbound(outbound[package].connection, outbound[package].package);
+                    FreePackage(outbound[package].package);
+                    continue;
                 }
 
-                if(RTN_OK != AddConnection(accept_socket, connection, EPOLLIN | EPOLLPRI))
+                const int fd = connection->second;
+                INET_SESSION& session = m_Sessions[fd];
+                if(RTN_OK != QueueOnSession(fd, session, outbound[package].package))
                 {
-                    LOG_WARN("Bad connection: ", accepted_address);
-                    close(accept_socket);
-                    return RTN_FAIL;
+                    continue;
                 }
 
-                return RTN_OK;
+                if(pending_sockets.empty() || pending_sockets.back() != fd)
+                {
+                    pending_sockets.push_back(fd);
+                }
             }
-            else
+        }
+
+        for(size_t socket_index = 0; socket_index < pending_sockets.size(); socket_index++)
+        {
+            std::unordered_map<int, INET_SESSION>::iterator session = m_Sessions.find(pending_sockets[socket_index]);
+
+            // Gone, or already written out earlier in this list, or socket is full
+            if(session == m_Sessions.end() || session->second.send_queue.empty() ||
+               session->second.write_armed)
             {
-                LOG_WARN("Failed to accept client: ", accepted_address);
-                close(accept_socket);
-                return RTN_CONNECTION_FAIL;
+                continue;
             }
+
+            FlushSession(session->first, session->second);
         }
-        else
+
+        return RTN_OK;
+    }
+
+    // Append to a peer's queue applying the overflow policy
+    RETCODE QueueOnSession(int fd, INET_SESSION& session, INET_PACKAGE* packet)
+    {
+        const size_t frame_size = session.FrameSize(packet);
+
+        // An empty queue always takes the package so huge frames still go
+        if(!session.send_queue.empty() &&
+           session.send_bytes + frame_size > m_SendBufferSize)
         {
-            err = errno;
-            if (err == EAGAIN)
+            switch(m_OverflowPolicy)
             {
-                return RTN_OK;
+                case INET_OVERFLOW_DISCONNECT:
+                {
+                    LOG_WARN("Send buffer full for ", session.connection.address, ":",
+                        session.connection.port, " -- disconnecting");
+                    InetMetrics().overflow_disconnects.Add();
+                    ReleaseOutbound(session.connection, packet);
+                    FreePackage(packet);
+                    RemoveConnection(fd, session.connection);
+                    return RTN_CONNECTION_FAIL;
+                }
+                case INET_OVERFLOW_DROP_OLDEST:
+                {
+                    // A partly written frame has to finish or the stream breaks
+                    size_t keep = (0 == session.send_offset) ? 0 : 1;
+                    while(session.send_queue.size() > keep &&
+                          session.send_bytes + frame_size > m_SendBufferSize)
+                    {
+                        std::deque<INET_PACKAGE*>::iterator oldest = session.send_queue.begin() + keep;
+                        session.send_bytes -= session.FrameSize(*oldest);
+                        ReleaseOutbound(session.connection, *oldest);
+                        FreePackage(*oldest);
+                        session.send_queue.erase(oldest);
+                        m_DroppedPackages++;
+                        InetMetrics().overflow_drops.Add();
+                    }
+                    break;
+                }
+                case INET_OVERFLOW_BLOCK:
+                default:
+                {
+                    // Producer already waited for room in Enqueue()
+                    break;
+                }
             }
+        }
 
-            /* Error */
-            LOG_ERROR("Error in accept(): ", strerror(err));
+        session.send_queue.push_back(packet);
+        session.send_bytes += frame_size;
+        return RTN_OK;
+    }
+
+    // Lay out the front of a peer's queue as header/payload pairs for
+    // writev, skipping what an earlier partial write already sent
+    size_t BuildSendIOV(INET_SESSION& session, char headers[][sizeof(INET_HEADER)],
+                        struct iovec* iov, size_t& out_num_packages)
+    {
+        INET_HEADER header;
+        size_t iov_count = 0;
+        size_t skip = session.send_offset;
+        out_num_packages = std::min(session.send_queue.size(), INET_MAX_COALESCE);
+
+        for(size_t package_index = 0; package_index < out_num_packages; package_index++)
+        {
+            INET_PACKAGE* package = session.send_queue[package_index];
+
+            // Payloads may be shared between peers so the header is
+            // framed here for this connection and the version it speaks
+            header = package->header;
+            header.connection = session.connection;
+            size_t header_size = EncodeInetHeader(header, session.version, headers[package_index]);
+            size_t payload_size = package->header.message_size;
+
+            // Only the front frame can be partly written already
+            if(skip < header_size)
+            {
+                iov[iov_count].iov_base = headers[package_index] + skip;
+                iov[iov_count].iov_len = header_size - skip;
+                iov_count++;
+                skip = 0;
+            }
+            else
+            {
+                skip -= header_size;
+            }
+
+            if(skip < payload_size)
+            {
+                iov[iov_count].iov_base = package->payload + skip;
+                iov[iov_count].iov_len = payload_size - skip;
+                iov_count++;
+            }
+
+            skip = 0;
+        }
+
+        return iov_count;
+    }
+
+    // Write as much of the peer's queue as the socket takes. When the socket
+    // fills up EPOLLOUT is armed and the rest goes out once it drains.
+    RETCODE FlushSession(int fd, INET_SESSION& session)
+    {
+        PROFILE_FUNCTION();
+#if __INET_IO_URING
+        if(INET_BACKEND_IO_URING == m_Backend)
+        {
+            return SubmitSend(fd, session);
+        }
+#endif
+
+        char headers[INET_MAX_COALESCE][sizeof(INET_HEADER)];
+        struct iovec iov[INET_MAX_COALESCE * 2];
+        size_t num_packages = 0;
+        ssize_t written = 0;
+        int err = 0;
+
+        while(!session.send_queue.empty())
+        {
+            size_t iov_count = BuildSendIOV(session, headers, iov, num_packages);
+
+            written = writev(fd, iov, iov_count);
+            if(0 > written)
+            {
+                err = errno;
+                if(EINTR == err)
+                {
+                    continue;
+                }
+
+                if(EAGAIN == err || EWOULDBLOCK == err)
+                {
+                    return ArmWrite(fd, session);
+                }
+
+                LOG_WARN("Error sending to connection: ", session.connection.address, ":",
+                    session.connection.port, " errorno: ", strerror(err));
+                RemoveConnection(fd, session.connection);
+                return RTN_CONNECTION_FAIL;
+            }
+
+            ConsumeWritten(session, written);
+        }
+
+        // All caught up so stop waking on writable
+        if(session.write_armed)
+        {
+            session.write_armed = false;
+            return ModifyFDInPoll(fd, session.events);
+        }
+
+        return RTN_OK;
+    }
+
+    // Pop fully written frames and remember how far into the next one we are
+    void ConsumeWritten(INET_SESSION& session, size_t written)
+    {
+        InetMetrics().bytes_sent.Add(written);
+        while(0 < written && !session.send_queue.empty())
+        {
+            INET_PACKAGE* package = session.send_queue.front();
+            size_t remaining = session.FrameSize(package) - session.send_offset;
+            if(written < remaining)
+            {
+                session.send_offset += written;
+                session.send_bytes -= written;
+                return;
+            }
+
+            written -= remaining;
+            session.send_bytes -= remaining;
+            session.send_offset = 0;
+            session.send_queue.pop_front();
+            InetMetrics().frames_sent.Add();
+            ReleaseOutbound(session.connection, package);
+            FreePackage(package);
+        }
+    }
+
+    // Socket buffer is full so wait for it to drain
+    RETCODE ArmWrite(int fd, INET_SESSION& session)
+    {
+        if(session.write_armed)
+        {
+            return RTN_OK;
+        }
+
+        session.write_armed = true;
+        return ModifyFDInPoll(fd, session.events | EPOLLOUT);
+    }
+
+    // Free whatever never made it out to a peer
+    void DropSendQueue(INET_SESSION& session)
+    {
+        while(!session.send_queue.empty())
+        {
+            ReleaseOutbound(session.connection, session.send_queue.front());
+            FreePackage(session.send_queue.front());
+            session.send_queue.pop_front();
+        }
+
+        session.send_offset = 0;
+        session.send_bytes = 0;
+    }
+
+    // KDB_INET_BACKEND picks epoll or io_uring. io_uring falls back to
+    // epoll when the build or the kernel doesn't have it.
+    void LoadBackend(void)
+    {
+        m_Backend = INET_BACKEND_EPOLL;
+
+        std::string backend = ConfigValues::Instance().Get(KDB_INET_BACKEND);
+        if(backend.empty() || "EPOLL" == backend)
+        {
+            return;
+        }
+
+        if("IO_URING" != backend)
+        {
+            LOG_WARN("Unknown ", KDB_INET_BACKEND, " value ", backend, " -- using EPOLL");
+            return;
+        }
+
+#if __INET_IO_URING
+        if(IOUring::KernelSupported() &&
+           RTN_OK == m_Ring.Init(INET_URING_ENTRIES) &&
+           RTN_OK == m_Ring.RegisterBuffers(INET_URING_BUFFER_GROUP, INET_URING_BUFFERS, INET_URING_BUFFER_SIZE))
+        {
+            m_Backend = INET_BACKEND_IO_URING;
+            return;
+        }
+
+        LOG_WARN("io_uring is not available on this kernel -- using EPOLL");
+#else
+        LOG_WARN("Built without io_uring -- using EPOLL");
+#endif
+    }
+
+    void LoadHandshakeTimeout(void)
+    {
+        std::string timeout = ConfigValues::Instance().Get(KDB_INET_HANDSHAKE_TIMEOUT);
+        if(timeout.empty())
+        {
+            return;
+        }
+
+        try
+        {
+            m_HandshakeTimeout = std::chrono::milliseconds(std::stoul(timeout));
+        }
+        catch(std::exception const& except)
+        {
+            LOG_WARN("Could not convert ", KDB_INET_HANDSHAKE_TIMEOUT, " value ", timeout, " -- using ",
+                m_HandshakeTimeout.count(), "ms");
+        }
+    }
+
+    // Send buffer size and overflow policy from the config
+    void LoadSendLimits(void)
+    {
+        m_SendBufferSize = INET_DEFAULT_SEND_BUFFER_SIZE;
+        m_OverflowPolicy = INET_OVERFLOW_DISCONNECT;
+
+        std::string buffer_size = ConfigValues::Instance().Get(KDB_INET_SEND_BUFFER_SIZE);
+        if(!buffer_size.empty())
+        {
+            try
+            {
+                m_SendBufferSize = std::stoul(buffer_size);
+            }
+            catch(std::exception const& except)
+            {
+                LOG_WARN("Could not convert ", KDB_INET_SEND_BUFFER_SIZE, " value ", buffer_size, " -- using ", m_SendBufferSize);
+            }
+        }
+
+        std::string policy = ConfigValues::Instance().Get(KDB_INET_OVERFLOW_POLICY);
+        if("DROP_OLDEST" == policy)
+        {
+            m_OverflowPolicy = INET_OVERFLOW_DROP_OLDEST;
+        }
+        else if("BLOCK" == policy)
+        {
+            m_OverflowPolicy = INET_OVERFLOW_BLOCK;
+        }
+        else if(!policy.empty() && "DISCONNECT" != policy)
+        {
+            LOG_WARN("Unknown ", KDB_INET_OVERFLOW_POLICY, " value ", policy, " -- using DISCONNECT");
+        }
+    }
+
+#if __INET_IO_URING
+    // io_uring loop -- same sessions, framing and send queues as epoll but
+    // accept and receive stay armed (multishot) and every send queued in a
+    // pass goes to the kernel in one submit
+    void ExecuteRing(void)
+    {
+        PROFILE_FUNCTION();
+        struct io_uring_cqe cqe;
+
+        ArmAccept(m_TCPSocket);
+        if(0 <= m_LocalSocket)
+        {
+            ArmAccept(m_LocalSocket);
+        }
+        ArmNotify();
+        ArmTimer();
+
+        while(StopRequested() == false)
+        {
+            AdoptPendingSessions();
+            HandleSends();
+
+            if(RTN_OK != m_Ring.Submit() || RTN_OK != m_Ring.Wait())
+            {
+                break;
+            }
+
+            while(m_Ring.PopCompletion(cqe))
+            {
+                HandleCompletion(cqe);
+            }
+        }
+
+        LOG_DEBUG("Stopped polling thread");
+    }
+
+    static uint64_t RingUserData(INET_URING_OP op, uint64_t session_id)
+    {
+        return (session_id << INET_URING_OP_BITS) | op;
+    }
+
+    void HandleCompletion(const struct io_uring_cqe& cqe)
+    {
+        const bool more = cqe.flags & IORING_CQE_F_MORE;
+        switch(cqe.user_data & INET_URING_OP_MASK)
+        {
+            case INET_URING_OP_SEND:
+            {
+                SendCompleted(reinterpret_cast<INET_URING_SEND*>(cqe.user_data), cqe.res);
+                break;
+            }
+            case INET_URING_OP_ACCEPT:
+            {
+                if(0 <= cqe.res)
+                {
+                    struct sockaddr_storage peer_address;
+                    socklen_t peer_address_size = sizeof(peer_address);
+                    getpeername(cqe.res, (struct sockaddr *)&peer_address, &peer_address_size);
+                    if (RTN_OK != AcceptSocket(cqe.res, peer_address))
+                    {
+                        LOG_WARN("Failed to accept client socket: ", cqe.res);
+                    }
+                }
+                else if(-ECANCELED != cqe.res && -EINVAL != cqe.res)
+                {
+                    LOG_ERROR("Error in accept(): ", strerror(-cqe.res));
+                }
+
+                if(!more && !StopRequested() && -EINVAL != cqe.res)
+                {
+                    ArmAccept(cqe.user_data >> INET_URING_OP_BITS);
+                }
+                break;
+            }
+            case INET_URING_OP_RECEIVE:
+            {
+                ReceiveCompleted(cqe.user_data >> INET_URING_OP_BITS, cqe.res, cqe.flags);
+                break;
+            }
+            case INET_URING_OP_NOTIFY:
+            {
+                // Producers queued sends -- they go out at the top of the loop
+                m_SendNotifier.Drain();
+                if(!more)
+                {
+                    ArmNotify();
+                }
+                break;
+            }
+            case INET_URING_OP_TIMER:
+            {
+                ExpireHandshakes();
+                if(!more && !StopRequested())
+                {
+                    ArmTimer();
+                }
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+
+    void ReceiveCompleted(uint64_t session_id, int result, uint32_t flags)
+    {
+        PROFILE_FUNCTION();
+        const bool has_buffer = flags & IORING_CQE_F_BUFFER;
+        const unsigned short buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        std::unordered_map<uint64_t, int>::iterator owner = m_RingSessions.find(session_id);
+        if(owner == m_RingSessions.end())
+        {
+            // Connection already gone
+            if(has_buffer)
+            {
+                m_Ring.ReturnBuffer(buffer_id);
+            }
+            return;
+        }
+
+        const int fd = owner->second;
+        INET_SESSION& session = m_Sessions[fd];
+
+        if(has_buffer)
+        {
+            if(0 < result)
+            {
+                AppendToReadBuffer(session, m_Ring.Buffer(buffer_id), result);
+                InetMetrics().bytes_received.Add(result);
+            }
+
+            m_Ring.ReturnBuffer(buffer_id);
+
+            if(0 < result && RTN_OK != ParseFrames(fd, session))
+            {
+                LOG_WARN("Bad frame from connection: ", session.connection.address, ":", session.connection.port);
+                InetMetrics().bad_frames.Add();
+                RemoveConnection(fd, session.connection);
+                return;
+            }
+        }
+
+        // Out of buffers only pauses the receive -- anything else ends it
+        if(0 == result || (0 > result && -ENOBUFS != result))
+        {
+            if(0 > result)
+            {
+                LOG_WARN("Error receving data from connection: ", session.connection.address, ":", " errorno: ", strerror(-result));
+            }
+
+            RemoveConnection(fd, session.connection);
+            return;
+        }
+
+        if(0 == (flags & IORING_CQE_F_MORE))
+        {
+            ArmReceive(fd, session);
+        }
+    }
+
+    // Put received bytes after whatever partial frame is already buffered
+    void AppendToReadBuffer(INET_SESSION& session, const char* data, size_t length)
+    {
+        while(session.read_buffer.size() - session.read_end < length)
+        {
+            CompactReadBuffer(session);
+        }
+
+        memcpy(session.read_buffer.data() + session.read_end, data, length);
+        session.read_end += length;
+    }
+
+    // One writev in flight per peer so frames can't be reordered
+    RETCODE SubmitSend(int fd, INET_SESSION& session)
+    {
+        if(session.send_inflight || session.send_queue.empty())
+        {
+            return RTN_OK;
+        }
+
+        INET_URING_SEND* send = new INET_URING_SEND;
+        send->session_id = session.id;
+        size_t iov_count = BuildSendIOV(session, send->headers, send->iov, send->num_packages);
+        for(size_t package_index = 0; package_index < send->num_packages; package_index++)
+        {
+            send->packages[package_index] = RetainPackage(session.send_queue[package_index]);
+        }
+
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(send->iov);
+        sqe.len = iov_count;
+        sqe.user_data = reinterpret_cast<uint64_t>(send);
+
+        session.send_inflight = true;
+        return m_Ring.Prepare(sqe);
+    }
+
+    void SendCompleted(INET_URING_SEND* send, int result)
+    {
+        PROFILE_FUNCTION();
+        std::unordered_map<uint64_t, int>::iterator owner = m_RingSessions.find(send->session_id);
+        if(owner != m_RingSessions.end())
+        {
+            const int fd = owner->second;
+            INET_SESSION& session = m_Sessions[fd];
+            session.send_inflight = false;
+
+            if(0 > result)
+            {
+                LOG_WARN("Error sending to connection: ", session.connection.address, ":",
+                    session.connection.port, " errorno: ", strerror(-result));
+                RemoveConnection(fd, session.connection);
+            }
+            else
+            {
+                ConsumeWritten(session, result);
+                SubmitSend(fd, session);
+            }
+        }
+
+        for(size_t package_index = 0; package_index < send->num_packages; package_index++)
+        {
+            FreePackage(send->packages[package_index]);
+        }
+
+        delete send;
+    }
+
+    // Completions carry the listening socket so they can be re-armed
+    RETCODE ArmAccept(int listen_socket)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.fd = listen_socket;
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.user_data = RingUserData(INET_URING_OP_ACCEPT, listen_socket);
+        return m_Ring.Prepare(sqe);
+    }
+
+    RETCODE ArmReceive(int fd, const INET_SESSION& session)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = fd;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = INET_URING_BUFFER_GROUP;
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.user_data = RingUserData(INET_URING_OP_RECEIVE, session.id);
+        return m_Ring.Prepare(sqe);
+    }
+
+    RETCODE ArmNotify(void)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = m_SendNotifier.GetFD();
+        sqe.poll32_events = POLLIN;
+        sqe.len = IORING_POLL_ADD_MULTI;
+        sqe.user_data = RingUserData(INET_URING_OP_NOTIFY, 0);
+        return m_Ring.Prepare(sqe);
+    }
+
+    RETCODE ArmTimer(void)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = m_HandshakeTimer.GetFD();
+        sqe.poll32_events = POLLIN;
+        sqe.len = IORING_POLL_ADD_MULTI;
+        sqe.user_data = RingUserData(INET_URING_OP_TIMER, 0);
+        return m_Ring.Prepare(sqe);
+    }
+#endif
+
+    // Take whatever is waiting on the listener, up to a batch
+    RETCODE AcceptNewClient(int listen_socket)
+    {
+        PROFILE_FUNCTION();
+        struct sockaddr_storage incoming_accepted_address;
+        socklen_t incoming_address_size = sizeof(incoming_accepted_address);
+        int accept_socket = -1;
+        int err = 0;
+
+        for(size_t accepted = 0; accepted < INET_MAX_ACCEPT_BATCH; accepted++)
+        {
+            incoming_address_size = sizeof(incoming_accepted_address);
+            accept_socket = accept(listen_socket,
+                                (struct sockaddr *)&incoming_accepted_address,
+                                &incoming_address_size);
+
+            if(0 > accept_socket)
+            {
+                err = errno;
+                if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR)
+                {
+                    return RTN_OK;
+                }
+
+                /* Error */
+                LOG_ERROR("Error in accept(): ", strerror(err));
+                return RTN_FAIL;
+            }
+
+            if(RTN_OK != AcceptSocket(accept_socket, incoming_accepted_address))
+            {
+                LOG_WARN("Failed to accept client socket: ", accept_socket);
+            }
+        }
+
+        return RTN_OK;
+    }
+
+    // Start reading from a freshly accepted socket. Its handshake is parsed
+    // like any other frame when it arrives -- nothing here waits on the peer.
+    RETCODE AcceptSocket(int accept_socket, const struct sockaddr_storage& incoming_accepted_address)
+    {
+        PROFILE_FUNCTION();
+        CONNECTION connection = {0};
+
+        if(AF_UNIX == incoming_accepted_address.ss_family)
+        {
+            connection = LocalConnection(accept_socket);
+        }
+        else
+        {
+            inet_ntop(incoming_accepted_address.ss_family,
+            get_in_addr((struct sockaddr *)&incoming_accepted_address),
+                connection.address, sizeof(connection.address));
+
+            // Peer port keeps connections from the same host distinct
+            connection.port = get_in_port((struct sockaddr *)&incoming_accepted_address);
+        }
+
+        // Non-block set for smooth receives and sends
+        if(IsBlacklisted(connection) ||
+           fcntl(accept_socket, F_SETFL, fcntl(accept_socket, F_GETFL) | O_NONBLOCK) < 0)
+        {
+            close(accept_socket);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        INET_SESSION& session = OpenSession(accept_socket, connection,
+            EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLET, _LEGACY_SERVER_VERSION);
+        session.handshaking = true;
+        if(RTN_OK != ArmSession(accept_socket, session))
+        {
+            LOG_WARN("Bad connection: ", connection.address);
+            RemoveConnection(accept_socket, connection);
+            return RTN_FAIL;
+        }
+
+        INET_HANDSHAKE_DEADLINE deadline = {std::chrono::steady_clock::now() + m_HandshakeTimeout,
+            accept_socket, session.id};
+        m_HandshakeDeadlines.push_back(deadline);
+        if(1 == m_HandshakeDeadlines.size())
+        {
+            m_HandshakeTimer.ArmAt(deadline.deadline);
+        }
+
+        return RTN_OK;
+    }
+
+    RETCODE AddFDToPoll(int fd, uint32_t events)
+    {
+        PROFILE_FUNCTION();
+        int err;
+        struct epoll_event event;
+
+        /* Shut the valgrind up! */
+        memset(&event, 0, sizeof(struct epoll_event));
+
+        event.events = events;
+        event.data.fd = fd;
+        if (0 > epoll_ctl(m_PollFD, EPOLL_CTL_ADD, fd, &event))
+        {
+            err = errno;
+            LOG_ERROR(
+                "Failed to add socket: ",
+                fd,
+                " to polling with error: ",
+                strerror(err));
             return RTN_FAIL;
         }
 
+        return RTN_OK;
     }
 
-    RETCODE AddFDToPoll(int fd, uint32_t events)
+
+    RETCODE ModifyFDInPoll(int fd, uint32_t events)
     {
         PROFILE_FUNCTION();
         int err;
         struct epoll_event event;
-
-        /* Shut the valgrind up! */
         memset(&event, 0, sizeof(struct epoll_event));
 
         event.events = events;
         event.data.fd = fd;
-        if (0 > epoll_ctl(m_PollFD, EPOLL_CTL_ADD, fd, &event))
+        if (0 > epoll_ctl(m_PollFD, EPOLL_CTL_MOD, fd, &event))
         {
             err = errno;
             LOG_ERROR(
-                "Failed to add socket: ",
+                "Failed to modify socket: ",
                 fd,
-                " to polling with error: ",
+                " in polling with error: ",
                 strerror(err));
             return RTN_FAIL;
         }
@@ -758,8 +2351,8 @@ public:
         return RTN_OK;
     }
 
-
-    RETCODE AddConnection(int fd, const CONNECTION& connection, uint32_t events)
+    RETCODE AddConnection(int fd, const CONNECTION& connection, uint32_t events,
+                          unsigned int version = _LEGACY_SERVER_VERSION)
     {
         if(m_ConnectionMap.find(connection) != m_ConnectionMap.end())
         {
@@ -767,31 +2360,119 @@ public:
             return RTN_CONNECTION_FAIL;
         }
 
-#if __INET_BLACKLIST
-        //Blacklist on outside connections -- remove later
-        if(0 != strncmp(connection.address, "192.168.0.", sizeof("192.168.0.") - 1))
+        if(IsBlacklisted(connection))
         {
             close(fd);
             return RTN_CONNECTION_FAIL;
         }
-#endif
 
-        RETCODE retcode = AddFDToPoll(fd, events);
+        INET_SESSION& session = OpenSession(fd, connection, events, version);
+        RETCODE retcode = ArmSession(fd, session);
+        RegisterConnection(fd, connection);
+        return retcode;
+    }
+
+    bool IsBlacklisted(const CONNECTION& connection)
+    {
+#if __INET_BLACKLIST
+        //Blacklist on outside connections -- remove later
+        return !IsLocalConnection(connection) &&
+           0 != strncmp(connection.address, "192.168.0.", sizeof("192.168.0.") - 1);
+#else
+        return false;
+#endif
+    }
 
-        m_ConnectionMap[connection] = fd;
-        m_FDMap[fd] = connection;
+    INET_SESSION& OpenSession(int fd, const CONNECTION& connection, uint32_t events, unsigned int version)
+    {
+        INET_SESSION& session = m_Sessions[fd];
+        session = INET_SESSION(connection, version, events, ++m_NextSessionID);
+        return session;
+    }
 
-        m_OnClientConnect.Invoke(connection);
+    // Start receiving on a session's socket
+    RETCODE ArmSession(int fd, INET_SESSION& session)
+    {
+        RETCODE retcode = RTN_OK;
+#if __INET_IO_URING
+        if(INET_BACKEND_IO_URING == m_Backend)
+        {
+            m_RingSessions[session.id] = fd;
+            retcode = ArmReceive(fd, session);
+        }
+        else
+#endif
+        {
+            retcode = AddFDToPoll(fd, session.events);
+        }
 
         return retcode;
     }
 
+    // Make a connected session reachable by Send() and tell everyone
+    void RegisterConnection(int fd, const CONNECTION& connection)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            m_ConnectionMap[connection] = fd;
+        }
+
+        if(INET_OVERFLOW_BLOCK == m_OverflowPolicy)
+        {
+            std::lock_guard<std::mutex> lock(m_OutboundMutex);
+            m_OutboundBytes[connection] = 0;
+        }
+
+        InetMetrics().connects.Add();
+        InetMetrics().connections.Add(1);
+        m_OnClientConnect.Invoke(connection);
+    }
+
     RETCODE RemoveConnection(int fd, const CONNECTION& connection)
     {
+        // Copy first -- connection may live in the session being erased
+        const CONNECTION disconnected = connection;
         RETCODE retcode = RemoveFDFromPoll(fd);
-        m_FDMap.erase(fd);
-        m_ConnectionMap.erase(connection);
-        m_OnDisconnect.Invoke(connection);
+        bool connected = true;
+
+        std::unordered_map<int, INET_SESSION>::iterator session = m_Sessions.find(fd);
+        if(session != m_Sessions.end())
+        {
+#if __INET_IO_URING
+            // Late completions for this session are recognised and dropped
+            m_RingSessions.erase(session->second.id);
+#endif
+            connected = !session->second.handshaking;
+            DropSendQueue(session->second);
+            m_Sessions.erase(session);
+        }
+
+        // Never made it past the handshake so nobody knows about it
+        if(!connected)
+        {
+            return retcode;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            m_ConnectionMap.erase(disconnected);
+        }
+
+        // Wake any producer blocked on this peer
+        if(INET_OVERFLOW_BLOCK == m_OverflowPolicy)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_OutboundMutex);
+                m_OutboundBytes.erase(disconnected);
+            }
+
+            m_OutboundCondition.notify_all();
+        }
+
+        FailRequests(disconnected);
+        InetMetrics().disconnects.Add();
+        InetMetrics().connections.Add(-1);
+        m_OnDisconnect.Invoke(disconnected);
 
         return retcode;
     }
@@ -801,6 +2482,21 @@ public:
         PROFILE_FUNCTION();
         int err;
 
+#if __INET_IO_URING
+        // Ends the multishot ops on it -- their last completions are ignored
+        if(INET_BACKEND_IO_URING == m_Backend)
+        {
+            shutdown(fd, SHUT_RDWR);
+            if(close(fd))
+            {
+                err = errno;
+                LOG_ERROR("Failed to close socket: ", fd, " with error: ", strerror(err));
+            }
+
+            return RTN_OK;
+        }
+#endif
+
         if (0 > epoll_ctl(m_PollFD, EPOLL_CTL_DEL, fd, NULL))
         {
             err = errno;
@@ -846,18 +2542,52 @@ public:
     RETCODE StopPoll()
     {
         RETCODE retcode = RTN_OK;
-        m_SendQueue.done();
         m_ReceiveQueue.done();
+
+        // Release producers blocked on full peers before joining
+        {
+            std::lock_guard<std::mutex> lock(m_OutboundMutex);
+            m_Ready = false;
+        }
+        m_OutboundCondition.notify_all();
+
         Stop();
+        FailPendingSessions();
 
-        for(std::unordered_map<CONNECTION,int>::iterator iter = m_ConnectionMap.begin(); iter != m_ConnectionMap.end(); ++iter)
+        // RemoveConnection erases from the map so walk a copy
+        std::unordered_map<CONNECTION, int> connections = m_ConnectionMap;
+        for(std::unordered_map<CONNECTION,int>::iterator iter = connections.begin(); iter != connections.end(); ++iter)
         {
             retcode |= RemoveConnection(iter->second, iter->first);
         }
 
+        // Accepted sockets still waiting on their handshake
+        std::vector<int> handshaking;
+        for(std::unordered_map<int, INET_SESSION>::iterator session = m_Sessions.begin(); session != m_Sessions.end(); ++session)
+        {
+            if(session->second.handshaking)
+            {
+                handshaking.push_back(session->first);
+            }
+        }
+        for(size_t pending = 0; pending < handshaking.size(); pending++)
+        {
+            retcode |= RemoveConnection(handshaking[pending], m_Sessions[handshaking[pending]].connection);
+        }
+        m_HandshakeDeadlines.clear();
+
         retcode |= RemoveFDFromPoll(m_TCPSocket);
-        m_ConnectionMap.clear();
-        m_FDMap.clear();
+        if(0 <= m_LocalSocket)
+        {
+            retcode |= RemoveFDFromPoll(m_LocalSocket);
+            m_LocalSocket = -1;
+            unlink(m_LocalPath.c_str());
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            m_ConnectionMap.clear();
+        }
+        m_Sessions.clear();
 
         m_OnStop.Invoke();
 
@@ -865,6 +2595,110 @@ public:
 
     }
 
+    void CloseLocalSocket()
+    {
+        if(0 <= m_LocalSocket)
+        {
+            close(m_LocalSocket);
+            m_LocalSocket = -1;
+            unlink(m_LocalPath.c_str());
+        }
+    }
+
+    // Break out of epoll_wait so a stop request is seen
+    void Wake()
+    {
+        m_SendNotifier.Notify();
+    }
+
+    std::shared_ptr<PackageTracker> GetTracker(const CONNECTION& connection)
+    {
+        std::lock_guard<std::mutex> lock(m_TrackerMutex);
+        std::shared_ptr<PackageTracker>& tracker = m_Trackers[connection];
+        if(!tracker)
+        {
+            tracker = std::make_shared<PackageTracker>(m_RequestOrder);
+            m_NumTrackers.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        return tracker;
+    }
+
+    // Checked after tracking so a disconnect either fails it or is seen here
+    void SendRequest(PackageTracker& tracker, unsigned short request_id, const CONNECTION& connection,
+        unsigned int data_type, const void* payload, size_t size, unsigned short flags)
+    {
+        INET_PACKAGE* package = m_Ready && HasConnection(connection) ? AllocatePackage(size) : nullptr;
+        if(nullptr == package)
+        {
+            tracker.Cancel(request_id);
+            return;
+        }
+
+        package->header.connection = connection;
+        package->header.data_type = data_type;
+        package->header.flags = flags;
+        package->header.request_id = request_id;
+        memcpy(package->payload, payload, size);
+        Enqueue(connection, package);
+    }
+
+    // True when the package was a reply someone was waiting on
+    bool CompleteRequest(PackageHandle& package)
+    {
+        // Servers never make requests so skip the lock
+        if(0 == m_NumTrackers.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        std::shared_ptr<PackageTracker> tracker;
+        {
+            std::lock_guard<std::mutex> lock(m_TrackerMutex);
+            std::unordered_map<CONNECTION, std::shared_ptr<PackageTracker>>::iterator found =
+                m_Trackers.find(package->header.connection);
+            if(m_Trackers.end() == found)
+            {
+                return false;
+            }
+            tracker = found->second;
+        }
+
+        return tracker->Complete(package->header.request_id, package);
+    }
+
+    void FailRequests(const CONNECTION& connection)
+    {
+        std::shared_ptr<PackageTracker> tracker;
+        {
+            std::lock_guard<std::mutex> lock(m_TrackerMutex);
+            std::unordered_map<CONNECTION, std::shared_ptr<PackageTracker>>::iterator found =
+                m_Trackers.find(connection);
+            if(m_Trackers.end() == found)
+            {
+                return;
+            }
+            tracker = found->second;
+            m_Trackers.erase(found);
+            m_NumTrackers.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        tracker->FailAll();
+    }
+
+    // Safe to call from any thread
+    bool HasConnection(const CONNECTION& connection)
+    {
+        std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+        return m_ConnectionMap.find(connection) != m_ConnectionMap.end();
+    }
+
+    size_t NumConnections()
+    {
+        std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+        return m_ConnectionMap.size();
+    }
+
     std::string GetTCPAddress()
     {
         return m_Address;
@@ -880,15 +2714,49 @@ public:
         return m_TCPSocket;
     }
 
+    // Empty when not listening locally
+    std::string GetLocalPath()
+    {
+        return 0 <= m_LocalSocket ? m_LocalPath : std::string();
+    }
+
     bool m_Ready;
     int m_PollFD;
     int m_TCPSocket;
+    int m_LocalSocket; // AF_UNIX listener, -1 when not listening locally
     std::string m_Port;
+    bool m_ReusePort;
     std::string m_Address;
-    TasQ<INET_PACKAGE*> m_SendQueue;
+    std::string m_LocalPath;
+    MpscQ<INET_OUTBOUND> m_SendQueue; // Any thread pushes, the poll thread pops
+    EventNotifier m_SendNotifier; // Wakes the poll loop when sends are queued
     TasQ<INET_PACKAGE*> m_ReceiveQueue;
-    std::unordered_map<CONNECTION, int> m_ConnectionMap;
-    std::unordered_map<int, CONNECTION> m_FDMap;
+    std::unordered_map<CONNECTION, int> m_ConnectionMap; // Poll thread writes under m_ConnectionMutex
+    std::mutex m_ConnectionMutex;
+    std::unordered_map<int, INET_SESSION> m_Sessions; // Keyed by socket
+    size_t m_SendBufferSize; // Max bytes queued per peer
+    INET_OVERFLOW_POLICY m_OverflowPolicy;
+    uint64_t m_DroppedPackages;
+    std::atomic<std::thread::id> m_PollThreadID; // Set by the poll thread, read by any
+    INET_BACKEND m_Backend;
+    uint64_t m_NextSessionID;
+    std::chrono::milliseconds m_HandshakeTimeout;
+    TimerNotifier m_HandshakeTimer; // Fires at the front deadline
+    std::deque<INET_HANDSHAKE_DEADLINE> m_HandshakeDeadlines; // Oldest first
+    std::mutex m_PendingMutex; // Guards m_PendingSessions and m_Adopting
+    std::deque<INET_PENDING_SESSION*> m_PendingSessions; // Connected off the poll thread
+    bool m_Adopting; // False once the poll thread stops taking sessions
+#if __INET_IO_URING
+    IOUring m_Ring;
+    std::unordered_map<uint64_t, int> m_RingSessions; // Session id to socket
+#endif
+    std::mutex m_TrackerMutex; // Guards m_Trackers
+    std::unordered_map<CONNECTION, std::shared_ptr<PackageTracker>> m_Trackers; // Peers we made Request()s to
+    std::atomic<size_t> m_NumTrackers;
+    REQUEST_ORDER m_RequestOrder;
+    std::mutex m_OutboundMutex; // Guards m_OutboundBytes for BLOCK
+    std::condition_variable m_OutboundCondition;
+    std::unordered_map<CONNECTION, size_t> m_OutboundBytes; // Queued per peer, BLOCK only
     Hook<ConnectDelegate> m_OnClientConnect;
     Hook<ConnectDelegate> m_OnServerConnect;
     Hook<DisconnectDelegate> m_OnDisconnect;
@@ -896,5 +2764,210 @@ public:
     Hook<StopDelegate> m_OnStop;
 };
 
+// Adds and removes delegates on the same hook of every reactor in a group
+template <class DelegateType>
+class HookGroup
+{
+
+public:
+
+    void Attach(Hook<DelegateType>& hook)
+    {
+        m_Hooks.push_back(&hook);
+    }
+
+    void operator +=(DelegateType&& delegate)
+    {
+        for(size_t hook_index = 0; hook_index < m_Hooks.size(); hook_index++)
+        {
+            DelegateType copy = delegate;
+            *m_Hooks[hook_index] += std::move(copy);
+        }
+    }
+
+    void operator -=(DelegateType& delegate)
+    {
+        for(size_t hook_index = 0; hook_index < m_Hooks.size(); hook_index++)
+        {
+            *m_Hooks[hook_index] -= delegate;
+        }
+    }
+
+private:
+    std::vector<Hook<DelegateType>*> m_Hooks;
+};
+
+/* N PollThreads serving one port. Each reactor has its own epoll set and
+ * its own SO_REUSEPORT listener, so the kernel spreads new connections
+ * across them and a connection stays on the reactor that accepted it.
+ * Hooks fire on whichever reactor owns the connection, so delegates must
+ * be safe to call from several threads at once.
+ */
+class PollGroup
+{
+
+public:
+
+    // Zero reactors reads the count from KDB_INET_REACTORS. The first reactor
+    // also serves local clients on KDB_INET_UNIX_PATH when it is set.
+    PollGroup(const std::string& portNumber, size_t num_reactors = 0)
+        : m_Reactors()
+    {
+        PROFILE_FUNCTION();
+        if(0 == num_reactors)
+        {
+            num_reactors = LoadReactorCount();
+        }
+
+        // An ephemeral port would give every reactor a different one
+        if(1 < num_reactors && portNumber.empty())
+        {
+            LOG_WARN("Multiple reactors need a fixed port -- using one reactor");
+            num_reactors = 1;
+        }
+
+        // A path can only be bound once so one reactor owns it
+        const std::string local_path = ConfigValues::Instance().Get(KDB_INET_UNIX_PATH);
+
+        for(size_t reactor_index = 0; reactor_index < num_reactors; reactor_index++)
+        {
+            PollThread* reactor = new PollThread(portNumber, 1 < num_reactors,
+                0 == reactor_index ? local_path : std::string());
+            m_Reactors.emplace_back(reactor);
+
+            m_OnClientConnect.Attach(reactor->m_OnClientConnect);
+            m_OnServerConnect.Attach(reactor->m_OnServerConnect);
+            m_OnDisconnect.Attach(reactor->m_OnDisconnect);
+            m_OnReceive.Attach(reactor->m_OnReceive);
+            m_OnStop.Attach(reactor->m_OnStop);
+        }
+
+        LOG_INFO("Polling with ", m_Reactors.size(), " reactor(s)");
+    }
+
+    // Every reactor shares the same package -- caller still frees its own
+    RETCODE SendAll(INET_PACKAGE* package)
+    {
+        PROFILE_FUNCTION();
+        RETCODE retcode = RTN_OK;
+        for(size_t reactor_index = 0; reactor_index < m_Reactors.size(); reactor_index++)
+        {
+            retcode |= m_Reactors[reactor_index]->SendAll(package);
+        }
+
+        return retcode;
+    }
+
+    // Takes ownership of a package from AllocatePackage()
+    RETCODE Send(INET_PACKAGE* package)
+    {
+        return Send(package->header.connection, package);
+    }
+
+    // Takes one reference to a package that may be shared
+    RETCODE Send(const CONNECTION& connection, INET_PACKAGE* package)
+    {
+        PROFILE_FUNCTION();
+        PollThread* reactor = FindReactor(connection);
+        if(nullptr == reactor)
+        {
+            FreePackage(package);
+            return RTN_NOT_FOUND;
+        }
+
+        return reactor->Send(connection, package);
+    }
+
+    // Send packed data -- structs without other references
+    template<class DATA>
+    RETCODE Send(const DATA& data, const CONNECTION& connection)
+    {
+        PROFILE_FUNCTION();
+        PollThread* reactor = FindReactor(connection);
+        if(nullptr == reactor)
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        return reactor->Send(data, connection);
+    }
+
+    RETCODE StopPoll()
+    {
+        RETCODE retcode = RTN_OK;
+        for(size_t reactor_index = 0; reactor_index < m_Reactors.size(); reactor_index++)
+        {
+            retcode |= m_Reactors[reactor_index]->StopPoll();
+        }
+
+        return retcode;
+    }
+
+    size_t NumReactors()
+    {
+        return m_Reactors.size();
+    }
+
+    std::string GetTCPAddress()
+    {
+        return m_Reactors.empty() ? std::string() : m_Reactors[0]->GetTCPAddress();
+    }
+
+    std::string GetTCPPort()
+    {
+        return m_Reactors.empty() ? std::string() : m_Reactors[0]->GetTCPPort();
+    }
+
+    std::string GetLocalPath()
+    {
+        return m_Reactors.empty() ? std::string() : m_Reactors[0]->GetLocalPath();
+    }
+
+    HookGroup<ConnectDelegate> m_OnClientConnect;
+    HookGroup<ConnectDelegate> m_OnServerConnect;
+    HookGroup<DisconnectDelegate> m_OnDisconnect;
+    HookGroup<MessageDelegate> m_OnReceive;
+    HookGroup<StopDelegate> m_OnStop;
+
+private:
+
+    PollThread* FindReactor(const CONNECTION& connection)
+    {
+        for(size_t reactor_index = 0; reactor_index < m_Reactors.size(); reactor_index++)
+        {
+            if(m_Reactors[reactor_index]->HasConnection(connection))
+            {
+                return m_Reactors[reactor_index].get();
+            }
+        }
+
+        return nullptr;
+    }
+
+    static size_t LoadReactorCount(void)
+    {
+        size_t num_reactors = 1;
+        std::string reactors = ConfigValues::Instance().Get(KDB_INET_REACTORS);
+        if(!reactors.empty())
+        {
+            try
+            {
+                num_reactors = std::stoul(reactors);
+            }
+            catch(std::exception const& except)
+            {
+                LOG_WARN("Could not convert ", KDB_INET_REACTORS, " value ", reactors, " -- using one reactor");
+            }
+        }
+
+        return 0 == num_reactors ? 1 : num_reactors;
+    }
+
+    PollGroup(const PollGroup&);
+    PollGroup& operator=(const PollGroup&);
+
+    std::vector<std::unique_ptr<PollThread>> m_Reactors;
+};
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,313 @@
+#ifndef __IO_URING_HH
+#define __IO_URING_HH
+
+/* Minimal io_uring ring for the network backend.
+ *
+ * Talks to the kernel through the raw syscalls so there is no liburing
+ * dependency. Only what PollThread needs is here: a submission and
+ * completion queue, one provided buffer ring for multishot receives, and
+ * a check that the running kernel has the multishot ops at all.
+ *
+ * Any thread may Prepare() and Submit(); only one thread may Wait() and
+ * consume completions.
+ */
+
+#if __INET_IO_URING
+
+#include <retcode.hh>
+#include <Logger.hh>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+class IOUring
+{
+
+public:
+
+    IOUring()
+        : m_RingFD(-1), m_RingMemory(MAP_FAILED), m_RingMemorySize(0),
+          m_SQEs(static_cast<struct io_uring_sqe*>(MAP_FAILED)), m_SQEsSize(0),
+          m_SQHead(nullptr), m_SQTail(nullptr), m_SQMask(0), m_SQEntries(0),
+          m_SQLocalTail(0), m_SQSubmitted(0), m_CQHead(nullptr), m_CQTail(nullptr),
+          m_CQMask(0), m_CQEs(nullptr), m_BufferRing(nullptr), m_BufferRingSize(0),
+          m_BufferMask(0), m_BufferTail(0), m_BufferSize(0), m_Buffers()
+    {
+    }
+
+    ~IOUring()
+    {
+        // Closing the ring cancels everything in flight before buffers go away
+        if(0 <= m_RingFD)
+        {
+            close(m_RingFD);
+        }
+
+        if(MAP_FAILED != m_RingMemory)
+        {
+            munmap(m_RingMemory, m_RingMemorySize);
+        }
+
+        if(MAP_FAILED != static_cast<void*>(m_SQEs))
+        {
+            munmap(m_SQEs, m_SQEsSize);
+        }
+
+        if(nullptr != m_BufferRing)
+        {
+            munmap(m_BufferRing, m_BufferRingSize);
+        }
+    }
+
+    // Multishot receive with provided buffers needs 6.0
+    static bool KernelSupported(void)
+    {
+        struct utsname name;
+        int major = 0;
+        int minor = 0;
+        if(0 != uname(&name) || 2 != sscanf(name.release, "%d.%d", &major, &minor))
+        {
+            return false;
+        }
+
+        return 6 <= major;
+    }
+
+    RETCODE Init(unsigned int entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        m_RingFD = syscall(__NR_io_uring_setup, entries, &params);
+        if(0 > m_RingFD)
+        {
+            LOG_WARN("io_uring_setup failed: ", strerror(errno));
+            return RTN_FAIL;
+        }
+
+        if(0 == (params.features & IORING_FEAT_SINGLE_MMAP))
+        {
+            LOG_WARN("io_uring is too old -- no single mmap");
+            return RTN_FAIL;
+        }
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        m_RingMemorySize = sq_size > cq_size ? sq_size : cq_size;
+        m_RingMemory = mmap(nullptr, m_RingMemorySize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_RingFD, IORING_OFF_SQ_RING);
+        if(MAP_FAILED == m_RingMemory)
+        {
+            LOG_WARN("Could not map io_uring rings: ", strerror(errno));
+            return RTN_MALLOC_FAIL;
+        }
+
+        m_SQEsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_SQEs = static_cast<struct io_uring_sqe*>(mmap(nullptr, m_SQEsSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_RingFD, IORING_OFF_SQES));
+        if(MAP_FAILED == static_cast<void*>(m_SQEs))
+        {
+            LOG_WARN("Could not map io_uring submissions: ", strerror(errno));
+            return RTN_MALLOC_FAIL;
+        }
+
+        char* ring = static_cast<char*>(m_RingMemory);
+        m_SQHead = reinterpret_cast<unsigned int*>(ring + params.sq_off.head);
+        m_SQTail = reinterpret_cast<unsigned int*>(ring + params.sq_off.tail);
+        m_SQMask = *reinterpret_cast<unsigned int*>(ring + params.sq_off.ring_mask);
+        m_SQEntries = params.sq_entries;
+        m_CQHead = reinterpret_cast<unsigned int*>(ring + params.cq_off.head);
+        m_CQTail = reinterpret_cast<unsigned int*>(ring + params.cq_off.tail);
+        m_CQMask = *reinterpret_cast<unsigned int*>(ring + params.cq_off.ring_mask);
+        m_CQEs = reinterpret_cast<struct io_uring_cqe*>(ring + params.cq_off.cqes);
+
+        // Slots map one to one onto SQEs so the array never changes again
+        unsigned int* sq_array = reinterpret_cast<unsigned int*>(ring + params.sq_off.array);
+        for(unsigned int index = 0; index < m_SQEntries; index++)
+        {
+            sq_array[index] = index;
+        }
+
+        m_SQLocalTail = *m_SQTail;
+        m_SQSubmitted = m_SQLocalTail;
+        return RTN_OK;
+    }
+
+    // Provided buffers that multishot receives pick from. num_buffers must be
+    // a power of two.
+    RETCODE RegisterBuffers(unsigned short group, unsigned int num_buffers, size_t buffer_size)
+    {
+        m_BufferRingSize = num_buffers * sizeof(struct io_uring_buf);
+        m_BufferRing = static_cast<struct io_uring_buf*>(mmap(nullptr, m_BufferRingSize,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if(MAP_FAILED == static_cast<void*>(m_BufferRing))
+        {
+            m_BufferRing = nullptr;
+            return RTN_MALLOC_FAIL;
+        }
+
+        struct io_uring_buf_reg registration;
+        memset(&registration, 0, sizeof(registration));
+        registration.ring_addr = reinterpret_cast<unsigned long>(m_BufferRing);
+        registration.ring_entries = num_buffers;
+        registration.bgid = group;
+        if(0 > syscall(__NR_io_uring_register, m_RingFD, IORING_REGISTER_PBUF_RING, &registration, 1))
+        {
+            LOG_WARN("Could not register io_uring buffers: ", strerror(errno));
+            return RTN_FAIL;
+        }
+
+        m_BufferMask = num_buffers - 1;
+        m_BufferSize = buffer_size;
+        m_Buffers.resize(num_buffers * buffer_size);
+        for(unsigned int buffer_id = 0; buffer_id < num_buffers; buffer_id++)
+        {
+            ReturnBuffer(buffer_id);
+        }
+
+        return RTN_OK;
+    }
+
+    const char* Buffer(unsigned short buffer_id) const
+    {
+        return m_Buffers.data() + buffer_id * m_BufferSize;
+    }
+
+    // Give a buffer back to the kernel once its data has been consumed
+    void ReturnBuffer(unsigned short buffer_id)
+    {
+        struct io_uring_buf* buffer = &m_BufferRing[m_BufferTail & m_BufferMask];
+        buffer->addr = reinterpret_cast<unsigned long>(m_Buffers.data() + buffer_id * m_BufferSize);
+        buffer->len = m_BufferSize;
+        buffer->bid = buffer_id;
+        m_BufferTail++;
+
+        // Ring tail lives in the first entry's resv field
+        __atomic_store_n(&m_BufferRing[0].resv, m_BufferTail, __ATOMIC_RELEASE);
+    }
+
+    // Copy a filled in submission onto the ring. It goes to the kernel with
+    // the next Submit().
+    RETCODE Prepare(const struct io_uring_sqe& sqe)
+    {
+        std::lock_guard<std::mutex> lock(m_SubmitMutex);
+        if(m_SQLocalTail - __atomic_load_n(m_SQHead, __ATOMIC_ACQUIRE) == m_SQEntries)
+        {
+            // Full -- push what is there to make room
+            RETCODE retcode = SubmitLocked();
+            if(RTN_OK != retcode)
+            {
+                return retcode;
+            }
+        }
+
+        m_SQEs[m_SQLocalTail & m_SQMask] = sqe;
+        m_SQLocalTail++;
+        __atomic_store_n(m_SQTail, m_SQLocalTail, __ATOMIC_RELEASE);
+        return RTN_OK;
+    }
+
+    // Hand every prepared submission to the kernel in one syscall
+    RETCODE Submit(void)
+    {
+        std::lock_guard<std::mutex> lock(m_SubmitMutex);
+        return SubmitLocked();
+    }
+
+    // Block until at least one completion is ready
+    RETCODE Wait(void)
+    {
+        while(0 > syscall(__NR_io_uring_enter, m_RingFD, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0))
+        {
+            if(EINTR != errno)
+            {
+                LOG_ERROR("io_uring wait failed: ", strerror(errno));
+                return RTN_FAIL;
+            }
+        }
+
+        return RTN_OK;
+    }
+
+    // Copy out the next completion. Returns false when there are none.
+    bool PopCompletion(struct io_uring_cqe& out_cqe)
+    {
+        unsigned int head = *m_CQHead;
+        if(head == __atomic_load_n(m_CQTail, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+
+        out_cqe = m_CQEs[head & m_CQMask];
+        __atomic_store_n(m_CQHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+
+    RETCODE SubmitLocked(void)
+    {
+        unsigned int to_submit = m_SQLocalTail - m_SQSubmitted;
+        while(0 < to_submit)
+        {
+            int submitted = syscall(__NR_io_uring_enter, m_RingFD, to_submit, 0, 0, nullptr, 0);
+            if(0 > submitted)
+            {
+                if(EINTR == errno || EAGAIN == errno || EBUSY == errno)
+                {
+                    continue;
+                }
+
+                LOG_ERROR("io_uring submit failed: ", strerror(errno));
+                return RTN_FAIL;
+            }
+
+            m_SQSubmitted += submitted;
+            to_submit -= submitted;
+        }
+
+        return RTN_OK;
+    }
+
+    IOUring(const IOUring&);
+    IOUring& operator=(const IOUring&);
+
+    int m_RingFD;
+    void* m_RingMemory;
+    size_t m_RingMemorySize;
+    struct io_uring_sqe* m_SQEs;
+    size_t m_SQEsSize;
+
+    std::mutex m_SubmitMutex; // Guards the submission side
+    unsigned int* m_SQHead;
+    unsigned int* m_SQTail;
+    unsigned int m_SQMask;
+    unsigned int m_SQEntries;
+    unsigned int m_SQLocalTail;
+    unsigned int m_SQSubmitted;
+
+    unsigned int* m_CQHead;
+    unsigned int* m_CQTail;
+    unsigned int m_CQMask;
+    struct io_uring_cqe* m_CQEs;
+
+    // Indexed as plain entries -- io_uring_buf_ring's flexible array member
+    // lands at the wrong offset when compiled as C++
+    struct io_uring_buf* m_BufferRing;
+    size_t m_BufferRingSize;
+    unsigned short m_BufferMask;
+    unsigned short m_BufferTail;
+    size_t m_BufferSize;
+    std::vector<char> m_Buffers;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,688 @@
+#ifndef __KDB_CLIENT_HH
+#define __KDB_CLIENT_HH
+
+/* Client library for the UpdateDaemon.
+ *
+ * KDBClient keeps a few connections to one daemon, each on its own
+ * PollThread, and sends every request for a record down the same one, so
+ * requests for a record are answered in the order they were made. Calls
+ * return straight away with a future, or take a callback that is run with
+ * the reply on that connection's poll thread.
+ *
+ * Nothing waits on a reply before sending the next request, so a caller
+ * can keep thousands in flight. The poll thread writes everything queued
+ * for a connection with one writev -- a burst of small requests goes out
+ * in a handful of syscalls without the client holding any back to batch.
+ *
+ * On the daemon's host, an address of "unix:" and the daemon's
+ * KDB_INET_UNIX_PATH connects through its AF_UNIX socket and the port is
+ * not used.
+ *
+ * An empty reply means the request failed: the daemon could not serve it
+ * or the connection went away. A connection that drops is redialled in the
+ * background, backing off up to KDB_CLIENT_RECONNECT_MAX, and its
+ * subscriptions are sent again once it is back. Requests made while it is
+ * down fail straight away and updates sent while it is down are lost.
+ *
+ *     KDBClient client("10.0.0.5", "5000");
+ *     std::future<std::optional<DCC_CHAR>> hero = client.Read<DCC_CHAR>(O_DCC_CHAR_INFO, 7);
+ *     client.Write({3, 20, 7, 0}, "9001"); // OFRI_ID -- DCC_CHAR is object 3
+ */
+
+#include <INETMessenger.hh>
+#include <RecordDelta.hh>
+#include <ObjectSchema.hh>
+#include <MessageTypes.hh>
+#include <DaemonThread.hh>
+#include <ConfigValues.hh>
+#include <Constants.hh>
+#include <Logger.hh>
+#include <OFRI.hh>
+
+#include <future>
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef unsigned long long SubscriptionID; // 0 is never handed out
+
+constexpr size_t KDB_CLIENT_DEFAULT_CONNECTIONS = 2;
+constexpr std::chrono::milliseconds KDB_CLIENT_RECONNECT_MIN(100);
+constexpr std::chrono::milliseconds KDB_CLIENT_RECONNECT_MAX(5000);
+
+class KDBClient
+{
+
+public:
+
+    typedef PackageTracker::Callback ReplyCallback;
+    // payload and size are the whole UPDATE, ready for ApplyDelta()
+    typedef std::function<void(const UPDATE_HEADER&, const char* payload, size_t size)> UpdateCallback;
+    typedef std::function<void(SubscriptionID)> SubscribeCallback;
+
+    // Zero connections reads the count from KDB_CLIENT_CONNECTIONS. Any that
+    // cannot be made now are retried in the background.
+    KDBClient(const std::string& address, const std::string& port, size_t num_connections = 0)
+        : m_Address(address), m_Port(port), m_Slots(), m_Stopping(false),
+          m_SubscriptionMutex(), m_Subscriptions(), m_Keys(), m_NextSubscription(1),
+          m_RedialMutex(), m_RedialCondition(), m_Redialer(*this)
+    {
+        if(0 == num_connections)
+        {
+            num_connections = LoadConnectionCount();
+        }
+
+        for(size_t slot = 0; slot < num_connections; slot++)
+        {
+            m_Slots.emplace_back(new CLIENT_SLOT());
+            m_Slots.back()->poll.m_OnDisconnect += [this, slot](const CONNECTION&)
+            {
+                ConnectionLost(slot);
+            };
+            m_Slots.back()->poll.m_OnReceive += [this, slot](const INET_PACKAGE* package)
+            {
+                ReceiveUpdate(slot, package);
+            };
+
+            if(RTN_OK != Dial(slot))
+            {
+                LOG_WARN("Could not connect to ", m_Address, ":", m_Port, " -- retrying in the background");
+                ConnectionLost(slot);
+            }
+        }
+
+        m_Redialer.Start();
+    }
+
+    ~KDBClient()
+    {
+        m_Stopping.store(true, std::memory_order_release);
+        m_Redialer.Stop();
+        for(size_t slot = 0; slot < m_Slots.size(); slot++)
+        {
+            m_Slots[slot]->poll.StopPoll();
+        }
+    }
+
+    // Whole record of ofri.o, ofri.r
+    std::future<PackageHandle> Read(const OFRI_ID& ofri)
+    {
+        return Request(SlotOf(ofri.o, ofri.r), MESSAGE_TYPE::DB, &ofri, sizeof(OFRI_ID));
+    }
+
+    void Read(const OFRI_ID& ofri, ReplyCallback on_reply)
+    {
+        Request(SlotOf(ofri.o, ofri.r), MESSAGE_TYPE::DB, &ofri, sizeof(OFRI_ID), on_reply);
+    }
+
+    // A record as its generated struct, from the schema entry generated
+    // beside it -- Read<DCC_CHAR>(O_DCC_CHAR_INFO, r). Empty on failure.
+    template<class Record>
+    std::future<std::optional<Record>> Read(const OBJECT_SCHEMA& object, RECORD r)
+    {
+        std::shared_ptr<std::promise<std::optional<Record>>> typed =
+            std::make_shared<std::promise<std::optional<Record>>>();
+        std::future<std::optional<Record>> record = typed->get_future();
+        Read<Record>(object, r, [typed](const Record* p_record)
+        {
+            typed->set_value(nullptr == p_record ? std::optional<Record>() : std::optional<Record>(*p_record));
+        });
+        return record;
+    }
+
+    // on_record gets nullptr on failure
+    template<class Record>
+    void Read(const OBJECT_SCHEMA& object, RECORD r, std::function<void(const Record*)> on_record)
+    {
+        static_assert(std::is_trivially_copyable<Record>::value, "Records are read as raw bytes");
+
+        OFRI_ID ofri = {static_cast<OBJECT_ID>(object.objectNumber), 0, r, 0};
+        Read(ofri, [on_record](PackageHandle reply)
+        {
+            if(!reply || sizeof(Record) != reply->header.message_size)
+            {
+                on_record(nullptr);
+                return;
+            }
+
+            Record record;
+            memcpy(&record, reply->payload, sizeof(Record));
+            on_record(&record);
+        });
+    }
+
+    // Set field ofri.f, index ofri.i of a record from its text form. The
+    // reply is the whole record after the write.
+    std::future<PackageHandle> Write(const OFRI_ID& ofri, const std::string& value)
+    {
+        std::string payload = WritePayload(ofri, value);
+        return Request(SlotOf(ofri.o, ofri.r), MESSAGE_TYPE::DB, payload.data(), payload.size());
+    }
+
+    void Write(const OFRI_ID& ofri, const std::string& value, ReplyCallback on_reply)
+    {
+        std::string payload = WritePayload(ofri, value);
+        Request(SlotOf(ofri.o, ofri.r), MESSAGE_TYPE::DB, payload.data(), payload.size(), on_reply);
+    }
+
+    // The daemon's metrics as exposition text in the reply payload
+    std::future<PackageHandle> Stats(void)
+    {
+        return Request(0, MESSAGE_TYPE::STATS, "", 0);
+    }
+
+    // Hear about changes to an object, a record or one field. ofri.r and
+    // ofri.f may be SUBSCRIBE_ALL. on_update runs on a poll thread. The
+    // future holds 0 if the daemon refused.
+    std::future<SubscriptionID> Subscribe(const OFRI_ID& ofri, UpdateCallback on_update)
+    {
+        std::shared_ptr<std::promise<SubscriptionID>> done = std::make_shared<std::promise<SubscriptionID>>();
+        std::future<SubscriptionID> subscription = done->get_future();
+        Subscribe(ofri, on_update, [done](SubscriptionID id)
+        {
+            done->set_value(id);
+        });
+        return subscription;
+    }
+
+    void Subscribe(const OFRI_ID& ofri, UpdateCallback on_update, SubscribeCallback on_done)
+    {
+        const SUBSCRIPTION key = {ofri.o, ofri.r, ofri.f};
+        SubscriptionID id = 0;
+        bool live = false;
+        bool send = false;
+        {
+            std::lock_guard<std::mutex> lock(m_SubscriptionMutex);
+            id = m_NextSubscription++;
+
+            // The daemon holds one subscription per key for us however
+            // many callers share it
+            KEY_STATE& state = m_Keys[key];
+            live = KEY_LIVE == state;
+            send = KEY_NONE == state;
+            if(send)
+            {
+                state = KEY_PENDING;
+            }
+
+            m_Subscriptions.push_back({id, key, on_update, on_done, live});
+        }
+
+        if(live)
+        {
+            on_done(id);
+        }
+
+        if(send)
+        {
+            Request(SlotOf(key.o, key.r), MESSAGE_TYPE::SUBSCRIBE, &ofri, sizeof(OFRI_ID),
+                [this, key](PackageHandle reply)
+                {
+                    Subscribed(key, reply && 0 < reply->header.message_size);
+                });
+        }
+    }
+
+    // No more updates for id once this returns
+    void Unsubscribe(SubscriptionID id)
+    {
+        SUBSCRIPTION key = {0};
+        {
+            std::lock_guard<std::mutex> lock(m_SubscriptionMutex);
+            std::vector<CLIENT_SUBSCRIPTION>::iterator subscription = std::find_if(
+                m_Subscriptions.begin(), m_Subscriptions.end(),
+                [id](const CLIENT_SUBSCRIPTION& entry)
+                {
+                    return id == entry.id;
+                });
+            if(m_Subscriptions.end() == subscription)
+            {
+                return;
+            }
+
+            key = subscription->key;
+            m_Subscriptions.erase(subscription);
+
+            // Still pending -- Subscribed() drops it if nobody is left
+            std::unordered_map<SUBSCRIPTION, KEY_STATE>::iterator state = m_Keys.find(key);
+            if(KEY_LIVE != state->second || HasSubscribers(key))
+            {
+                return;
+            }
+            m_Keys.erase(state);
+        }
+
+        SendUnsubscribe(key);
+    }
+
+    size_t NumConnections(void) const
+    {
+        return m_Slots.size();
+    }
+
+    // Connections that are up right now
+    size_t NumConnected(void) const
+    {
+        size_t connected = 0;
+        for(size_t slot = 0; slot < m_Slots.size(); slot++)
+        {
+            connected += m_Slots[slot]->up.load(std::memory_order_acquire);
+        }
+
+        return connected;
+    }
+
+private:
+
+    struct CLIENT_SLOT
+    {
+        CLIENT_SLOT()
+            : poll(), server_mutex(), server(), up(false), drops(0),
+              backoff(KDB_CLIENT_RECONNECT_MIN), redial_at(), changed_fields(), matched()
+        {
+        }
+
+        PollThread poll;
+        std::mutex server_mutex;
+        CONNECTION server; // Renamed by every dial -- a local one by its new socket
+        std::atomic<bool> up;
+        std::atomic<unsigned int> drops; // Bumped by every disconnect
+        std::chrono::milliseconds backoff; // Guarded by m_RedialMutex
+        std::chrono::steady_clock::time_point redial_at; // Guarded by m_RedialMutex
+        std::vector<uint64_t> changed_fields; // Poll thread only
+        std::vector<UpdateCallback> matched; // Poll thread only
+    };
+
+    enum KEY_STATE
+    {
+        KEY_NONE = 0,
+        KEY_PENDING, // SUBSCRIBE sent, no reply yet
+        KEY_LIVE
+    };
+
+    struct CLIENT_SUBSCRIPTION
+    {
+        SubscriptionID id;
+        SUBSCRIPTION key;
+        UpdateCallback on_update;
+        SubscribeCallback on_done;
+        bool live;
+    };
+
+    class RedialThread : public DaemonThread<>
+    {
+
+    public:
+
+        explicit RedialThread(KDBClient& client)
+            : m_Client(client)
+        {
+        }
+
+        void execute(void)
+        {
+            m_Client.Redial();
+        }
+
+        void Wake()
+        {
+            std::lock_guard<std::mutex> lock(m_Client.m_RedialMutex);
+            m_Client.m_RedialCondition.notify_all();
+        }
+
+    private:
+
+        KDBClient& m_Client;
+    };
+
+    KDBClient(const KDBClient&);
+    KDBClient& operator=(const KDBClient&);
+
+    // Every request for a record takes the same connection
+    size_t SlotOf(OBJECT_ID o, RECORD r) const
+    {
+        size_t hash = o;
+        hash = hash * 0x9E3779B97F4A7C15ULL ^ r;
+        return (hash ^ (hash >> 32)) % m_Slots.size();
+    }
+
+    std::future<PackageHandle> Request(size_t slot, unsigned int data_type, const void* payload, size_t size)
+    {
+        CLIENT_SLOT& client_slot = *m_Slots[slot];
+        if(!client_slot.up.load(std::memory_order_acquire))
+        {
+            std::promise<PackageHandle> failed;
+            failed.set_value(PackageHandle());
+            return failed.get_future();
+        }
+
+        return client_slot.poll.Request(Server(client_slot), data_type, payload, size, INET_FLAG_OBJECT_ID);
+    }
+
+    void Request(size_t slot, unsigned int data_type, const void* payload, size_t size, ReplyCallback on_reply)
+    {
+        CLIENT_SLOT& client_slot = *m_Slots[slot];
+        if(!client_slot.up.load(std::memory_order_acquire))
+        {
+            on_reply(PackageHandle());
+            return;
+        }
+
+        client_slot.poll.Request(Server(client_slot), data_type, payload, size, INET_FLAG_OBJECT_ID, on_reply);
+    }
+
+    static CONNECTION Server(CLIENT_SLOT& client_slot)
+    {
+        std::lock_guard<std::mutex> lock(client_slot.server_mutex);
+        return client_slot.server;
+    }
+
+    static std::string WritePayload(const OFRI_ID& ofri, const std::string& value)
+    {
+        std::string payload(reinterpret_cast<const char*>(&ofri), sizeof(OFRI_ID));
+        payload += value;
+        return payload;
+    }
+
+    bool IsLocalAddress() const
+    {
+        return 0 == m_Address.compare(0, sizeof(INET_LOCAL_PREFIX) - 1, INET_LOCAL_PREFIX);
+    }
+
+    RETCODE Dial(size_t slot)
+    {
+        CLIENT_SLOT& client_slot = *m_Slots[slot];
+        const unsigned int drops = client_slot.drops.load(std::memory_order_acquire);
+
+        CONNECTION server;
+        RETCODE retcode = IsLocalAddress() ?
+            client_slot.poll.ConnectLocal(m_Address.substr(sizeof(INET_LOCAL_PREFIX) - 1), server) :
+            client_slot.poll.Connect(m_Address, m_Port, server);
+        if(RTN_OK != retcode)
+        {
+            return retcode;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(client_slot.server_mutex);
+            client_slot.server = server;
+        }
+        client_slot.up.store(true, std::memory_order_release);
+
+        // Dropped again before it was marked up -- ConnectionLost() saw it
+        // down and will have it redialled
+        if(drops != client_slot.drops.load(std::memory_order_acquire))
+        {
+            client_slot.up.store(false, std::memory_order_release);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_RedialMutex);
+            client_slot.backoff = KDB_CLIENT_RECONNECT_MIN;
+        }
+        return RTN_OK;
+    }
+
+    // Poll thread, or the constructor when the first dial fails
+    void ConnectionLost(size_t slot)
+    {
+        if(m_Stopping.load(std::memory_order_acquire))
+        {
+            return;
+        }
+
+        CLIENT_SLOT& client_slot = *m_Slots[slot];
+        client_slot.drops.fetch_add(1, std::memory_order_acq_rel);
+        client_slot.up.store(false, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(m_RedialMutex);
+        client_slot.redial_at = std::chrono::steady_clock::now() + client_slot.backoff;
+        m_RedialCondition.notify_all();
+    }
+
+    // Body of the redial thread
+    void Redial(void)
+    {
+        std::unique_lock<std::mutex> lock(m_RedialMutex);
+        while(!m_Stopping.load(std::memory_order_acquire))
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+            for(size_t slot = 0; slot < m_Slots.size(); slot++)
+            {
+                CLIENT_SLOT& client_slot = *m_Slots[slot];
+                if(client_slot.up.load(std::memory_order_acquire))
+                {
+                    continue;
+                }
+
+                if(client_slot.redial_at > now)
+                {
+                    next = std::min(next, client_slot.redial_at);
+                    continue;
+                }
+
+                lock.unlock();
+                bool redialled = RTN_OK == Dial(slot);
+                if(redialled)
+                {
+                    LOG_INFO("Reconnected to ", m_Address, ":", m_Port);
+                    Resubscribe(slot);
+                }
+                lock.lock();
+
+                if(!redialled)
+                {
+                    client_slot.backoff = std::min(client_slot.backoff * 2, KDB_CLIENT_RECONNECT_MAX);
+                    client_slot.redial_at = std::chrono::steady_clock::now() + client_slot.backoff;
+                    next = std::min(next, client_slot.redial_at);
+                }
+            }
+
+            if(std::chrono::steady_clock::time_point::max() == next)
+            {
+                m_RedialCondition.wait(lock);
+            }
+            else
+            {
+                m_RedialCondition.wait_until(lock, next);
+            }
+        }
+    }
+
+    // The daemon dropped this connection's subscriptions with it
+    void Resubscribe(size_t slot)
+    {
+        std::vector<SUBSCRIPTION> keys;
+        {
+            std::lock_guard<std::mutex> lock(m_SubscriptionMutex);
+            for(std::unordered_map<SUBSCRIPTION, KEY_STATE>::const_iterator state = m_Keys.begin();
+                state != m_Keys.end(); ++state)
+            {
+                if(KEY_LIVE == state->second && slot == SlotOf(state->first.o, state->first.r))
+                {
+                    keys.push_back(state->first);
+                }
+            }
+        }
+
+        for(size_t key = 0; key < keys.size(); key++)
+        {
+            OFRI_ID ofri = {keys[key].o, keys[key].f, keys[key].r, 0};
+            Request(slot, MESSAGE_TYPE::SUBSCRIBE, &ofri, sizeof(OFRI_ID),
+                [ofri](PackageHandle reply)
+                {
+                    if(!reply || 0 == reply->header.message_size)
+                    {
+                        LOG_WARN("Could not resubscribe to ", ofri.o, ".", ofri.f, ".", ofri.r);
+                    }
+                });
+        }
+    }
+
+    // Reply to the first SUBSCRIBE for key
+    void Subscribed(const SUBSCRIPTION& key, bool accepted)
+    {
+        std::vector<std::pair<SubscribeCallback, SubscriptionID>> done;
+        bool abandoned = false;
+        {
+            std::lock_guard<std::mutex> lock(m_SubscriptionMutex);
+            std::vector<CLIENT_SUBSCRIPTION>::iterator subscription = m_Subscriptions.begin();
+            while(m_Subscriptions.end() != subscription)
+            {
+                if(!(key == subscription->key) || subscription->live)
+                {
+                    ++subscription;
+                    continue;
+                }
+
+                done.emplace_back(subscription->on_done, accepted ? subscription->id : 0);
+                if(accepted)
+                {
+                    subscription->live = true;
+                    ++subscription;
+                }
+                else
+                {
+                    subscription = m_Subscriptions.erase(subscription);
+                }
+            }
+
+            // Everyone unsubscribed while it was pending
+            abandoned = accepted && done.empty();
+            if(accepted && !abandoned)
+            {
+                m_Keys[key] = KEY_LIVE;
+            }
+            else
+            {
+                m_Keys.erase(key);
+            }
+        }
+
+        if(abandoned)
+        {
+            SendUnsubscribe(key);
+        }
+
+        for(size_t waiting = 0; waiting < done.size(); waiting++)
+        {
+            done[waiting].first(done[waiting].second);
+        }
+    }
+
+    void SendUnsubscribe(const SUBSCRIPTION& key)
+    {
+        OFRI_ID ofri = {key.o, key.f, key.r, 0};
+        Request(SlotOf(key.o, key.r), MESSAGE_TYPE::UNSUBSCRIBE, &ofri, sizeof(OFRI_ID),
+            [](PackageHandle reply)
+            {
+            });
+    }
+
+    // Caller holds m_SubscriptionMutex
+    bool HasSubscribers(const SUBSCRIPTION& key) const
+    {
+        for(size_t subscription = 0; subscription < m_Subscriptions.size(); subscription++)
+        {
+            if(key == m_Subscriptions[subscription].key)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Messages nobody asked for -- change notifications
+    void ReceiveUpdate(size_t slot, const INET_PACKAGE* package)
+    {
+        if(MESSAGE_TYPE::UPDATE != package->header.data_type ||
+           sizeof(UPDATE_HEADER) > package->header.message_size)
+        {
+            return;
+        }
+
+        UPDATE_HEADER update;
+        memcpy(&update, package->payload, sizeof(UPDATE_HEADER));
+        const size_t bitmap_size = DeltaBitmapWords(update.num_fields) * sizeof(uint64_t);
+        if(sizeof(UPDATE_HEADER) + bitmap_size > package->header.message_size)
+        {
+            return;
+        }
+
+        // Copied out -- the payload need not be aligned for uint64_t
+        std::vector<uint64_t>& changed_fields = m_Slots[slot]->changed_fields;
+        changed_fields.resize(DeltaBitmapWords(update.num_fields));
+        memcpy(changed_fields.data(), package->payload + sizeof(UPDATE_HEADER), bitmap_size);
+
+        // The daemon sends one update per connection, so only keys held on
+        // this one count. Called outside the lock so they may subscribe and
+        // unsubscribe.
+        std::vector<UpdateCallback>& matched = m_Slots[slot]->matched;
+        matched.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_SubscriptionMutex);
+            for(size_t subscription = 0; subscription < m_Subscriptions.size(); subscription++)
+            {
+                const CLIENT_SUBSCRIPTION& entry = m_Subscriptions[subscription];
+                if(entry.live && slot == SlotOf(entry.key.o, entry.key.r) &&
+                   SubscriptionMatches(entry.key, update, changed_fields.data()))
+                {
+                    matched.push_back(entry.on_update);
+                }
+            }
+        }
+
+        for(size_t callback = 0; callback < matched.size(); callback++)
+        {
+            matched[callback](update, package->payload, package->header.message_size);
+        }
+    }
+
+    static size_t LoadConnectionCount(void)
+    {
+        size_t num_connections = KDB_CLIENT_DEFAULT_CONNECTIONS;
+        std::string connections = ConfigValues::Instance().Get(KDB_CLIENT_CONNECTIONS);
+        if(!connections.empty())
+        {
+            try
+            {
+                num_connections = std::stoul(connections);
+            }
+            catch(std::exception const& except)
+            {
+                LOG_WARN("Could not convert ", KDB_CLIENT_CONNECTIONS, " value ", connections,
+                         " -- using ", KDB_CLIENT_DEFAULT_CONNECTIONS, " connections");
+            }
+        }
+
+        return 0 == num_connections ? 1 : num_connections;
+    }
+
+    const std::string m_Address;
+    const std::string m_Port;
+    std::vector<std::unique_ptr<CLIENT_SLOT>> m_Slots;
+    std::atomic<bool> m_Stopping;
+
+    std::mutex m_SubscriptionMutex; // Guards m_Subscriptions and m_Keys
+    std::vector<CLIENT_SUBSCRIPTION> m_Subscriptions;
+    std::unordered_map<SUBSCRIPTION, KEY_STATE> m_Keys;
+    SubscriptionID m_NextSubscription;
+
+    std::mutex m_RedialMutex;
+    std::condition_variable m_RedialCondition;
+    RedialThread m_Redialer;
+};
+
+#endif
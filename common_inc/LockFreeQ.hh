@@ -0,0 +1,433 @@
+#ifndef __LOCK_FREE_Q_HH
+#define __LOCK_FREE_Q_HH
+
+/* Lock-free queues for handing work between threads.
+ *
+ * SpscQ has one producer and one consumer, MpscQ any number of producers
+ * and one consumer. Both sit on a ring of a fixed power of two size with
+ * the producer and consumer indexes on cache lines of their own, so the
+ * two sides only share a line when they touch the same slot.
+ *
+ * TryPush()/TryPushN() are strictly bounded and fail when the ring is
+ * full. Push()/PushN() never fail or wait -- whatever does not fit spills
+ * into a locked overflow list that is drained once the ring is empty.
+ * That keeps them a drop-in for TasQ where threads feed each other in a
+ * loop and a full queue must not stall the producer.
+ *
+ * PopNoWait() only fails when the queue is empty, never because another
+ * thread holds a lock as TasQ::TryPop does. SetNotifier() works as in
+ * TasQ: a consumer waiting on the notifier must pop until a pop fails
+ * before waiting again. A failed pop marks the consumer idle and only then
+ * does a producer pay for Notify().
+ *
+ * Order is kept per producer. Each slot is moved out of on pop, not
+ * destroyed, so Element should be cheap to default construct.
+ */
+
+#include <EventNotifier.hh>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <cstddef>
+
+constexpr size_t LOCKFREE_CACHE_LINE = 64;
+constexpr size_t LOCKFREE_DEFAULT_CAPACITY = 4096;
+
+// Next power of two, at least 2
+inline size_t LockFreeCapacity(size_t capacity)
+{
+    size_t rounded = 2;
+    while(rounded < capacity)
+    {
+        rounded <<= 1;
+    }
+
+    return rounded;
+}
+
+// Lamport ring. Each side keeps a stale copy of the other's index and only
+// reloads it when the copy says the ring is full or empty.
+template<class Element>
+class SpscRing
+{
+
+public:
+
+    explicit SpscRing(size_t capacity)
+        : m_Mask(LockFreeCapacity(capacity) - 1), m_Slots(new Element[m_Mask + 1]),
+          m_Tail(0), m_CachedHead(0), m_Head(0), m_CachedTail(0)
+    {
+    }
+
+    // Producer only. Moves out the first n elements that fit, returns n.
+    size_t TryPushN(Element* elements, size_t count)
+    {
+        const size_t tail = m_Tail.load(std::memory_order_relaxed);
+        size_t room = Capacity() - (tail - m_CachedHead);
+        if(room < count)
+        {
+            m_CachedHead = m_Head.load(std::memory_order_acquire);
+            room = Capacity() - (tail - m_CachedHead);
+        }
+
+        count = std::min(count, room);
+        for(size_t element = 0; element < count; element++)
+        {
+            m_Slots[(tail + element) & m_Mask] = std::move(elements[element]);
+        }
+
+        if(0 != count)
+        {
+            m_Tail.store(tail + count, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // Consumer only
+    size_t TryPopN(Element* out_elements, size_t max_elements)
+    {
+        const size_t head = m_Head.load(std::memory_order_relaxed);
+        size_t ready = m_CachedTail - head;
+        if(ready < max_elements)
+        {
+            m_CachedTail = m_Tail.load(std::memory_order_acquire);
+            ready = m_CachedTail - head;
+        }
+
+        max_elements = std::min(max_elements, ready);
+        for(size_t element = 0; element < max_elements; element++)
+        {
+            out_elements[element] = std::move(m_Slots[(head + element) & m_Mask]);
+        }
+
+        if(0 != max_elements)
+        {
+            m_Head.store(head + max_elements, std::memory_order_release);
+        }
+        return max_elements;
+    }
+
+    // Consumer only -- nothing pushed that has not been popped
+    bool Empty(void) const
+    {
+        return m_Head.load(std::memory_order_relaxed) == m_Tail.load(std::memory_order_acquire);
+    }
+
+    size_t Size(void) const
+    {
+        const size_t head = m_Head.load(std::memory_order_acquire);
+        return m_Tail.load(std::memory_order_acquire) - head;
+    }
+
+    size_t Capacity(void) const
+    {
+        return m_Mask + 1;
+    }
+
+private:
+
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+    const size_t m_Mask;
+    std::unique_ptr<Element[]> m_Slots;
+
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<size_t> m_Tail; // Producer's line
+    size_t m_CachedHead;
+
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<size_t> m_Head; // Consumer's line
+    size_t m_CachedTail;
+};
+
+// Bounded ring after Vyukov. Producers claim slots by moving the tail with
+// a CAS then publish each slot through its sequence number, so the
+// consumer can tell a claimed slot from a filled one. With one consumer
+// slots are freed in order and the consumer's index alone says how many
+// are free.
+template<class Element>
+class MpscRing
+{
+
+public:
+
+    explicit MpscRing(size_t capacity)
+        : m_Mask(LockFreeCapacity(capacity) - 1), m_Cells(new CELL[m_Mask + 1]),
+          m_Tail(0), m_Head(0)
+    {
+        // Slot i holds position p once its sequence is p + 1
+        for(size_t cell = 0; cell <= m_Mask; cell++)
+        {
+            m_Cells[cell].sequence.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Any producer. Claims as many slots as fit in one go, returns how many.
+    size_t TryPushN(Element* elements, size_t count)
+    {
+        size_t tail = m_Tail.load(std::memory_order_relaxed);
+        size_t claim = 0;
+        for(;;)
+        {
+            const size_t head = m_Head.load(std::memory_order_acquire);
+            if(static_cast<std::ptrdiff_t>(tail - head) < 0)
+            {
+                // Our tail is older than what the consumer has seen
+                tail = m_Tail.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            claim = std::min(count, Capacity() - (tail - head));
+            if(0 == claim)
+            {
+                return 0;
+            }
+
+            if(m_Tail.compare_exchange_weak(tail, tail + claim, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        for(size_t element = 0; element < claim; element++)
+        {
+            CELL& cell = m_Cells[(tail + element) & m_Mask];
+            cell.value = std::move(elements[element]);
+            cell.sequence.store(tail + element + 1, std::memory_order_release);
+        }
+
+        return claim;
+    }
+
+    // Consumer only. Stops at the first slot claimed but not yet filled.
+    size_t TryPopN(Element* out_elements, size_t max_elements)
+    {
+        const size_t head = m_Head.load(std::memory_order_relaxed);
+        size_t popped = 0;
+        for(; popped < max_elements; popped++)
+        {
+            CELL& cell = m_Cells[(head + popped) & m_Mask];
+            if(cell.sequence.load(std::memory_order_acquire) != head + popped + 1)
+            {
+                break;
+            }
+
+            out_elements[popped] = std::move(cell.value);
+        }
+
+        if(0 != popped)
+        {
+            m_Head.store(head + popped, std::memory_order_release);
+        }
+        return popped;
+    }
+
+    // Consumer only -- every claimed slot has been popped
+    bool Empty(void) const
+    {
+        return m_Head.load(std::memory_order_relaxed) == m_Tail.load(std::memory_order_acquire);
+    }
+
+    size_t Size(void) const
+    {
+        const size_t head = m_Head.load(std::memory_order_acquire);
+        const size_t tail = m_Tail.load(std::memory_order_acquire);
+        return static_cast<std::ptrdiff_t>(tail - head) < 0 ? 0 : tail - head;
+    }
+
+    size_t Capacity(void) const
+    {
+        return m_Mask + 1;
+    }
+
+private:
+
+    struct CELL
+    {
+        std::atomic<size_t> sequence;
+        Element value;
+    };
+
+    MpscRing(const MpscRing&);
+    MpscRing& operator=(const MpscRing&);
+
+    const size_t m_Mask;
+    std::unique_ptr<CELL[]> m_Cells;
+
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<size_t> m_Tail; // Shared by producers
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<size_t> m_Head; // Consumer's line
+};
+
+// A ring plus the overflow list and consumer wakeup. Use SpscQ or MpscQ.
+template<class Element, template<class> class Ring>
+class LockFreeQ
+{
+
+public:
+
+    explicit LockFreeQ(size_t capacity = LOCKFREE_DEFAULT_CAPACITY)
+        : m_Ring(capacity), m_Idle(true), m_Spilled(0), m_Notifier(nullptr),
+          m_SpillMutex(), m_Spill()
+    {
+    }
+
+    // Notified when a push finds the consumer idle
+    void SetNotifier(EventNotifier* notifier)
+    {
+        m_Notifier.store(notifier, std::memory_order_release);
+    }
+
+    // False when the ring is full
+    bool TryPush(Element& element)
+    {
+        return 1 == TryPushN(&element, 1);
+    }
+
+    // Moves out the first n elements that fit in the ring, returns n
+    size_t TryPushN(Element* elements, size_t count)
+    {
+        // Anything spilled is ahead of us
+        if(0 != m_Spilled.load(std::memory_order_acquire))
+        {
+            return 0;
+        }
+
+        size_t pushed = m_Ring.TryPushN(elements, count);
+        if(0 != pushed)
+        {
+            WakeConsumer();
+        }
+        return pushed;
+    }
+
+    void Push(Element& element)
+    {
+        PushN(&element, 1);
+    }
+
+    void PushN(Element* elements, size_t count)
+    {
+        size_t pushed = TryPushN(elements, count);
+        if(pushed < count)
+        {
+            Spill(elements + pushed, count - pushed);
+        }
+    }
+
+    // Consumer only
+    bool PopNoWait(Element& result)
+    {
+        return 1 == PopN(&result, 1);
+    }
+
+    // Same as PopNoWait() -- kept so TasQ users need not change
+    bool TryPop(Element& result)
+    {
+        return PopNoWait(result);
+    }
+
+    // Consumer only. Returns how many were moved into out_elements.
+    size_t PopN(Element* out_elements, size_t max_elements)
+    {
+        size_t popped = TakeAvailable(out_elements, max_elements);
+        if(0 != popped || 0 == max_elements)
+        {
+            return popped;
+        }
+
+        // Going idle. Either a push that races with this sees the flag and
+        // notifies or the second look sees its element.
+        m_Idle.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        popped = TakeAvailable(out_elements, max_elements);
+        if(0 != popped)
+        {
+            m_Idle.store(false, std::memory_order_relaxed);
+        }
+
+        return popped;
+    }
+
+    size_t Size(void) const
+    {
+        return m_Ring.Size() + m_Spilled.load(std::memory_order_acquire);
+    }
+
+    size_t Capacity(void) const
+    {
+        return m_Ring.Capacity();
+    }
+
+private:
+
+    size_t TakeAvailable(Element* out_elements, size_t max_elements)
+    {
+        size_t popped = m_Ring.TryPopN(out_elements, max_elements);
+
+        // Spilled elements came after everything in the ring
+        if(popped < max_elements && 0 != m_Spilled.load(std::memory_order_acquire) && m_Ring.Empty())
+        {
+            std::lock_guard<std::mutex> lock(m_SpillMutex);
+            size_t unspilled = std::min(max_elements - popped, m_Spill.size());
+            for(size_t element = 0; element < unspilled; element++)
+            {
+                out_elements[popped + element] = std::move(m_Spill.front());
+                m_Spill.pop_front();
+            }
+
+            m_Spilled.fetch_sub(unspilled, std::memory_order_release);
+            popped += unspilled;
+        }
+
+        return popped;
+    }
+
+    void Spill(Element* elements, size_t count)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_SpillMutex);
+            for(size_t element = 0; element < count; element++)
+            {
+                m_Spill.push_back(std::move(elements[element]));
+            }
+            m_Spilled.fetch_add(count, std::memory_order_release);
+        }
+
+        WakeConsumer();
+    }
+
+    void WakeConsumer(void)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_Idle.load(std::memory_order_relaxed) && m_Idle.exchange(false, std::memory_order_acq_rel))
+        {
+            EventNotifier* notifier = m_Notifier.load(std::memory_order_acquire);
+            if(nullptr != notifier)
+            {
+                notifier->Notify();
+            }
+        }
+    }
+
+    LockFreeQ(const LockFreeQ&);
+    LockFreeQ& operator=(const LockFreeQ&);
+
+    Ring<Element> m_Ring;
+
+    // Read on every push, written rarely
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<bool> m_Idle;
+    std::atomic<size_t> m_Spilled;
+    std::atomic<EventNotifier*> m_Notifier;
+
+    alignas(LOCKFREE_CACHE_LINE) std::mutex m_SpillMutex;
+    std::deque<Element> m_Spill;
+};
+
+template<class Element>
+using SpscQ = LockFreeQ<Element, SpscRing>;
+
+template<class Element>
+using MpscQ = LockFreeQ<Element, MpscRing>;
+
+#endif
@@ -1,12 +1,77 @@
 #ifndef __MESSAGE_TYPES_HH
 #define __MESSAGE_TYPES_HH
 
+#include <OFRI.hh>
+#include <RecordDelta.hh>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Record or field of a SUBSCRIBE meaning "any"
+constexpr unsigned int SUBSCRIBE_ALL = 0xFFFFFFFF;
+
+// What a SUBSCRIBE asks for. The daemon and KDBClient both key on it.
+struct SUBSCRIPTION
+{
+    OBJECT_ID o;
+    RECORD r;
+    FIELD f;
+
+    bool operator == (const SUBSCRIPTION& other) const
+    {
+        return o == other.o && r == other.r && f == other.f;
+    }
+};
+
+namespace std
+{
+    template<>
+    struct hash<SUBSCRIPTION>
+    {
+        size_t operator() (const SUBSCRIPTION& key) const
+        {
+            size_t hash = key.o;
+            hash = hash * 0x9E3779B97F4A7C15ULL ^ key.r;
+            hash = hash * 0x9E3779B97F4A7C15ULL ^ key.f;
+            return hash;
+        }
+    };
+}
+
+// The keys a change to field f of record r can match -- any record, then
+// record r. f may be SUBSCRIBE_ALL to get the whole-record keys.
+constexpr size_t SUBSCRIPTION_LEVELS = 2;
+
+inline void SubscriptionKeys(OBJECT_ID o, RECORD r, FIELD f, SUBSCRIPTION (&out_keys)[SUBSCRIPTION_LEVELS])
+{
+    out_keys[0] = {o, SUBSCRIBE_ALL, f};
+    out_keys[1] = {o, r, f};
+}
+
+// Whether an UPDATE is for key -- true exactly when SubscriptionKeys gives
+// key for SUBSCRIBE_ALL or for one of the changed fields.
+inline bool SubscriptionMatches(const SUBSCRIPTION& key, const UPDATE_HEADER& update, const uint64_t* changed_fields)
+{
+    if(key.o != update.o || (SUBSCRIBE_ALL != key.r && key.r != update.r))
+    {
+        return false;
+    }
+
+    return SUBSCRIBE_ALL == key.f ||
+        (key.f < update.num_fields && DeltaFieldChanged(changed_fields, key.f));
+}
+
 enum MESSAGE_TYPE
 {
     NONE = 0,
     TEXT,
     ACK,
-    DB
+    DB,
+    UPDATE, // Change notification -- RecordDelta UPDATE_HEADER, changed-field bitmap, values
+    SUBSCRIBE, // OFRI or OFRI_ID -- record or field may be SUBSCRIBE_ALL
+    UNSUBSCRIBE, // Same payload as SUBSCRIBE. Empty drops every subscription.
+    STATS // Empty request. Reply is the daemon's metrics as exposition text.
 };
 
 #endif
\ No newline at end of file
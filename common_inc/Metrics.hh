@@ -0,0 +1,486 @@
+#ifndef __METRICS_HH
+#define __METRICS_HH
+
+/* Process-wide counters, gauges and histograms.
+ *
+ * Hot paths only ever touch their own shard of a metric: each thread is
+ * handed one of METRICS_SHARDS cache lines the first time it records
+ * anything and adds to it with a relaxed atomic. Reading a metric sums the
+ * shards, so values are exact once writers are quiet and never torn.
+ *
+ * Metrics are looked up by name once, at startup or through a function
+ * local static, and the reference kept -- the registry never removes one.
+ * Labels are part of the name, e.g. kdb_requests_total{type="DB"}.
+ *
+ * Render() writes every metric in the Prometheus text exposition format.
+ * A gauge can instead be sampled: Sample() gives it a callback that is run
+ * only when rendering, for values such as queue depths that already live
+ * somewhere else. Unsample() before whatever the callback reads goes away.
+ */
+
+#include <retcode.hh>
+#include <Logger.hh>
+#include <DaemonThread.hh>
+#include <EventNotifier.hh>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+constexpr size_t METRICS_SHARDS = 16;
+
+// This thread's shard -- threads are dealt out round robin
+inline size_t MetricsShard(void)
+{
+    static std::atomic<size_t> next_shard(0);
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+    return shard;
+}
+
+class Metric
+{
+
+public:
+
+    virtual ~Metric() { }
+
+    virtual const char* Type(void) const = 0;
+
+    // Every sample line of this metric
+    virtual void Render(std::ostream& out, const std::string& name) const = 0;
+
+};
+
+class Counter: public Metric
+{
+
+public:
+
+    Counter()
+        : m_Cells()
+    {
+    }
+
+    void Add(uint64_t amount = 1)
+    {
+        m_Cells[MetricsShard()].value.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t Value(void) const
+    {
+        uint64_t total = 0;
+        for(const COUNTER_CELL& cell : m_Cells)
+        {
+            total += cell.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    const char* Type(void) const
+    {
+        return "counter";
+    }
+
+    void Render(std::ostream& out, const std::string& name) const
+    {
+        out << name << " " << Value() << "\n";
+    }
+
+private:
+
+    struct alignas(64) COUNTER_CELL
+    {
+        std::atomic<uint64_t> value{0};
+    };
+
+    COUNTER_CELL m_Cells[METRICS_SHARDS];
+};
+
+// Gauges go up and down so they are not sharded -- Set() has to win
+class Gauge: public Metric
+{
+
+public:
+
+    Gauge()
+        : m_Value(0), m_Sampler()
+    {
+    }
+
+    void Set(int64_t value)
+    {
+        m_Value.store(value, std::memory_order_relaxed);
+    }
+
+    void Add(int64_t amount)
+    {
+        m_Value.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    int64_t Value(void) const
+    {
+        return m_Value.load(std::memory_order_relaxed);
+    }
+
+    const char* Type(void) const
+    {
+        return "gauge";
+    }
+
+    void Render(std::ostream& out, const std::string& name) const
+    {
+        if(m_Sampler)
+        {
+            // Enough digits that byte counts do not come out rounded
+            std::streamsize precision = out.precision(15);
+            out << name << " " << m_Sampler() << "\n";
+            out.precision(precision);
+            return;
+        }
+
+        out << name << " " << Value() << "\n";
+    }
+
+private:
+
+    friend class MetricsRegistry; // Owns the sampler under its lock
+
+    std::atomic<int64_t> m_Value;
+    std::function<double()> m_Sampler;
+};
+
+// Bucket i counts values up to and including bounds[i]. Anything above the
+// last bound only shows in the +Inf bucket.
+class Histogram: public Metric
+{
+
+public:
+
+    explicit Histogram(const std::vector<uint64_t>& bounds)
+        : m_Bounds(bounds), m_Shards(new HISTOGRAM_SHARD[METRICS_SHARDS])
+    {
+        for(size_t shard = 0; shard < METRICS_SHARDS; shard++)
+        {
+            m_Shards[shard].buckets.reset(new std::atomic<uint64_t>[m_Bounds.size() + 1]);
+            for(size_t bucket = 0; bucket <= m_Bounds.size(); bucket++)
+            {
+                m_Shards[shard].buckets[bucket].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // bounds of start, start * factor, ... count of them
+    static std::vector<uint64_t> ExponentialBounds(uint64_t start, uint64_t factor, size_t count)
+    {
+        std::vector<uint64_t> bounds;
+        uint64_t bound = start;
+        for(size_t index = 0; index < count; index++)
+        {
+            bounds.push_back(bound);
+            bound *= factor;
+        }
+        return bounds;
+    }
+
+    void Observe(uint64_t value)
+    {
+        size_t bucket = 0;
+        while(bucket < m_Bounds.size() && value > m_Bounds[bucket])
+        {
+            bucket++;
+        }
+
+        HISTOGRAM_SHARD& shard = m_Shards[MetricsShard()];
+        shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    const char* Type(void) const
+    {
+        return "histogram";
+    }
+
+    // Buckets are cumulative in the exposition format. A labelled name gets
+    // le added to its labels.
+    void Render(std::ostream& out, const std::string& name) const
+    {
+        const std::string::size_type label_start = name.find('{');
+        const std::string base = name.substr(0, label_start);
+        const std::string labels = std::string::npos == label_start ?
+            "" : name.substr(label_start + 1, name.size() - label_start - 2) + ",";
+
+        uint64_t cumulative = 0;
+        uint64_t sum = 0;
+        for(size_t bucket = 0; bucket <= m_Bounds.size(); bucket++)
+        {
+            for(size_t shard = 0; shard < METRICS_SHARDS; shard++)
+            {
+                cumulative += m_Shards[shard].buckets[bucket].load(std::memory_order_relaxed);
+            }
+
+            out << base << "_bucket{" << labels << "le=\"";
+            if(bucket < m_Bounds.size())
+            {
+                out << m_Bounds[bucket];
+            }
+            else
+            {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+
+        for(size_t shard = 0; shard < METRICS_SHARDS; shard++)
+        {
+            sum += m_Shards[shard].sum.load(std::memory_order_relaxed);
+        }
+
+        const std::string suffix = std::string::npos == label_start ? "" : name.substr(label_start);
+        out << base << "_sum" << suffix << " " << sum << "\n";
+        out << base << "_count" << suffix << " " << cumulative << "\n";
+    }
+
+private:
+
+    struct alignas(64) HISTOGRAM_SHARD
+    {
+        std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+        std::atomic<uint64_t> sum{0};
+    };
+
+    std::vector<uint64_t> m_Bounds;
+    std::unique_ptr<HISTOGRAM_SHARD[]> m_Shards;
+};
+
+// Observes the time from construction to destruction in nanoseconds
+class MetricsTimer
+{
+
+public:
+
+    explicit MetricsTimer(Histogram& histogram)
+        : m_Histogram(histogram), m_Start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~MetricsTimer()
+    {
+        m_Histogram.Observe(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_Start).count());
+    }
+
+private:
+
+    MetricsTimer(const MetricsTimer&);
+    MetricsTimer& operator=(const MetricsTimer&);
+
+    Histogram& m_Histogram;
+    std::chrono::steady_clock::time_point m_Start;
+};
+
+// 1us to about 0.5s in doubling steps
+static const std::vector<uint64_t> METRICS_LATENCY_NS_BOUNDS = Histogram::ExponentialBounds(1000, 2, 20);
+
+class MetricsRegistry
+{
+
+public:
+
+    // Never destroyed -- daemon threads may still count during exit
+    static MetricsRegistry& Instance(void)
+    {
+        static MetricsRegistry* instance = new MetricsRegistry();
+        return *instance;
+    }
+
+    Counter& GetCounter(const std::string& name, const std::string& help)
+    {
+        return Find<Counter>(name, help, [](){ return new Counter(); });
+    }
+
+    Gauge& GetGauge(const std::string& name, const std::string& help)
+    {
+        return Find<Gauge>(name, help, [](){ return new Gauge(); });
+    }
+
+    Histogram& GetHistogram(const std::string& name, const std::string& help,
+                            const std::vector<uint64_t>& bounds = METRICS_LATENCY_NS_BOUNDS)
+    {
+        return Find<Histogram>(name, help, [&bounds](){ return new Histogram(bounds); });
+    }
+
+    // Gauge whose value is sampler() at render time
+    void Sample(const std::string& name, const std::string& help, std::function<double()> sampler)
+    {
+        Gauge& gauge = GetGauge(name, help);
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        gauge.m_Sampler = sampler;
+    }
+
+    // Back to a plain gauge, left at zero
+    void Unsample(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        std::map<std::string, METRIC_ENTRY>::iterator entry = m_Metrics.find(name);
+        if(m_Metrics.end() == entry)
+        {
+            return;
+        }
+
+        Gauge* gauge = dynamic_cast<Gauge*>(entry->second.metric.get());
+        if(nullptr != gauge)
+        {
+            gauge->m_Sampler = nullptr;
+            gauge->Set(0);
+        }
+    }
+
+    // HELP and TYPE once per family. Names sort so a family's labelled
+    // metrics sit together.
+    void Render(std::ostream& out)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        std::string family;
+        for(const std::pair<const std::string, METRIC_ENTRY>& entry : m_Metrics)
+        {
+            std::string entry_family = entry.first.substr(0, entry.first.find('{'));
+            if(entry_family != family)
+            {
+                family = entry_family;
+                out << "# HELP " << family << " " << entry.second.help << "\n";
+                out << "# TYPE " << family << " " << entry.second.metric->Type() << "\n";
+            }
+
+            entry.second.metric->Render(out, entry.first);
+        }
+    }
+
+    std::string Render(void)
+    {
+        std::stringstream text;
+        Render(text);
+        return text.str();
+    }
+
+    // Written beside path and renamed over it so readers never see half
+    RETCODE RenderToFile(const std::string& path)
+    {
+        const std::string staging = path + ".tmp";
+        {
+            std::ofstream metrics_file(staging, std::ios::trunc);
+            if(!metrics_file.is_open())
+            {
+                return RTN_NOT_FOUND;
+            }
+
+            Render(metrics_file);
+            if(!metrics_file.good())
+            {
+                return RTN_FAIL;
+            }
+        }
+
+        return 0 == std::rename(staging.c_str(), path.c_str()) ? RTN_OK : RTN_FAIL;
+    }
+
+private:
+
+    struct METRIC_ENTRY
+    {
+        std::string help;
+        std::unique_ptr<Metric> metric;
+    };
+
+    MetricsRegistry()
+        : m_Mutex(), m_Metrics(), m_Orphans()
+    {
+    }
+
+    MetricsRegistry(const MetricsRegistry&);
+    MetricsRegistry& operator=(const MetricsRegistry&);
+
+    template<class METRIC_TYPE, class Create>
+    METRIC_TYPE& Find(const std::string& name, const std::string& help, Create create)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        std::map<std::string, METRIC_ENTRY>::iterator entry = m_Metrics.find(name);
+        if(m_Metrics.end() == entry)
+        {
+            METRIC_TYPE* metric = create();
+            m_Metrics[name] = METRIC_ENTRY{help, std::unique_ptr<Metric>(metric)};
+            return *metric;
+        }
+
+        METRIC_TYPE* metric = dynamic_cast<METRIC_TYPE*>(entry->second.metric.get());
+        if(nullptr == metric)
+        {
+            // Still hand back something to count into, it just never shows
+            LOG_ERROR("Metric ", name, " is already a ", entry->second.metric->Type());
+            metric = create();
+            m_Orphans.emplace_back(metric);
+        }
+
+        return *metric;
+    }
+
+    std::mutex m_Mutex;
+    std::map<std::string, METRIC_ENTRY> m_Metrics;
+    std::vector<std::unique_ptr<Metric>> m_Orphans; // Type clashes
+};
+
+/* Writes the registry to a file every interval, and once more on Stop(),
+ * for anything that scrapes files rather than asking for STATS.
+ */
+class MetricsDumper: public DaemonThread<std::string, std::chrono::seconds>
+{
+
+public:
+
+    MetricsDumper()
+        : m_Notifier()
+    {
+    }
+
+    void execute(std::string path, std::chrono::seconds interval)
+    {
+        const int interval_ms = static_cast<int>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(interval).count());
+
+        while(!StopRequested())
+        {
+            Dump(path);
+            m_Notifier.Wait(interval_ms);
+        }
+
+        Dump(path);
+    }
+
+    void Wake()
+    {
+        m_Notifier.Notify();
+    }
+
+private:
+
+    static void Dump(const std::string& path)
+    {
+        if(RTN_OK != MetricsRegistry::Instance().RenderToFile(path))
+        {
+            LOG_WARN("Could not write metrics to ", path);
+        }
+    }
+
+    EventNotifier m_Notifier;
+};
+
+#endif
@@ -4,6 +4,7 @@
 constexpr unsigned int OBJECT_NAME_LEN = 20;
 
 typedef char OBJECT[OBJECT_NAME_LEN];
+typedef unsigned int OBJECT_ID; // Object number from the schema
 typedef unsigned int FIELD;
 typedef unsigned int RECORD;
 typedef unsigned int INDEX;
@@ -16,6 +17,14 @@ struct OFRI // Specific quanta of data
     INDEX i;
 };
 
+struct OFRI_ID // OFRI with the object given by number -- compact messages
+{
+    OBJECT_ID o;
+    FIELD f;
+    RECORD r;
+    INDEX i;
+};
+
 struct OR // Refence specific object
 {
     OBJECT o;
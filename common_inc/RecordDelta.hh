@@ -0,0 +1,208 @@
+#ifndef __RECORD_DELTA_HH
+#define __RECORD_DELTA_HH
+
+/* Change notifications that carry only what changed in a record.
+ *
+ * An UPDATE payload is
+ *
+ *     UPDATE_HEADER | bitmap | values
+ *
+ * The bitmap has one bit per field, in schema order, packed into 64 bit
+ * words. values holds the full contents of every field whose bit is set,
+ * back to back in field order. A reader with the schema can walk it with
+ * ApplyDelta().
+ *
+ * The sender keeps a snapshot of each record as last sent and DiffRecord()
+ * compares it against the live record a word at a time. Only words that
+ * differ are looked at byte by byte to find which fields they belong to.
+ */
+
+#include <ObjectSchema.hh>
+#include <OFRI.hh>
+#include <retcode.hh>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct UPDATE_HEADER
+{
+    OBJECT_ID o;
+    RECORD r;
+    unsigned int num_fields; // Bits in the bitmap
+    unsigned int value_size; // Bytes of packed values after the bitmap
+};
+
+constexpr unsigned short DELTA_NO_FIELD = 0xFFFF; // Padding between fields
+
+inline size_t DeltaBitmapWords(size_t num_fields)
+{
+    return (num_fields + 63) / 64;
+}
+
+inline bool DeltaFieldChanged(const uint64_t* bitmap, size_t field)
+{
+    return bitmap[field / 64] & (1ULL << (field % 64));
+}
+
+// Which field owns each byte of a record. Built once per object.
+class DeltaLayout
+{
+
+public:
+
+    explicit DeltaLayout(const OBJECT_SCHEMA& object)
+        : m_ByteField(object.objectSize, DELTA_NO_FIELD),
+          m_BitmapWords(DeltaBitmapWords(object.fields.size()))
+    {
+        for(size_t field = 0; field < object.fields.size(); field++)
+        {
+            size_t offset = object.fields[field].fieldOffset;
+            size_t end = offset + object.fields[field].fieldSize;
+            for(; offset < end && offset < m_ByteField.size(); offset++)
+            {
+                m_ByteField[offset] = static_cast<unsigned short>(field);
+            }
+        }
+    }
+
+    // Set a bit in out_bitmap for every field that differs between the
+    // snapshot and the live record. Returns the number of changed fields.
+    size_t DiffRecord(const char* p_snapshot, const char* p_record, uint64_t* out_bitmap) const
+    {
+        memset(out_bitmap, 0, m_BitmapWords * sizeof(uint64_t));
+
+        const size_t size = m_ByteField.size();
+        const size_t whole_words = size / sizeof(uint64_t);
+        size_t changed = 0;
+        for(size_t word = 0; word < whole_words; word++)
+        {
+            uint64_t before;
+            uint64_t after;
+            memcpy(&before, p_snapshot + word * sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&after, p_record + word * sizeof(uint64_t), sizeof(uint64_t));
+
+            // Visit only the bytes that differ
+            uint64_t difference = before ^ after;
+            while(0 != difference)
+            {
+                size_t byte = word * sizeof(uint64_t) + __builtin_ctzll(difference) / 8;
+                changed += MarkByte(byte, out_bitmap);
+                difference &= ~(0xFFULL << (__builtin_ctzll(difference) & ~7U));
+            }
+        }
+
+        for(size_t byte = whole_words * sizeof(uint64_t); byte < size; byte++)
+        {
+            if(p_snapshot[byte] != p_record[byte])
+            {
+                changed += MarkByte(byte, out_bitmap);
+            }
+        }
+
+        return changed;
+    }
+
+    size_t BitmapWords(void) const
+    {
+        return m_BitmapWords;
+    }
+
+private:
+
+    // 1 the first time a field is marked
+    size_t MarkByte(size_t byte, uint64_t* bitmap) const
+    {
+        unsigned short field = m_ByteField[byte];
+        if(DELTA_NO_FIELD == field || DeltaFieldChanged(bitmap, field))
+        {
+            return 0;
+        }
+
+        bitmap[field / 64] |= 1ULL << (field % 64);
+        return 1;
+    }
+
+    std::vector<unsigned short> m_ByteField;
+    size_t m_BitmapWords;
+};
+
+// Bytes EncodeDelta() will write for this bitmap
+inline size_t DeltaSize(const OBJECT_SCHEMA& object, const uint64_t* bitmap)
+{
+    size_t size = sizeof(UPDATE_HEADER) + DeltaBitmapWords(object.fields.size()) * sizeof(uint64_t);
+    for(size_t field = 0; field < object.fields.size(); field++)
+    {
+        if(DeltaFieldChanged(bitmap, field))
+        {
+            size += object.fields[field].fieldSize;
+        }
+    }
+
+    return size;
+}
+
+// out_payload must hold DeltaSize() bytes
+inline void EncodeDelta(const OBJECT_SCHEMA& object, RECORD record, const uint64_t* bitmap,
+                        const char* p_record, char* out_payload)
+{
+    const size_t bitmap_size = DeltaBitmapWords(object.fields.size()) * sizeof(uint64_t);
+    char* p_value = out_payload + sizeof(UPDATE_HEADER) + bitmap_size;
+    for(size_t field = 0; field < object.fields.size(); field++)
+    {
+        if(DeltaFieldChanged(bitmap, field))
+        {
+            memcpy(p_value, p_record + object.fields[field].fieldOffset, object.fields[field].fieldSize);
+            p_value += object.fields[field].fieldSize;
+        }
+    }
+
+    UPDATE_HEADER header = {static_cast<OBJECT_ID>(object.objectNumber), record,
+        static_cast<unsigned int>(object.fields.size()), 0};
+    header.value_size = p_value - (out_payload + sizeof(UPDATE_HEADER) + bitmap_size);
+    memcpy(out_payload, &header, sizeof(UPDATE_HEADER));
+    memcpy(out_payload + sizeof(UPDATE_HEADER), bitmap, bitmap_size);
+}
+
+// Copy the changed fields of an UPDATE payload into a local copy of the record
+inline RETCODE ApplyDelta(const OBJECT_SCHEMA& object, const char* payload, size_t size, char* out_record)
+{
+    UPDATE_HEADER header;
+    if(sizeof(UPDATE_HEADER) > size)
+    {
+        return RTN_BAD_ARG;
+    }
+    memcpy(&header, payload, sizeof(UPDATE_HEADER));
+
+    const size_t bitmap_words = DeltaBitmapWords(header.num_fields);
+    const size_t values_start = sizeof(UPDATE_HEADER) + bitmap_words * sizeof(uint64_t);
+    if(header.num_fields != object.fields.size() || values_start + header.value_size > size)
+    {
+        return RTN_BAD_ARG;
+    }
+
+    std::vector<uint64_t> bitmap(bitmap_words);
+    memcpy(bitmap.data(), payload + sizeof(UPDATE_HEADER), bitmap_words * sizeof(uint64_t));
+
+    const char* p_value = payload + values_start;
+    const char* p_end = p_value + header.value_size;
+    for(size_t field = 0; field < object.fields.size(); field++)
+    {
+        if(!DeltaFieldChanged(bitmap.data(), field))
+        {
+            continue;
+        }
+
+        if(p_value + object.fields[field].fieldSize > p_end)
+        {
+            return RTN_BAD_ARG;
+        }
+
+        memcpy(out_record + object.fields[field].fieldOffset, p_value, object.fields[field].fieldSize);
+        p_value += object.fields[field].fieldSize;
+    }
+
+    return RTN_OK;
+}
+
+#endif
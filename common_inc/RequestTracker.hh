@@ -0,0 +1,250 @@
+#ifndef __REQUEST_TRACKER_HH
+#define __REQUEST_TRACKER_HH
+
+/* Matches replies to requests by the request_id in the compact header.
+ *
+ * Track() hands out an ID and a future for the reply so a client can keep
+ * many requests in flight on one connection. Complete() is fed every reply
+ * that arrives and fulfils the matching future. REPLY is whatever owns a
+ * reply -- PollThread uses PackageHandle. An empty REPLY means the request
+ * was cancelled or its connection went away.
+ *
+ * REQUEST_ORDER_ANY fulfils futures as soon as replies arrive.
+ * REQUEST_ORDER_SUBMITTED holds a reply back until every earlier request
+ * has been answered, so futures become ready in the order they were made.
+ *
+ * A request can name a callback instead of taking a future. It is called
+ * with the reply on whichever thread completes the request, after the
+ * tracker's lock is released, so it may make further requests.
+ *
+ * ID 0 is never handed out -- it marks messages nobody is waiting on.
+ */
+
+#include <retcode.hh>
+#include <future>
+#include <functional>
+#include <vector>
+#include <mutex>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+
+// IDs are 16 bits on the wire so this must stay well under 65535
+constexpr size_t REQUEST_MAX_IN_FLIGHT = 16 * 1024;
+
+enum REQUEST_ORDER
+{
+    REQUEST_ORDER_ANY = 0,
+    REQUEST_ORDER_SUBMITTED
+};
+
+template<class REPLY>
+class RequestTracker
+{
+
+public:
+
+    RequestTracker(REQUEST_ORDER order = REQUEST_ORDER_ANY, size_t max_in_flight = REQUEST_MAX_IN_FLIGHT)
+        : m_Order(order), m_MaxInFlight(max_in_flight), m_NextID(1)
+    {
+    }
+
+    // Replies that never came resolve empty
+    ~RequestTracker()
+    {
+        FailAll();
+    }
+
+    typedef std::function<void(REPLY)> Callback;
+
+    // RTN_FAIL when max_in_flight requests are already waiting
+    RETCODE Track(unsigned short& out_request_id, std::future<REPLY>& out_reply)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        PENDING* pending = NewPending(out_request_id);
+        if(nullptr == pending)
+        {
+            return RTN_FAIL;
+        }
+
+        out_reply = pending->promise.get_future();
+        return RTN_OK;
+    }
+
+    // on_reply is called once, with an empty REPLY if the request fails
+    RETCODE Track(unsigned short& out_request_id, Callback on_reply)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        PENDING* pending = NewPending(out_request_id);
+        if(nullptr == pending)
+        {
+            return RTN_FAIL;
+        }
+
+        pending->callback = std::move(on_reply);
+        return RTN_OK;
+    }
+
+    // Returns false, leaving reply alone, when nobody is waiting on request_id
+    bool Complete(unsigned short request_id, REPLY& reply)
+    {
+        std::vector<PENDING> released;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            typename PendingMap::iterator pending = m_Pending.find(request_id);
+            if(m_Pending.end() == pending || pending->second.answered)
+            {
+                return false;
+            }
+
+            pending->second.reply = std::move(reply);
+            pending->second.answered = true;
+            if(REQUEST_ORDER_ANY == m_Order)
+            {
+                Release(pending, released);
+            }
+            else
+            {
+                ReleaseAnswered(released);
+            }
+        }
+
+        Fulfil(released);
+        return true;
+    }
+
+    // Give up on one request, e.g. when it could not be sent
+    void Cancel(unsigned short request_id)
+    {
+        std::vector<PENDING> released;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            typename PendingMap::iterator pending = m_Pending.find(request_id);
+            if(m_Pending.end() == pending)
+            {
+                return;
+            }
+
+            pending->second.reply = REPLY();
+            Release(pending, released);
+
+            if(REQUEST_ORDER_SUBMITTED == m_Order)
+            {
+                m_Submitted.erase(std::find(m_Submitted.begin(), m_Submitted.end(), request_id));
+                ReleaseAnswered(released);
+            }
+        }
+
+        Fulfil(released);
+    }
+
+    // Connection went away -- every waiter gets an empty reply
+    void FailAll()
+    {
+        std::vector<PENDING> released;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            for(typename PendingMap::iterator pending = m_Pending.begin(); pending != m_Pending.end(); ++pending)
+            {
+                pending->second.reply = REPLY();
+                released.push_back(std::move(pending->second));
+            }
+
+            m_Pending.clear();
+            m_Submitted.clear();
+        }
+
+        Fulfil(released);
+    }
+
+    size_t InFlight()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Pending.size();
+    }
+
+private:
+
+    struct PENDING
+    {
+        std::promise<REPLY> promise; // Unless there is a callback
+        Callback callback;
+        REPLY reply; // Held back until earlier requests are answered
+        bool answered = false;
+    };
+    typedef std::unordered_map<unsigned short, PENDING> PendingMap;
+
+    // Under m_Mutex. nullptr when max_in_flight are already waiting.
+    PENDING* NewPending(unsigned short& out_request_id)
+    {
+        if(m_MaxInFlight <= m_Pending.size())
+        {
+            return nullptr;
+        }
+
+        // Skip 0 and any ID still waiting after a wrap
+        while(0 == m_NextID || m_Pending.end() != m_Pending.find(m_NextID))
+        {
+            m_NextID++;
+        }
+
+        out_request_id = m_NextID++;
+        if(REQUEST_ORDER_SUBMITTED == m_Order)
+        {
+            m_Submitted.push_back(out_request_id);
+        }
+
+        return &m_Pending[out_request_id];
+    }
+
+    // Under m_Mutex -- release everything at the front that has been answered
+    void ReleaseAnswered(std::vector<PENDING>& out_released)
+    {
+        while(!m_Submitted.empty())
+        {
+            typename PendingMap::iterator pending = m_Pending.find(m_Submitted.front());
+            if(!pending->second.answered)
+            {
+                break;
+            }
+
+            m_Submitted.pop_front();
+            Release(pending, out_released);
+        }
+    }
+
+    // Under m_Mutex
+    void Release(typename PendingMap::iterator pending, std::vector<PENDING>& out_released)
+    {
+        out_released.push_back(std::move(pending->second));
+        m_Pending.erase(pending);
+    }
+
+    // Outside m_Mutex -- a callback may make the next request
+    static void Fulfil(std::vector<PENDING>& released)
+    {
+        for(PENDING& pending : released)
+        {
+            if(pending.callback)
+            {
+                pending.callback(std::move(pending.reply));
+            }
+            else
+            {
+                pending.promise.set_value(std::move(pending.reply));
+            }
+        }
+    }
+
+    RequestTracker(const RequestTracker&);
+    RequestTracker& operator=(const RequestTracker&);
+
+    REQUEST_ORDER m_Order;
+    size_t m_MaxInFlight;
+    unsigned short m_NextID;
+    std::mutex m_Mutex;
+    PendingMap m_Pending;
+    std::deque<unsigned short> m_Submitted; // Issue order, SUBMITTED only
+};
+
+#endif
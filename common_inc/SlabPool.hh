@@ -0,0 +1,392 @@
+#ifndef __SLAB_POOL_HH
+#define __SLAB_POOL_HH
+
+/* Size-class slab allocator for message buffers.
+
+ * Blocks are carved out of large slabs and recycled through a small
+ * thread-local cache per size class. When a cache runs dry it refills in a
+ * batch from the shared free list of that class, and only when that is
+ * empty is a new slab malloc'd. Memory is never handed back to the system,
+ * so after warmup the message path does not touch malloc at all.
+
+ * Requests larger than the biggest size class go straight to malloc and
+ * are counted as oversized. Their size is not kept so bytes in use only
+ * counts pooled blocks.
+
+ * Counts taken on every Allocate()/Free() live in the calling thread's
+ * cache. Only that thread writes them, so the hot path does no locked
+ * instructions for them. Stats() sums every live cache plus whatever the
+ * threads that already exited left behind.
+
+ * Every block carries a reference count starting at one. Retain() adds an
+ * owner and Free() drops one, so a block can be shared between threads and
+ * only goes back to the pool when its last owner lets go.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+
+struct SLAB_POOL_STATS
+{
+    uint64_t allocations; // Total Allocate() calls
+    uint64_t thread_hits; // Served from the calling thread's cache
+    uint64_t shared_hits; // Served by refilling from the shared free list
+    uint64_t misses; // Needed a new slab
+    uint64_t oversized; // Too large for any size class -- malloc'd
+    uint64_t bytes_held; // Slab memory owned by the pool
+    uint64_t bytes_in_use; // Pooled blocks handed out and not yet freed
+
+    double HitRate() const
+    {
+        if(0 == allocations)
+        {
+            return 0.0;
+        }
+
+        return static_cast<double>(thread_hits + shared_hits) / allocations;
+    }
+};
+
+class SlabPool
+{
+public:
+    static constexpr size_t NUM_SIZE_CLASSES = 11; // 64B -> 64KB
+    static constexpr size_t MIN_CLASS_SHIFT = 6;
+    static constexpr size_t MAX_BLOCK_SIZE = size_t(1) << (MIN_CLASS_SHIFT + NUM_SIZE_CLASSES - 1);
+    static constexpr size_t THREAD_CACHE_SIZE = 64; // Blocks per class per thread
+    static constexpr size_t SLAB_SIZE = 256 * 1024; // Bytes per slab (at least one block)
+    static constexpr unsigned int OVERSIZED_CLASS = NUM_SIZE_CLASSES;
+
+    // Prefix of every block. Data starts right after it.
+    struct alignas(16) BLOCK_HEADER
+    {
+        BLOCK_HEADER* next; // Free list link while pooled
+        unsigned int size_class;
+        std::atomic<unsigned int> refs; // Owners while handed out
+    };
+    static_assert(16 == sizeof(BLOCK_HEADER), "Block header must keep data 16 byte aligned");
+
+    // Never destroyed -- daemon threads may still free blocks during exit
+    static SlabPool& Instance()
+    {
+        static SlabPool* instance = new SlabPool();
+        return *instance;
+    }
+
+    void* Allocate(size_t size)
+    {
+        ThreadCache& cache = LocalCache();
+        Bump(cache.counts.allocations);
+
+        unsigned int size_class = SizeClass(size);
+        BLOCK_HEADER* block = nullptr;
+        if(OVERSIZED_CLASS == size_class)
+        {
+            Bump(cache.counts.oversized);
+            block = static_cast<BLOCK_HEADER*>(malloc(sizeof(BLOCK_HEADER) + size));
+            if(nullptr == block)
+            {
+                return nullptr;
+            }
+        }
+        else
+        {
+            if(0 == cache.count[size_class])
+            {
+                Refill(cache, size_class);
+            }
+            else
+            {
+                Bump(cache.counts.thread_hits);
+            }
+
+            if(0 == cache.count[size_class])
+            {
+                return nullptr;
+            }
+
+            block = cache.blocks[size_class][--cache.count[size_class]];
+            Bump(cache.counts.bytes_allocated, ClassSize(size_class));
+        }
+
+        block->size_class = size_class;
+        block->next = nullptr;
+        block->refs.store(1, std::memory_order_relaxed);
+        return block + 1;
+    }
+
+    void Free(void* memory)
+    {
+        if(nullptr == memory)
+        {
+            return;
+        }
+
+        BLOCK_HEADER* block = static_cast<BLOCK_HEADER*>(memory) - 1;
+
+        // Sole owner skips the locked decrement
+        if(1 != block->refs.load(std::memory_order_acquire) &&
+           1 != block->refs.fetch_sub(1, std::memory_order_acq_rel))
+        {
+            return;
+        }
+
+        unsigned int size_class = block->size_class;
+
+        if(OVERSIZED_CLASS == size_class)
+        {
+            free(block);
+            return;
+        }
+
+        ThreadCache& cache = LocalCache();
+        Bump(cache.counts.bytes_freed, ClassSize(size_class));
+
+        if(THREAD_CACHE_SIZE == cache.count[size_class])
+        {
+            // Give half back so the other threads can use them
+            Release(cache, size_class, THREAD_CACHE_SIZE / 2);
+        }
+
+        cache.blocks[size_class][cache.count[size_class]++] = block;
+    }
+
+    // Add an owner -- each one must Free() the block
+    void Retain(void* memory)
+    {
+        BLOCK_HEADER* block = static_cast<BLOCK_HEADER*>(memory) - 1;
+        block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    SLAB_POOL_STATS Stats()
+    {
+        CACHE_TOTALS totals;
+        {
+            std::lock_guard<std::mutex> lock(m_CachesMutex);
+            totals = m_Retired;
+            for(const ThreadCache* cache : m_Caches)
+            {
+                totals.Add(cache->counts);
+            }
+        }
+
+        SLAB_POOL_STATS stats;
+        stats.allocations = totals.allocations;
+        stats.thread_hits = totals.thread_hits;
+        stats.shared_hits = m_SharedHits.load(std::memory_order_relaxed);
+        stats.misses = m_Misses.load(std::memory_order_relaxed);
+        stats.oversized = totals.oversized;
+        stats.bytes_held = m_BytesHeld.load(std::memory_order_relaxed);
+
+        // A block freed on another thread than the one that took it may be
+        // seen freed before it is seen taken
+        stats.bytes_in_use = totals.bytes_allocated > totals.bytes_freed ?
+            totals.bytes_allocated - totals.bytes_freed : 0;
+        return stats;
+    }
+
+    static size_t ClassSize(unsigned int size_class)
+    {
+        return size_t(1) << (MIN_CLASS_SHIFT + size_class);
+    }
+
+    static unsigned int SizeClass(size_t size)
+    {
+        unsigned int size_class = 0;
+        while(size_class < NUM_SIZE_CLASSES && ClassSize(size_class) < size)
+        {
+            size_class++;
+        }
+
+        return size_class;
+    }
+
+private:
+
+    // Written by the owning thread only, read by Stats() from any thread
+    struct CACHE_COUNTS
+    {
+        std::atomic<uint64_t> allocations{0};
+        std::atomic<uint64_t> thread_hits{0};
+        std::atomic<uint64_t> oversized{0};
+        std::atomic<uint64_t> bytes_allocated{0}; // Pooled blocks only
+        std::atomic<uint64_t> bytes_freed{0};
+    };
+
+    struct CACHE_TOTALS
+    {
+        uint64_t allocations = 0;
+        uint64_t thread_hits = 0;
+        uint64_t oversized = 0;
+        uint64_t bytes_allocated = 0;
+        uint64_t bytes_freed = 0;
+
+        void Add(const CACHE_COUNTS& counts)
+        {
+            allocations += counts.allocations.load(std::memory_order_relaxed);
+            thread_hits += counts.thread_hits.load(std::memory_order_relaxed);
+            oversized += counts.oversized.load(std::memory_order_relaxed);
+            bytes_allocated += counts.bytes_allocated.load(std::memory_order_relaxed);
+            bytes_freed += counts.bytes_freed.load(std::memory_order_relaxed);
+        }
+    };
+
+    // Single writer -- a plain load and store, no locked add
+    static void Bump(std::atomic<uint64_t>& count, uint64_t amount = 1)
+    {
+        count.store(count.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    struct ThreadCache
+    {
+        BLOCK_HEADER* blocks[NUM_SIZE_CLASSES][THREAD_CACHE_SIZE];
+        size_t count[NUM_SIZE_CLASSES];
+        CACHE_COUNTS counts;
+        SlabPool* owner;
+
+        ThreadCache(SlabPool* pool)
+            : count(), counts(), owner(pool)
+        {
+            owner->Register(this);
+        }
+
+        // Hand everything back when the thread exits
+        ~ThreadCache()
+        {
+            for(unsigned int size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++)
+            {
+                owner->Release(*this, size_class, count[size_class]);
+            }
+            owner->Unregister(this);
+        }
+    };
+
+    void Register(ThreadCache* cache)
+    {
+        std::lock_guard<std::mutex> lock(m_CachesMutex);
+        m_Caches.push_back(cache);
+    }
+
+    // Keep the exiting thread's counts in the totals
+    void Unregister(ThreadCache* cache)
+    {
+        std::lock_guard<std::mutex> lock(m_CachesMutex);
+        m_Retired.Add(cache->counts);
+        m_Caches.erase(std::remove(m_Caches.begin(), m_Caches.end(), cache), m_Caches.end());
+    }
+
+    struct SharedList
+    {
+        std::mutex mutex;
+        BLOCK_HEADER* head = nullptr;
+    };
+
+    ThreadCache& LocalCache()
+    {
+        thread_local ThreadCache cache(this);
+        return cache;
+    }
+
+    void Refill(ThreadCache& cache, unsigned int size_class)
+    {
+        SharedList& shared = m_Shared[size_class];
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            while(nullptr != shared.head &&
+                  cache.count[size_class] < THREAD_CACHE_SIZE / 2)
+            {
+                cache.blocks[size_class][cache.count[size_class]++] = shared.head;
+                shared.head = shared.head->next;
+            }
+        }
+
+        if(0 != cache.count[size_class])
+        {
+            m_SharedHits.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        m_Misses.fetch_add(1, std::memory_order_relaxed);
+        CarveSlab(cache, size_class);
+    }
+
+    void Release(ThreadCache& cache, unsigned int size_class, size_t num_blocks)
+    {
+        if(0 == num_blocks)
+        {
+            return;
+        }
+
+        SharedList& shared = m_Shared[size_class];
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        while(num_blocks--)
+        {
+            BLOCK_HEADER* block = cache.blocks[size_class][--cache.count[size_class]];
+            block->next = shared.head;
+            shared.head = block;
+        }
+    }
+
+    void CarveSlab(ThreadCache& cache, unsigned int size_class)
+    {
+        const size_t block_size = sizeof(BLOCK_HEADER) + ClassSize(size_class);
+        size_t num_blocks = SLAB_SIZE / block_size;
+        if(0 == num_blocks)
+        {
+            num_blocks = 1;
+        }
+
+        char* slab = static_cast<char*>(malloc(block_size * num_blocks));
+        if(nullptr == slab)
+        {
+            return;
+        }
+
+        m_BytesHeld.fetch_add(block_size * num_blocks, std::memory_order_relaxed);
+
+        // Keep what fits in the cache and share the rest
+        size_t block_index = 0;
+        for(; block_index < num_blocks && cache.count[size_class] < THREAD_CACHE_SIZE / 2; block_index++)
+        {
+            BLOCK_HEADER* block = reinterpret_cast<BLOCK_HEADER*>(slab + block_index * block_size);
+            block->size_class = size_class;
+            cache.blocks[size_class][cache.count[size_class]++] = block;
+        }
+
+        SharedList& shared = m_Shared[size_class];
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        for(; block_index < num_blocks; block_index++)
+        {
+            BLOCK_HEADER* block = reinterpret_cast<BLOCK_HEADER*>(slab + block_index * block_size);
+            block->size_class = size_class;
+            block->next = shared.head;
+            shared.head = block;
+        }
+    }
+
+    SlabPool()
+        : m_CachesMutex(), m_Caches(), m_Retired(),
+          m_SharedHits(0), m_Misses(0), m_BytesHeld(0)
+    {
+    }
+
+    SlabPool(const SlabPool&);
+    SlabPool& operator=(const SlabPool&);
+
+    SharedList m_Shared[NUM_SIZE_CLASSES];
+    // Every call -- counted per thread cache
+    std::mutex m_CachesMutex; // Guards m_Caches and m_Retired
+    std::vector<ThreadCache*> m_Caches; // One per live thread
+    CACHE_TOTALS m_Retired; // Left by threads that exited
+    // Refills and new slabs only, under a shared list lock anyway
+    std::atomic<uint64_t> m_SharedHits;
+    std::atomic<uint64_t> m_Misses;
+    std::atomic<uint64_t> m_BytesHeld;
+};
+
+#endif
@@ -4,8 +4,18 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
 #include <unordered_map>
+#include <cstdint>
 #include <DaemonThread.hh>
+#include <EventNotifier.hh>
+#include <LockFreeQ.hh>
 
 template <class Key, class Element>
 class TasM
@@ -102,13 +112,24 @@ class TasQ
         bool m_Done;
         std::mutex n_Mutex;
         std::condition_variable n_ReadyCondition;
+        EventNotifier* m_Notifier;
 
     public:
         TasQ()
-            : m_ResultQueue(), m_Done(false), n_Mutex(), n_ReadyCondition()
+            : m_ResultQueue(), m_Done(false), n_Mutex(), n_ReadyCondition(),
+              m_Notifier(nullptr)
         {
         }
 
+        // Notified whenever the queue goes from empty to not empty. Consumers
+        // waiting on it must PopNoWait() until empty before waiting again.
+        void SetNotifier(EventNotifier* notifier)
+        {
+            n_Mutex.lock();
+            m_Notifier = notifier;
+            n_Mutex.unlock();
+        }
+
         void done()
         {
             n_Mutex.lock();
@@ -137,6 +158,22 @@ class TasQ
             return true;
         }
 
+        // Never blocks for an element but, unlike TryPop, does wait for the
+        // lock so it can't miss one that is already queued
+        bool PopNoWait(Element& result)
+        {
+            std::lock_guard<std::mutex> lock(n_Mutex);
+            if(m_ResultQueue.empty())
+            {
+                return false;
+            }
+
+            result = std::move(m_ResultQueue.front());
+            m_ResultQueue.pop();
+
+            return true;
+        }
+
         bool TryPop(Element& result)
         {
 
@@ -162,10 +199,22 @@ class TasQ
         void Push(Element& result)
         {
             n_Mutex.lock();
+            bool was_empty = m_ResultQueue.empty();
             m_ResultQueue.push(result);
+            EventNotifier* notifier = m_Notifier;
             n_Mutex.unlock();
 
             n_ReadyCondition.notify_one();
+            if(was_empty && nullptr != notifier)
+            {
+                notifier->Notify();
+            }
+        }
+
+        size_t Size(void)
+        {
+            std::lock_guard<std::mutex> lock(n_Mutex);
+            return m_ResultQueue.size();
         }
 
         bool TryPush(Element& result)
@@ -175,178 +224,493 @@ class TasQ
                 return false;
             }
 
+            bool was_empty = m_ResultQueue.empty();
             m_ResultQueue.push(result);
+            EventNotifier* notifier = m_Notifier;
 
             n_Mutex.unlock();
             n_ReadyCondition.notify_one();
+            if(was_empty && nullptr != notifier)
+            {
+                notifier->Notify();
+            }
             return true;
         }
 };
 
-#if 0
-template <class Element>
-class TaskWorker : public DaemonThread<std::vector<TasQ<Element>>*>
+class PoolTask
+{
+
+public:
+
+    virtual ~PoolTask() { }
+    virtual void Run(void) = 0;
+};
+
+// Keeps the result or exception for the caller's future
+template<class Result>
+class PackagedPoolTask : public PoolTask
 {
 
+public:
+
+    explicit PackagedPoolTask(std::packaged_task<Result()>&& task)
+        : m_Task(std::move(task))
+    {
+    }
+
+    void Run(void)
+    {
+        m_Task();
+    }
+
 private:
-    size_t worker_id;
-    bool m_Running;
 
-    TaskWorker& operator=(const TaskWorker&);
+    std::packaged_task<Result()> m_Task;
+};
+
+/* Chase-Lev deque of tasks.
+ *
+ * The owning worker pushes and pops at the bottom, other workers steal
+ * from the top. Only the last task needs a CAS to settle who gets it.
+ * Grows when full -- outgrown rings are kept until the deque goes because
+ * a thief may still be reading one.
+ */
+class TaskDeque
+{
 
 public:
 
-    TaskWorker(const TaskWorker&) { }
+    explicit TaskDeque(size_t capacity = 256)
+        : m_Top(0), m_Bottom(0), m_Ring(nullptr), m_Rings()
+    {
+        m_Rings.emplace_back(new RING(LockFreeCapacity(capacity)));
+        m_Ring.store(m_Rings.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only
+    void Push(PoolTask* task)
+    {
+        const int64_t bottom = m_Bottom.load(std::memory_order_relaxed);
+        const int64_t top = m_Top.load(std::memory_order_acquire);
+        RING* ring = m_Ring.load(std::memory_order_relaxed);
+        if(bottom - top > static_cast<int64_t>(ring->mask))
+        {
+            ring = Grow(ring, top, bottom);
+        }
+
+        ring->slots[bottom & ring->mask].store(task, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
 
-    void execute(std::vector<TasQ<Element>>* results_queue)
+    // Owner only. Newest first.
+    PoolTask* Pop(void)
     {
+        const int64_t bottom = m_Bottom.load(std::memory_order_relaxed) - 1;
+        RING* ring = m_Ring.load(std::memory_order_relaxed);
+        m_Bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_Top.load(std::memory_order_relaxed);
 
-        Element result;
-        result.m_End = 0;
-        std::vector<TasQ<Element>>& queue = *results_queue;
+        if(top > bottom)
+        {
+            m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
 
-        while (!StopRequested())
+        PoolTask* task = ring->slots[bottom & ring->mask].load(std::memory_order_relaxed);
+        if(top == bottom)
         {
-            // Steal tasks
-            for(size_t queueIndex = 0; queueIndex != queue.size(); ++queueIndex)
+            // Last one -- thieves may be after it too
+            if(!m_Top.compare_exchange_strong(top, top + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed))
             {
-                if(queue[(queueIndex + worker_id) %
-                    queue.size()].TryPop(result))
-                {
-                    break;
-                }
+                task = nullptr;
             }
+            m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
 
-            // Otherwise wait for ours
-            if(!result.m_End && !queue[worker_id].Pop(result))
-            {
-                // Once done, just wait for the thread to be stopped
-                continue;
-            }
+        return task;
+    }
 
-            PerformTask(result);
+    // Any thread. Oldest first. nullptr when empty or another thief won.
+    PoolTask* Steal(void)
+    {
+        int64_t top = m_Top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t bottom = m_Bottom.load(std::memory_order_acquire);
+        if(top >= bottom)
+        {
+            return nullptr;
         }
 
-        // If we stopped before our queue is empty then
-        while(queue[worker_id].Pop(result))
+        RING* ring = m_Ring.load(std::memory_order_acquire);
+        PoolTask* task = ring->slots[top & ring->mask].load(std::memory_order_relaxed);
+        if(!m_Top.compare_exchange_strong(top, top + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
         {
-            PerformTask(result);
+            return nullptr;
         }
 
-        m_json_stream.close();
+        return task;
+    }
+
+    bool Empty(void) const
+    {
+        return m_Bottom.load(std::memory_order_acquire) <= m_Top.load(std::memory_order_acquire);
     }
 
-    TaskWorker(size_t writer_id)
-        : worker_id(writer_id), m_Running(false)
+private:
+
+    struct RING
+    {
+        explicit RING(size_t capacity)
+            : mask(capacity - 1), slots(new std::atomic<PoolTask*>[capacity])
         {
         }
 
-    ~TaskWorker()
-    {
-    }
+        size_t mask;
+        std::unique_ptr<std::atomic<PoolTask*>[]> slots;
+    };
 
-    void PerformTask(const Element& result)
+    RING* Grow(RING* ring, int64_t top, int64_t bottom)
     {
+        m_Rings.emplace_back(new RING((ring->mask + 1) * 2));
+        RING* grown = m_Rings.back().get();
+        for(int64_t index = top; index < bottom; index++)
+        {
+            grown->slots[index & grown->mask].store(
+                ring->slots[index & ring->mask].load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+        }
+
+        m_Ring.store(grown, std::memory_order_release);
+        return grown;
     }
 
+    TaskDeque(const TaskDeque&);
+    TaskDeque& operator=(const TaskDeque&);
+
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<int64_t> m_Top; // Thieves' end
+    alignas(LOCKFREE_CACHE_LINE) std::atomic<int64_t> m_Bottom; // Owner's end
+    std::atomic<RING*> m_Ring;
+    std::vector<std::unique_ptr<RING>> m_Rings; // Owner only
 };
 
-template <class Element>
+/* Work-stealing thread pool.
+ *
+ * Every worker runs the tasks on its own deque, newest first, and steals
+ * the oldest from the others when it runs dry. Tasks submitted by a task
+ * go on that worker's deque so split-up work stays on one cache until
+ * someone idle takes it. Tasks from other threads go on a shared queue
+ * that workers check before stealing. Workers with nothing to find park
+ * until the next Submit().
+ *
+ * Waiting on a future from inside a task would hold up a worker -- use
+ * Await() there, which runs other tasks until the result is ready.
+ */
 class TasqPool
 {
-    static constexpr size_t ROUNDS = 3;
+
 public:
 
-    // Could try to make this async
-    void PushTask(Element&& result)
+    // Zero workers means one per core
+    explicit TasqPool(size_t num_workers = 0)
+        : m_Workers(), m_InjectedMutex(), m_Injected(), m_NumInjected(0), m_Closed(false),
+          m_ParkMutex(), m_ParkCondition(), m_Parked(0), m_Stopping(false)
     {
-        if(!m_Ready)
+        if(0 == num_workers)
         {
-            // Bail out to avoid accessing the empty queue array
-            return;
+            num_workers = std::max(1U, std::thread::hardware_concurrency());
         }
 
-        // Keep moving where we start pushing to spread between queues
-        m_PushIndex++; // May need to reset to avoid possible integer overflow?
+        for(size_t worker = 0; worker < num_workers; worker++)
+        {
+            m_Workers.emplace_back(new TaskWorker(*this, worker));
+        }
 
-        // Run through queues to see if any are available for a push
-        for(size_t queueIndex = 0;
-            queueIndex != m_Queues.size() * ROUNDS;
-            ++queueIndex)
+        for(std::unique_ptr<TaskWorker>& worker : m_Workers)
         {
-            if(m_Queues[(m_PushIndex + queueIndex) %
-                m_Queues.size()].TryPush(std::move(result)))
+            worker->Start();
+        }
+    }
+
+    ~TasqPool()
+    {
+        Stop();
+    }
+
+    // Runs task on the pool. Once stopped it runs on the caller instead.
+    template<class Function>
+    std::future<typename std::invoke_result<Function>::type> Submit(Function&& task)
+    {
+        typedef typename std::invoke_result<Function>::type Result;
+        std::packaged_task<Result()> packaged(std::forward<Function>(task));
+        std::future<Result> result = packaged.get_future();
+        Schedule(new PackagedPoolTask<Result>(std::move(packaged)));
+        return result;
+    }
+
+    // future.get() that keeps a worker busy while it waits
+    template<class Result>
+    Result Await(std::future<Result>& result)
+    {
+        if(this == s_Current.pool)
+        {
+            while(std::future_status::ready != result.wait_for(std::chrono::seconds(0)))
+            {
+                PoolTask* task = FindTask(s_Current.index);
+                if(nullptr == task)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                RunTask(task);
+            }
+        }
+
+        return result.get();
+    }
+
+    // body(first, last) over [begin, end) in pieces of grain. Returns once
+    // every piece is done.
+    template<class Function>
+    void ParallelFor(size_t begin, size_t end, size_t grain, Function body)
+    {
+        grain = std::max(static_cast<size_t>(1), grain);
+        std::vector<std::future<void>> pieces;
+        for(size_t first = begin; first < end; first += grain)
+        {
+            const size_t last = std::min(end, first + grain);
+            pieces.push_back(Submit([&body, first, last]()
+            {
+                body(first, last);
+            }));
+        }
+
+        for(std::future<void>& piece : pieces)
+        {
+            Await(piece);
+        }
+    }
+
+    // Workers finish what they are running and leave. Anything still queued
+    // runs on the caller so no future is left waiting.
+    void Stop(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_ParkMutex);
+            if(m_Stopping.exchange(true))
             {
                 return;
             }
         }
+        m_ParkCondition.notify_all();
+
+        for(std::unique_ptr<TaskWorker>& worker : m_Workers)
+        {
+            worker->Stop();
+        }
 
-        // All queues are busy, just wait until free;
-        m_Queues[m_PushIndex % m_Queues.size()].Push(std::move(result));
+        // Workers are gone so only outside threads can still schedule --
+        // after this they run their own tasks and the drain sees the rest
+        {
+            std::lock_guard<std::mutex> lock(m_InjectedMutex);
+            m_Closed = true;
+        }
+
+        PoolTask* task = nullptr;
+        while(nullptr != (task = FindTask(0)))
+        {
+            RunTask(task);
+        }
     }
 
-    TasqPool(const std::string& file_path = "", bool enabled = true,
-             size_t num_threads = 4)
-    : m_PushIndex(0), m_NumQueues(num_threads), m_Queues(m_NumQueues),
-      m_Ready(enabled),
+    size_t NumWorkers(void) const
     {
-        if(!enabled)
+        return m_Workers.size();
+    }
+
+    static TasqPool& Instance()
+    {
+        /* Singleton instance*/
+        static TasqPool instance;
+        return instance;
+    }
+
+private:
+
+    class TaskWorker : public DaemonThread<>
+    {
+
+    public:
+
+        TaskWorker(TasqPool& pool, size_t index)
+            : m_Pool(pool), m_Index(index), m_Deque()
+        {
+        }
+
+        void execute()
         {
+            s_Current.pool = &m_Pool;
+            s_Current.index = m_Index;
+
+            while(!m_Pool.m_Stopping.load(std::memory_order_acquire))
+            {
+                PoolTask* task = m_Pool.FindTask(m_Index);
+                if(nullptr == task)
+                {
+                    m_Pool.Park();
+                    continue;
+                }
+
+                RunTask(task);
+            }
+
+            s_Current.pool = nullptr;
+        }
+
+        void Wake()
+        {
+            std::lock_guard<std::mutex> lock(m_Pool.m_ParkMutex);
+            m_Pool.m_ParkCondition.notify_all();
+        }
+
+        TasqPool& m_Pool;
+        size_t m_Index;
+        TaskDeque m_Deque;
+    };
+
+    // Which pool, if any, the calling thread works for
+    struct CURRENT_WORKER
+    {
+        TasqPool* pool;
+        size_t index;
+    };
+
+    static void RunTask(PoolTask* task)
+    {
+        task->Run();
+        delete task;
+    }
+
+    void Schedule(PoolTask* task)
+    {
+        if(m_Stopping.load(std::memory_order_acquire))
+        {
+            RunTask(task);
             return;
         }
 
-        m_Workers.reserve(m_NumQueues); // avoid copy constructors
-        for(size_t worker_id = 0; worker_id < m_NumQueues; worker_id++)
+        if(this == s_Current.pool)
         {
-            m_Workers.emplace_back(worker_id);
+            m_Workers[s_Current.index]->m_Deque.Push(task);
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(m_InjectedMutex);
+            if(m_Closed)
+            {
+                // Stop() is draining or done and may not come back for it
+                lock.unlock();
+                RunTask(task);
+                return;
+            }
+            m_Injected.push_back(task);
+            m_NumInjected.fetch_add(1, std::memory_order_release);
         }
 
-        for(TaskWorker& worker : m_Workers)
+        // Pairs with the fence in Park() -- either it sees the task or we
+        // see it parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(0 != m_Parked.load(std::memory_order_relaxed))
         {
-            worker.Start(&m_Queues);
+            std::lock_guard<std::mutex> lock(m_ParkMutex);
+            m_ParkCondition.notify_one();
         }
     }
 
-    ~TasqPool()
+    // Own deque, then the shared queue, then steal starting past ourself
+    PoolTask* FindTask(size_t index)
     {
-        if(m_Ready)
+        PoolTask* task = m_Workers[index]->m_Deque.Pop();
+        if(nullptr != task)
+        {
+            return task;
+        }
+
+        if(0 != m_NumInjected.load(std::memory_order_acquire))
         {
-            Stop();
+            std::lock_guard<std::mutex> lock(m_InjectedMutex);
+            if(!m_Injected.empty())
+            {
+                task = m_Injected.front();
+                m_Injected.pop_front();
+                m_NumInjected.fetch_sub(1, std::memory_order_release);
+                return task;
+            }
+        }
+
+        for(size_t victim = 1; victim < m_Workers.size(); victim++)
+        {
+            task = m_Workers[(index + victim) % m_Workers.size()]->m_Deque.Steal();
+            if(nullptr != task)
+            {
+                return task;
+            }
         }
+
+        return nullptr;
     }
 
-    void Stop()
+    bool HasWork(void) const
     {
-        // Must be done before we stop writers
-        for(TasQ& queue : m_Queues)
+        if(0 != m_NumInjected.load(std::memory_order_acquire))
         {
-            queue.done();
+            return true;
         }
 
-        for(TaskWorker& writer: m_Workers)
+        for(const std::unique_ptr<TaskWorker>& worker : m_Workers)
         {
-            writer.Stop();
+            if(!worker->m_Deque.Empty())
+            {
+                return true;
+            }
         }
+
+        return false;
     }
 
-    static TasqPool& Instance()
+    void Park(void)
     {
-        /* Singleton instance*/
-        static TasqPool instance;
-        return instance;
+        std::unique_lock<std::mutex> lock(m_ParkMutex);
+        m_Parked.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!m_Stopping.load(std::memory_order_relaxed) && !HasWork())
+        {
+            m_ParkCondition.wait(lock);
+        }
+        m_Parked.fetch_sub(1, std::memory_order_relaxed);
     }
 
-private:
     TasqPool(const TasqPool&);
     TasqPool& operator=(const TasqPool&);
 
-    private:
-        size_t m_PushIndex;
-        size_t m_NumQueues;
-        std::vector<TaskWorker> m_Workers;
-        std::vector<TasQ> m_Queues;
-        bool m_Ready;
+    static inline thread_local CURRENT_WORKER s_Current = {nullptr, 0};
+
+    std::vector<std::unique_ptr<TaskWorker>> m_Workers;
+
+    std::mutex m_InjectedMutex;
+    std::deque<PoolTask*> m_Injected; // Submitted from outside the pool
+    std::atomic<size_t> m_NumInjected;
+    bool m_Closed; // Guarded by m_InjectedMutex -- set once Stop() drains
+
+    std::mutex m_ParkMutex;
+    std::condition_variable m_ParkCondition;
+    std::atomic<size_t> m_Parked;
+    std::atomic<bool> m_Stopping;
 };
 
 #endif
-#endif
\ No newline at end of file
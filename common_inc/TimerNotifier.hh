@@ -0,0 +1,90 @@
+#ifndef __TIMER_NOTIFIER_HH
+#define __TIMER_NOTIFIER_HH
+
+/* Wakes a thread when a deadline passes.
+ *
+ * Wraps a timerfd so a poll loop can wait on timeouts the same way it waits
+ * on sockets and EventNotifier. Only one deadline is held at a time -- the
+ * owner keeps its own list and arms the timer for the earliest.
+ */
+
+#include <Logger.hh>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdint>
+#include <chrono>
+
+class TimerNotifier
+{
+
+public:
+
+    TimerNotifier()
+        : m_FD(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    {
+        if(0 > m_FD)
+        {
+            LOG_ERROR("Could not create timerfd: ", strerror(errno));
+        }
+    }
+
+    ~TimerNotifier()
+    {
+        if(0 <= m_FD)
+        {
+            close(m_FD);
+        }
+    }
+
+    // Fire once at deadline -- replaces whatever was armed. steady_clock is
+    // CLOCK_MONOTONIC on Linux so the two can be mixed.
+    void ArmAt(std::chrono::steady_clock::time_point deadline)
+    {
+        std::chrono::nanoseconds since_epoch = deadline.time_since_epoch();
+        struct itimerspec timer_value;
+        memset(&timer_value, 0, sizeof(timer_value));
+        timer_value.it_value.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+        timer_value.it_value.tv_nsec = (since_epoch % std::chrono::seconds(1)).count();
+
+        // All zero would disarm instead
+        if(0 == timer_value.it_value.tv_sec && 0 == timer_value.it_value.tv_nsec)
+        {
+            timer_value.it_value.tv_nsec = 1;
+        }
+
+        if(0 != timerfd_settime(m_FD, TFD_TIMER_ABSTIME, &timer_value, nullptr))
+        {
+            LOG_ERROR("Could not arm timerfd: ", strerror(errno));
+        }
+    }
+
+    void Disarm(void)
+    {
+        struct itimerspec timer_value;
+        memset(&timer_value, 0, sizeof(timer_value));
+        timerfd_settime(m_FD, 0, &timer_value, nullptr);
+    }
+
+    // Clear the expiry so the fd stops polling readable
+    void Drain(void)
+    {
+        uint64_t expirations = 0;
+        while(0 < read(m_FD, &expirations, sizeof(expirations)));
+    }
+
+    int GetFD(void) const
+    {
+        return m_FD;
+    }
+
+private:
+
+    TimerNotifier(const TimerNotifier&);
+    TimerNotifier& operator=(const TimerNotifier&);
+
+    int m_FD;
+};
+
+#endif
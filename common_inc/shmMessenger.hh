@@ -1,70 +1,930 @@
-#ifndef MESSENGER__HH
-#define MESSENGER__HH
-#include <retcode.hh>
-#include <stddef.h>
-#include <OFRI.hh>
-#include <sstream>
-#include <sys/socket.h>
-#include <un.h>
+#ifndef SHM_MESSENGER__HH
+#define SHM_MESSENGER__HH
 
-constexpr unsigned short SOCKET_NAME_SIZE = 60;
+/* Shared memory transport for clients on the same host.
+ *
+ * UpdateDaemon creates one segment with shm_open(). Every client maps it,
+ * claims a slot and then talks through two rings:
+ *
+ *   requests  -- one multi producer ring of fixed size cells shared by all
+ *                clients. Slots are claimed with a CAS on a ticket counter
+ *                and published with a per cell sequence number.
+ *   responses -- one single producer byte ring per client slot, written by
+ *                the daemon and read by that client only.
+ *
+ * Frames inside the rings are the compact INET frames, so requests and
+ * replies look exactly like they do on a socket. Waiting is done with
+ * shared futexes -- a consumer only sleeps after announcing it, and a
+ * producer only makes the wake syscall when someone announced they sleep.
+ *
+ * The segment is created owner only (0600) -- clients must run as the
+ * same user as the daemon.
+ *
+ * A client that dies between claiming and publishing a request cell stalls
+ * the request ring, the same as any lock-free bounded queue. Dead clients
+ * are otherwise noticed by pid and their slot is freed.
+ */
 
-typedef char SOCKET_NAME[SOCKET_NAME_SIZE];
+#include <INETMessenger.hh>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <climits>
+#include <ctime>
+#include <atomic>
+#include <new>
 
-struct MESSAGE_HEADER
+constexpr uint32_t SHM_MAGIC = 0x6b444253; // "kDBS"
+constexpr uint32_t SHM_LAYOUT_VERSION = 1;
+constexpr size_t SHM_MAX_CLIENTS = 64;
+constexpr size_t SHM_REQUEST_CELLS = 1024; // Must be a power of two
+constexpr size_t SHM_CELL_SIZE = 4096; // Largest request frame
+constexpr size_t SHM_RESPONSE_RING_SIZE = 256 * 1024; // Per client, power of two
+constexpr int SHM_LIVENESS_MS = 1000; // How often dead clients are looked for
+constexpr size_t SHM_CACHE_LINE = 64;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared rings need address free atomics");
+
+// Shared memory clients are named "shm:<pid>:<n>" with their slot as the
+// port. n counts every client the daemon has added, so a process that
+// reopens and lands on its old slot does not get replies meant for the old
+// session. The daemon, as its clients see it, is just "shm:<pid>".
+static const char SHM_CONNECTION_PREFIX[] = "shm:";
+
+inline bool IsShmConnection(const CONNECTION& connection)
+{
+    return 0 == strncmp(connection.address, SHM_CONNECTION_PREFIX, sizeof(SHM_CONNECTION_PREFIX) - 1);
+}
+
+// Futex wakeup shared between processes. Producers Signal() after
+// publishing, consumers Wait() with the sequence they saw before checking
+// for work so a signal in between is never lost.
+struct SHM_SIGNAL
+{
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> sleeping;
+
+    void Signal(void)
+    {
+        sequence.fetch_add(1, std::memory_order_seq_cst);
+        if(0 != sleeping.load(std::memory_order_seq_cst))
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    uint32_t Observe(void)
+    {
+        return sequence.load(std::memory_order_seq_cst);
+    }
+
+    // Caller re-checks for work between Observe() and Wait()
+    void Wait(uint32_t observed, int timeout_ms)
+    {
+        struct timespec timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+        sleeping.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAIT, observed,
+            0 > timeout_ms ? nullptr : &timeout, nullptr, 0);
+        sleeping.fetch_sub(1, std::memory_order_seq_cst);
+    }
+};
+
+enum SHM_CELL_KIND
+{
+    SHM_CELL_FRAME = 0,
+    SHM_CELL_CONNECT,
+    SHM_CELL_DISCONNECT
+};
+
+struct alignas(SHM_CACHE_LINE) SHM_REQUEST_CELL
+{
+    std::atomic<uint64_t> sequence; // Position it can be written at, +1 once readable
+    uint32_t slot; // Client that sent it
+    uint32_t kind;
+    uint32_t size;
+    char frame[SHM_CELL_SIZE];
+};
+
+// Bounded MPSC queue -- any client pushes, only the daemon pops
+struct SHM_REQUEST_RING
+{
+    alignas(SHM_CACHE_LINE) std::atomic<uint64_t> tail; // Next ticket for producers
+    alignas(SHM_CACHE_LINE) uint64_t head; // Daemon only
+    alignas(SHM_CACHE_LINE) SHM_SIGNAL signal;
+    SHM_REQUEST_CELL cells[SHM_REQUEST_CELLS];
+
+    void Init(void)
+    {
+        tail.store(0, std::memory_order_relaxed);
+        head = 0;
+        signal.sequence.store(0, std::memory_order_relaxed);
+        signal.sleeping.store(0, std::memory_order_relaxed);
+        for(uint64_t cell = 0; cell < SHM_REQUEST_CELLS; cell++)
+        {
+            cells[cell].sequence.store(cell, std::memory_order_relaxed);
+        }
+    }
+
+    bool Push(uint32_t slot, uint32_t kind, const char* frame, uint32_t size)
+    {
+        uint64_t position = tail.load(std::memory_order_relaxed);
+        SHM_REQUEST_CELL* cell = nullptr;
+        while(true)
+        {
+            cell = &cells[position & (SHM_REQUEST_CELLS - 1)];
+            int64_t ready = static_cast<int64_t>(cell->sequence.load(std::memory_order_acquire) - position);
+            if(0 == ready)
+            {
+                if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(0 > ready)
+            {
+                // Daemon has not caught up
+                return false;
+            }
+            else
+            {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->slot = slot;
+        cell->kind = kind;
+        cell->size = size;
+        if(0 < size)
+        {
+            memcpy(cell->frame, frame, size);
+        }
+        cell->sequence.store(position + 1, std::memory_order_release);
+        signal.Signal();
+        return true;
+    }
+
+    // Cell stays valid until Release()
+    SHM_REQUEST_CELL* Peek(void)
+    {
+        SHM_REQUEST_CELL* cell = &cells[head & (SHM_REQUEST_CELLS - 1)];
+        if(cell->sequence.load(std::memory_order_acquire) != head + 1)
+        {
+            return nullptr;
+        }
+
+        return cell;
+    }
+
+    void Release(SHM_REQUEST_CELL* cell)
+    {
+        cell->sequence.store(head + SHM_REQUEST_CELLS, std::memory_order_release);
+        head++;
+    }
+};
+
+// SPSC byte ring of length prefixed frames. Frames wrap around the end.
+struct SHM_RESPONSE_RING
+{
+    alignas(SHM_CACHE_LINE) std::atomic<uint64_t> head; // Client only
+    alignas(SHM_CACHE_LINE) std::atomic<uint64_t> tail; // Daemon only
+    alignas(SHM_CACHE_LINE) SHM_SIGNAL signal;
+    char data[SHM_RESPONSE_RING_SIZE];
+
+    void Reset(void)
+    {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        signal.sleeping.store(0, std::memory_order_relaxed);
+    }
+
+    // Header and payload are gathered in so the frame is only copied once
+    bool Push(const char* header, uint32_t header_size, const char* payload, uint32_t payload_size)
+    {
+        const uint32_t frame_size = header_size + payload_size;
+        uint64_t position = tail.load(std::memory_order_relaxed);
+        if(SHM_RESPONSE_RING_SIZE - (position - head.load(std::memory_order_acquire)) <
+           sizeof(frame_size) + frame_size)
+        {
+            return false;
+        }
+
+        CopyIn(position, reinterpret_cast<const char*>(&frame_size), sizeof(frame_size));
+        CopyIn(position + sizeof(frame_size), header, header_size);
+        CopyIn(position + sizeof(frame_size) + header_size, payload, payload_size);
+        tail.store(position + sizeof(frame_size) + frame_size, std::memory_order_release);
+        signal.Signal();
+        return true;
+    }
+
+    // Returns the frame size, or zero when empty. Frames bigger than
+    // out_size are skipped.
+    uint32_t Pop(char* out_frame, uint32_t out_size)
+    {
+        uint64_t position = head.load(std::memory_order_relaxed);
+        if(position == tail.load(std::memory_order_acquire))
+        {
+            return 0;
+        }
+
+        uint32_t frame_size = 0;
+        CopyOut(position, reinterpret_cast<char*>(&frame_size), sizeof(frame_size));
+        if(frame_size <= out_size)
+        {
+            CopyOut(position + sizeof(frame_size), out_frame, frame_size);
+        }
+
+        head.store(position + sizeof(frame_size) + frame_size, std::memory_order_release);
+        return frame_size <= out_size ? frame_size : 0;
+    }
+
+    // Size of the next frame, or zero when empty
+    uint32_t NextSize(void)
+    {
+        uint64_t position = head.load(std::memory_order_relaxed);
+        if(position == tail.load(std::memory_order_acquire))
+        {
+            return 0;
+        }
+
+        uint32_t frame_size = 0;
+        CopyOut(position, reinterpret_cast<char*>(&frame_size), sizeof(frame_size));
+        return frame_size;
+    }
+
+private:
+
+    void CopyIn(uint64_t position, const char* source, size_t size)
+    {
+        size_t offset = position & (SHM_RESPONSE_RING_SIZE - 1);
+        size_t first = std::min(size, SHM_RESPONSE_RING_SIZE - offset);
+        memcpy(data + offset, source, first);
+        memcpy(data, source + first, size - first);
+    }
+
+    void CopyOut(uint64_t position, char* destination, size_t size)
+    {
+        size_t offset = position & (SHM_RESPONSE_RING_SIZE - 1);
+        size_t first = std::min(size, SHM_RESPONSE_RING_SIZE - offset);
+        memcpy(destination, data + offset, first);
+        memcpy(destination + first, data, size - first);
+    }
+};
+
+enum SHM_SLOT_STATE
 {
-    size_t size;
-    SOCKET_NAME return_address;
+    SHM_SLOT_FREE = 0,
+    SHM_SLOT_CLAIMED, // Client is setting it up
+    SHM_SLOT_OPEN
 };
 
-class Messenger
+struct alignas(SHM_CACHE_LINE) SHM_CLIENT_SLOT
 {
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> pid;
+    SHM_RESPONSE_RING responses;
+};
+
+struct SHM_SEGMENT
+{
+    std::atomic<uint32_t> magic; // Written last by the daemon
+    uint32_t layout_version;
+    std::atomic<int32_t> server_pid; // Zero once the daemon stops
+    SHM_REQUEST_RING requests;
+    SHM_CLIENT_SLOT clients[SHM_MAX_CLIENTS];
+};
+
+// Daemon side -- owns the segment and serves every client slot
+class ShmMessenger: public DaemonThread<int>
+{
+
 public:
-    Messenger(SOCKET_NAME name)
-        : m_MessageID(0)
+
+    ShmMessenger(const std::string& name)
+        : m_Ready(false), m_Name(name), m_Segment(nullptr), m_Generation(0), m_DroppedPackages(0)
+    {
+        PROFILE_FUNCTION();
+        memset(m_Open, 0, sizeof(m_Open));
+        memset(m_Pids, 0, sizeof(m_Pids));
+        CreateSegment();
+    }
+
+    ~ShmMessenger()
+    {
+        StopPoll();
+        if(nullptr != m_Segment)
+        {
+            munmap(m_Segment, sizeof(SHM_SEGMENT));
+        }
+    }
+
+    // Takes ownership of a package from AllocatePackage()
+    RETCODE Send(INET_PACKAGE* package)
+    {
+        return Send(package->header.connection, package);
+    }
+
+    // Takes one reference to a package that may be shared
+    RETCODE Send(const CONNECTION& connection, INET_PACKAGE* package)
+    {
+        PROFILE_FUNCTION();
+        RETCODE retcode = RTN_CONNECTION_FAIL;
+        if(m_Ready)
+        {
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            retcode = PushResponse(connection, package);
+        }
+
+        FreePackage(package);
+        return retcode;
+    }
+
+    // Caller still frees its own
+    RETCODE SendAll(INET_PACKAGE* package)
+    {
+        PROFILE_FUNCTION();
+        if(!m_Ready)
+        {
+            return RTN_CONNECTION_FAIL;
+        }
+
+        std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+        for(size_t slot = 0; slot < SHM_MAX_CLIENTS; slot++)
+        {
+            if(m_Open[slot])
+            {
+                PushResponse(m_Connections[slot], package);
+            }
+        }
+
+        return RTN_OK;
+    }
+
+    void execute(int dummy = 0)
+    {
+        PROFILE_FUNCTION();
+        SHM_REQUEST_RING& requests = m_Segment->requests;
+        std::chrono::steady_clock::time_point last_check = std::chrono::steady_clock::now();
+
+        while(StopRequested() == false)
+        {
+            uint32_t observed = requests.signal.Observe();
+
+            SHM_REQUEST_CELL* cell = nullptr;
+            bool handled = false;
+            while(nullptr != (cell = requests.Peek()))
+            {
+                HandleCell(*cell);
+                requests.Release(cell);
+                handled = true;
+            }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if(std::chrono::milliseconds(SHM_LIVENESS_MS) <= now - last_check)
+            {
+                RemoveDeadClients();
+                last_check = now;
+            }
+
+            if(!handled)
+            {
+                requests.signal.Wait(observed, SHM_LIVENESS_MS);
+            }
+        }
+
+        LOG_DEBUG("Stopped shared memory thread");
+    }
+
+    void Wake()
+    {
+        m_Segment->requests.signal.Signal();
+    }
+
+    // Serve clients -- call once the hooks are attached. Clients that open
+    // the segment before then wait in the request ring.
+    RETCODE StartPoll()
     {
-        strncpy(m_SockeName, name, sizeof(m_SockeName));
-        CreateQueue();
+        if(!IsCreated())
+        {
+            return RTN_FAIL;
+        }
+
+        if(!m_Ready)
+        {
+            Start(0);
+            m_Ready = true;
+        }
+
+        return RTN_OK;
     }
 
-    ~Messenger()
+    RETCODE StopPoll()
     {
-        DestroyQueue();
+        if(!IsCreated())
+        {
+            return RTN_OK;
+        }
+
+        if(m_Ready)
+        {
+            m_Ready = false;
+            Stop();
+        }
+
+        m_Segment->server_pid.store(0, std::memory_order_release);
+        shm_unlink(m_Name.c_str());
+
+        for(size_t slot = 0; slot < SHM_MAX_CLIENTS; slot++)
+        {
+            if(m_Open[slot])
+            {
+                RemoveClient(slot);
+            }
+        }
+
+        m_OnStop.Invoke();
+        return RTN_OK;
     }
 
-    RETCODE Send(const SOCKET_NAME& name, const MESSAGE_HEADER& message)
+    // Safe to call from any thread
+    bool HasConnection(const CONNECTION& connection)
     {
-        msgsnd(m_MessageID, &message, message.size + sizeof(MESSAGE_HEADER), 0);
+        std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+        return RTN_OK == FindSlot(connection, nullptr);
     }
 
-    RETCODE Receive(MESSAGE_HEADER& message)
+    // Empty when the segment could not be made or has been stopped
+    std::string GetName()
     {
-        char* body = NULL;
-        msgrcv(m_MessageID, &message, sizeof(MESSAGE_HEADER), 1, 0);
-        msgrcv(m_MessageID, body, message.size, 1, 0);
+        return IsCreated() ? m_Name : std::string();
     }
 
+    Hook<ConnectDelegate> m_OnClientConnect;
+    Hook<DisconnectDelegate> m_OnDisconnect;
+    Hook<MessageDelegate> m_OnReceive;
+    Hook<StopDelegate> m_OnStop;
+
 private:
-    SOCKET_NAME m_SockeName;
-    struct sockaddr_un m_Address;
 
-    void CreateQueue()
+    bool IsCreated(void)
+    {
+        return nullptr != m_Segment && 0 != m_Segment->server_pid.load(std::memory_order_acquire);
+    }
+
+    RETCODE CreateSegment(void)
+    {
+        // Left behind by a daemon that did not shut down cleanly
+        shm_unlink(m_Name.c_str());
+
+        int fd = shm_open(m_Name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(0 > fd)
+        {
+            LOG_ERROR("Could not create shared memory ", m_Name, ": ", strerror(errno));
+            return RTN_FAIL;
+        }
+
+        if(0 != ftruncate(fd, sizeof(SHM_SEGMENT)))
+        {
+            LOG_ERROR("Could not size shared memory ", m_Name, ": ", strerror(errno));
+            close(fd);
+            shm_unlink(m_Name.c_str());
+            return RTN_MALLOC_FAIL;
+        }
+
+        void* memory = mmap(nullptr, sizeof(SHM_SEGMENT), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(MAP_FAILED == memory)
+        {
+            LOG_ERROR("Could not map shared memory ", m_Name, ": ", strerror(errno));
+            shm_unlink(m_Name.c_str());
+            return RTN_MALLOC_FAIL;
+        }
+
+        // Fresh pages are zero -- free slots and empty rings
+        m_Segment = new (memory) SHM_SEGMENT;
+        m_Segment->layout_version = SHM_LAYOUT_VERSION;
+        m_Segment->server_pid.store(getpid(), std::memory_order_relaxed);
+        m_Segment->requests.Init();
+        m_Segment->magic.store(SHM_MAGIC, std::memory_order_release);
+        return RTN_OK;
+    }
+
+    void HandleCell(const SHM_REQUEST_CELL& cell)
+    {
+        if(SHM_MAX_CLIENTS <= cell.slot)
+        {
+            return;
+        }
+
+        switch(cell.kind)
+        {
+            case SHM_CELL_CONNECT:
+            {
+                AddClient(cell.slot);
+                break;
+            }
+            case SHM_CELL_DISCONNECT:
+            {
+                if(m_Open[cell.slot])
+                {
+                    RemoveClient(cell.slot);
+                }
+                break;
+            }
+            case SHM_CELL_FRAME:
+            {
+                ReceiveFrame(cell);
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+
+    void ReceiveFrame(const SHM_REQUEST_CELL& cell)
+    {
+        if(!m_Open[cell.slot] || sizeof(INET_COMPACT_HEADER) > cell.size || SHM_CELL_SIZE < cell.size)
+        {
+            return;
+        }
+
+        INET_HEADER header = {0};
+        DecodeInetHeader(cell.frame, _SERVER_VERSION, header);
+        if(cell.size - sizeof(INET_COMPACT_HEADER) < header.message_size)
+        {
+            LOG_WARN("Bad frame from ", m_Connections[cell.slot].address);
+            return;
+        }
+
+        INET_PACKAGE* package = AllocatePackage(header.message_size);
+        if(nullptr == package)
+        {
+            LOG_ERROR("Out of package memory for ", m_Connections[cell.slot].address);
+            return;
+        }
+
+        header.connection = m_Connections[cell.slot];
+        package->header = header;
+        memcpy(package->payload, cell.frame + sizeof(INET_COMPACT_HEADER), header.message_size);
+        m_OnReceive.Invoke(package);
+        FreePackage(package);
+    }
+
+    void AddClient(uint32_t slot)
+    {
+        SHM_CLIENT_SLOT& client = m_Segment->clients[slot];
+        if(SHM_SLOT_OPEN != client.state.load(std::memory_order_acquire))
+        {
+            return;
+        }
+
+        const pid_t pid = client.pid.load(std::memory_order_relaxed);
+        CONNECTION connection = {0};
+        {
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            if(m_Open[slot] && m_Pids[slot] == pid)
+            {
+                return;
+            }
+
+            snprintf(connection.address, sizeof(connection.address), "%s%d:%llu",
+                SHM_CONNECTION_PREFIX, pid, static_cast<unsigned long long>(++m_Generation));
+            connection.port = static_cast<unsigned short>(slot);
+
+            m_Connections[slot] = connection;
+            m_Pids[slot] = pid;
+            m_Open[slot] = true;
+        }
+
+        m_OnClientConnect.Invoke(connection);
+    }
+
+    void RemoveClient(uint32_t slot)
+    {
+        CONNECTION connection;
+        {
+            std::lock_guard<std::mutex> lock(m_ConnectionMutex);
+            connection = m_Connections[slot];
+            m_Open[slot] = false;
+        }
+
+        // Wake the client in case it is waiting for a reply that won't come
+        SHM_CLIENT_SLOT& client = m_Segment->clients[slot];
+        client.pid.store(0, std::memory_order_relaxed);
+        client.state.store(SHM_SLOT_FREE, std::memory_order_release);
+        client.responses.signal.Signal();
+
+        m_OnDisconnect.Invoke(connection);
+    }
+
+    void RemoveDeadClients(void)
+    {
+        for(uint32_t slot = 0; slot < SHM_MAX_CLIENTS; slot++)
+        {
+            SHM_CLIENT_SLOT& client = m_Segment->clients[slot];
+            if(SHM_SLOT_FREE == client.state.load(std::memory_order_acquire))
+            {
+                continue;
+            }
+
+            pid_t pid = client.pid.load(std::memory_order_relaxed);
+            if(0 != pid && 0 != kill(pid, 0) && ESRCH == errno)
+            {
+                LOG_INFO("Shared memory client ", pid, " went away");
+                if(m_Open[slot])
+                {
+                    RemoveClient(slot);
+                }
+                else
+                {
+                    // Died while setting the slot up
+                    client.state.store(SHM_SLOT_FREE, std::memory_order_release);
+                }
+            }
+        }
+    }
+
+    // Under m_ConnectionMutex
+    RETCODE FindSlot(const CONNECTION& connection, size_t* out_slot)
+    {
+        if(!IsShmConnection(connection) || SHM_MAX_CLIENTS <= connection.port ||
+           !m_Open[connection.port] || !(m_Connections[connection.port] == connection))
+        {
+            return RTN_NOT_FOUND;
+        }
+
+        if(nullptr != out_slot)
+        {
+            *out_slot = connection.port;
+        }
+
+        return RTN_OK;
+    }
+
+    // Under m_ConnectionMutex -- the daemon is the only producer per ring
+    RETCODE PushResponse(const CONNECTION& connection, const INET_PACKAGE* package)
+    {
+        size_t slot = 0;
+        if(RTN_OK != FindSlot(connection, &slot))
+        {
+            LOG_DEBUG("Could not find shared memory client ", connection.address);
+            return RTN_NOT_FOUND;
+        }
+
+        char header[sizeof(INET_COMPACT_HEADER)];
+        size_t header_size = EncodeInetHeader(package->header, _SERVER_VERSION, header);
+        if(!m_Segment->clients[slot].responses.Push(header, header_size,
+            package->payload, package->header.message_size))
+        {
+            // Client is not reading -- it will see a gap rather than stall us
+            m_DroppedPackages++;
+            LOG_WARN("Shared memory client ", connection.address, " is full -- dropped reply");
+            return RTN_FAIL;
+        }
+
+        return RTN_OK;
+    }
+
+    ShmMessenger(const ShmMessenger&);
+    ShmMessenger& operator=(const ShmMessenger&);
+
+    bool m_Ready;
+    std::string m_Name;
+    SHM_SEGMENT* m_Segment;
+    std::mutex m_ConnectionMutex; // Guards the tables below and response pushes
+    CONNECTION m_Connections[SHM_MAX_CLIENTS];
+    pid_t m_Pids[SHM_MAX_CLIENTS];
+    bool m_Open[SHM_MAX_CLIENTS];
+    uint64_t m_Generation; // Clients added so far -- names each one apart
+    size_t m_DroppedPackages;
+};
+
+// Client side -- one slot in a daemon's segment
+class ShmClient
+{
+
+public:
+
+    ShmClient()
+        : m_Segment(nullptr), m_Slot(SHM_MAX_CLIENTS)
+    {
+    }
+
+    ~ShmClient()
+    {
+        Close();
+    }
+
+    RETCODE Open(const std::string& name)
+    {
+        PROFILE_FUNCTION();
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if(0 > fd)
+        {
+            LOG_WARN("Could not open shared memory ", name, ": ", strerror(errno));
+            return RTN_NOT_FOUND;
+        }
+
+        struct stat segment_stat;
+        if(0 != fstat(fd, &segment_stat) || sizeof(SHM_SEGMENT) != static_cast<size_t>(segment_stat.st_size))
+        {
+            LOG_WARN("Shared memory ", name, " has the wrong size");
+            close(fd);
+            return RTN_CONNECTION_FAIL;
+        }
+
+        void* memory = mmap(nullptr, sizeof(SHM_SEGMENT), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(MAP_FAILED == memory)
+        {
+            return RTN_MALLOC_FAIL;
+        }
+
+        m_Segment = static_cast<SHM_SEGMENT*>(memory);
+        if(SHM_MAGIC != m_Segment->magic.load(std::memory_order_acquire) ||
+           SHM_LAYOUT_VERSION != m_Segment->layout_version ||
+           0 == m_Segment->server_pid.load(std::memory_order_acquire))
+        {
+            LOG_WARN("Shared memory ", name, " is not being served");
+            Unmap();
+            return RTN_CONNECTION_FAIL;
+        }
+
+        for(size_t slot = 0; slot < SHM_MAX_CLIENTS; slot++)
+        {
+            uint32_t expected = SHM_SLOT_FREE;
+            SHM_CLIENT_SLOT& client = m_Segment->clients[slot];
+            if(client.state.compare_exchange_strong(expected, SHM_SLOT_CLAIMED, std::memory_order_acq_rel))
+            {
+                client.pid.store(getpid(), std::memory_order_relaxed);
+                client.responses.Reset();
+                client.state.store(SHM_SLOT_OPEN, std::memory_order_release);
+                m_Slot = slot;
+                break;
+            }
+        }
+
+        if(SHM_MAX_CLIENTS == m_Slot)
+        {
+            LOG_WARN("No free shared memory slots in ", name);
+            Unmap();
+            return RTN_CONNECTION_FAIL;
+        }
+
+        if(!m_Segment->requests.Push(m_Slot, SHM_CELL_CONNECT, nullptr, 0))
+        {
+            Close();
+            return RTN_CONNECTION_FAIL;
+        }
+
+        return RTN_OK;
+    }
+
+    // RTN_FAIL when the request ring is full -- try again
+    RETCODE Send(MESSAGE_TYPE data_type, const void* payload, uint32_t size,
+                 unsigned short flags = INET_FLAG_NONE, unsigned short request_id = 0)
+    {
+        PROFILE_FUNCTION();
+        if(!IsOpen())
+        {
+            return RTN_CONNECTION_FAIL;
+        }
+
+        if(SHM_CELL_SIZE - sizeof(INET_COMPACT_HEADER) < size)
+        {
+            LOG_WARN("Request of ", size, " bytes is too big for shared memory");
+            return RTN_BAD_ARG;
+        }
+
+        char frame[SHM_CELL_SIZE];
+        INET_HEADER header = {0};
+        header.message_size = size;
+        header.data_type = data_type;
+        header.flags = flags;
+        header.request_id = request_id;
+        size_t header_size = EncodeInetHeader(header, _SERVER_VERSION, frame);
+        memcpy(frame + header_size, payload, size);
+
+        return m_Segment->requests.Push(m_Slot, SHM_CELL_FRAME, frame, header_size + size) ?
+            RTN_OK : RTN_FAIL;
+    }
+
+    // Wait up to timeout_ms (-1 forever) for a reply. User must FreePackage()
+    // it after use.
+    RETCODE Receive(INET_PACKAGE*& out_package, int timeout_ms = -1)
+    {
+        PROFILE_FUNCTION();
+        if(!IsOpen())
+        {
+            return RTN_CONNECTION_FAIL;
+        }
+
+        SHM_CLIENT_SLOT& client = m_Segment->clients[m_Slot];
+        SHM_RESPONSE_RING& responses = client.responses;
+        const std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        uint32_t frame_size = 0;
+        while(0 == (frame_size = responses.NextSize()))
+        {
+            uint32_t observed = responses.signal.Observe();
+            if(0 != responses.NextSize())
+            {
+                continue;
+            }
+
+            if(SHM_SLOT_OPEN != client.state.load(std::memory_order_acquire) ||
+               getpid() != client.pid.load(std::memory_order_relaxed))
+            {
+                // Daemon dropped us
+                return RTN_CONNECTION_FAIL;
+            }
+
+            int wait_ms = timeout_ms;
+            if(0 <= timeout_ms)
+            {
+                wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if(0 >= wait_ms)
+                {
+                    return RTN_NOT_FOUND;
+                }
+            }
+
+            responses.signal.Wait(observed, wait_ms);
+        }
+
+        if(sizeof(INET_COMPACT_HEADER) > frame_size)
+        {
+            responses.Pop(nullptr, 0);
+            return RTN_FAIL;
+        }
+
+        INET_PACKAGE* package = AllocatePackage(frame_size - sizeof(INET_COMPACT_HEADER));
+        if(nullptr == package)
+        {
+            return RTN_MALLOC_FAIL;
+        }
+
+        // Frame lands so its payload is in place -- the wire header just
+        // before it is decoded then overwritten by the real header
+        char* frame = package->payload - sizeof(INET_COMPACT_HEADER);
+        INET_HEADER header = {0};
+        responses.Pop(frame, frame_size);
+        DecodeInetHeader(frame, _SERVER_VERSION, header);
+
+        header.connection = Server();
+        package->header = header;
+        out_package = package;
+        return RTN_OK;
+    }
+
+    void Close(void)
     {
-        key_t key;
+        if(IsOpen())
+        {
+            m_Segment->requests.Push(m_Slot, SHM_CELL_DISCONNECT, nullptr, 0);
+        }
 
-        // Probably should make subfolder for queue
-        // ftok to generate unique key
-        key = ftok(m_SockeName, 65);
+        Unmap();
+    }
 
-        // msgget creates a message queue
-        // and returns identifier
-        m_MessageID = msgget(key, 0666 | IPC_CREAT);
+    bool IsOpen(void)
+    {
+        return nullptr != m_Segment && SHM_MAX_CLIENTS != m_Slot;
     }
 
-    void DestroyQueue()
+    // How replies name the daemon
+    CONNECTION Server(void)
     {
-        msgctl(m_MessageID, IPC_RMID, NULL);
+        CONNECTION connection = {0};
+        snprintf(connection.address, sizeof(connection.address), "%s%d",
+            SHM_CONNECTION_PREFIX, nullptr == m_Segment ? 0 : m_Segment->server_pid.load(std::memory_order_relaxed));
+        return connection;
     }
+
+private:
+
+    void Unmap(void)
+    {
+        if(nullptr != m_Segment)
+        {
+            munmap(m_Segment, sizeof(SHM_SEGMENT));
+            m_Segment = nullptr;
+        }
+
+        m_Slot = SHM_MAX_CLIENTS;
+    }
+
+    ShmClient(const ShmClient&);
+    ShmClient& operator=(const ShmClient&);
+
+    SHM_SEGMENT* m_Segment;
+    size_t m_Slot;
 };
 
-#endif
\ No newline at end of file
+#endif